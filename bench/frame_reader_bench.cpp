@@ -0,0 +1,186 @@
+// 对比两种接收方式的吞吐量与每个package平均的读调用次数：
+//   legacy   : 每个package分header/body两次async_read（改进前Participant的实现）
+//   buffered : FrameReader + async_read_some，一次读尽可能多的数据再逐个解析
+// 用法: frame_reader_bench [package数量] [body长度]
+#include "protocol.hpp"
+#include "frame_reader.hpp"
+#include <boost/asio.hpp>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <thread>
+
+using boost::asio::ip::tcp;
+
+// 包装socket，统计async_read_some的调用次数（每次调用至少对应一次read系统调用）
+class CountingSocket
+{
+private:
+    tcp::socket &socket;
+    std::size_t &reads;
+
+public:
+    using executor_type = tcp::socket::executor_type;
+
+    CountingSocket(tcp::socket &s, std::size_t &counter) : socket(s), reads(counter) {}
+
+    executor_type get_executor() { return socket.get_executor(); }
+
+    template <typename MutableBufferSequence, typename ReadHandler>
+    auto async_read_some(const MutableBufferSequence &buffers, ReadHandler &&handler)
+    {
+        ++reads;
+        return socket.async_read_some(buffers, std::forward<ReadHandler>(handler));
+    }
+};
+
+struct Result
+{
+    std::size_t packages = 0;
+    std::size_t reads = 0;
+    double seconds = 0;
+};
+
+// v1的header：length只有2个字节
+struct LegacyPackage
+{
+    std::uint16_t type;
+    std::uint16_t length;
+    std::vector<std::uint8_t> body;
+};
+
+class LegacyReader
+{
+private:
+    CountingSocket stream;
+    std::size_t remain;
+    Result &result;
+
+public:
+    LegacyReader(tcp::socket &s, std::size_t total, Result &rlt)
+        : stream(s, rlt.reads), remain(total), result(rlt) {}
+
+    void readHeader()
+    {
+        auto pkg = std::make_shared<LegacyPackage>();
+        boost::asio::async_read(stream,
+                                std::vector<boost::asio::mutable_buffer>{
+                                    boost::asio::buffer(&pkg->type, sizeof(LegacyPackage::type)),
+                                    boost::asio::buffer(&pkg->length, sizeof(LegacyPackage::length)),
+                                },
+                                [pkg, this](std::error_code ec, std::size_t) {
+                                    if (!ec)
+                                    {
+                                        pkg->body.resize(pkg->length);
+                                        readBody(pkg);
+                                    }
+                                });
+    }
+
+    void readBody(std::shared_ptr<LegacyPackage> pkg)
+    {
+        boost::asio::async_read(stream, boost::asio::buffer(pkg->body, pkg->length),
+                                [pkg, this](std::error_code ec, std::size_t) {
+                                    if (!ec)
+                                    {
+                                        result.packages++;
+                                        if (--remain > 0)
+                                        {
+                                            readHeader();
+                                        }
+                                    }
+                                });
+    }
+};
+
+class BufferedReader
+{
+private:
+    CountingSocket stream;
+    std::size_t remain;
+    Result &result;
+    FrameReader reader;
+    Protocol::Package pkg;
+
+public:
+    BufferedReader(tcp::socket &s, std::size_t total, Result &rlt)
+        : stream(s, rlt.reads), remain(total), result(rlt) {}
+
+    void readFrames()
+    {
+        stream.async_read_some(reader.prepare(),
+                               [this](std::error_code ec, std::size_t len) {
+                                   if (!ec)
+                                   {
+                                       reader.commit(len);
+                                       while (reader.next(pkg))
+                                       {
+                                           result.packages++;
+                                           remain--;
+                                       }
+                                       if (remain > 0)
+                                       {
+                                           readFrames();
+                                       }
+                                   }
+                               });
+    }
+};
+
+template <typename Reader>
+Result run(std::size_t total, std::size_t bodyLength)
+{
+    boost::asio::io_context ioContext;
+    tcp::acceptor acceptor(ioContext, tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0));
+    tcp::socket sender(ioContext);
+    sender.connect(acceptor.local_endpoint());
+    tcp::socket receiver = acceptor.accept();
+
+    // 预先把所有package编码好，由发送线程尽快写入
+    auto frame = Protocol::encodeFrame(Protocol::encodePackage(std::string(bodyLength, 'a')));
+    std::thread writer([&sender, frame, total]() {
+        constexpr std::size_t BATCH = 256;
+        std::vector<std::uint8_t> batch;
+        for (std::size_t i = 0; i < BATCH; i++)
+        {
+            batch.insert(batch.end(), frame->begin(), frame->end());
+        }
+        for (std::size_t sent = 0; sent < total; sent += BATCH)
+        {
+            std::size_t count = std::min(BATCH, total - sent);
+            boost::asio::write(sender, boost::asio::buffer(batch.data(), count * frame->size()));
+        }
+    });
+
+    Result result;
+    Reader reader(receiver, total, result);
+    auto start = std::chrono::steady_clock::now();
+    if constexpr (std::is_same<Reader, LegacyReader>::value)
+    {
+        reader.readHeader();
+    }
+    else
+    {
+        reader.readFrames();
+    }
+    ioContext.run();
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    writer.join();
+    return result;
+}
+
+void report(const char *name, const Result &rlt)
+{
+    std::cout << name << ": " << rlt.packages << " packages, "
+              << static_cast<std::size_t>(rlt.packages / rlt.seconds) << " msgs/sec, "
+              << static_cast<double>(rlt.reads) / rlt.packages << " reads/msg" << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+    std::size_t total = argc > 1 ? std::stoul(argv[1]) : 1000000;
+    std::size_t bodyLength = argc > 2 ? std::stoul(argv[2]) : 10;
+    report("legacy  ", run<LegacyReader>(total, bodyLength));
+    report("buffered", run<BufferedReader>(total, bodyLength));
+    return 0;
+}
@@ -0,0 +1,1331 @@
+// 端到端的负载生成器：建立大量连接并按channel分组，以给定的大小和速率发送消息，
+// 统计msgs/sec、bytes/sec以及端到端延迟（发送时间戳写在payload的前8个字节中）
+// 不指定--connect时fork出子进程运行Server，以便单独统计server进程的RSS与CPU；--nodes大于1时
+// fork出多个组成federation的server进程。连接按轮转方式分配给各server，同一channel的成员因此分布在不同的节点上
+// --bulk为iperf式的吞吐量测试（见runBulk()），比较经由channel以frame转发与经由隧道以splice()转发的吞吐量
+// --handshake为握手速率测试（见runHandshakes()）。--tls-cert使server启用TLS，client以同一证书作为CA验证server，
+// 只用于--bulk与--handshake，与不指定时的明文结果对比
+// 用法: bench [--connect <host:port>[,<host:port>...]] [--server-pid <pid>] [--threads <N>] [--load-threads <N>]
+//             [--connections <N>] [--channel-size <K>] [--size <bytes>] [--rate <msgs/sec>]
+//             [--duration <seconds>] [--warmup <seconds>] [--engine callback|coroutine|io_uring] [--batch <N>]
+//             [--nodes <N>] [--bulk framed|tunnel] [--handshake new|resume] [--tls-cert <pem>] [--tls-key <pem>]
+#include "server.hpp"
+#include "protocol.hpp"
+#include "frame_reader.hpp"
+#include "frame_queue.hpp"
+#include "handler_memory.hpp"
+#include "histogram.hpp"
+#include "tls.hpp"
+#include <boost/asio.hpp>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <unistd.h>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <atomic>
+
+using boost::asio::ip::tcp;
+using Clock = std::chrono::steady_clock;
+
+struct BenchOptions
+{
+    std::vector<tcp::endpoint> servers; // 为空时在子进程中启动server
+    pid_t serverPid = 0;     // 用于统计server的RSS/CPU，只在server运行于本机时有效
+    unsigned int serverThreads = 1; // 子进程中server的线程数（shard数）
+    unsigned int nodes = 1; // 子进程中启动的server个数，大于1时组成federation
+    SessionEngine engine = SessionEngine::CALLBACK; // 子进程中server的会话引擎
+    unsigned int threads = std::max(1u, std::thread::hardware_concurrency() / 2); // 负载线程数
+    unsigned int connections = 1000;
+    unsigned int channelSize = 2;
+    std::size_t size = 64;  // payload长度，至少8个字节用于时间戳
+    double rate = 100;      // 每个连接每秒发送的消息数，为0时每次写完成后立即发送下一条
+    double duration = 10;
+    double warmup = 1;
+    unsigned int batch = 1; // 每个frame中的消息数，大于1时协商v2并以MESSAGE_BATCH发送
+    std::string bulk;       // 非空时为吞吐量测试："framed"或"tunnel"
+    std::string handshake;  // 非空时为握手速率测试："new"（每次完整握手）或"resume"（以session ticket恢复）
+    std::string tlsCert;    // 非空时启用TLS，server的证书，同时是client验证server所用的CA
+    std::string tlsKey;     // server的私钥，为空时从tlsCert中读取
+};
+
+// 每个负载线程独占的统计，结束后再合并
+struct ThreadStats
+{
+    std::uint64_t sent = 0;
+    std::uint64_t received = 0;
+    std::uint64_t bytesReceived = 0;
+    std::uint64_t skipped = 0; // 发送队列积压而放弃发送的消息数
+    std::uint64_t errors = 0;
+    Histogram latency; // 纳秒
+};
+
+// 测量阶段开始后才计入统计
+std::atomic<bool> measuring(false);
+
+std::uint64_t nowNanos()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+}
+
+// 同步发送一个v1的请求并等待回复，只在开始收发之前使用
+template <typename Stream>
+Protocol::Package request(Stream &socket, FrameReader &reader, Protocol::Type type, const std::string &body)
+{
+    auto frame = Protocol::encodeFrame(Protocol::encodePackage(type, body));
+    boost::asio::write(socket, boost::asio::buffer(frame->data(), frame->size()));
+    Protocol::Package reply;
+    while (!reader.next(reply))
+    {
+        reader.commit(socket.read_some(reader.prepare()));
+    }
+    return reply;
+}
+
+// ---------------- Class BenchConnection ------------------------------
+
+// 与Client相同的收发方式（FrameReader批量读取、FrameQueue合并写），但不打印消息而是统计延迟
+class BenchConnection
+{
+private:
+    tcp::socket socket;
+    ThreadStats &stats;
+    FrameQueue pkgQueue;
+    FrameReader reader;
+    Protocol::Package inputPkg;
+    boost::asio::steady_timer timer;
+    Clock::duration period;
+    Clock::time_point deadline;
+    std::vector<std::uint8_t> payload;
+    unsigned int batch;
+    bool stopped;
+    HandlerMemory readMemory;
+    HandlerMemory writeMemory;
+    HandlerMemory timerMemory;
+
+public:
+    BenchConnection(boost::asio::io_context &ioCtx, ThreadStats &threadStats, const BenchOptions &opts)
+        : socket(ioCtx),
+          stats(threadStats),
+          pkgQueue(1024 * 1024, 1024),
+          timer(ioCtx),
+          period(opts.rate > 0 ? std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(opts.batch / opts.rate))
+                               : Clock::duration::zero()),
+          payload(std::max<std::size_t>(opts.size, sizeof(std::uint64_t)), 'x'),
+          batch(opts.batch),
+          stopped(false)
+    {
+    }
+
+    void connect(const tcp::endpoint &endpoint)
+    {
+        socket.connect(endpoint);
+        socket.set_option(tcp::no_delay(true));
+        if (batch > 1)
+        {
+            // MESSAGE_BATCH只发给协商了v2的接收方，v1的接收方会收到拆分后的MESSAGE
+            auto reply = request(Protocol::Type::HELLO, std::string(1, static_cast<char>(Protocol::Version::V2)));
+            if (reply.type != static_cast<std::uint16_t>(Protocol::Type::HELLO_ACK) || reply.body.empty() ||
+                reply.body[0] != static_cast<std::uint8_t>(Protocol::Version::V2))
+            {
+                throw std::runtime_error("server does not support protocol v2");
+            }
+        }
+    }
+
+    // 同步发送一个请求并等待回复，只在开始收发消息之前使用
+    Protocol::Package request(Protocol::Type type, const std::string &body)
+    {
+        return ::request(socket, reader, type, body);
+    }
+
+    // 开始收发，sender为false时只接收
+    void start(bool sender, Clock::duration offset)
+    {
+        readFrames();
+        if (!sender)
+        {
+            return;
+        }
+        if (period == Clock::duration::zero())
+        {
+            send();
+        }
+        else
+        {
+            // 各连接错开发送时刻，避免所有连接同时突发
+            deadline = Clock::now() + offset;
+            schedule();
+        }
+    }
+
+    void stop()
+    {
+        stopped = true;
+        timer.cancel();
+        boost::system::error_code ec;
+        socket.close(ec);
+    }
+
+    Clock::duration sendPeriod() const
+    {
+        return period;
+    }
+
+private:
+    void schedule()
+    {
+        timer.expires_at(deadline);
+        timer.async_wait(makeCustomAllocHandler(timerMemory, [this](std::error_code ec) {
+            if (ec || stopped)
+            {
+                return;
+            }
+            send();
+            deadline += period;
+            auto now = Clock::now();
+            if (now - deadline > std::chrono::milliseconds(100))
+            {
+                // 落后太多时不再补发，按实际时间重新计时
+                deadline = now;
+            }
+            schedule();
+        }));
+    }
+
+    void send()
+    {
+        std::uint64_t timestamp = nowNanos();
+        std::memcpy(payload.data(), &timestamp, sizeof(timestamp));
+        Protocol::FramePtr frame;
+        if (batch > 1)
+        {
+            std::string_view message(reinterpret_cast<const char *>(payload.data()), payload.size());
+            Protocol::FrameBuilder builder(Protocol::Type::MESSAGE_BATCH, Protocol::Version::V2,
+                                           batch * Protocol::batchEntryLength(message.size()));
+            for (unsigned int i = 0; i < batch; i++)
+            {
+                Protocol::appendBatchEntry(builder, message);
+            }
+            frame = builder.finish();
+        }
+        else
+        {
+            auto single = Protocol::makeFrame(Protocol::headerLength(Protocol::Version::V1, payload.size()) + payload.size());
+            Protocol::encodeTo(Protocol::Version::V1, Protocol::Type::MESSAGE, 0, payload.data(), payload.size(),
+                               single->data(), single->size());
+            frame = std::move(single);
+        }
+        if (pkgQueue.full(frame->size()))
+        {
+            stats.skipped += batch;
+            return;
+        }
+        if (measuring.load(std::memory_order_relaxed))
+        {
+            stats.sent += batch;
+        }
+        if (pkgQueue.push(std::move(frame)))
+        {
+            execWriteAction();
+        }
+    }
+
+    void readFrames()
+    {
+        socket.async_read_some(reader.prepare(),
+                               makeCustomAllocHandler(readMemory, [this](std::error_code ec, std::size_t len) {
+                                   if (ec || stopped)
+                                   {
+                                       return;
+                                   }
+                                   reader.commit(len);
+                                   std::uint64_t now = nowNanos();
+                                   bool counting = measuring.load(std::memory_order_relaxed);
+                                   while (reader.next(inputPkg))
+                                   {
+                                       auto body = inputPkg.view().body;
+                                       try
+                                       {
+                                           // server转发的v2消息带有channel ID
+                                           if (inputPkg.flags & Protocol::FLAG_CHANNEL)
+                                           {
+                                               Protocol::readChannelId(body);
+                                           }
+                                       }
+                                       catch (const Protocol::invalid_length &)
+                                       {
+                                           stats.errors++;
+                                           continue;
+                                       }
+                                       if (inputPkg.type == static_cast<std::uint16_t>(Protocol::Type::MESSAGE))
+                                       {
+                                           receive(body, now, counting);
+                                           continue;
+                                       }
+                                       if (inputPkg.type == static_cast<std::uint16_t>(Protocol::Type::PING))
+                                       {
+                                           // 只收不发的连接在server看来是空闲的，需回复心跳
+                                           if (pkgQueue.push(Protocol::encodeFrame(Protocol::Type::PONG, body, Protocol::Version::V2)))
+                                           {
+                                               execWriteAction();
+                                           }
+                                           continue;
+                                       }
+                                       if (inputPkg.type != static_cast<std::uint16_t>(Protocol::Type::MESSAGE_BATCH))
+                                       {
+                                           stats.errors++;
+                                           continue;
+                                       }
+                                       try
+                                       {
+                                           Protocol::BatchReader messages(body);
+                                           std::string_view message;
+                                           while (messages.next(message))
+                                           {
+                                               receive(message, now, counting);
+                                           }
+                                       }
+                                       catch (const Protocol::invalid_length &)
+                                       {
+                                           stats.errors++;
+                                       }
+                                   }
+                                   readFrames();
+                               }));
+    }
+
+    void receive(std::string_view message, std::uint64_t now, bool counting)
+    {
+        if (message.size() < sizeof(std::uint64_t))
+        {
+            stats.errors++;
+            return;
+        }
+        if (counting)
+        {
+            std::uint64_t timestamp;
+            std::memcpy(&timestamp, message.data(), sizeof(timestamp));
+            stats.received++;
+            stats.bytesReceived += message.size();
+            stats.latency.record(now > timestamp ? now - timestamp : 0);
+        }
+    }
+
+    void execWriteAction()
+    {
+        boost::asio::async_write(socket, pkgQueue.gather(),
+                                 makeCustomAllocHandler(writeMemory, [this](std::error_code ec, std::size_t) {
+                                     if (ec || stopped)
+                                     {
+                                         return;
+                                     }
+                                     if (pkgQueue.pop())
+                                     {
+                                         execWriteAction();
+                                     }
+                                     else if (period == Clock::duration::zero())
+                                     {
+                                         // 不限速：上一批写完后立即发送下一条
+                                         send();
+                                     }
+                                 }));
+    }
+};
+
+// ---------------- server进程的资源统计 ------------------------------
+
+struct ProcessUsage
+{
+    std::size_t rssBytes = 0;
+    double cpuSeconds = 0;
+};
+
+ProcessUsage processUsage(pid_t pid)
+{
+    ProcessUsage usage;
+    std::string dir = "/proc/" + std::to_string(pid);
+    std::ifstream status(dir + "/status");
+    std::string line;
+    while (std::getline(status, line))
+    {
+        if (line.compare(0, 6, "VmRSS:") == 0)
+        {
+            usage.rssBytes = std::stoull(line.substr(6)) * 1024;
+        }
+    }
+    // /proc/<pid>/stat的第14、15个字段为utime、stime（单位为clock tick），进程名可能含空格，从')'之后开始解析
+    std::ifstream statFile(dir + "/stat");
+    std::string stat((std::istreambuf_iterator<char>(statFile)), std::istreambuf_iterator<char>());
+    auto pos = stat.rfind(')');
+    if (pos != std::string::npos)
+    {
+        std::istringstream ss(stat.substr(pos + 2));
+        std::string field;
+        unsigned long long utime = 0, stime = 0;
+        for (int i = 3; i <= 15 && ss >> field; i++)
+        {
+            if (i == 14)
+            {
+                utime = std::stoull(field);
+            }
+            else if (i == 15)
+            {
+                stime = std::stoull(field);
+            }
+        }
+        usage.cpuSeconds = static_cast<double>(utime + stime) / sysconf(_SC_CLK_TCK);
+    }
+    return usage;
+}
+
+// 所有server进程的RSS与CPU之和
+ProcessUsage processUsage(const std::vector<pid_t> &pids)
+{
+    ProcessUsage total;
+    for (pid_t pid : pids)
+    {
+        auto usage = processUsage(pid);
+        total.rssBytes += usage.rssBytes;
+        total.cpuSeconds += usage.cpuSeconds;
+    }
+    return total;
+}
+
+void stopServers(const std::vector<pid_t> &pids)
+{
+    for (pid_t pid : pids)
+    {
+        kill(pid, SIGTERM);
+    }
+    for (pid_t pid : pids)
+    {
+        waitpid(pid, nullptr, 0);
+    }
+}
+
+/**
+ * 为count个federation节点预留loopback上的端口，返回各节点的地址
+ * 端口由内核分配后立即释放，子进程随后再绑定（Server设置了SO_REUSEADDR）
+ */
+std::vector<std::string> reserveNodes(unsigned int count)
+{
+    boost::asio::io_context ioCtx;
+    std::vector<std::string> nodes;
+    for (unsigned int i = 0; i < count; i++)
+    {
+        tcp::acceptor acceptor(ioCtx, tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0));
+        nodes.push_back("127.0.0.1:" + std::to_string(acceptor.local_endpoint().port()));
+    }
+    return nodes;
+}
+
+/**
+ * fork出子进程运行Server，返回子进程pid
+ * nodes为空时监听loopback上由内核分配的端口，端口写入port；否则作为第index个节点监听其中的端口
+ */
+pid_t spawnServer(const BenchOptions &opts, const std::vector<std::string> &nodes, unsigned int index,
+                  unsigned short &port)
+{
+    int fds[2];
+    if (pipe(fds) != 0)
+    {
+        throw std::runtime_error("pipe failed");
+    }
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        throw std::runtime_error("fork failed");
+    }
+    if (pid > 0)
+    {
+        close(fds[1]);
+        if (read(fds[0], &port, sizeof(port)) != sizeof(port))
+        {
+            throw std::runtime_error("server failed to start");
+        }
+        close(fds[0]);
+        return pid;
+    }
+
+    // 子进程：与server_program相同，每个线程一个io_context
+    close(fds[0]);
+    ServerOptions options;
+    options.channelCapacity = opts.channelSize;
+    options.engine = opts.engine;
+    options.nodes = nodes;
+    options.nodeIndex = index;
+    options.tls.certFile = opts.tlsCert;
+    options.tls.keyFile = opts.tlsKey;
+    std::vector<std::unique_ptr<boost::asio::io_context>> ioContexts;
+    std::vector<boost::asio::io_context *> contexts;
+    for (unsigned int i = 0; i < opts.serverThreads; i++)
+    {
+        ioContexts.push_back(std::make_unique<boost::asio::io_context>(1));
+        contexts.push_back(ioContexts.back().get());
+    }
+    Server server(contexts, tcp::endpoint(boost::asio::ip::address_v4::loopback(), port), options);
+    unsigned short listenPort = server.localEndpoint().port();
+    if (write(fds[1], &listenPort, sizeof(listenPort)) != sizeof(listenPort))
+    {
+        _exit(1);
+    }
+    close(fds[1]);
+    std::vector<std::thread> workers;
+    for (unsigned int i = 1; i < opts.serverThreads; i++)
+    {
+        workers.emplace_back([&ioContexts, i]() { ioContexts[i]->run(); });
+    }
+    ioContexts[0]->run();
+    _exit(0);
+}
+
+// 数千个连接需要放宽文件描述符的上限
+void raiseFileLimit()
+{
+    rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+bool parseOptions(int argc, char **argv, BenchOptions &opts)
+{
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        std::string flag = argv[i];
+        std::string value = argv[i + 1];
+        if (flag == "--connect")
+        {
+            for (std::size_t start = 0; start < value.size();)
+            {
+                auto end = std::min(value.find(',', start), value.size());
+                auto server = value.substr(start, end - start);
+                auto pos = server.rfind(':');
+                if (pos == std::string::npos)
+                {
+                    return false;
+                }
+                opts.servers.emplace_back(boost::asio::ip::make_address(server.substr(0, pos)),
+                                          static_cast<unsigned short>(std::stoul(server.substr(pos + 1))));
+                start = end + 1;
+            }
+        }
+        else if (flag == "--server-pid")
+        {
+            opts.serverPid = std::stoi(value);
+        }
+        else if (flag == "--threads")
+        {
+            opts.serverThreads = std::max(1, std::stoi(value));
+        }
+        else if (flag == "--load-threads")
+        {
+            opts.threads = std::max(1, std::stoi(value));
+        }
+        else if (flag == "--connections")
+        {
+            opts.connections = std::max(2, std::stoi(value));
+        }
+        else if (flag == "--channel-size")
+        {
+            opts.channelSize = std::max(2, std::stoi(value));
+        }
+        else if (flag == "--size")
+        {
+            opts.size = std::max<std::size_t>(sizeof(std::uint64_t), std::stoul(value));
+        }
+        else if (flag == "--rate")
+        {
+            opts.rate = std::stod(value);
+        }
+        else if (flag == "--duration")
+        {
+            opts.duration = std::stod(value);
+        }
+        else if (flag == "--warmup")
+        {
+            opts.warmup = std::stod(value);
+        }
+        else if (flag == "--engine")
+        {
+            if (!parseSessionEngine(value, opts.engine))
+            {
+                return false;
+            }
+        }
+        else if (flag == "--batch")
+        {
+            opts.batch = std::max(1, std::stoi(value));
+        }
+        else if (flag == "--nodes")
+        {
+            opts.nodes = std::max(1, std::stoi(value));
+        }
+        else if (flag == "--bulk")
+        {
+            if (value != "framed" && value != "tunnel")
+            {
+                return false;
+            }
+            opts.bulk = value;
+        }
+        else if (flag == "--handshake")
+        {
+            if (value != "new" && value != "resume")
+            {
+                return false;
+            }
+            opts.handshake = value;
+        }
+        else if (flag == "--tls-cert")
+        {
+            opts.tlsCert = value;
+        }
+        else if (flag == "--tls-key")
+        {
+            opts.tlsKey = value;
+        }
+        else
+        {
+            return false;
+        }
+    }
+    if (!opts.handshake.empty() && !opts.bulk.empty())
+    {
+        return false;
+    }
+    // 消息负载测试的连接不支持TLS
+    if (!opts.tlsCert.empty() && opts.bulk.empty() && opts.handshake.empty())
+    {
+        return false;
+    }
+#ifndef TCP_PROTO_TLS
+    if (!opts.tlsCert.empty())
+    {
+        return false;
+    }
+#endif
+    // 吞吐量测试以v2发送，消息可以更长
+    return (argc - 1) % 2 == 0 && opts.size <= (opts.bulk.empty() ? Protocol::BODY_MAX_LENGTH : Protocol::V2_BODY_MAX_LENGTH);
+}
+
+// ---------------- Class BenchStream ------------------------------
+
+/**
+ * 吞吐量及握手测试所用的阻塞连接，配置了TLS时在connect()中完成握手，之后经由OpenSSL读写
+ * 与TlsSession相同，两个方向都由内核加解密（kTLS）时释放SSL，之后直接读写socket
+ * 读、写可以分别在不同的线程中进行
+ */
+class BenchStream
+{
+private:
+    tcp::socket socket;
+    std::shared_ptr<TlsContext> tls;
+#ifdef TCP_PROTO_TLS
+    SSL *ssl = nullptr;
+#endif
+    bool resumedSession = false;
+
+public:
+    BenchStream(boost::asio::io_context &ioCtx, std::shared_ptr<TlsContext> tlsContext)
+        : socket(ioCtx),
+          tls(std::move(tlsContext))
+    {
+    }
+
+    ~BenchStream()
+    {
+#ifdef TCP_PROTO_TLS
+        release();
+#endif
+    }
+
+    BenchStream(const BenchStream &) = delete;
+    BenchStream &operator=(const BenchStream &) = delete;
+
+    // 建立连接并完成TLS握手，失败时抛出异常
+    void connect(const tcp::endpoint &endpoint)
+    {
+        socket.connect(endpoint);
+        socket.set_option(tcp::no_delay(true));
+#ifdef TCP_PROTO_TLS
+        if (!tls)
+        {
+            return;
+        }
+        ssl = SSL_new(tls->native());
+        if (!ssl || SSL_set_fd(ssl, socket.native_handle()) != 1)
+        {
+            throw std::runtime_error(TlsContext::lastError("SSL_new failed"));
+        }
+        if (SSL_SESSION *cached = tls->cachedSession())
+        {
+            SSL_set_session(ssl, cached);
+            SSL_SESSION_free(cached);
+        }
+        ERR_clear_error();
+        if (SSL_connect(ssl) != 1)
+        {
+            throw std::runtime_error(TlsContext::lastError("TLS handshake failed"));
+        }
+        resumedSession = SSL_session_reused(ssl) == 1;
+        if (BIO_get_ktls_send(SSL_get_wbio(ssl)) && BIO_get_ktls_recv(SSL_get_rbio(ssl)))
+        {
+            release();
+        }
+#endif
+    }
+
+    std::size_t read_some(boost::asio::mutable_buffer buffer, boost::system::error_code &ec)
+    {
+#ifdef TCP_PROTO_TLS
+        if (ssl)
+        {
+            std::size_t len = 0;
+            ERR_clear_error();
+            int result = SSL_read_ex(ssl, buffer.data(), buffer.size(), &len);
+            ec = result == 1 ? boost::system::error_code() : failure(result);
+            return len;
+        }
+#endif
+        return socket.read_some(buffer, ec);
+    }
+
+    std::size_t read_some(boost::asio::mutable_buffer buffer)
+    {
+        boost::system::error_code ec;
+        std::size_t len = read_some(buffer, ec);
+        if (ec)
+        {
+            throw boost::system::system_error(ec);
+        }
+        return len;
+    }
+
+    // 满足SyncWriteStream，可用于boost::asio::write()
+    template <typename ConstBufferSequence>
+    std::size_t write_some(const ConstBufferSequence &buffers, boost::system::error_code &ec)
+    {
+#ifdef TCP_PROTO_TLS
+        if (ssl)
+        {
+            // 每次只写出第一个非空的buffer，SSL_write_ex()在阻塞模式下写完才返回
+            for (auto it = boost::asio::buffer_sequence_begin(buffers); it != boost::asio::buffer_sequence_end(buffers); ++it)
+            {
+                boost::asio::const_buffer buffer(*it);
+                if (buffer.size() == 0)
+                {
+                    continue;
+                }
+                std::size_t len = 0;
+                ERR_clear_error();
+                int result = SSL_write_ex(ssl, buffer.data(), buffer.size(), &len);
+                ec = result == 1 ? boost::system::error_code() : failure(result);
+                return len;
+            }
+            ec = boost::system::error_code();
+            return 0;
+        }
+#endif
+        return socket.write_some(buffers, ec);
+    }
+
+    // 关闭两个方向，使其他线程中阻塞的读写返回
+    void shutdown()
+    {
+        boost::system::error_code ec;
+        socket.shutdown(tcp::socket::shutdown_both, ec);
+    }
+
+    // 以RST关闭连接，大量短连接不在本端留下TIME_WAIT
+    void abort()
+    {
+        boost::system::error_code ec;
+        socket.set_option(boost::asio::socket_base::linger(true, 0), ec);
+        socket.close(ec);
+    }
+
+    bool resumed() const
+    {
+        return resumedSession;
+    }
+
+    // 连接的传输方式，用于输出
+    std::string transport() const
+    {
+        if (!tls)
+        {
+            return "plaintext";
+        }
+#ifdef TCP_PROTO_TLS
+        if (!ssl)
+        {
+            return "TLS (kernel offload)";
+        }
+#endif
+        return "TLS (user space)";
+    }
+
+private:
+#ifdef TCP_PROTO_TLS
+    // 与TlsSession相同，不发送close_notify，且不使缓存的会话失效
+    void release()
+    {
+        if (ssl)
+        {
+            SSL_set_shutdown(ssl, SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+            SSL_free(ssl);
+            ssl = nullptr;
+        }
+    }
+
+    boost::system::error_code failure(int result)
+    {
+        switch (SSL_get_error(ssl, result))
+        {
+        case SSL_ERROR_ZERO_RETURN:
+            return boost::asio::error::eof;
+        case SSL_ERROR_SYSCALL:
+            return errno != 0 ? boost::system::error_code(errno, boost::system::system_category())
+                              : boost::system::error_code(boost::asio::error::eof);
+        default:
+            return boost::system::error_code(static_cast<int>(ERR_get_error()), boost::asio::error::get_ssl_category());
+        }
+    }
+#endif
+};
+
+// 配置了--tls-cert时创建client的TlsContext（以证书作为CA验证server），否则返回空
+std::shared_ptr<TlsContext> clientTls(const BenchOptions &opts, bool resumeSessions)
+{
+#ifdef TCP_PROTO_TLS
+    if (!opts.tlsCert.empty())
+    {
+        TlsOptions options;
+        options.caFile = opts.tlsCert;
+        options.resumeSessions = resumeSessions;
+        return std::make_shared<TlsContext>(TlsRole::CLIENT, options);
+    }
+#endif
+    return nullptr;
+}
+
+// ---------------- 吞吐量测试 ------------------------------
+
+// 每对连接中的一端以阻塞的write()尽快发送size字节的数据，另一端接收并计数，各占一个线程
+struct BulkPair
+{
+    BenchStream control;  // tunnel：创建channel并保持其存在
+    BenchStream sender;
+    BenchStream receiver;
+    std::atomic<std::uint64_t> received{0}; // 收到的payload字节数
+
+    BulkPair(boost::asio::io_context &ioCtx, const std::shared_ptr<TlsContext> &tls)
+        : control(ioCtx, tls),
+          sender(ioCtx, tls),
+          receiver(ioCtx, tls)
+    {
+    }
+};
+
+// 建立一对连接：framed时两端以v2加入同一个channel（pause策略，接收方跟不上时暂停发送方），tunnel时配对成隧道
+void setupBulkPair(BulkPair &pair, const BenchOptions &opts, const tcp::endpoint &server, const std::string &name)
+{
+    FrameReader senderReader, receiverReader;
+    pair.sender.connect(server);
+    pair.receiver.connect(server);
+    auto expect = [&name](const Protocol::Package &reply, Protocol::Type type) {
+        if (reply.type != static_cast<std::uint16_t>(type))
+        {
+            throw std::runtime_error("setup of " + name + " failed: " + std::string(reply.body.begin(), reply.body.end()));
+        }
+    };
+    if (opts.bulk == "framed")
+    {
+        const std::string v2(1, static_cast<char>(Protocol::Version::V2));
+        expect(request(pair.receiver, receiverReader, Protocol::Type::HELLO, v2), Protocol::Type::HELLO_ACK);
+        expect(request(pair.sender, senderReader, Protocol::Type::HELLO, v2), Protocol::Type::HELLO_ACK);
+        expect(request(pair.receiver, receiverReader, Protocol::Type::CREATE_CHANNEL, name + ",pause"),
+               Protocol::Type::SUCCEED_IN_CREATE_CHANNEL);
+        expect(request(pair.sender, senderReader, Protocol::Type::JOIN_IN_CHANNEL, name),
+               Protocol::Type::SUCCEED_IN_JOIN_IN_CHANNEL);
+        return;
+    }
+    FrameReader controlReader;
+    pair.control.connect(server);
+    expect(request(pair.control, controlReader, Protocol::Type::CREATE_CHANNEL, name), Protocol::Type::SUCCEED_IN_CREATE_CHANNEL);
+    // offer先到达server，connect才能与之配对
+    auto offer = Protocol::encodeFrame(Protocol::encodePackage(Protocol::Type::TUNNEL, "offer," + name + "," + name));
+    boost::asio::write(pair.receiver, boost::asio::buffer(offer->data(), offer->size()));
+    for (int attempt = 0;; attempt++)
+    {
+        auto reply = request(pair.sender, senderReader, Protocol::Type::TUNNEL, "connect," + name + "," + name);
+        if (reply.type == static_cast<std::uint16_t>(Protocol::Type::TUNNEL_READY) || attempt == 100)
+        {
+            expect(reply, Protocol::Type::TUNNEL_READY);
+            break;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    Protocol::Package ready;
+    while (!receiverReader.next(ready))
+    {
+        receiverReader.commit(pair.receiver.read_some(receiverReader.prepare()));
+    }
+    expect(ready, Protocol::Type::TUNNEL_READY);
+}
+
+// 接收直到连接关闭：framed时只计入消息的body，tunnel时计入所有字节
+void receiveBulk(BulkPair &pair, bool framed)
+{
+    FrameReader reader(1024 * 1024);
+    Protocol::PackageView message;
+    boost::system::error_code ec;
+    while (true)
+    {
+        auto space = reader.prepare();
+        std::size_t len = pair.receiver.read_some(space, ec);
+        if (ec)
+        {
+            return;
+        }
+        if (!framed)
+        {
+            pair.received.fetch_add(len, std::memory_order_relaxed);
+            continue;
+        }
+        reader.commit(len);
+        std::uint64_t bytes = 0;
+        while (reader.next(message))
+        {
+            bytes += message.length;
+        }
+        pair.received.fetch_add(bytes, std::memory_order_relaxed);
+    }
+}
+
+/**
+ * iperf式的吞吐量测试：--connections个连接组成若干对，每对中一端尽快发送、另一端接收，持续warmup + duration秒
+ * framed为channel中以frame转发（server解析每个frame并放入接收方的发送队列），tunnel为隧道中以splice()转发
+ * 启用TLS时隧道要求连接由内核加解密，否则server拒绝建立
+ * 输出测量阶段的吞吐量，以及server每转发1GiB数据所用的CPU时间
+ */
+int runBulk(const BenchOptions &opts, const std::vector<tcp::endpoint> &servers, const std::vector<pid_t> &serverPids)
+{
+    bool framed = opts.bulk == "framed";
+    unsigned int pairNum = std::max(1u, opts.connections / 2);
+    boost::asio::io_context ioCtx;
+    std::vector<std::unique_ptr<BulkPair>> pairs;
+    try
+    {
+        auto tls = clientTls(opts, true);
+        for (unsigned int i = 0; i < pairNum; i++)
+        {
+            pairs.push_back(std::make_unique<BulkPair>(ioCtx, tls));
+            setupBulkPair(*pairs.back(), opts, servers[i % servers.size()], "bulk-" + std::to_string(i));
+        }
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << "setup failed: " << e.what() << std::endl;
+        return 1;
+    }
+
+    std::vector<std::thread> workers;
+    std::vector<std::uint8_t> payload(opts.size, 'x');
+    auto frame = Protocol::encodeFrame(Protocol::Type::MESSAGE,
+                                       std::string_view(reinterpret_cast<const char *>(payload.data()), payload.size()),
+                                       Protocol::Version::V2);
+    for (auto &pair : pairs)
+    {
+        workers.emplace_back([&pair, framed]() { receiveBulk(*pair, framed); });
+        workers.emplace_back([&pair, &payload, &frame, framed]() {
+            boost::system::error_code ec;
+            boost::asio::const_buffer buffer = framed ? boost::asio::const_buffer(frame->data(), frame->size())
+                                                      : boost::asio::const_buffer(payload.data(), payload.size());
+            while (!ec)
+            {
+                boost::asio::write(pair->sender, buffer, ec);
+            }
+        });
+    }
+    auto total = [&pairs]() {
+        std::uint64_t bytes = 0;
+        for (auto &pair : pairs)
+        {
+            bytes += pair->received.load(std::memory_order_relaxed);
+        }
+        return bytes;
+    };
+
+    std::this_thread::sleep_for(std::chrono::duration<double>(opts.warmup));
+    ProcessUsage before = processUsage(serverPids);
+    std::uint64_t startBytes = total();
+    auto start = Clock::now();
+    std::this_thread::sleep_for(std::chrono::duration<double>(opts.duration));
+    std::uint64_t bytes = total() - startBytes;
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    ProcessUsage after = processUsage(serverPids);
+
+    // 关闭两个方向使阻塞中的读写返回
+    for (auto &pair : pairs)
+    {
+        pair->sender.shutdown();
+        pair->receiver.shutdown();
+    }
+    for (auto &worker : workers)
+    {
+        worker.join();
+    }
+
+    double mib = bytes / seconds / (1024 * 1024);
+    std::cout << std::fixed << std::setprecision(1);
+    std::cout << "bulk: " << opts.bulk << ", " << pairs.front()->sender.transport() << ", pairs: " << pairNum
+              << ", write size: " << opts.size << " bytes"
+              << ", server threads: " << (serverPids.empty() ? "external" : std::to_string(opts.serverThreads)) << std::endl;
+    std::cout << "throughput: " << mib << " MiB/sec, " << mib * 8 * 1024 * 1024 / 1e9 << " Gbit/sec" << std::endl;
+    if (!serverPids.empty())
+    {
+        double cpu = after.cpuSeconds - before.cpuSeconds;
+        std::cout << std::setprecision(2) << "server cpu: " << cpu / seconds * 100 << " %, "
+                  << (bytes > 0 ? cpu / (bytes / (1024.0 * 1024 * 1024)) : 0) << " cpu-seconds per GiB" << std::endl;
+    }
+    return 0;
+}
+
+// ---------------- 握手速率测试 ------------------------------
+
+// 每个负载线程独占的握手统计
+struct HandshakeStats
+{
+    std::uint64_t completed = 0;
+    std::uint64_t resumed = 0;
+    std::uint64_t errors = 0;
+    Histogram latency; // 纳秒，从开始连接到收到HELLO_ACK
+    std::string transport;
+};
+
+/**
+ * 握手速率测试：每个负载线程循环建立连接、完成握手并以HELLO/HELLO_ACK确认server可用后以RST断开，持续warmup + duration秒
+ * new时每个连接都是完整握手，resume时以上一次连接得到的session ticket恢复会话（每个线程一个TlsContext）
+ * 未指定--tls-cert时测量明文的连接及HELLO，作为对比的基准
+ * 输出每秒完成的握手数、每次握手的延迟，以及server每1000次握手所用的CPU时间
+ */
+int runHandshakes(const BenchOptions &opts, const std::vector<tcp::endpoint> &servers, const std::vector<pid_t> &serverPids)
+{
+    std::vector<std::shared_ptr<TlsContext>> contexts;
+    try
+    {
+        for (unsigned int i = 0; i < opts.threads; i++)
+        {
+            contexts.push_back(clientTls(opts, opts.handshake == "resume"));
+        }
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << "setup failed: " << e.what() << std::endl;
+        return 1;
+    }
+
+    std::vector<HandshakeStats> stats(opts.threads);
+    std::atomic<bool> stopped(false);
+    std::vector<std::thread> workers;
+    for (unsigned int t = 0; t < opts.threads; t++)
+    {
+        workers.emplace_back([&opts, &servers, &contexts, &stats, &stopped, t]() {
+            boost::asio::io_context ioCtx;
+            const std::string v1(1, static_cast<char>(Protocol::Version::V1));
+            HandshakeStats &threadStats = stats[t];
+            for (std::size_t i = t; !stopped.load(std::memory_order_relaxed); i += opts.threads)
+            {
+                auto begin = nowNanos();
+                BenchStream stream(ioCtx, contexts[t]);
+                FrameReader reader;
+                try
+                {
+                    stream.connect(servers[i % servers.size()]);
+                    if (request(stream, reader, Protocol::Type::HELLO, v1).type !=
+                        static_cast<std::uint16_t>(Protocol::Type::HELLO_ACK))
+                    {
+                        throw std::runtime_error("unexpected reply to HELLO");
+                    }
+                }
+                catch (const std::exception &)
+                {
+                    threadStats.errors++;
+                    stream.abort();
+                    continue;
+                }
+                if (measuring.load(std::memory_order_relaxed))
+                {
+                    threadStats.completed++;
+                    threadStats.resumed += stream.resumed();
+                    threadStats.latency.record(nowNanos() - begin);
+                }
+                threadStats.transport = stream.transport();
+                stream.abort();
+            }
+        });
+    }
+
+    std::this_thread::sleep_for(std::chrono::duration<double>(opts.warmup));
+    ProcessUsage before = processUsage(serverPids);
+    auto start = Clock::now();
+    measuring.store(true, std::memory_order_relaxed);
+    std::this_thread::sleep_for(std::chrono::duration<double>(opts.duration));
+    measuring.store(false, std::memory_order_relaxed);
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    ProcessUsage after = processUsage(serverPids);
+    stopped.store(true, std::memory_order_relaxed);
+    for (auto &worker : workers)
+    {
+        worker.join();
+    }
+
+    HandshakeStats total;
+    for (auto &item : stats)
+    {
+        total.completed += item.completed;
+        total.resumed += item.resumed;
+        total.errors += item.errors;
+        total.latency.merge(item.latency);
+        if (!item.transport.empty())
+        {
+            total.transport = item.transport;
+        }
+    }
+
+    auto micros = [](std::uint64_t nanos) { return nanos / 1000.0; };
+    std::cout << std::fixed << std::setprecision(1);
+    std::cout << "handshake: " << (opts.tlsCert.empty() ? "plain connect" : opts.handshake) << ", " << total.transport
+              << ", load threads: " << opts.threads
+              << ", server threads: " << (serverPids.empty() ? "external" : std::to_string(opts.serverThreads)) << std::endl;
+    std::cout << "handshakes: " << total.completed / seconds << " /sec, resumed: "
+              << (total.completed ? 100.0 * total.resumed / total.completed : 0) << " %" << std::endl;
+    std::cout << "latency (us): p50 " << micros(total.latency.percentile(0.5))
+              << ", p99 " << micros(total.latency.percentile(0.99))
+              << ", p999 " << micros(total.latency.percentile(0.999))
+              << ", max " << micros(total.latency.max()) << std::endl;
+    if (total.errors)
+    {
+        std::cout << "failed: " << total.errors << std::endl;
+    }
+    if (!serverPids.empty())
+    {
+        double cpu = after.cpuSeconds - before.cpuSeconds;
+        std::cout << std::setprecision(2) << "server cpu: " << cpu / seconds * 100 << " %, "
+                  << (total.completed ? cpu * 1000 / total.completed : 0) << " cpu-seconds per 1k handshakes" << std::endl;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    BenchOptions opts;
+    if (!parseOptions(argc, argv, opts))
+    {
+        std::cerr << "Usage: bench [--connect <host:port>[,<host:port>...]] [--server-pid <pid>] [--threads <N>] [--load-threads <N>]"
+                  << " [--connections <N>] [--channel-size <K>] [--size <bytes>] [--rate <msgs/sec>]"
+                  << " [--duration <seconds>] [--warmup <seconds>] [--engine callback|coroutine|io_uring] [--batch <N>]"
+                  << " [--nodes <N>] [--bulk framed|tunnel] [--handshake new|resume] [--tls-cert <pem>] [--tls-key <pem>]"
+                  << std::endl;
+        return 1;
+    }
+    raiseFileLimit();
+
+    // 必须在创建任何线程之前fork
+    std::vector<tcp::endpoint> servers = opts.servers;
+    std::vector<pid_t> serverPids;
+    if (opts.serverPid > 0)
+    {
+        serverPids.push_back(opts.serverPid);
+    }
+    bool spawned = servers.empty();
+    if (spawned)
+    {
+        auto nodes = opts.nodes > 1 ? reserveNodes(opts.nodes) : std::vector<std::string>();
+        for (unsigned int i = 0; i < opts.nodes; i++)
+        {
+            unsigned short port = nodes.empty() ? 0 : static_cast<unsigned short>(std::stoul(nodes[i].substr(nodes[i].rfind(':') + 1)));
+            serverPids.push_back(spawnServer(opts, nodes, i, port));
+            servers.emplace_back(boost::asio::ip::address_v4::loopback(), port);
+        }
+    }
+    if (!opts.bulk.empty() || !opts.handshake.empty())
+    {
+        int result = opts.bulk.empty() ? runHandshakes(opts, servers, serverPids) : runBulk(opts, servers, serverPids);
+        if (spawned)
+        {
+            stopServers(serverPids);
+        }
+        return result;
+    }
+    ProcessUsage baseline;
+    if (!serverPids.empty())
+    {
+        baseline = processUsage(serverPids);
+    }
+
+    // 每个负载线程一个io_context，连接按轮转方式分配
+    std::vector<std::unique_ptr<boost::asio::io_context>> ioContexts;
+    std::vector<ThreadStats> stats(opts.threads);
+    for (unsigned int i = 0; i < opts.threads; i++)
+    {
+        ioContexts.push_back(std::make_unique<boost::asio::io_context>(1));
+    }
+    std::vector<std::unique_ptr<BenchConnection>> connections;
+    auto setupStart = Clock::now();
+    try
+    {
+        for (unsigned int i = 0; i < opts.connections; i++)
+        {
+            unsigned int t = i % opts.threads;
+            connections.push_back(std::make_unique<BenchConnection>(*ioContexts[t], stats[t], opts));
+            connections.back()->connect(servers[i % servers.size()]);
+        }
+
+        // 连续的channelSize个连接组成一个channel，第一个负责创建，其余加入；不足一组的连接只保持连接
+        unsigned int channelNum = opts.connections / opts.channelSize;
+        for (unsigned int c = 0; c < channelNum; c++)
+        {
+            std::string name = "bench-" + std::to_string(c);
+            for (unsigned int m = 0; m < opts.channelSize; m++)
+            {
+                auto &conn = connections[c * opts.channelSize + m];
+                auto type = m == 0 ? Protocol::Type::CREATE_CHANNEL : Protocol::Type::JOIN_IN_CHANNEL;
+                auto expected = m == 0 ? Protocol::Type::SUCCEED_IN_CREATE_CHANNEL : Protocol::Type::SUCCEED_IN_JOIN_IN_CHANNEL;
+                auto reply = conn->request(type, name);
+                if (reply.type != static_cast<std::uint16_t>(expected))
+                {
+                    std::cerr << "setup of " << name << " failed: " << std::string(reply.body.begin(), reply.body.end())
+                              << " (for an external server, start it with --channel-capacity " << opts.channelSize << ")"
+                              << std::endl;
+                    if (spawned)
+                    {
+                        stopServers(serverPids);
+                    }
+                    return 1;
+                }
+            }
+        }
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << "setup failed: " << e.what() << std::endl;
+        if (spawned)
+        {
+            stopServers(serverPids);
+        }
+        return 1;
+    }
+    double setupSeconds = std::chrono::duration<double>(Clock::now() - setupStart).count();
+    ProcessUsage connected;
+    if (!serverPids.empty())
+    {
+        connected = processUsage(serverPids);
+    }
+
+    std::mt19937 random(42);
+    unsigned int senders = opts.connections / opts.channelSize * opts.channelSize;
+    for (unsigned int i = 0; i < connections.size(); i++)
+    {
+        auto period = connections[i]->sendPeriod();
+        std::uniform_int_distribution<Clock::rep> offset(0, std::max<Clock::rep>(0, period.count() - 1));
+        connections[i]->start(i < senders, Clock::duration(offset(random)));
+    }
+    std::vector<std::thread> workers;
+    for (auto &ioContext : ioContexts)
+    {
+        workers.emplace_back([&ioContext]() { ioContext->run(); });
+    }
+
+    std::this_thread::sleep_for(std::chrono::duration<double>(opts.warmup));
+    ProcessUsage before;
+    if (!serverPids.empty())
+    {
+        before = processUsage(serverPids);
+    }
+    auto start = Clock::now();
+    measuring.store(true, std::memory_order_relaxed);
+    std::this_thread::sleep_for(std::chrono::duration<double>(opts.duration));
+    measuring.store(false, std::memory_order_relaxed);
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    ProcessUsage after;
+    if (!serverPids.empty())
+    {
+        after = processUsage(serverPids);
+    }
+
+    // 在各自的线程中关闭连接，之后io_context没有未完成的操作，run()随之返回
+    for (unsigned int i = 0; i < connections.size(); i++)
+    {
+        BenchConnection *conn = connections[i].get();
+        boost::asio::post(*ioContexts[i % opts.threads], [conn]() { conn->stop(); });
+    }
+    for (auto &worker : workers)
+    {
+        worker.join();
+    }
+    if (spawned)
+    {
+        stopServers(serverPids);
+    }
+
+    ThreadStats total;
+    for (auto &item : stats)
+    {
+        total.sent += item.sent;
+        total.received += item.received;
+        total.bytesReceived += item.bytesReceived;
+        total.skipped += item.skipped;
+        total.errors += item.errors;
+        total.latency.merge(item.latency);
+    }
+
+    auto micros = [](std::uint64_t nanos) { return nanos / 1000.0; };
+    std::cout << std::fixed << std::setprecision(1);
+    std::cout << "connections: " << opts.connections << ", channels: " << opts.connections / opts.channelSize
+              << " x " << opts.channelSize << " members, payload: " << opts.size << " bytes, rate: "
+              << (opts.rate > 0 ? std::to_string(static_cast<long long>(opts.rate)) + " msgs/sec/conn" : "unlimited")
+              << (opts.batch > 1 ? ", batch: " + std::to_string(opts.batch) : "")
+              << ", server threads: " << (spawned ? std::to_string(opts.serverThreads) : "external")
+              << (servers.size() > 1 ? ", nodes: " + std::to_string(servers.size()) : "")
+              << ", load threads: " << opts.threads << std::endl;
+    std::cout << "setup: " << setupSeconds << " s" << std::endl;
+    std::cout << "sent: " << total.sent / seconds << " msgs/sec" << (total.skipped ? ", skipped: " : "")
+              << (total.skipped ? std::to_string(total.skipped) : "") << std::endl;
+    std::cout << "delivered: " << total.received / seconds << " msgs/sec, "
+              << total.bytesReceived / seconds / (1024 * 1024) << " MiB/sec" << std::endl;
+    std::cout << "latency (us): p50 " << micros(total.latency.percentile(0.5))
+              << ", p99 " << micros(total.latency.percentile(0.99))
+              << ", p999 " << micros(total.latency.percentile(0.999))
+              << ", max " << micros(total.latency.max()) << std::endl;
+    if (total.errors)
+    {
+        std::cout << "unexpected frames: " << total.errors << std::endl;
+    }
+    if (!serverPids.empty())
+    {
+        double perThousand = 1000.0 / opts.connections;
+        double rssDelta = static_cast<double>(connected.rssBytes) - baseline.rssBytes;
+        double cpu = (after.cpuSeconds - before.cpuSeconds) / seconds * 100;
+        std::cout << "server rss: " << after.rssBytes / (1024.0 * 1024) << " MiB, "
+                  << rssDelta * perThousand / (1024 * 1024) << " MiB per 1k connections" << std::endl;
+        std::cout << "server cpu: " << cpu << " %, " << cpu * perThousand << " % per 1k connections" << std::endl;
+    }
+    return 0;
+}
@@ -0,0 +1,426 @@
+// 协议层及channel分发热点函数的微基准测试（Google Benchmark）
+// 不使用真实连接：participant的socket从未打开，io_context也不执行写操作，
+// 转发的frame停留在participant的发送队列中，队列达到上限后按DROP_OLDEST淘汰最早的frame
+// 每个benchmark额外报告allocs（每次迭代的堆分配次数），默认以JSON输出，便于在不同提交之间比较：
+//     microbench > before.json
+// 也可以使用Google Benchmark自带的参数，如 --benchmark_filter=Channel --benchmark_format=console
+#include "server.hpp"
+#include "client.hpp"
+#include "protocol.hpp"
+#include <benchmark/benchmark.h>
+#include <boost/asio.hpp>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+using boost::asio::ip::tcp;
+
+// 统计堆分配次数
+std::atomic<std::uint64_t> allocations(0);
+
+void *operator new(std::size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void *ptr = std::malloc(size ? size : 1))
+    {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void *ptr) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete(void *ptr, std::size_t) noexcept
+{
+    std::free(ptr);
+}
+
+// 在循环开始前记录分配次数，结束后换算为每次迭代的平均值
+class AllocationCounter
+{
+private:
+    benchmark::State &state;
+    std::uint64_t start;
+
+public:
+    explicit AllocationCounter(benchmark::State &s)
+        : state(s),
+          start(allocations.load(std::memory_order_relaxed))
+    {
+    }
+
+    ~AllocationCounter()
+    {
+        state.counters["allocs"] = benchmark::Counter(
+            static_cast<double>(allocations.load(std::memory_order_relaxed) - start),
+            benchmark::Counter::kAvgIterations);
+    }
+};
+
+// ---------------- Protocol ------------------------------
+
+void BM_encodePackage(benchmark::State &state)
+{
+    const std::string msg(state.range(0), 'a');
+    {
+        AllocationCounter counter(state);
+        for (auto _ : state)
+        {
+            benchmark::DoNotOptimize(Protocol::encodePackage(msg));
+        }
+    }
+    state.SetBytesProcessed(state.iterations() * msg.size());
+}
+BENCHMARK(BM_encodePackage)->Arg(16)->Arg(1024)->Arg(Protocol::BODY_MAX_LENGTH);
+
+void BM_decodePackage(benchmark::State &state)
+{
+    auto pkg = Protocol::encodePackage(std::string(state.range(0), 'a'));
+    AllocationCounter counter(state);
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(Protocol::decodePackage(pkg));
+    }
+}
+BENCHMARK(BM_decodePackage)->Arg(16)->Arg(1024);
+
+void BM_checkType(benchmark::State &state)
+{
+    // 包含合法与不合法的type，避免分支被完全预测
+    std::vector<Protocol::Type> types;
+    for (std::uint16_t i = 0; i < 64; i++)
+    {
+        types.push_back(static_cast<Protocol::Type>((i * 7) % 20));
+    }
+    std::size_t i = 0;
+    AllocationCounter counter(state);
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(Protocol::checkType(types[i++ & 63]));
+    }
+}
+BENCHMARK(BM_checkType);
+
+void BM_encodeFrame(benchmark::State &state)
+{
+    auto version = static_cast<Protocol::Version>(state.range(0));
+    auto pkg = Protocol::encodePackage(std::string(state.range(1), 'a'));
+    {
+        AllocationCounter counter(state);
+        for (auto _ : state)
+        {
+            benchmark::DoNotOptimize(Protocol::encodeFrame(pkg, version));
+        }
+    }
+    state.SetBytesProcessed(state.iterations() * pkg.body.size());
+}
+BENCHMARK(BM_encodeFrame)->ArgNames({"version", "size"})->Args({1, 16})->Args({1, 1024})->Args({2, 16})->Args({2, 1024});
+
+// ---------------- Channel / Participant ------------------------------
+
+// 单shard的server以及若干从未连接的participant
+// 所有操作都在io_context的线程中执行，Shard::dispatch因此会直接调用而不经过inbox
+class Fixture
+{
+private:
+    boost::asio::io_context ioContext;
+    std::unique_ptr<Server> server;
+
+public:
+    std::vector<std::shared_ptr<Participant>> members;
+
+    explicit Fixture(unsigned int memberNum)
+        : ioContext(1)
+    {
+        ServerOptions options;
+        options.channelCapacity = memberNum;
+        options.sendQueueMaxFrames = 256;
+        server = std::make_unique<Server>(ioContext, tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0), options);
+        for (unsigned int i = 0; i < memberNum; i++)
+        {
+            members.push_back(std::make_shared<Participant>(tcp::socket(ioContext), server->shard(0), server->getOptions()));
+        }
+    }
+
+    ~Fixture()
+    {
+        // 未完成的写操作持有participant，需要在io_context之前销毁
+        members.clear();
+        ioContext.stop();
+    }
+
+    Shard &shard()
+    {
+        return server->shard(0);
+    }
+
+    // 在io_context的线程中执行task并等待其完成
+    template <typename Task>
+    void run(Task &&task)
+    {
+        bool done = false;
+        boost::asio::post(ioContext, [&]() {
+            task();
+            done = true;
+        });
+        while (!done)
+        {
+            ioContext.run_one();
+        }
+    }
+
+    // 所有成员通过handle()加入同一个channel，第一个成员负责创建
+    void joinAll(const std::string &name)
+    {
+        for (unsigned int i = 0; i < members.size(); i++)
+        {
+            auto type = i == 0 ? Protocol::Type::CREATE_CHANNEL : Protocol::Type::JOIN_IN_CHANNEL;
+            members[i]->handle(Protocol::encodePackage(type, name));
+        }
+    }
+};
+
+void BM_channelSend(benchmark::State &state)
+{
+    Fixture fixture(state.range(0));
+    fixture.run([&]() {
+        fixture.joinAll("bench");
+        auto channel = *fixture.shard().channels().find("bench");
+        auto sender = fixture.members.front();
+        auto frame = Protocol::encodeFrame(Protocol::encodePackage(std::string(64, 'a')));
+        // 先填满所有接收方的发送队列，使队列的扩容不计入测量
+        for (std::size_t i = 0; i <= fixture.shard().getServer().getOptions().sendQueueMaxFrames; i++)
+        {
+            channel->send(sender, frame);
+        }
+        AllocationCounter counter(state);
+        for (auto _ : state)
+        {
+            channel->send(sender, frame);
+        }
+    });
+    state.SetItemsProcessed(state.iterations() * (state.range(0) - 1));
+}
+BENCHMARK(BM_channelSend)->ArgName("members")->Arg(2)->Arg(16)->Arg(256)->Arg(4096);
+
+void BM_handle(benchmark::State &state)
+{
+    Fixture fixture(2);
+    fixture.run([&]() {
+        fixture.joinAll("bench");
+        auto type = static_cast<Protocol::Type>(state.range(0));
+        auto pkg = Protocol::encodePackage(type, type == Protocol::Type::MESSAGE ? std::string(64, 'a') : "");
+        auto &participant = *fixture.members.front();
+        for (std::size_t i = 0; i <= fixture.shard().getServer().getOptions().sendQueueMaxFrames; i++)
+        {
+            participant.handle(pkg);
+        }
+        AllocationCounter counter(state);
+        for (auto _ : state)
+        {
+            participant.handle(pkg);
+        }
+    });
+}
+BENCHMARK(BM_handle)->ArgName("type")
+    ->Arg(static_cast<int>(Protocol::Type::MESSAGE))
+    ->Arg(static_cast<int>(Protocol::Type::LIST_ALL_CHANNELS));
+
+// ---------------- Session ------------------------------
+
+// 通过loopback上的真实连接测量一条消息经过server转发的完整路径，用于比较两种会话引擎：
+// server在单独的线程中运行，两个阻塞的客户端socket加入同一个channel，A每发送一条消息B就读取一条
+class SessionFixture
+{
+private:
+    boost::asio::io_context serverContext;
+    boost::asio::io_context clientContext;
+    std::unique_ptr<Server> server;
+    std::thread serverThread;
+
+public:
+    tcp::socket sender;
+    tcp::socket receiver;
+
+    explicit SessionFixture(SessionEngine engine)
+        : serverContext(1),
+          sender(clientContext),
+          receiver(clientContext)
+    {
+        ServerOptions options;
+        options.engine = engine;
+        server = std::make_unique<Server>(serverContext, tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0), options);
+        serverThread = std::thread([this]() { serverContext.run(); });
+        sender.connect(server->localEndpoint());
+        receiver.connect(server->localEndpoint());
+        sender.set_option(tcp::no_delay(true));
+        receiver.set_option(tcp::no_delay(true));
+        request(sender, Protocol::Type::CREATE_CHANNEL, "bench");
+        request(receiver, Protocol::Type::JOIN_IN_CHANNEL, "bench");
+    }
+
+    ~SessionFixture()
+    {
+        boost::system::error_code ec;
+        sender.close(ec);
+        receiver.close(ec);
+        serverContext.stop();
+        serverThread.join();
+    }
+
+    // 读取一个v1 frame，返回其type
+    static std::uint16_t readFrame(tcp::socket &socket, std::vector<std::uint8_t> &body)
+    {
+        std::uint8_t header[Protocol::HEADER_LENGTH];
+        boost::asio::read(socket, boost::asio::buffer(header));
+        std::uint16_t type;
+        std::uint16_t length;
+        std::memcpy(&type, header, sizeof(type));
+        std::memcpy(&length, header + sizeof(type), sizeof(length));
+        body.resize(length);
+        boost::asio::read(socket, boost::asio::buffer(body));
+        return type;
+    }
+
+private:
+    static void request(tcp::socket &socket, Protocol::Type type, const std::string &body)
+    {
+        auto frame = Protocol::encodeFrame(Protocol::encodePackage(type, body));
+        boost::asio::write(socket, boost::asio::buffer(frame->data(), frame->size()));
+        std::vector<std::uint8_t> reply;
+        readFrame(socket, reply);
+    }
+};
+
+void BM_session(benchmark::State &state)
+{
+    SessionFixture fixture(static_cast<SessionEngine>(state.range(0)));
+    auto frame = Protocol::encodeFrame(Protocol::encodePackage(std::string(64, 'a')));
+    std::vector<std::uint8_t> body;
+    {
+        AllocationCounter counter(state);
+        for (auto _ : state)
+        {
+            boost::asio::write(fixture.sender, boost::asio::buffer(frame->data(), frame->size()));
+            SessionFixture::readFrame(fixture.receiver, body);
+        }
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_session)->ArgName("engine")
+    ->Arg(static_cast<int>(SessionEngine::CALLBACK))
+#ifdef TCP_PROTO_COROUTINES
+    ->Arg(static_cast<int>(SessionEngine::COROUTINE))
+#endif
+#ifdef TCP_PROTO_IO_URING
+    ->Arg(static_cast<int>(SessionEngine::IO_URING))
+#endif
+    ->UseRealTime();
+
+// ---------------- Client ------------------------------
+
+// 多个生产者线程同时调用Client::write()，对端只读取并丢弃数据，测量write()的吞吐量
+// 包括io线程从outbox取出frame并写入socket：outbox写满后生产者等待，测得的是持续的速率
+class ClientFixture
+{
+private:
+    boost::asio::io_context ioContext;
+    tcp::acceptor acceptor;
+    tcp::socket peer;
+    std::thread sinkThread;
+    std::thread ioThread;
+
+public:
+    std::unique_ptr<Client> client;
+
+    ClientFixture()
+        : acceptor(ioContext, tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0)),
+          peer(ioContext)
+    {
+        tcp::resolver resolver(ioContext);
+        auto endpoints = resolver.resolve("127.0.0.1", std::to_string(acceptor.local_endpoint().port()));
+        client = std::make_unique<Client>(ioContext, endpoints);
+        ioThread = std::thread([this]() { ioContext.run(); });
+        acceptor.accept(peer);
+        // 读到HELLO说明连接已建立，之后不回复HELLO_ACK，client保持v1
+        std::uint8_t hello[Protocol::HEADER_LENGTH + 1];
+        boost::asio::read(peer, boost::asio::buffer(hello));
+        sinkThread = std::thread([this]() {
+            std::vector<std::uint8_t> buffer(256 * 1024);
+            boost::system::error_code ec;
+            while (!ec)
+            {
+                peer.read_some(boost::asio::buffer(buffer), ec);
+            }
+        });
+    }
+
+    ~ClientFixture()
+    {
+        client->close();
+        boost::system::error_code ec;
+        peer.shutdown(tcp::socket::shutdown_both, ec);
+        sinkThread.join();
+        ioContext.stop();
+        ioThread.join();
+    }
+};
+
+void BM_clientWrite(benchmark::State &state)
+{
+    static std::unique_ptr<ClientFixture> fixture;
+    if (state.thread_index() == 0)
+    {
+        fixture = std::make_unique<ClientFixture>();
+    }
+    const std::string msg(64, 'a');
+    {
+        std::unique_ptr<AllocationCounter> counter;
+        if (state.thread_index() == 0)
+        {
+            counter = std::make_unique<AllocationCounter>(state);
+        }
+        for (auto _ : state)
+        {
+            fixture->client->write(Protocol::Type::MESSAGE, msg);
+        }
+    }
+    state.SetItemsProcessed(state.iterations());
+    if (state.thread_index() == 0)
+    {
+        fixture.reset();
+    }
+}
+BENCHMARK(BM_clientWrite)->ThreadRange(1, 4)->UseRealTime();
+
+int main(int argc, char **argv)
+{
+    // 未指定输出格式时默认输出JSON
+    std::vector<char *> args(argv, argv + argc);
+    std::string format = "--benchmark_format=json";
+    bool hasFormat = false;
+    for (int i = 1; i < argc; i++)
+    {
+        hasFormat = hasFormat || std::string(argv[i]).rfind("--benchmark_format", 0) == 0;
+    }
+    if (!hasFormat)
+    {
+        args.push_back(format.data());
+    }
+    int count = static_cast<int>(args.size());
+    benchmark::Initialize(&count, args.data());
+    if (benchmark::ReportUnrecognizedArguments(count, args.data()))
+    {
+        return 1;
+    }
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
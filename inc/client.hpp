@@ -1,29 +1,206 @@
 #include "protocol.hpp"
+#include "frame_reader.hpp"
+#include "frame_queue.hpp"
+#include "mpsc_ring.hpp"
+#include "handler_memory.hpp"
+#include "session_engine.hpp"
+#include "tls.hpp"
 #include <boost/asio.hpp>
 #include <memory>
-#include <queue>
+#include <chrono>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <optional>
+#include <deque>
+#include <unordered_map>
 
 class Client
 {
+public:
+    // write()编码好的frame先放入outbox，由io线程成批移入发送队列
+    static constexpr std::size_t OUTBOX_CAPACITY = 64 * 1024;
+    // 发送队列的上限：超出后io线程暂停从outbox取出，outbox写满后write()等待，使生产者受到反压
+    static constexpr std::size_t SEND_QUEUE_MAX_BYTES = 8 * 1024 * 1024;
+    static constexpr std::size_t SEND_QUEUE_MAX_FRAMES = 16 * 1024;
+
 private:
+    // 每次drain最多移入发送队列的frame个数，避免长期占用io线程
+    static constexpr unsigned int DRAIN_BATCH = 1024;
+
     boost::asio::io_context &ioContext;
     boost::asio::ip::tcp::socket socket;
-    std::queue<Protocol::Package> pkgQueue;
+    FrameQueue pkgQueue; // 只在io线程中访问
+    // 任意线程无锁地放入frame，io线程是唯一的消费者
+    MpscRing<Protocol::FramePtr> outbox;
+    // outbox是否已安排在io线程中处理：只有outbox由空变为非空时才投递一次drain，唤醒io线程
+    std::atomic<bool> outboxScheduled;
+    // outbox已满时生产者在outboxSpace上等待，io线程取出frame后只在outboxWaiters不为0时才加锁唤醒
+    std::mutex outboxMutex;
+    std::condition_variable outboxSpace;
+    std::atomic<unsigned int> outboxWaiters;
+    bool outboxStalled;       // 因发送队列已满而暂停取出outbox，写完成后继续，只在io线程中访问
+    std::atomic<bool> closed; // close()之后write()不再发送
+    std::chrono::microseconds writeDelay; // 类Nagle的发送延迟，默认为0即立即发送
+    boost::asio::steady_timer flushTimer;
+    FrameReader reader;
+    Protocol::PackageView inputPkg; // body直接指向接收缓冲区
+    // 与server协商出的协议版本，收到HELLO_ACK之前为v1。write()可能在其他线程调用，因此为原子变量
+    std::atomic<Protocol::Version> version;
+    HandlerMemory readMemory; // 读/写handler复用的内存
+    HandlerMemory writeMemory;
+    SessionEngine engine;
+    // 消息合并：write()发送的MESSAGE先追加到batch中，达到batchBytes或第一条消息等待满batchDelay后整体发出
+    // write()可能在其他线程调用，batch相关的成员由batchMutex保护。未开启合并时write()不加锁
+    // io线程不会阻塞在batchMutex上：持有锁的生产者可能正在等待io线程取走outbox中的frame
+    std::mutex batchMutex;
+    std::atomic<std::size_t> batchBytes; // 为0时不合并
+    std::chrono::microseconds batchDelay;
+    std::optional<Protocol::FrameBuilder> batch;
+    std::uint32_t batchChannel; // batch所属的channel
+    std::uint64_t batchSeq; // 每开始一个新的batch加一，用于识别过期的batchTimer
+    boost::asio::steady_timer batchTimer;
+    // 之后的MESSAGE、LEAVE_CHANNEL、HISTORY所指的channel，为NO_CHANNEL时不带ID（只加入了一个channel）
+    // 只在协商出v2之后生效
+    std::atomic<std::uint32_t> channelId;
+    // 多路复用（见Protocol::Type::STREAM）：server在HELLO_ACK中给出的每个stream的窗口大小，为0时不支持stream
+    std::atomic<std::uint32_t> streamWindow;
+    struct StreamState
+    {
+        std::int64_t credit; // server还允许本端发送的字节数
+        std::deque<std::pair<Protocol::FramePtr, std::size_t>> pending; // 额度不足时排队的frame及其内层frame的长度
+    };
+    // 由streamMutex保护，与batchMutex相同，io线程不阻塞在该锁上
+    std::mutex streamMutex;
+    std::unordered_map<std::uint32_t, StreamState> streams;
+    // 各stream已收到、尚未归还额度的字节数，只在io线程中访问
+    std::unordered_map<std::uint32_t, std::size_t> streamOwed;
+    std::shared_ptr<TlsContext> tlsContext; // 为空时为明文
+#ifdef TCP_PROTO_TLS
+    // 握手后内核完成加解密时为空，否则读写都经过tls。连接建立及握手期间不发送，以下只在io线程中访问
+    std::unique_ptr<TlsSession> tls;
+    bool securing;
+#endif
+#ifdef TCP_PROTO_COROUTINES
+    // 协程引擎：写循环在队列为空时等待该timer，cancel()即唤醒
+    boost::asio::steady_timer writerWakeup;
+#endif
 
 public:
+    /**
+     * tls不为空时连接建立后先完成TLS握手（需以TCP_PROTO_TLS编译），同一个TlsContext的后续连接以其缓存的会话恢复
+     * 在用户态加解密的TLS连接只使用回调引擎
+     */
     Client(boost::asio::io_context &ioCtx,
-           const boost::asio::ip::tcp::resolver::results_type &endpoints);
+           const boost::asio::ip::tcp::resolver::results_type &endpoints,
+           std::chrono::microseconds delay = std::chrono::microseconds(0),
+           SessionEngine sessionEngine = SessionEngine::CALLBACK,
+           std::shared_ptr<TlsContext> tls = nullptr);
 
+    // 以当前协商出的协议版本编码后发送
     void write(const Protocol::Package &pkg);
 
+    /**
+     * 把body直接编码进frame后发送，不经过Package
+     * 可在任意线程并发调用：frame编码在调用方线程中完成（FramePool），之后无锁地放入outbox，
+     * 不为每条消息投递handler；outbox已满时阻塞在条件变量上（不空转），直到io线程取走frame或close()。
+     * 同一线程先后写入的frame按顺序发出
+     * 当type值不合法或body超出当前版本的上限时抛出异常：invalid_type / invalid_length
+     */
+    void write(Protocol::Type type, std::string_view body);
+
+    Protocol::Version protocolVersion();
+
+    /**
+     * 开启消息合并：MESSAGE在发送前合并为MESSAGE_BATCH，body达到maxBytes字节，
+     * 或batch中第一条消息已等待maxDelay时发出；maxBytes为0时关闭
+     * 只在与server协商出v2之后生效（旧server不认识MESSAGE_BATCH），超过maxBytes的单条消息直接发送
+     */
+    void setBatching(std::size_t maxBytes, std::chrono::microseconds maxDelay);
+
+    /**
+     * 选择之后的消息发往的channel（CREATE/JOIN成功的回复中的ID），未合并完的batch仍发往原来的channel
+     * 加入或创建channel成功后自动切换到该channel
+     */
+    void setChannel(std::uint32_t id);
+
+    /**
+     * 在ID为stream的逻辑会话上发送，第一次使用某个ID即打开该stream，之后与一个独立的连接相同
+     * 可在任意线程调用；该stream的额度不足时frame在本地排队，收到server归还的额度后依次发出
+     * 内层frame不带channel ID，不参与消息合并。server不支持stream（或尚未收到HELLO_ACK）时返回false
+     * 当type值不合法或body超出v2的上限时抛出异常：invalid_type / invalid_length
+     */
+    bool writeStream(std::uint32_t stream, Protocol::Type type, std::string_view body);
+
+    // 关闭stream，排队中尚未发出的frame被丢弃
+    void closeStream(std::uint32_t stream);
+
     void close();
 
 private:
+    // 按type编码frame，发往某个channel的请求带上channelId
+    Protocol::FramePtr encode(Protocol::Type type, std::string_view body, Protocol::Version currentVersion);
+
+    // 可在任意线程调用：放入outbox，必要时唤醒io线程；在io线程中调用时直接放入发送队列
+    void send(Protocol::FramePtr frame);
+
+    // io线程取出frame或close()之后唤醒等待outbox空间的生产者
+    void wakeProducers();
+
+    /**
+     * 在io线程中把outbox中至多DRAIN_BATCH个frame移入发送队列，发送队列已满时停止
+     * 返回true表示发送队列由空变为非空，需要发起写操作
+     */
+    bool takeOutbox();
+
+    // 在io线程中处理outbox，未取完时让出线程后继续
+    void drainOutbox();
+
+    // 写完成后发送队列回落到一半以下时，继续取出因队列已满而暂停的outbox
+    void resumeOutbox();
+
+    // 把一条消息追加到batch中，需持有batchMutex
+    void appendToBatch(std::string_view message, Protocol::Version currentVersion);
+
+    // 构造发往channel的frame
+    Protocol::FrameBuilder makeBuilder(Protocol::Type type, Protocol::Version currentVersion, std::size_t capacity,
+                                       std::uint32_t channel);
+
+    // batchTimer到期：发出序号为seq的batch。锁被生产者持有时稍后重试
+    void flushExpiredBatch(std::uint64_t seq);
+
+    // 发出当前的batch（如果有），需持有batchMutex
+    void flushBatch();
+
+    // 在io线程中收到STREAM_CREDIT：增加额度并发出排队的frame。锁被生产者持有时稍后重试
+    void onStreamCredit(std::uint32_t stream, std::uint32_t bytes);
+
+    // 在io线程中收到server关闭stream的通知：丢弃该stream的状态并回复关闭。锁被生产者持有时稍后重试
+    void onStreamClosed(std::uint32_t stream);
+
     void connect(const boost::asio::ip::tcp::resolver::results_type &endpoints);
 
-    void readHeader();
+#ifdef TCP_PROTO_TLS
+    // 连接建立后完成TLS握手，失败时关闭
+    void secure(const std::string &host);
+#endif
+
+    // 连接（及TLS握手）已完成：请求升级到v2，开始读写循环
+    void established();
+
+    void readFrames();
 
-    void readBody(std::shared_ptr<Protocol::Package> pkg);
+    // 处理server发来的package：HELLO_ACK用于切换版本，PING回复PONG，STREAM拆开后处理内层frame，其余的打印出来
+    void print(const Protocol::PackageView &pkg, std::uint32_t stream = 0);
+
+    // 发送队列由空变为非空时发起写操作
+    void startWrite();
 
     void execWriteAction();
+
+#ifdef TCP_PROTO_COROUTINES
+    boost::asio::awaitable<void> readLoop();
+
+    boost::asio::awaitable<void> writeLoop();
+#endif
 };
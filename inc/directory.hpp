@@ -0,0 +1,84 @@
+#pragma once
+
+#include "protocol.hpp"
+#include "registry.hpp"
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <set>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// server中所有channel名称的有序索引，带版本号，只在一个线程（Server::directoryShard()）中使用
+// 各shard创建/删除channel后把变化投递过来，LIST不再需要向每个shard收集全部channel：
+//   - 每次创建或删除使版本号加一，并记入有界的变更日志，客户端可以只取某个版本之后的变化
+//   - 按前缀过滤、以名称为游标分页，每页的body不超过该版本的上限
+//   - 编码好的页在版本变化之前缓存复用，同一页的重复请求只是共享同一个frame
+class ChannelDirectory
+{
+public:
+    static constexpr std::size_t DEFAULT_PAGE_SIZE = 100;
+    static constexpr std::size_t MAX_PAGE_SIZE = 1000;
+    // 变更日志保留的最近变化数，更早的版本只能重新LIST
+    static constexpr std::size_t CHANGE_LOG_CAPACITY = 4096;
+    // 缓存的页数上限，超出时整体清空
+    static constexpr std::size_t MAX_CACHED_PAGES = 256;
+
+    ChannelDirectory();
+
+    // 登记新建的channel，名称已存在时返回false，版本号不变
+    bool add(std::string_view name);
+
+    // 删除channel，名称不存在时返回false，版本号不变
+    bool remove(std::string_view name);
+
+    std::uint64_t version() const;
+
+    std::size_t size() const;
+
+    /**
+     * 返回以prefix开头、排在cursor之后（cursor为空时从头开始）的至多limit个名称，编码为CHANNEL_LIST：
+     *     "版本号,是否还有下一页\n名称\n名称..."
+     * 还有下一页时以本页最后一个名称作为cursor继续请求
+     * limit为0时取DEFAULT_PAGE_SIZE，超过MAX_PAGE_SIZE时取MAX_PAGE_SIZE
+     */
+    Protocol::FramePtr list(std::string_view prefix, std::string_view cursor, std::size_t limit,
+                            Protocol::Version frameVersion);
+
+    /**
+     * 旧格式的LIST回复，用于不带参数的v1请求：所有名称以", "连接，不带版本号
+     * 超出v1的body上限时分成多个v1的CHANNEL_LIST，依次发送；没有channel时为一个空的CHANNEL_LIST
+     */
+    const std::vector<Protocol::FramePtr> &legacyList();
+
+    /**
+     * 返回版本since之后的至多limit个变化，编码为CHANNEL_CHANGES：
+     *     "包含的最后一个变化的版本号,是否还有更多\n+新建的名称\n-删除的名称..."
+     * since已不在变更日志中（或大于当前版本）时返回空
+     */
+    Protocol::FramePtr changes(std::uint64_t since, std::size_t limit, Protocol::Version frameVersion);
+
+private:
+    struct Change
+    {
+        bool added;
+        std::string name;
+    };
+
+    std::set<std::string, std::less<>> names;
+    std::uint64_t currentVersion;
+    // log[i]是版本logStart + i + 1的变化，版本号连续
+    std::deque<Change> log;
+    std::uint64_t logStart;
+    // 当前版本下已编码的页，key由请求参数拼接而成
+    FlatMap<Protocol::FramePtr> pages;
+    // 当前版本下旧格式的LIST回复，为空时尚未编码
+    std::vector<Protocol::FramePtr> legacyPages;
+
+    void changed(bool added, std::string_view name);
+
+    // 缓存中的页，没有时调用build编码后放入缓存
+    template <typename Build>
+    Protocol::FramePtr cached(const std::string &key, Build &&build);
+};
@@ -0,0 +1,83 @@
+#pragma once
+
+#include "hash_ring.hpp"
+#include "server.hpp"
+#include <boost/asio.hpp>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// 多个server进程组成的网状集群：channel按一致性哈希分配给某个节点（owner），只在该节点上完整存在
+// 参与者加入其他节点所拥有的channel时，本节点建立一个镜像channel：本地成员之间直接转发，
+// 与owner之间经由一个节点间连接上的stream（见Protocol::Type::STREAM）以一个成员的身份收发，
+// 每个事件循环中积压的消息合并为一个MESSAGE_BATCH。每个shard到每个其他节点各有一个连接，按需建立
+// 除构造外只在各shard自己的线程中访问该shard的状态
+class Federation
+{
+private:
+    // 本shard到某个节点的连接
+    struct Link
+    {
+        std::shared_ptr<Participant> connection;
+        // 正在连接，等待连接建立（或失败，此时参数为空）的请求
+        std::vector<std::function<void(const std::shared_ptr<Participant> &)>> waiting;
+    };
+
+    // 镜像channel建立之前到达的create/join请求，第一个请求发给owner，其余的等待其结果
+    struct Waiter
+    {
+        std::shared_ptr<Participant> participant;
+        bool create;
+        SlowConsumerPolicy policy;
+    };
+
+    struct ShardState
+    {
+        std::vector<Link> links; // 按节点下标
+        std::unordered_map<std::string, std::vector<Waiter>> pending; // 按channel名称
+    };
+
+    Server &server;
+    HashRing ring;
+    unsigned int self;
+    std::vector<boost::asio::ip::tcp::endpoint> endpoints;
+    std::vector<ShardState> states; // 按shard下标
+
+public:
+    /**
+     * nodes为所有节点的地址（"IP:端口"），各节点必须使用相同的列表；self为本节点在其中的下标
+     * 地址不合法或self越界时抛出异常：std::invalid_argument
+     */
+    Federation(Server &srv, const std::vector<std::string> &nodes, unsigned int self);
+
+    // channel所属节点的下标
+    unsigned int ownerNode(std::string_view channelName) const;
+
+    bool isLocal(std::string_view channelName) const;
+
+    // address是否为节点列表中某个节点的IP
+    bool isNode(const boost::asio::ip::address &address) const;
+
+    /**
+     * 在其他节点所拥有的、本节点上还没有镜像的channel上处理create/join
+     * 在channel名称所属的shard（Server::owner()）中调用，完成后与本地channel一样以onJoined()回复participant
+     */
+    void join(Shard &shard, const std::shared_ptr<Participant> &participant, const std::string &name, bool create,
+              SlowConsumerPolicy policy);
+
+private:
+    // 取本shard到node的连接，必要时先建立连接。连接失败时done的参数为空
+    void withLink(Shard &shard, unsigned int node, std::function<void(const std::shared_ptr<Participant> &)> done);
+
+    // 在连接上打开一个stream，向owner发出第一个等待者的请求
+    void request(Shard &shard, const std::string &name, const std::shared_ptr<Participant> &connection);
+
+    // owner回复了请求（reply为空表示连接已断开）：建立镜像channel并让等待者加入，失败时回复所有等待者
+    void replied(Shard &shard, const std::string &name, const std::shared_ptr<Participant> &session,
+                 const Protocol::PackageView *reply);
+
+    // 以失败回复等待者
+    void reject(const Waiter &waiter, std::string_view error);
+};
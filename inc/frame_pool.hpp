@@ -0,0 +1,59 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+
+// 按size class分级的内存池，用于frame数据及其控制块
+// 每个线程各有一份缓存，分配与释放都不需要加锁；超出最大size class的请求直接使用operator new
+// 内存在哪个线程释放就回到哪个线程的缓存中，每个size class缓存的总字节数有上限。
+// 超出上限时把一半的块成批交给全局的depot，缓存为空的线程从depot成批取回：
+// 一个线程分配、另一个线程释放（如client的生产者线程与io线程）时块也能循环使用，
+// depot的锁只在整批转移时获取
+namespace FramePool
+{
+    // 各size class的块大小，最后一级能容纳一个完整的v1 package
+    constexpr std::size_t SIZE_CLASSES[] = {64, 256, 1024, 4096, 16 * 1024, 64 * 1024 + 64};
+    constexpr std::size_t SIZE_CLASS_NUM = sizeof(SIZE_CLASSES) / sizeof(SIZE_CLASSES[0]);
+    // 每个线程每个size class最多缓存的字节数
+    constexpr std::size_t MAX_CACHED_BYTES = 4 * 1024 * 1024;
+    // depot中每个size class最多保存的字节数，超出时直接释放
+    constexpr std::size_t MAX_DEPOT_BYTES = 16 * 1024 * 1024;
+
+    void *allocate(std::size_t size);
+
+    // size必须与allocate时相同
+    void deallocate(void *ptr, std::size_t size);
+
+    // 当前线程各size class中缓存的空闲块总数，用于测试
+    std::size_t cachedBlocks();
+} // namespace FramePool
+
+// 基于FramePool的标准分配器，可用于std::allocate_shared等
+template <typename T>
+class PoolAllocator
+{
+public:
+    using value_type = T;
+
+    PoolAllocator() noexcept = default;
+
+    template <typename U>
+    PoolAllocator(const PoolAllocator<U> &) noexcept {}
+
+    T *allocate(std::size_t n)
+    {
+        return static_cast<T *>(FramePool::allocate(n * sizeof(T)));
+    }
+
+    void deallocate(T *ptr, std::size_t n) noexcept
+    {
+        FramePool::deallocate(ptr, n * sizeof(T));
+    }
+
+    template <typename U>
+    bool operator==(const PoolAllocator<U> &) const noexcept { return true; }
+
+    template <typename U>
+    bool operator!=(const PoolAllocator<U> &) const noexcept { return false; }
+};
@@ -0,0 +1,113 @@
+#pragma once
+
+#include "protocol.hpp"
+#include <boost/asio.hpp>
+#include <vector>
+#include <limits>
+
+// gather()返回的buffer序列，只引用FrameQueue内部的数组。
+// async_write会拷贝buffer序列，使用视图可以避免每次写操作都复制一个std::vector
+class GatherBuffers
+{
+private:
+    const boost::asio::const_buffer *first;
+    const boost::asio::const_buffer *last;
+
+public:
+    using value_type = boost::asio::const_buffer;
+    using const_iterator = const boost::asio::const_buffer *;
+
+    GatherBuffers(const boost::asio::const_buffer *begin, const boost::asio::const_buffer *end)
+        : first(begin),
+          last(end)
+    {
+    }
+
+    const_iterator begin() const { return first; }
+    const_iterator end() const { return last; }
+    std::size_t size() const { return last - first; }
+};
+
+// 每个连接的发送队列
+// gather()把队列头部的多个frame合并成一组buffer，交给一次async_write（writev）发送，
+// 写完成后由pop()一次性弹出本次发送的所有frame
+// 队列可设置字节数及frame个数上限，超出上限后如何处理由调用方决定（见full()）
+class FrameQueue
+{
+private:
+    // 环形缓冲区，容量为2的幂，只在需要时扩容，稳定状态下不再分配内存
+    std::vector<Protocol::FramePtr> ring;
+    std::size_t head;                               // 队首在ring中的位置
+    std::size_t count;                              // 队列中的frame个数
+    std::vector<boost::asio::const_buffer> buffers; // 复用的gather buffer
+    std::size_t inFlight;                           // 正在发送的frame个数
+    std::size_t byteCount;                          // 队列中所有frame的总字节数
+    std::size_t maxBytes;
+    std::size_t maxFrames;
+
+public:
+    // 一次gather最多合并的buffer个数及字节数（至少包含一个frame）
+    static constexpr std::size_t MAX_GATHER_BUFFERS = 64;
+    static constexpr std::size_t MAX_GATHER_BYTES = 256 * 1024;
+
+    explicit FrameQueue(std::size_t bytesLimit = std::numeric_limits<std::size_t>::max(),
+                        std::size_t framesLimit = std::numeric_limits<std::size_t>::max());
+
+    /**
+     * 追加一个frame
+     * 返回true表示追加前队列为空，调用方需要发起写操作
+     */
+    bool push(Protocol::FramePtr frame);
+
+    // 合并队列头部的frame，返回本次需要发送的buffer序列
+    GatherBuffers gather();
+
+    /**
+     * 弹出上一次gather()所合并的所有frame
+     * 返回true表示队列中还有待发送的frame
+     */
+    bool pop();
+
+    /**
+     * 再放入一个incoming字节的frame是否会超出上限
+     * 空队列总能放入一个frame，无论其大小
+     */
+    bool full(std::size_t incoming) const;
+
+    /**
+     * 再放入一个incoming字节的frame是否会超出上限的factor倍（硬上限）
+     * 与full()相同，空队列总能放入一个frame
+     */
+    bool exceeds(std::size_t incoming, std::size_t factor) const;
+
+    // 使用量是否已回落到上限的一半以下，用于解除对发送方的暂停
+    bool belowLowWatermark() const;
+
+    /**
+     * 丢弃最早的一个尚未开始发送的frame
+     * 队列中的frame都在发送中时返回false
+     */
+    bool dropOldest();
+
+    /**
+     * 取出队首的frame，供不经过gather()/pop()、而是把frame转交给其他队列的使用方（stream会话）
+     * 队列不能为空，也不能有正在发送的frame
+     */
+    Protocol::FramePtr take();
+
+    // 队列中第i个frame，i必须小于size()
+    const Protocol::FramePtr &peek(std::size_t i);
+
+    bool empty() const;
+
+    std::size_t size() const;
+
+    std::size_t bytes() const;
+
+    // 上一次gather()合并、正在发送的frame个数
+    std::size_t sending() const;
+
+private:
+    // 队列中第i个frame
+    Protocol::FramePtr &at(std::size_t i);
+};
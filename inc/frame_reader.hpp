@@ -0,0 +1,61 @@
+#pragma once
+
+#include "protocol.hpp"
+#include <boost/asio.hpp>
+#include <vector>
+
+// 每个连接独占的接收缓冲区
+// 通过async_read_some一次读入尽可能多的数据，再由next()逐个解析出其中所有完整的package，
+// 避免每个package分两次(header/body)调用async_read
+// 大的package按实际到达的数据成倍扩容，而不是按header中声明的长度一次分配；解析完之后缓冲区缩回初始大小
+class FrameReader
+{
+private:
+    std::vector<std::uint8_t> buffer;
+    std::size_t head; // 尚未解析数据的起始位置
+    std::size_t tail; // 已读入数据的结束位置
+    std::size_t capacity; // 初始大小，缓冲区空闲时缩回该大小
+    std::uint32_t maxBodyLength;
+
+public:
+    static constexpr std::size_t DEFAULT_CAPACITY = 16 * 1024;
+    // 缓冲区为空且超出该大小（及初始大小）时释放多出的内存
+    static constexpr std::size_t RETAIN_CAPACITY = 256 * 1024;
+
+    explicit FrameReader(std::size_t initialCapacity = DEFAULT_CAPACITY,
+                         std::uint32_t maxBody = Protocol::V2_BODY_MAX_LENGTH);
+
+    // 允许的最大body长度，header声明的长度超出时next()抛出invalid_length（例如server在协商出v2之前只接受v1的长度）
+    void setMaxBodyLength(std::uint32_t maxBody);
+
+    /**
+     * 返回缓冲区中可写入的空闲空间，交给async_read_some使用
+     * 剩余空间不足时会把未解析的数据移到缓冲区头部，缓冲区已读满而package仍不完整时扩容为两倍（至多一个完整的package）
+     */
+    boost::asio::mutable_buffer prepare();
+
+    // 标记有len个字节已经读入prepare()返回的空间
+    void commit(std::size_t len);
+
+    /**
+     * 从缓冲区中解析出下一个完整的package（v1或v2），写入pkg（复用pkg.body已有的内存）
+     * 数据不足一个完整package时返回false
+     * header不合法或body超出最大长度时抛出异常：invalid_length
+     */
+    bool next(Protocol::Package &pkg);
+
+    /**
+     * 与next(Package &)相同，但不复制body：view.body直接指向接收缓冲区，在下一次prepare()之前有效
+     */
+    bool next(Protocol::PackageView &view);
+
+    // 缓冲区中尚未解析的字节数
+    std::size_t size() const;
+
+    // 缓冲区中尚未解析的数据，在下一次prepare()之前有效
+    boost::asio::const_buffer data() const;
+
+private:
+    // 解析缓冲区头部的header并检查body长度
+    bool decodeHeader(Protocol::Header &header) const;
+};
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <boost/asio.hpp>
+#include <cstddef>
+#include <memory>
+#include <type_traits>
+#include <utility>
+
+// 每个连接为异步操作预留的一块内存
+// 同一个方向（读或写）上同时只有一个未完成的异步操作，因此一块内存即可满足该方向所有的handler分配，
+// 请求超出大小或内存已被占用时退回operator new
+class HandlerMemory
+{
+private:
+    static constexpr std::size_t SIZE = 1024;
+    typename std::aligned_storage<SIZE>::type storage;
+    bool inUse;
+
+public:
+    HandlerMemory() : inUse(false) {}
+
+    HandlerMemory(const HandlerMemory &) = delete;
+    HandlerMemory &operator=(const HandlerMemory &) = delete;
+
+    void *allocate(std::size_t size)
+    {
+        if (!inUse && size <= sizeof(storage))
+        {
+            inUse = true;
+            return &storage;
+        }
+        return ::operator new(size);
+    }
+
+    void deallocate(void *ptr)
+    {
+        if (ptr == &storage)
+        {
+            inUse = false;
+        }
+        else
+        {
+            ::operator delete(ptr);
+        }
+    }
+};
+
+// 从HandlerMemory分配内存的分配器，作为handler的associated_allocator交给asio
+template <typename T>
+class HandlerAllocator
+{
+private:
+    template <typename>
+    friend class HandlerAllocator;
+
+    HandlerMemory &memory;
+
+public:
+    using value_type = T;
+
+    explicit HandlerAllocator(HandlerMemory &mem) : memory(mem) {}
+
+    template <typename U>
+    HandlerAllocator(const HandlerAllocator<U> &other) noexcept : memory(other.memory) {}
+
+    T *allocate(std::size_t n) const
+    {
+        return static_cast<T *>(memory.allocate(sizeof(T) * n));
+    }
+
+    void deallocate(T *ptr, std::size_t) const
+    {
+        memory.deallocate(ptr);
+    }
+
+    template <typename U>
+    bool operator==(const HandlerAllocator<U> &other) const noexcept { return &memory == &other.memory; }
+
+    template <typename U>
+    bool operator!=(const HandlerAllocator<U> &other) const noexcept { return &memory != &other.memory; }
+};
+
+// 带有自定义分配器的handler包装
+template <typename Handler>
+class CustomAllocHandler
+{
+private:
+    HandlerMemory &memory;
+    Handler handler;
+
+public:
+    using allocator_type = HandlerAllocator<Handler>;
+
+    CustomAllocHandler(HandlerMemory &mem, Handler h)
+        : memory(mem),
+          handler(std::move(h))
+    {
+    }
+
+    allocator_type get_allocator() const noexcept
+    {
+        return allocator_type(memory);
+    }
+
+    template <typename... Args>
+    void operator()(Args &&...args)
+    {
+        handler(std::forward<Args>(args)...);
+    }
+};
+
+template <typename Handler>
+inline CustomAllocHandler<Handler> makeCustomAllocHandler(HandlerMemory &memory, Handler handler)
+{
+    return CustomAllocHandler<Handler>(memory, std::move(handler));
+}
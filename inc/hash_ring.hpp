@@ -0,0 +1,30 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// 一致性哈希环：每个节点在环上放置若干虚拟节点，key顺时针遇到的第一个虚拟节点所属的节点即为其owner
+// 增删一个节点时只有约1/N的key改变owner。哈希值与进程、平台无关，各节点据同一份节点列表算出相同的结果
+class HashRing
+{
+public:
+    // 每个节点的虚拟节点数，越多各节点分到的key越均匀
+    static constexpr unsigned int VIRTUAL_NODES = 64;
+
+    explicit HashRing(const std::vector<std::string> &nodes, unsigned int virtualNodes = VIRTUAL_NODES);
+
+    // key所属节点在nodes中的下标，nodes为空时返回0
+    unsigned int owner(std::string_view key) const;
+
+    std::size_t nodeCount() const;
+
+    // 64位FNV-1a，再经过一次混合使相近的字符串也能分散开
+    static std::uint64_t hash(std::string_view key);
+
+private:
+    std::size_t nodes;
+    std::vector<std::pair<std::uint64_t, unsigned int>> points; // 按哈希值排序的虚拟节点
+};
@@ -0,0 +1,148 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <algorithm>
+
+// ---------------- Class Histogram ------------------------------
+
+// HDR风格的对数-线性直方图：每个2的幂区间再等分为SUB_BUCKETS个桶，相对误差不超过1/SUB_BUCKETS
+// 记录和查询都是O(1)的数组操作，不分配内存；多个线程各自记录后再merge()
+class Histogram
+{
+public:
+    static constexpr unsigned int SUB_BITS = 5;
+    static constexpr unsigned int SUB_BUCKETS = 1u << SUB_BITS;
+    static constexpr unsigned int BUCKET_NUM = (64 - SUB_BITS) * SUB_BUCKETS + SUB_BUCKETS;
+
+private:
+    std::array<std::uint64_t, BUCKET_NUM> counts{};
+    std::uint64_t total = 0;
+    std::uint64_t sumValue = 0;
+    std::uint64_t maxValue = 0;
+
+public:
+    void record(std::uint64_t value)
+    {
+        counts[bucketOf(value)]++;
+        total++;
+        sumValue += value;
+        maxValue = std::max(maxValue, value);
+    }
+
+    void merge(const Histogram &other)
+    {
+        for (unsigned int i = 0; i < BUCKET_NUM; i++)
+        {
+            counts[i] += other.counts[i];
+        }
+        total += other.total;
+        sumValue += other.sumValue;
+        maxValue = std::max(maxValue, other.maxValue);
+    }
+
+    void reset()
+    {
+        counts.fill(0);
+        total = 0;
+        sumValue = 0;
+        maxValue = 0;
+    }
+
+    std::uint64_t count() const
+    {
+        return total;
+    }
+
+    std::uint64_t sum() const
+    {
+        return sumValue;
+    }
+
+    std::uint64_t max() const
+    {
+        return maxValue;
+    }
+
+    // 小于value的记录个数，value为桶的下界（如2的幂）时结果是精确的
+    std::uint64_t countBelow(std::uint64_t value) const
+    {
+        std::uint64_t seen = 0;
+        for (unsigned int i = 0; i < bucketOf(value); i++)
+        {
+            seen += counts[i];
+        }
+        return seen;
+    }
+
+    // 直接累加桶计数及总和/最大值，用于从并发记录的直方图生成快照
+    void add(unsigned int index, std::uint64_t count)
+    {
+        counts[index] += count;
+        total += count;
+    }
+
+    void addSummary(std::uint64_t sum, std::uint64_t max)
+    {
+        sumValue += sum;
+        maxValue = std::max(maxValue, max);
+    }
+
+    // 第q分位（0 < q <= 1）的近似值，取所在桶的中点，没有记录时返回0
+    std::uint64_t percentile(double q) const
+    {
+        if (total == 0)
+        {
+            return 0;
+        }
+        std::uint64_t rank = std::max<std::uint64_t>(1, static_cast<std::uint64_t>(q * total + 0.5));
+        std::uint64_t seen = 0;
+        for (unsigned int i = 0; i < BUCKET_NUM; i++)
+        {
+            seen += counts[i];
+            if (seen >= rank)
+            {
+                return std::min(maxValue, lowerBound(i) + (width(i) - 1) / 2);
+            }
+        }
+        return maxValue;
+    }
+
+    // 按桶遍历：func(std::uint64_t lowerBound, std::uint64_t upperBound, std::uint64_t count)，跳过空桶
+    template <typename Func>
+    void forEach(Func &&func) const
+    {
+        for (unsigned int i = 0; i < BUCKET_NUM; i++)
+        {
+            if (counts[i] > 0)
+            {
+                func(lowerBound(i), lowerBound(i) + width(i) - 1, counts[i]);
+            }
+        }
+    }
+
+    static unsigned int bucketOf(std::uint64_t value)
+    {
+        if (value < SUB_BUCKETS)
+        {
+            return static_cast<unsigned int>(value);
+        }
+        unsigned int shift = 63 - __builtin_clzll(value) - SUB_BITS;
+        return shift * SUB_BUCKETS + static_cast<unsigned int>(value >> shift);
+    }
+
+    static std::uint64_t lowerBound(unsigned int index)
+    {
+        if (index < 2 * SUB_BUCKETS)
+        {
+            return index;
+        }
+        unsigned int shift = index / SUB_BUCKETS - 1;
+        return static_cast<std::uint64_t>(index - shift * SUB_BUCKETS) << shift;
+    }
+
+    static std::uint64_t width(unsigned int index)
+    {
+        return index < 2 * SUB_BUCKETS ? 1 : std::uint64_t(1) << (index / SUB_BUCKETS - 1);
+    }
+};
@@ -0,0 +1,91 @@
+#pragma once
+
+#include "protocol.hpp"
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+
+// channel历史的配置
+struct HistoryOptions
+{
+    // 每个channel在该目录下有一个子目录（名称的十六进制编码），为空时不保存历史
+    std::string directory;
+    // 每个segment文件的大小
+    std::size_t segmentBytes = 64 * 1024 * 1024;
+    // 每个channel保留的总字节数上限，超出时删除最早的segment（正在写入的segment除外）
+    std::uint64_t maxBytes = 1024ull * 1024 * 1024;
+    // 最后一次写入早于该时长的segment被删除，为0时不按时间删除
+    std::chrono::seconds maxAge{0};
+};
+
+// 一个channel的消息历史，只追加，只在channel所属shard的线程中使用
+// 转发的frame按原样依次写入映射到内存的segment文件，每个frame占一个序号：
+//   - 每个segment的开头是一个64字节的header（起始序号、frame数、已写入的字节数等），之后是紧密排列的frame，
+//     与socket上的字节完全相同，回放时连续的多个frame可以作为一个Frame直接引用映射的内存发送
+//   - 每个segment在内存中有一个稀疏索引（每INDEX_INTERVAL个frame记录一个偏移），打开时扫描segment重建
+//   - 数据只写入page cache，不调用fsync：进程崩溃不丢失，机器掉电可能丢失最后的部分
+// 被删除的segment在引用它的Frame都释放之后才解除映射
+class ChannelHistory
+{
+public:
+    static constexpr std::uint64_t INDEX_INTERVAL = 64;
+    // 回放时合并为一个Frame的连续frame的最大字节数（单个frame超出时不受限制）
+    static constexpr std::size_t CHUNK_BYTES = 256 * 1024;
+
+    // 一次读取的序号范围[first, next)
+    struct Range
+    {
+        std::uint64_t first = 0;
+        std::uint64_t next = 0;
+    };
+
+    /**
+     * 打开（或创建）channel的历史，恢复已有的segment并执行保留策略
+     * 目录或文件操作失败时抛出异常：std::system_error
+     */
+    ChannelHistory(const HistoryOptions &opts, const std::string &channelName);
+    ~ChannelHistory();
+
+    ChannelHistory(const ChannelHistory &) = delete;
+    ChannelHistory &operator=(const ChannelHistory &) = delete;
+
+    /**
+     * 追加一个frame，返回其序号
+     * 超出segment大小的frame不保存，返回false；创建新segment失败时抛出异常：std::system_error
+     */
+    bool append(const Protocol::Frame &frame, std::uint64_t &sequence);
+
+    // 保留的最早序号
+    std::uint64_t firstSequence() const;
+
+    // 下一个追加的frame的序号
+    std::uint64_t nextSequence() const;
+
+    // 保留的总字节数
+    std::uint64_t bytes() const;
+
+    /**
+     * 从序号from（早于保留的最早序号时从最早的开始）读取最多maxFrames个、maxBytes字节的frame（至少一个），追加到out
+     * split为false时同一个segment中连续的frame合并为一个不超过CHUNK_BYTES的Frame，否则每个frame各一个Frame
+     * 返回读取的序号范围，没有可读的frame时first == next
+     */
+    Range read(std::uint64_t from, std::size_t maxFrames, std::size_t maxBytes, bool split,
+               std::vector<Protocol::FramePtr> &out);
+
+    // 删除超出保留大小或时间的segment，追加时新建segment及打开时自动调用
+    void enforceRetention();
+
+private:
+    class Segment;
+
+    HistoryOptions options;
+    std::string directory; // 本channel的目录
+    std::deque<std::shared_ptr<Segment>> segments; // 按起始序号排列，最后一个为正在写入的segment
+    std::uint64_t totalBytes;
+
+    // 创建起始序号为first的新segment作为正在写入的segment
+    void roll(std::uint64_t first);
+};
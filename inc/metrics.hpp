@@ -0,0 +1,138 @@
+#pragma once
+
+#include "histogram.hpp"
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <sstream>
+
+// 所有指标都只由一个线程（所属shard的线程）写入，其他线程只读
+// 因此写入时用relaxed的load + store代替fetch_add，避免带lock前缀的原子指令，热路径上与普通的加法几乎相同
+
+// 单写者计数器加n
+inline void increment(std::atomic<std::uint64_t> &counter, std::uint64_t n = 1)
+{
+    counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+// 单写者的最大值（高水位）更新
+inline void updateMax(std::atomic<std::uint64_t> &gauge, std::uint64_t value)
+{
+    if (value > gauge.load(std::memory_order_relaxed))
+    {
+        gauge.store(value, std::memory_order_relaxed);
+    }
+}
+
+// ---------------- Class LatencyHistogram ------------------------------
+
+// 可被其他线程读取的Histogram：桶计数为relaxed原子变量，只允许一个线程写入
+class LatencyHistogram
+{
+private:
+    std::array<std::atomic<std::uint64_t>, Histogram::BUCKET_NUM> counts{};
+    std::atomic<std::uint64_t> sumValue{0};
+    std::atomic<std::uint64_t> maxValue{0};
+
+public:
+    void record(std::uint64_t value)
+    {
+        increment(counts[Histogram::bucketOf(value)]);
+        increment(sumValue, value);
+        updateMax(maxValue, value);
+    }
+
+    // 把当前的分布累加到snapshot中，可在任意线程调用
+    void snapshot(Histogram &histogram) const
+    {
+        for (unsigned int i = 0; i < Histogram::BUCKET_NUM; i++)
+        {
+            std::uint64_t count = counts[i].load(std::memory_order_relaxed);
+            if (count > 0)
+            {
+                histogram.add(i, count);
+            }
+        }
+        histogram.addSummary(sumValue.load(std::memory_order_relaxed), maxValue.load(std::memory_order_relaxed));
+    }
+};
+
+// ---------------- 各层级的指标 ------------------------------
+
+// 每个shard一份，按cache line对齐，不同shard的线程写入时不会伪共享
+struct alignas(64) ShardMetrics
+{
+    std::atomic<std::uint64_t> accepted{0};      // accept的连接数
+    std::atomic<std::uint64_t> closed{0};        // 已断开的连接数
+    std::atomic<std::uint64_t> framesIn{0};
+    std::atomic<std::uint64_t> bytesIn{0};
+    std::atomic<std::uint64_t> framesOut{0};
+    std::atomic<std::uint64_t> bytesOut{0};
+    std::atomic<std::uint64_t> queueBytesHighWater{0}; // 本shard上所有发送队列的最大字节数
+    std::atomic<std::uint64_t> pings{0};              // 向空闲连接发出的PING数
+    std::atomic<std::uint64_t> handshakeTimeouts{0};  // 因各种超时而断开的连接数
+    std::atomic<std::uint64_t> idleTimeouts{0};
+    std::atomic<std::uint64_t> writeStallTimeouts{0};
+    std::atomic<std::uint64_t> tunnels{0};            // 在本shard中开始转发的隧道数
+    std::atomic<std::uint64_t> tunnelBytes{0};        // 这些隧道转发的字节数
+    std::atomic<std::uint64_t> tlsHandshakes{0};      // 完成的TLS握手数，其中以session ticket恢复的数目
+    std::atomic<std::uint64_t> tlsResumed{0};
+    std::atomic<std::uint64_t> tlsFailures{0};        // 失败的TLS握手数
+    std::atomic<std::uint64_t> tlsOffloaded{0};       // 由内核完成加解密（kTLS）的TLS连接数
+    LatencyHistogram fanoutNanos;                      // 一次转发在本shard上写入所有接收方队列的耗时
+};
+
+// 由channel所属的shard写入
+struct ChannelMetrics
+{
+    std::atomic<std::uint64_t> members{0};
+    std::atomic<std::uint64_t> messages{0};   // 发往该channel的消息数
+    std::atomic<std::uint64_t> bytesIn{0};
+    std::atomic<std::uint64_t> deliveries{0}; // 转发给接收方的次数（每条消息 × 接收方个数）
+    std::atomic<std::uint64_t> bytesOut{0};
+};
+
+// 由participant所在的shard写入
+struct ParticipantMetrics
+{
+    std::atomic<std::uint64_t> framesIn{0};
+    std::atomic<std::uint64_t> bytesIn{0};
+    std::atomic<std::uint64_t> framesOut{0};
+    std::atomic<std::uint64_t> bytesOut{0};
+    std::atomic<std::uint64_t> queueBytesHighWater{0};
+    std::atomic<std::uint64_t> queueFramesHighWater{0};
+};
+
+// ---------------- Class MetricsWriter ------------------------------
+
+// 以Prometheus文本格式（0.0.4）输出指标
+class MetricsWriter
+{
+private:
+    std::ostringstream out;
+    std::string prefix;
+
+public:
+    explicit MetricsWriter(std::string metricPrefix = "tcp_proto_");
+
+    /**
+     * 输出一个指标的HELP/TYPE行，同名的多个样本（不同label）只需要输出一次
+     * type为counter / gauge / histogram
+     */
+    void describe(const std::string &name, const std::string &type, const std::string &help);
+
+    // 输出一个样本，labels形如 channel="a"，可为空
+    void sample(const std::string &name, double value, const std::string &labels = "");
+
+    /**
+     * 输出一个纳秒直方图，单位换算为秒
+     * 桶的上界取2的幂（256ns ~ 1s），与Histogram的桶边界对齐，计数是精确的
+     */
+    void histogram(const std::string &name, const Histogram &histogram, const std::string &labels = "");
+
+    // 把label的值转义为Prometheus文本格式
+    static std::string escape(const std::string &value);
+
+    std::string str() const;
+};
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <atomic>
+#include <utility>
+
+// 无锁的多生产者单消费者队列（Vyukov intrusive MPSC）
+// push()可以在任意线程并发调用，pop()只能在唯一的消费者线程调用。
+// 生产者之间只有一次原子exchange，不会互相阻塞
+template <typename T>
+class MpscQueue
+{
+private:
+    struct Node
+    {
+        std::atomic<Node *> next{nullptr};
+        T value;
+    };
+
+    std::atomic<Node *> head; // 生产者在此追加
+    Node *tail;               // 消费者从此取出，始终指向一个已被取走的（哑）节点
+
+public:
+    MpscQueue()
+        : head(new Node()),
+          tail(head.load())
+    {
+    }
+
+    MpscQueue(const MpscQueue &) = delete;
+    MpscQueue &operator=(const MpscQueue &) = delete;
+
+    ~MpscQueue()
+    {
+        T value;
+        while (pop(value))
+        {
+        }
+        delete tail;
+    }
+
+    void push(T value)
+    {
+        Node *node = new Node();
+        node->value = std::move(value);
+        Node *prev = head.exchange(node, std::memory_order_acq_rel);
+        prev->next.store(node, std::memory_order_release);
+    }
+
+    /**
+     * 取出队首元素
+     * 队列为空（或者某个生产者尚未完成push）时返回false
+     */
+    bool pop(T &value)
+    {
+        Node *next = tail->next.load(std::memory_order_acquire);
+        if (next == nullptr)
+        {
+            return false;
+        }
+        value = std::move(next->value);
+        delete tail;
+        tail = next;
+        return true;
+    }
+
+    bool empty() const
+    {
+        return tail->next.load(std::memory_order_acquire) == nullptr;
+    }
+};
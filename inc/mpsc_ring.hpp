@@ -0,0 +1,113 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+
+// 有界的无锁多生产者单消费者环形队列（Vyukov bounded queue）
+// 每个槽位带一个序号：生产者以CAS抢占写入位置，写入后发布序号；消费者按序号判断槽位是否已写入
+// 与MpscQueue不同，所有槽位在构造时一次分配，之后push/pop都不再分配内存。
+// 队列已满时tryPush()返回false，由调用方决定等待还是放弃
+template <typename T>
+class MpscRing
+{
+private:
+    struct Slot
+    {
+        std::atomic<std::size_t> sequence;
+        T value;
+    };
+
+    std::unique_ptr<Slot[]> slots;
+    std::size_t mask;
+    // 生产者与消费者的位置分别独占一个cache line，避免伪共享
+    alignas(64) std::atomic<std::size_t> tail; // 下一个写入的位置
+    alignas(64) std::size_t head;              // 下一个读取的位置，只由消费者访问
+
+public:
+    // 容量向上取为2的幂
+    explicit MpscRing(std::size_t capacity)
+        : tail(0),
+          head(0)
+    {
+        std::size_t size = 2;
+        while (size < capacity)
+        {
+            size *= 2;
+        }
+        slots.reset(new Slot[size]);
+        mask = size - 1;
+        for (std::size_t i = 0; i < size; i++)
+        {
+            slots[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    MpscRing(const MpscRing &) = delete;
+    MpscRing &operator=(const MpscRing &) = delete;
+
+    /**
+     * 追加一个元素，可以在任意线程并发调用
+     * 成功时value被移入队列；队列已满时返回false，value保持不变
+     */
+    bool tryPush(T &value)
+    {
+        std::size_t pos = tail.load(std::memory_order_relaxed);
+        Slot *slot;
+        for (;;)
+        {
+            slot = &slots[pos & mask];
+            std::size_t sequence = slot->sequence.load(std::memory_order_acquire);
+            auto diff = static_cast<std::intptr_t>(sequence) - static_cast<std::intptr_t>(pos);
+            if (diff == 0)
+            {
+                if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                {
+                    break;
+                }
+            }
+            else if (diff < 0)
+            {
+                return false; // 该槽位上一轮的元素还没有被取走
+            }
+            else
+            {
+                pos = tail.load(std::memory_order_relaxed);
+            }
+        }
+        slot->value = std::move(value);
+        slot->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * 取出队首元素，只能在唯一的消费者线程调用
+     * 队列为空（或者队首的生产者尚未完成push）时返回false
+     */
+    bool pop(T &value)
+    {
+        Slot &slot = slots[head & mask];
+        if (slot.sequence.load(std::memory_order_acquire) != head + 1)
+        {
+            return false;
+        }
+        value = std::move(slot.value);
+        slot.value = T();
+        slot.sequence.store(head + mask + 1, std::memory_order_release);
+        head++;
+        return true;
+    }
+
+    // 只能在消费者线程调用
+    bool empty() const
+    {
+        return slots[head & mask].sequence.load(std::memory_order_acquire) != head + 1;
+    }
+
+    std::size_t capacity() const
+    {
+        return mask + 1;
+    }
+};
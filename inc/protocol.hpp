@@ -1,24 +1,114 @@
 #pragma once
 
 #include <string>
+#include <string_view>
 #include <vector>
+#include <memory>
 #include <iostream>
 
 // 简单的报文协议
+//
+// v1 header（4字节，主机字节序）：
+//     | type: uint16 | length: uint16 |
+// v2 header（5~9字节，网络字节序）：
+//     | magic/version: 0xA2 | flags: uint8 | type: uint16 | length: varint(LEB128) |
+// 两种格式可以在同一个连接中混用，每个frame由第一个字节区分：v1的第一个字节是type的一个字节，
+// 所有type的取值都远小于0xA2，因此不会与v2的magic冲突。
+// 客户端在连接后先以v1格式发送HELLO（body为其支持的最高版本），server回复HELLO_ACK（body为协商出的版本），
+// 之后双方都可以使用v2格式发送。不认识HELLO的旧server会忽略它，客户端继续使用v1；旧客户端不发送HELLO，
+// server始终以v1格式回复。
 namespace Protocol
 {
+    // 不拥有body的package，body指向接收缓冲区（见FrameReader::next()）或Package::body
+    // 只在所指向的内存有效期间可用，不能跨线程保存
+    struct PackageView
+    {
+        std::uint16_t type;
+        std::uint32_t length;
+        std::string_view body;
+        std::uint8_t flags = 0;
+    };
+
     // 描述协议报文的一个完整包的具体结构
     struct Package
     {
         std::uint16_t type;             // 标识该报文的类型
-        std::uint16_t length;           // 标识后续body的长度
+        std::uint32_t length;           // 标识后续body的长度
         std::vector<std::uint8_t> body; // 负载
+        std::uint8_t flags = 0;         // v2 header中的flags，v1报文恒为0
+
+        PackageView view() const
+        {
+            return {type, length, std::string_view(reinterpret_cast<const char *>(body.data()), body.size()), flags};
+        }
+    };
+
+    enum class Version : std::uint8_t
+    {
+        V1 = 1,
+        V2 = 2,
+    };
+
+    // 已编码完成的报文（header + body），可直接写入socket
+    // 数据存放在FramePool中，由makeFrame()创建并填充之后只读
+    class Frame
+    {
+    private:
+        std::uint8_t *storage; // 从FramePool分配的内存，引用外部内存时为空
+        std::size_t capacity;
+        std::uint8_t *bytes;   // frame的内容，位于storage之内
+        std::size_t length;
+
+    protected:
+        // 引用外部内存（见makeFrameView()），不分配也不释放
+        Frame(const std::uint8_t *external, std::size_t size);
+
+    public:
+        explicit Frame(std::size_t size);
+        ~Frame();
+
+        Frame(const Frame &) = delete;
+        Frame &operator=(const Frame &) = delete;
+
+        // 把frame的内容限定为从offset开始的size个字节，只能在frame被共享之前调用（见FrameBuilder）
+        void trim(std::size_t offset, std::size_t size);
+
+        std::uint8_t *data() { return bytes; }
+        const std::uint8_t *data() const { return bytes; }
+        std::size_t size() const { return length; }
+        const std::uint8_t *begin() const { return bytes; }
+        const std::uint8_t *end() const { return bytes + length; }
     };
 
+    // 只读、引用计数的frame。channel广播时所有接收方的发送队列共享同一份数据
+    using FramePtr = std::shared_ptr<const Frame>;
+
+    // 分配一个size字节的frame（控制块与数据都来自FramePool），由调用方填充内容
+    std::shared_ptr<Frame> makeFrame(std::size_t size);
+
+    /**
+     * 直接引用data开始的size个字节的frame（例如映射到内存的文件），不复制数据
+     * data可以包含连续的多个完整frame；owner在frame销毁之前保持存活，data在此期间必须有效且不再改变
+     */
+    FramePtr makeFrameView(const std::uint8_t *data, std::size_t size, std::shared_ptr<const void> owner);
+
     constexpr unsigned int HEADER_LENGTH = 2 + 2;
     constexpr std::uint16_t BODY_MAX_LENGTH = UINT16_MAX; // 2个byte所能标识的最大无符号数：65535
     constexpr unsigned int PACKAGE_MAX_LENGTH = BODY_MAX_LENGTH + HEADER_LENGTH;
 
+    constexpr std::uint8_t V2_MAGIC = 0xA2;
+    constexpr unsigned int V2_HEADER_MAX_LENGTH = 1 + 1 + 2 + 5;
+    constexpr std::uint32_t V2_BODY_MAX_LENGTH = 16 * 1024 * 1024;
+
+    // v2 header中flags的各位
+    // FLAG_CHANNEL：body以varint(LEB128)编码的channel ID开头，之后才是原有的body
+    constexpr std::uint8_t FLAG_CHANNEL = 0x01;
+    // server分配的channel ID从1开始，0表示未指定
+    constexpr std::uint32_t NO_CHANNEL = 0;
+    // HELLO的body在版本之后可以再带一个字节的选项
+    // HELLO_PEER：发起方是federation中的另一个节点（见Federation）
+    constexpr std::uint8_t HELLO_PEER = 0x01;
+
     enum class Type : std::uint16_t
     {
         MESSAGE = 0,
@@ -27,6 +117,7 @@ namespace Protocol
         SUCCEED_IN_CREATE_CHANNEL = 2,
         FAIL_IN_CREATE_CHANNEL = 3,
 
+        // body为"前缀,游标,页大小"，各项均可省略。回复CHANNEL_LIST，格式见ChannelDirectory::list()
         LIST_ALL_CHANNELS = 4,
         CHANNEL_LIST = 5,
 
@@ -38,6 +129,47 @@ namespace Protocol
         SUCCEED_IN_LEAVE_CHANNEL = 10,
 
         OTHER_ERROR = 11,
+
+        HELLO = 12,
+        HELLO_ACK = 13,
+
+        STATS = 14,
+        STATS_RESULT = 15,
+
+        MESSAGE_BATCH = 16, // 多条消息合并成的一个frame，body格式见appendBatchEntry()
+
+        // 心跳：收到PING的一方回复body相同的PONG。server只向协商出v2的连接发送PING
+        PING = 17,
+        PONG = 18,
+
+        // 请求所在channel的历史消息，body为"last,N"（最近N条）或"since,序号"（该序号及之后的所有消息）
+        // 每个转发的frame（MESSAGE或MESSAGE_BATCH）占一个序号。server先原样回放这些frame，
+        // 最后回复HISTORY_END，body为"回放的首个序号,回放之后的下一个序号,channel的下一个序号"。
+        // 一次回放的数据量有上限，后两者不相等时可以再以since继续请求
+        HISTORY = 19,
+        HISTORY_END = 20,
+
+        // 请求channel目录在某个版本之后的变化，body为"版本号"或"版本号,最大条数"
+        // 回复CHANNEL_CHANGES，格式见ChannelDirectory::changes()；该版本已过旧时回复OTHER_ERROR，需重新LIST
+        LIST_CHANGES = 21,
+        CHANNEL_CHANGES = 22,
+
+        // 多路复用：一个协商出v2的连接承载多个逻辑会话（stream），每个stream与一个独立的连接相同，
+        // 有自己的channel成员关系及协议状态。body为 | stream ID: varint | 一个完整的内层frame |，
+        // 只有stream ID时表示关闭该stream。客户端第一次使用某个stream ID即打开该stream；
+        // server关闭stream时发出关闭通知，客户端回复同样的关闭后该ID才可再次使用
+        STREAM = 23,
+        // 授予对端在某个stream上继续发送的字节数（按内层frame的长度计），body为 | stream ID: varint | 字节数: varint |
+        // 双方在每个stream上的初始额度均为HELLO_ACK中的窗口大小；额度大于0时即可发送一个frame，额度可因此变为负数
+        STREAM_CREDIT = 24,
+
+        // 隧道：body为"offer,名称,令牌"或"connect,名称,令牌"，名称为本节点上已存在的channel，令牌不能为空。
+        // offer的连接在该channel上等待，直到有令牌相同的connect连接与之配对；两端都收到TUNNEL_READY（body为名称）之后，连接上不再有frame，
+        // server在两个socket之间原样转发字节（splice），一端关闭写方向时转达给另一端。失败时回复TUNNEL_FAILED，
+        // 连接保持原状。请求只能在尚未加入任何channel的连接上发出，发出后直到收到回复之前不能再发送任何数据
+        TUNNEL = 25,
+        TUNNEL_READY = 26,
+        TUNNEL_FAILED = 27,
     };
 
     inline bool checkType(const Type &type)
@@ -56,6 +188,22 @@ namespace Protocol
         case Type::LEAVE_CHANNEL:
         case Type::SUCCEED_IN_LEAVE_CHANNEL:
         case Type::OTHER_ERROR:
+        case Type::HELLO:
+        case Type::HELLO_ACK:
+        case Type::STATS:
+        case Type::STATS_RESULT:
+        case Type::MESSAGE_BATCH:
+        case Type::PING:
+        case Type::PONG:
+        case Type::HISTORY:
+        case Type::HISTORY_END:
+        case Type::LIST_CHANGES:
+        case Type::CHANNEL_CHANGES:
+        case Type::STREAM:
+        case Type::STREAM_CREDIT:
+        case Type::TUNNEL:
+        case Type::TUNNEL_READY:
+        case Type::TUNNEL_FAILED:
             return true;
         }
         return false;
@@ -81,10 +229,13 @@ namespace Protocol
 
     /**
      * 将给定的信息封装成一个package
-     * 当长度超出限制时抛出异常：invalid_length
+     * 当长度超出该版本的限制（v1为BODY_MAX_LENGTH，v2为V2_BODY_MAX_LENGTH）时抛出异常：invalid_length
      */
-    Package encodePackage(const std::string &);
-    Package encodePackage(Type, const std::string &);
+    Package encodePackage(std::string_view);
+    Package encodePackage(Type, std::string_view, Version version = Version::V1);
+
+    // 该版本所允许的最大body长度
+    std::uint32_t bodyMaxLength(Version version);
 
     /**
      * 返回pakckage的类型信息
@@ -92,4 +243,221 @@ namespace Protocol
      * 当length值与实际负载长度不一致时抛出异常：invalid_length
      */
     Type decodePackage(const Package &);
+    Type decodePackage(const PackageView &);
+
+    // 解析出的header
+    struct Header
+    {
+        Version version;
+        std::uint8_t flags;
+        std::uint16_t type;
+        std::uint32_t length; // body长度
+        std::size_t size;     // header本身的长度
+    };
+
+    /**
+     * 从data开始解析一个v1或v2的header
+     * 数据不足一个完整header时返回false
+     * 当length超出该版本的上限，或varint格式不合法时抛出异常：invalid_length
+     */
+    bool decodeHeader(const std::uint8_t *data, std::size_t size, Header &header);
+
+    // 给定版本及body长度时header的长度
+    std::size_t headerLength(Version version, std::uint32_t length);
+
+    /**
+     * 将header直接写入out（至少需要headerLength()个字节），返回写入的字节数
+     * 当length超出该版本的上限时抛出异常：invalid_length
+     */
+    std::size_t encodeHeader(Version version, std::uint16_t type, std::uint8_t flags,
+                             std::uint32_t length, std::uint8_t *out);
+
+    /**
+     * 将完整的frame（header + body）直接写入调用方提供的缓冲区out，返回写入的字节数
+     * 当type值不合法时抛出异常：invalid_type
+     * 当length超出该版本的上限或out容量不足时抛出异常：invalid_length
+     */
+    std::size_t encodeTo(Version version, Type type, std::uint8_t flags,
+                         const std::uint8_t *body, std::size_t length,
+                         std::uint8_t *out, std::size_t capacity);
+
+    /**
+     * 将package编码成一个只读的frame，编码后可被任意多个发送队列共享而无需再拷贝
+     * 当type值不合法时抛出异常：invalid_type
+     * 当length值与实际负载长度不一致，或超出该版本的上限时抛出异常：invalid_length
+     */
+    FramePtr encodeFrame(const Package &, Version version = Version::V1);
+    FramePtr encodeFrame(const PackageView &, Version version = Version::V1);
+
+    /**
+     * 把body直接编码成frame，不经过Package
+     * 当type值不合法时抛出异常：invalid_type；body超出该版本的上限时抛出异常：invalid_length
+     */
+    FramePtr encodeFrame(Type type, std::string_view body, Version version = Version::V1);
+
+    // 在FramePool的frame中直接构造报文，body不需要先拼接成std::string或复制到Package中：
+    //     auto frame = FrameBuilder(Type::CHANNEL_LIST).append("a").append(", ").append("b").finish();
+    // 构造时为最长的header预留空间，finish()时回填header并去掉未使用的前缀；
+    // body超出预留的容量时换用更大的frame（复制已写入的部分）
+    class FrameBuilder
+    {
+    private:
+        std::shared_ptr<Frame> frame;
+        Type type;
+        Version version;
+        std::uint8_t flags;
+        std::size_t reserved; // 为header预留的字节数
+        std::size_t used;     // 已写入的body字节数
+
+    public:
+        // 默认预留的body容量，连同header可放入FramePool中256字节的size class
+        static constexpr std::size_t DEFAULT_CAPACITY = 256 - V2_HEADER_MAX_LENGTH;
+
+        /**
+         * 当type值不合法时抛出异常：invalid_type
+         * capacity为预计的body长度，不是上限
+         */
+        explicit FrameBuilder(Type frameType, Version frameVersion = Version::V1,
+                              std::size_t capacity = DEFAULT_CAPACITY, std::uint8_t frameFlags = 0);
+
+        /**
+         * 返回至少n个字节的可写空间，写入后调用commit()
+         * body将超出该版本的上限时抛出异常：invalid_length
+         */
+        std::uint8_t *prepare(std::size_t n);
+
+        // 标记prepare()返回的空间中有n个字节已写入
+        void commit(std::size_t n);
+
+        FrameBuilder &append(std::string_view text);
+
+        // 已写入的body长度
+        std::size_t size() const;
+
+        // 回填header，返回只读的frame，之后不能再使用该builder
+        FramePtr finish();
+    };
+
+    // frame所使用的版本
+    Version frameVersion(const Frame &frame);
+
+    /**
+     * frame的type字段（未校验取值）
+     * header不完整时抛出异常：invalid_length
+     */
+    std::uint16_t frameType(const Frame &frame);
+
+    /**
+     * 把frame转换为另一个版本的编码，版本相同时直接返回原frame
+     * 转换为v1时去掉body开头的channel ID（见FLAG_CHANNEL）
+     * body超出目标版本的上限时抛出异常：invalid_length
+     */
+    FramePtr convertFrame(const FramePtr &frame, Version version);
+
+    // MESSAGE_BATCH的body由若干条消息依次排列而成，每条消息为：
+    //     | length: varint(LEB128) | 消息内容 |
+    // server把整个batch作为一个frame扇出给channel中的其他成员，不逐条拆分；
+    // 只有v1的接收方（不认识MESSAGE_BATCH的旧客户端）会收到拆分后的MESSAGE
+
+    // 一条消息在batch中占用的字节数
+    std::size_t batchEntryLength(std::size_t messageLength);
+
+    /**
+     * 把一条消息追加到正在构造的MESSAGE_BATCH中
+     * batch将超出该版本的上限时抛出异常：invalid_length
+     */
+    void appendBatchEntry(FrameBuilder &builder, std::string_view message);
+
+    // 依次读出batch中的消息，消息指向body所在的内存
+    class BatchReader
+    {
+    private:
+        std::string_view rest;
+
+    public:
+        explicit BatchReader(std::string_view body) : rest(body) {}
+
+        /**
+         * 读出下一条消息，batch已读完时返回false
+         * 消息的长度字段不合法或超出body时抛出异常：invalid_length
+         */
+        bool next(std::string_view &message);
+    };
+
+    /**
+     * 校验batch的格式，返回其中的消息数
+     * body为空或格式不合法时抛出异常：invalid_length
+     */
+    std::size_t countBatch(std::string_view body);
+
+    /**
+     * 把MESSAGE_BATCH拆分为各条消息的v1 MESSAGE frame，供不认识MESSAGE_BATCH的v1接收方使用
+     * batch格式不合法时抛出异常：invalid_length；超出v1上限的单条消息被跳过
+     */
+    std::vector<FramePtr> splitBatch(const Frame &frame);
+
+    /**
+     * 读出body开头的varint(LEB128)编码的32位整数，并从body中去掉
+     * varint格式不合法或超出body时抛出异常：invalid_length
+     */
+    std::uint32_t readVarint(std::string_view &body);
+
+    // 把varint(LEB128)编码的整数写入正在构造的frame的body
+    void appendVarint(FrameBuilder &builder, std::uint32_t value);
+
+    // 带有FLAG_CHANNEL的frame：server转发的v2 MESSAGE/MESSAGE_BATCH总是带有所属channel的ID，
+    // 同一个frame由所有接收方共享，因此ID在整个server中唯一；v1的frame不带ID，转换为v1时ID被去掉
+
+    /**
+     * 读出body开头的channel ID，并从body中去掉
+     * varint格式不合法或超出body时抛出异常：invalid_length
+     */
+    std::uint32_t readChannelId(std::string_view &body);
+
+    // 把channel ID写入正在构造的frame的body（构造时需带有FLAG_CHANNEL）
+    void appendChannelId(FrameBuilder &builder, std::uint32_t channelId);
+
+    /**
+     * 把frame转换为带有该channel ID的v2编码，已带有ID时替换
+     * frame不完整或超出v2的上限时抛出异常：invalid_length
+     */
+    FramePtr tagFrame(const Frame &frame, std::uint32_t channelId);
+
+    /**
+     * 去掉frame中的channel ID，版本不变；不带ID的frame原样复制
+     * frame不完整时抛出异常：invalid_length
+     */
+    FramePtr untagFrame(const Frame &frame);
+
+    // STREAM的编码与解析，见Type::STREAM
+
+    /**
+     * STREAM frame中内层frame之前的部分（v2 header + stream ID），之后紧接着发送长为frameSize的内层frame即构成
+     * 完整的STREAM frame，内层frame无需复制；frameSize为0时本身就是关闭该stream的通知
+     * 超出v2的上限时抛出异常：invalid_length
+     */
+    FramePtr encodeStreamHeader(std::uint32_t streamId, std::size_t frameSize);
+
+    // 把内层frame复制进一个完整的STREAM frame
+    FramePtr encodeStream(std::uint32_t streamId, std::string_view frame);
+
+    /**
+     * 解析STREAM的body，frame为其中的内层frame（header + body），关闭stream时为空
+     * varint格式不合法，或内层frame不完整、之后还有多余的数据时抛出异常：invalid_length
+     */
+    std::uint32_t readStream(std::string_view body, std::string_view &frame);
+
+    /**
+     * frame（如readStream()得到的内层frame）的视图，body指向frame所在的内存
+     * header不完整或格式不合法、body不完整时抛出异常：invalid_length
+     */
+    PackageView viewFrame(std::string_view frame);
+
+    FramePtr encodeStreamCredit(std::uint32_t streamId, std::uint32_t bytes);
+
+    /**
+     * 解析STREAM_CREDIT的body，返回stream ID
+     * 格式不合法时抛出异常：invalid_length
+     */
+    std::uint32_t readStreamCredit(std::string_view body, std::uint32_t &bytes);
 }; // namespace Protocol
\ No newline at end of file
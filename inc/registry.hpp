@@ -0,0 +1,294 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <utility>
+#include <cstdint>
+#include <functional>
+
+class Channel;
+class Participant;
+
+// ---------------- Class FlatMap ------------------------------
+
+// 以字符串为key的开放寻址哈希表（线性探测，删除时向前移动后续元素，不留墓碑）
+// 所有元素存放在一块连续内存中，插入、查找、删除均为O(1)
+template <typename V>
+class FlatMap
+{
+private:
+    struct Bucket
+    {
+        bool used = false;
+        std::size_t hash = 0;
+        std::string key;
+        V value{};
+    };
+
+    static constexpr std::size_t MIN_CAPACITY = 16;
+
+    std::vector<Bucket> buckets;
+    std::size_t count;
+
+public:
+    FlatMap()
+        : buckets(MIN_CAPACITY),
+          count(0)
+    {
+    }
+
+    /**
+     * 插入key/value，key已存在时不做修改
+     * 返回指向表中value的指针（在下一次插入/删除之前有效），以及是否插入成功
+     */
+    std::pair<V *, bool> emplace(std::string_view key, V value)
+    {
+        if ((count + 1) * 4 > buckets.size() * 3)
+        {
+            rehash(buckets.size() * 2);
+        }
+        std::size_t hash = std::hash<std::string_view>{}(key);
+        std::size_t mask = buckets.size() - 1;
+        std::size_t i = hash & mask;
+        for (; buckets[i].used; i = (i + 1) & mask)
+        {
+            if (buckets[i].hash == hash && buckets[i].key == key)
+            {
+                return {&buckets[i].value, false};
+            }
+        }
+        buckets[i].used = true;
+        buckets[i].hash = hash;
+        buckets[i].key = std::string(key);
+        buckets[i].value = std::move(value);
+        count++;
+        return {&buckets[i].value, true};
+    }
+
+    // 查找key，不存在时返回nullptr
+    V *find(std::string_view key)
+    {
+        std::size_t index = locate(key);
+        return index == buckets.size() ? nullptr : &buckets[index].value;
+    }
+
+    bool erase(std::string_view key)
+    {
+        std::size_t i = locate(key);
+        if (i == buckets.size())
+        {
+            return false;
+        }
+        // 把探测链上后续的元素向前移动，填补被删除的位置
+        std::size_t mask = buckets.size() - 1;
+        for (std::size_t j = (i + 1) & mask; buckets[j].used; j = (j + 1) & mask)
+        {
+            std::size_t home = buckets[j].hash & mask;
+            if (((j - home) & mask) >= ((j - i) & mask))
+            {
+                buckets[i] = std::move(buckets[j]);
+                i = j;
+            }
+        }
+        buckets[i] = Bucket();
+        count--;
+        return true;
+    }
+
+    std::size_t size() const
+    {
+        return count;
+    }
+
+    // 遍历所有元素：func(const std::string &key, V &value)
+    template <typename Func>
+    void forEach(Func &&func)
+    {
+        for (auto &bucket : buckets)
+        {
+            if (bucket.used)
+            {
+                func(static_cast<const std::string &>(bucket.key), bucket.value);
+            }
+        }
+    }
+
+private:
+    // 返回key所在的位置，不存在时返回buckets.size()
+    std::size_t locate(std::string_view key) const
+    {
+        std::size_t hash = std::hash<std::string_view>{}(key);
+        std::size_t mask = buckets.size() - 1;
+        for (std::size_t i = hash & mask; buckets[i].used; i = (i + 1) & mask)
+        {
+            if (buckets[i].hash == hash && buckets[i].key == key)
+            {
+                return i;
+            }
+        }
+        return buckets.size();
+    }
+
+    void rehash(std::size_t capacity)
+    {
+        std::vector<Bucket> old(capacity);
+        old.swap(buckets);
+        std::size_t mask = buckets.size() - 1;
+        for (auto &bucket : old)
+        {
+            if (bucket.used)
+            {
+                std::size_t i = bucket.hash & mask;
+                while (buckets[i].used)
+                {
+                    i = (i + 1) & mask;
+                }
+                buckets[i] = std::move(bucket);
+            }
+        }
+    }
+};
+
+// ---------------- Class SlotTable ------------------------------
+
+// 带generation的槽位表。insert返回一个句柄，之后凭句柄O(1)访问或删除
+// 槽位被删除后generation加一，旧句柄随之失效，槽位可被复用
+template <typename T>
+class SlotTable
+{
+public:
+    // 高32位为generation，低32位为槽位下标。0永远不是有效句柄
+    using Handle = std::uint64_t;
+    static constexpr Handle INVALID_HANDLE = 0;
+
+private:
+    struct Slot
+    {
+        std::uint32_t generation = 1;
+        bool used = false;
+        T value{};
+    };
+
+    std::vector<Slot> slots;
+    std::vector<std::uint32_t> freeSlots;
+    std::size_t count;
+
+public:
+    SlotTable()
+        : count(0)
+    {
+    }
+
+    Handle insert(T value)
+    {
+        std::uint32_t index;
+        if (freeSlots.empty())
+        {
+            index = static_cast<std::uint32_t>(slots.size());
+            slots.emplace_back();
+        }
+        else
+        {
+            index = freeSlots.back();
+            freeSlots.pop_back();
+        }
+        Slot &slot = slots[index];
+        slot.used = true;
+        slot.value = std::move(value);
+        count++;
+        return (static_cast<Handle>(slot.generation) << 32) | index;
+    }
+
+    // 句柄无效（已被删除或从未存在）时返回nullptr
+    T *get(Handle handle)
+    {
+        Slot *slot = lookup(handle);
+        return slot ? &slot->value : nullptr;
+    }
+
+    bool remove(Handle handle)
+    {
+        Slot *slot = lookup(handle);
+        if (!slot)
+        {
+            return false;
+        }
+        slot->used = false;
+        slot->generation++;
+        slot->value = T();
+        freeSlots.push_back(static_cast<std::uint32_t>(handle));
+        count--;
+        return true;
+    }
+
+    std::size_t size() const
+    {
+        return count;
+    }
+
+    // 遍历所有元素：func(Handle handle, T &value)
+    template <typename Func>
+    void forEach(Func &&func)
+    {
+        for (std::size_t i = 0; i < slots.size(); i++)
+        {
+            if (slots[i].used)
+            {
+                func((static_cast<Handle>(slots[i].generation) << 32) | i, slots[i].value);
+            }
+        }
+    }
+
+private:
+    Slot *lookup(Handle handle)
+    {
+        std::uint32_t index = static_cast<std::uint32_t>(handle);
+        std::uint32_t generation = static_cast<std::uint32_t>(handle >> 32);
+        if (index >= slots.size() || !slots[index].used || slots[index].generation != generation)
+        {
+            return nullptr;
+        }
+        return &slots[index];
+    }
+};
+
+// ---------------- Class Registry ------------------------------
+
+// Server实例所拥有的channel及成员注册表
+// 注册表按shard分区，每个分区只由其所属shard的线程读写，因此多个shard（以及同一进程中的多个Server实例）
+// 可以并发运行而无需加锁。分区按cache line对齐，避免不同线程的分区之间出现伪共享
+class Registry
+{
+public:
+    struct alignas(64) Partition
+    {
+        // 本分区所拥有的channel
+        FlatMap<std::shared_ptr<Channel>> channels;
+        // 本分区accept的所有成员
+        SlotTable<std::shared_ptr<Participant>> members;
+        // 本分区分配channel ID所用的序号，已删除的channel的序号优先复用，使ID保持紧凑
+        std::uint32_t channelSlots = 0;
+        std::vector<std::uint32_t> freeChannelSlots;
+    };
+
+private:
+    std::vector<Partition> partitions;
+
+public:
+    explicit Registry(unsigned int partitionNum)
+        : partitions(partitionNum)
+    {
+    }
+
+    Partition &partition(unsigned int index)
+    {
+        return partitions[index];
+    }
+
+    unsigned int partitionCount() const
+    {
+        return partitions.size();
+    }
+};
@@ -1,48 +1,353 @@
 #pragma once
 
 #include "protocol.hpp"
+#include "frame_reader.hpp"
+#include "frame_queue.hpp"
+#include "mpsc_queue.hpp"
+#include "registry.hpp"
+#include "handler_memory.hpp"
+#include "metrics.hpp"
+#include "session_engine.hpp"
+#include "uring.hpp"
+#include "timing_wheel.hpp"
+#include "history.hpp"
+#include "directory.hpp"
+#include "tls.hpp"
 #include <boost/asio.hpp>
-#include <unordered_map>
 #include <set>
+#include <vector>
 #include <queue>
 #include <memory>
+#include <chrono>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <unordered_map>
 
+class Shard;
 class Channel;
 class Participant;
+class MetricsListener;
+class Federation;
+
+// 接收方发送队列已满（慢消费者）时channel采取的策略
+enum class SlowConsumerPolicy
+{
+    DROP_OLDEST,  // 丢弃接收方队列中最早的尚未发送的frame
+    DROP_NEWEST,  // 丢弃新到的frame
+    DISCONNECT,   // 断开慢消费者
+    PAUSE_SENDER, // 暂停读取发送方的数据，直到接收方队列回落；队列超出硬上限时断开接收方
+};
+
+/**
+ * 解析策略名称：drop-oldest / drop-newest / disconnect / pause
+ * 名称无效时返回false
+ */
+bool parseSlowConsumerPolicy(std::string_view str, SlowConsumerPolicy &policy);
+
+// 策略名称，parseSlowConsumerPolicy()的逆操作
+std::string_view slowConsumerPolicyName(SlowConsumerPolicy policy);
+
+// 各策略被触发的次数
+struct BackpressureStats
+{
+    // 丢弃的frame数：为新frame腾出空间而丢弃的旧frame，以及被丢弃的新frame（drop-oldest腾不出空间时也计入此项）
+    std::uint64_t droppedOldest = 0;
+    std::uint64_t droppedNewest = 0;
+    // 断开的连接数，包括pause策略下队列超出硬上限而断开的接收方
+    std::uint64_t disconnected = 0;
+    // 暂停发送方的次数：每个接收方对每个发送方计一次，该发送方被恢复之前不重复计数。server的计数为各连接之和
+    std::uint64_t paused = 0;
+};
+
+// Server的可配置项
+struct ServerOptions
+{
+    // 类Nagle的发送延迟：发送队列由空变为非空后等待该时长再发送，以便合并更多frame。默认为0，即立即发送
+    std::chrono::microseconds writeDelay{0};
+    // 每个连接发送队列的上限
+    std::size_t sendQueueMaxBytes = 8 * 1024 * 1024;
+    std::size_t sendQueueMaxFrames = 16 * 1024;
+    // 协商出v2之后接受的最大frame body长度（含STREAM等外层），之前只接受v1的长度（BODY_MAX_LENGTH）
+    std::uint32_t maxFrameBytes = Protocol::V2_BODY_MAX_LENGTH;
+    // 创建channel时未指定策略则使用该策略
+    SlowConsumerPolicy slowConsumerPolicy = SlowConsumerPolicy::DROP_OLDEST;
+    // 每个channel的最大成员数
+    unsigned int channelCapacity = 2;
+    // 以Prometheus文本格式输出指标的HTTP端口，只监听127.0.0.1。为0时不启用
+    unsigned short metricsPort = 0;
+    // 连接读写循环的实现方式
+    SessionEngine engine = SessionEngine::CALLBACK;
+    // 以下超时由每个shard的时间轮检查，精度为一个tick（100ms），为0时不启用
+    // 连接建立后须在该时长内发来第一个完整的frame
+    std::chrono::milliseconds handshakeTimeout{30000};
+    // 协商出v2的连接在该时长内没有发来任何frame时发出PING，之后heartbeatTimeout内仍没有收到frame则断开；
+    // heartbeatTimeout为0时不发送PING，空闲即断开。v1的客户端不认识PING，idleTimeout + heartbeatTimeout内
+    // 没有发来任何frame时直接断开
+    std::chrono::milliseconds idleTimeout{60000};
+    std::chrono::milliseconds heartbeatTimeout{15000};
+    // 发送队列非空、但该时长内没有任何写操作完成（对端不再读取或已失联）时断开
+    std::chrono::milliseconds writeStallTimeout{60000};
+    // channel的历史消息，目录为空时不保存
+    HistoryOptions history;
+    // 每个连接最多可加入的channel数。v1的连接无法在消息中指定channel，只能加入一个
+    unsigned int maxChannelsPerConnection = 64;
+    // 多路复用（见Protocol::Type::STREAM）：每个stream在每个方向上的流控窗口，为0时不支持stream
+    std::uint32_t streamWindow = 64 * 1024;
+    // 每个连接最多同时打开的stream数
+    unsigned int maxStreamsPerConnection = 1024;
+    // federation中其他节点的连接最多同时打开的stream数（每个镜像channel一个）
+    unsigned int maxStreamsPerPeer = 65536;
+    // federation（见Federation）：所有节点的地址（"IP:端口"），各节点须使用相同的列表及stream窗口；
+    // nodeIndex为本节点在其中的下标。少于两个节点时不启用
+    std::vector<std::string> nodes;
+    unsigned int nodeIndex = 0;
+    // TLS（需以TCP_PROTO_TLS编译），tls.certFile为空时为明文。启用后所有连接都须先完成TLS握手，
+    // federation中的节点之间也以TLS连接，各节点须同时启用。tls.caFile非空时节点之间双向验证证书：
+    // 发起连接的节点出示自己的证书，只有出示了由该CA签发的证书的连接才被接受为节点间连接
+    TlsOptions tls;
+};
 
 // ---------------- Class Server ------------------------------
 
 class Server
 {
 private:
-    boost::asio::ip::tcp::acceptor acceptor;
+    ServerOptions options;
+    Registry registry; // 每个shard一个分区
+    ChannelDirectory directory; // 只在directoryShard()的线程中访问
+    std::vector<std::unique_ptr<Shard>> shards;
+    // 所有连接累计的慢消费者策略触发次数
+    std::atomic<std::uint64_t> droppedOldest;
+    std::atomic<std::uint64_t> droppedNewest;
+    std::atomic<std::uint64_t> disconnected;
+    std::atomic<std::uint64_t> paused;
+    std::chrono::steady_clock::time_point startTime;
+    std::unique_ptr<MetricsListener> metricsListener;
+    std::unique_ptr<Federation> mesh; // 未启用federation时为空
+#ifdef TCP_PROTO_TLS
+    std::shared_ptr<TlsContext> tlsServer; // 未启用TLS时为空；启用tls.caFile时把节点之间的连接转给要求证书的context
+    std::shared_ptr<TlsContext> tlsPeer;   // federation：向其他节点发起的连接
+#endif
 
 public:
-    // 所有channel的集合
-    static std::unordered_map<std::string, std::shared_ptr<Channel>> channels;
-    // 所有成员集合
-    static std::set<std::shared_ptr<Participant>> members;
+    // 单线程模式：只有一个shard
+    Server(boost::asio::io_context &ioCtx, const boost::asio::ip::tcp::endpoint &endpoint,
+           const ServerOptions &opts = ServerOptions());
+
+    /**
+     * 多线程模式：每个io_context对应一个shard，需各自在独立的线程中run()
+     * 每个shard拥有自己的acceptor，通过SO_REUSEPORT监听同一个端口，由内核分配新连接
+     * 读取TLS证书失败，或未以TCP_PROTO_TLS编译却配置了证书时抛出异常：std::runtime_error
+     */
+    Server(const std::vector<boost::asio::io_context *> &ioContexts,
+           const boost::asio::ip::tcp::endpoint &endpoint,
+           const ServerOptions &opts = ServerOptions());
+
+    ~Server();
+
+    unsigned int shardCount();
+
+    Shard &shard(unsigned int index);
+
+    // 根据channel名称确定其所属的shard。启用federation时其他节点所拥有的channel的镜像也在该shard中
+    Shard &owner(std::string_view channelName);
+
+    // 未启用federation时为空
+    Federation *federation();
+
+    // 新连接使用的TLS，dialing为true时为本节点向其他节点发起的连接。未启用TLS时为空
+    std::shared_ptr<TlsContext> tlsContext(bool dialing);
+
+    // channel目录所在的shard，即shard 0
+    Shard &directoryShard();
+
+    // 只能在directoryShard()的线程中调用
+    ChannelDirectory &channelDirectory();
+
+    boost::asio::ip::tcp::endpoint localEndpoint();
+
+    const ServerOptions &getOptions();
+
+    BackpressureStats backpressureStats();
+
+    // 记录一次慢消费者策略的触发（drop-oldest/drop-newest记录丢弃的frame数），可在任意线程调用
+    void countBackpressure(SlowConsumerPolicy policy, std::uint64_t frames = 1);
+
+    // 输出server级别的指标（各shard汇总），可在任意线程调用
+    void writeMetrics(MetricsWriter &writer);
+
+    /**
+     * 输出server级别及所有channel的指标
+     * 需要向每个shard收集其拥有的channel，完成后在最后一个shard的线程中调用done
+     */
+    void collectMetrics(std::function<void(std::string)> done);
+
+    // shard接受了一个新连接，对端地址已填入shard.peer
+    void accepted(Shard &shard, boost::asio::ip::tcp::socket socket);
+
+private:
+    void accept(Shard &shard);
+};
+
+// ---------------- Class Shard ------------------------------
+
+// 一个事件循环（一个线程一个io_context）及其拥有的状态
+// shard的状态只在其自身的线程中访问，其他线程通过无锁的inbox把操作投递过来执行
+class Shard
+{
+private:
+    Server &server;
+    unsigned int index;
+    boost::asio::io_context &ioContext;
+    Registry::Partition &partition;
+    MpscQueue<std::function<void()>> inbox;
+    std::atomic<bool> scheduled; // inbox是否已安排在本线程中处理
+    ShardMetrics shardMetrics;
+    // 本shard所有连接的超时共用一个时间轮，只在有timer时由wheelTimer按tick驱动
+    TimingWheel wheel;
+    boost::asio::steady_timer wheelTimer;
+    std::chrono::steady_clock::time_point wheelStart; // tick 0对应的时刻
+    bool ticking;
+#ifdef TCP_PROTO_IO_URING
+    UringHandler<Shard> acceptOperation; // 先于ring声明，ring析构时仍可abandon()
+    std::unique_ptr<Uring> ring;         // 只在io_uring引擎下创建
+#endif
+    // 等待配对的隧道offer及其令牌
+    struct TunnelOffer
+    {
+        std::shared_ptr<Participant> participant;
+        std::string token;
+    };
+    // 在本shard所拥有的channel上等待配对的隧道offer，按channel名称，令牌相同的先到先配对
+    std::unordered_map<std::string, std::deque<TunnelOffer>> tunnelOffers;
 
 public:
-    Server(boost::asio::io_context &ioCtx, const boost::asio::ip::tcp::endpoint &endpoint);
+    boost::asio::ip::tcp::acceptor acceptor;
+    boost::asio::ip::tcp::endpoint peer; // accept时填入的对端地址
+
+public:
+    Shard(Server &srv, unsigned int idx, boost::asio::io_context &ioCtx, Registry::Partition &part);
+
+    Server &getServer();
+
+    unsigned int id();
+
+    boost::asio::io_context &context();
+
+    // 本shard所拥有的channel
+    FlatMap<std::shared_ptr<Channel>> &channels();
+
+    /**
+     * 登记新建的channel并为其分配ID，同名的channel已存在时返回false
+     * ID = 序号 * shard数 + shard号 + 1，在整个server中唯一。登记成功后投递给channel目录（镜像channel除外）
+     */
+    bool addChannel(const std::shared_ptr<Channel> &channel);
+
+    // 删除channel并回收其ID，同样投递给channel目录
+    void removeChannel(Channel &channel);
+
+    // 在本shard上accept的所有成员
+    SlotTable<std::shared_ptr<Participant>> &members();
+
+    // 只能在本shard的线程中写入
+    ShardMetrics &metrics();
+
+    // 以下只能在本shard的线程中调用
+    TimingWheel &timers();
+
+    // 时间轮的当前tick。时间轮停止期间先追上实际经过的时间
+    std::uint64_t now();
+
+    // 在deadline（tick）调用timer，必要时启动时间轮
+    void schedule(TimingWheel::Timer &timer, std::uint64_t deadline);
+
+    /**
+     * 处理participant在channel name上的隧道请求（见Protocol::Type::TUNNEL），name须属于本shard
+     * offer加入等待队列；connect与令牌相同的最早的offer配对，两端交出socket后在本shard中转发。失败时回复participant
+     */
+    void tunnel(const std::shared_ptr<Participant> &participant, const std::string &name, const std::string &token,
+                bool offer);
+
+    // 撤销participant在name上尚未配对的offer
+    void withdrawTunnel(const std::shared_ptr<Participant> &participant, const std::string &name);
+
+#ifdef TCP_PROTO_IO_URING
+    Uring &uring();
+
+    // 在本shard的io_uring上提交multishot accept
+    void acceptWithUring();
+#endif
+
+    // 在本shard的线程中执行task，若调用方已经在本shard的线程中则立即执行
+    template <typename Task>
+    void dispatch(Task &&task)
+    {
+        if (ioContext.get_executor().running_in_this_thread())
+        {
+            task();
+        }
+        else
+        {
+            enqueue(std::function<void()>(std::forward<Task>(task)));
+        }
+    }
 
 private:
-    void accept();
+    // 每次drain最多执行的task个数，避免inbox长期占用线程
+    static constexpr unsigned int DRAIN_BATCH = 1024;
+
+    void enqueue(std::function<void()> task);
+
+    void drain();
+
+    // 自wheelStart以来经过的tick数
+    std::uint64_t elapsedTicks();
+
+    // 等待下一个tick，到时推进时间轮；时间轮为空时停止
+    void tick();
+
+    // 两端各自在所在的shard中发出TUNNEL_READY并交出socket，都交出后在本shard中开始转发
+    void openTunnel(const std::shared_ptr<Participant> &offer, const std::shared_ptr<Participant> &connect,
+                    const std::string &name);
+
+#ifdef TCP_PROTO_IO_URING
+    void onUringAccept(int result, std::uint32_t flags);
+#endif
 };
 
 // ---------------- Class Channel ------------------------------
 
 class Channel : public std::enable_shared_from_this<Channel>
 {
+    friend class Shard;
+
+public:
+    // 某个shard上的成员快照，成员变化时整体替换（copy-on-write），广播时可直接跨线程共享
+    using MemberList = std::vector<std::shared_ptr<Participant>>;
+
 private:
     unsigned int MAX_CONNECTION_NUM;
     std::string name;
+    std::uint32_t channelId; // 由所属的shard在登记时分配，之后不再改变
+    Shard &shard; // 所属的shard，channel的所有操作都在该shard的线程中执行
+    SlowConsumerPolicy policy;
     std::set<std::shared_ptr<Participant>> connections;
+    std::vector<std::shared_ptr<const MemberList>> shardMembers; // 按成员所在shard分组
+    ChannelMetrics channelMetrics;
+    std::unique_ptr<ChannelHistory> history; // 未启用或打开失败时为空
+    // 镜像channel（见Federation）：owner节点上的channel在本节点的代理，upstream是到owner的stream会话，
+    // 作为一个普通成员收发。upstream退出时所有本地成员被移出，最后一个本地成员离开时关闭upstream
+    bool mirror;
+    std::shared_ptr<Participant> upstream;
 
 public:
-    explicit Channel(std::string channelName);
+    Channel(Shard &owner, std::string channelName);
 
-    Channel(std::string channelName, int num);
+    Channel(Shard &owner, std::string channelName, int num);
+
+    // 镜像channel，不保存历史，也不登记到channel目录。upstream占用一个成员的位置
+    Channel(Shard &owner, std::string channelName, std::shared_ptr<Participant> upstreamSession);
     ~Channel();
 
     bool ifFull();
@@ -51,52 +356,370 @@ public:
 
     std::string getName();
 
+    // 登记之后可在任意线程读取
+    std::uint32_t id();
+
+    Shard &owner();
+
+    SlowConsumerPolicy getPolicy();
+
+    void setPolicy(SlowConsumerPolicy slowConsumerPolicy);
+
     std::shared_ptr<Channel> getPtr();
 
+    // 只能在channel所属shard的线程中写入
+    ChannelMetrics &metrics();
+
     bool join(std::shared_ptr<Participant> con);
 
     bool send(std::shared_ptr<Participant> self, const Protocol::Package &pkg);
 
+    // messages为frame中的消息数，MESSAGE_BATCH为其中的消息条数，仅用于统计
+    bool send(std::shared_ptr<Participant> self, Protocol::FramePtr frame, std::uint64_t messages = 1);
+
     void leave(std::shared_ptr<Participant> self);
+
+    /**
+     * 读取历史消息，投递给target：last为true时从最近的count条开始，否则从序号count开始
+     * 每个frame单独回放，由target以当前的channel ID标记
+     */
+    void replay(std::shared_ptr<Participant> target, bool last, std::uint64_t count);
+
+    // 加入时检查是否已是成员
+    bool contains(const std::shared_ptr<Participant> &con);
+
+private:
+    void rebuildMembers(unsigned int shardIndex);
+
+    // 转发成功的frame追加到历史，写入失败时记录日志并停止保存
+    void record(const Protocol::Frame &frame);
 };
 
 // ---------------- Class Participant ------------------------------
 
 class Participant : public std::enable_shared_from_this<Participant>
 {
+    friend class Federation;
+
+public:
+    // pause策略下接收方队列的硬上限为发送队列上限的该倍数：暂停之前已读入的frame，
+    // 以及众多不同的发送方，仍会使队列继续增长，超出后按disconnect处理
+    static constexpr std::size_t PAUSE_QUEUE_LIMIT_FACTOR = 4;
+
 private:
     boost::asio::ip::tcp::socket socket;
-    std::shared_ptr<Channel> channel;
-    std::queue<Protocol::Package> pkgQueue;
+    Shard &shard; // 连接所在的shard，socket及以下状态只在该shard的线程中访问
+    SlotTable<std::shared_ptr<Participant>>::Handle id; // 在shard成员表中的句柄
+    // 已加入的channel，按ID排序。转发时按frame中的channel ID二分查找，不经过名称
+    std::vector<std::shared_ptr<Channel>> channels;
+    bool joining; // 正在等待channel所属shard处理create/join请求
+    bool closed;
+    int pauseCount;      // 因接收方队列已满而被暂停读取的次数，为0时才继续读取
+    bool readSuspended;  // 读取是否因暂停而停止
+    std::vector<std::shared_ptr<Participant>> pausedSenders; // 因本participant队列已满而被暂停的发送方
+    BackpressureStats stats; // 本participant作为接收方时各策略被触发的次数
+    ParticipantMetrics participantMetrics;
+    Protocol::Version version; // 与客户端协商出的协议版本，收到HELLO之前为v1
+    const ServerOptions &options;
+    FrameQueue pkgQueue;
+    boost::asio::steady_timer flushTimer; // 用于writeDelay
+    FrameReader reader;
+    Protocol::PackageView inputPkg; // 正在处理的package，body直接指向接收缓冲区
+    HandlerMemory readMemory;   // 读/写handler复用的内存
+    HandlerMemory writeMemory;
+    // 握手、空闲及写停滞超时共用一个timer，到期的tick取其中最早的一个
+    // 收到frame、写完成时只记录tick，不重新调度：到期时再检查是否真正超时，未超时则按记录的tick重新调度
+    WheelTimer<Participant> timeout;
+    bool handshaken;        // 是否已收到第一个完整的frame
+    std::uint64_t lastRead;  // 最近一次收到frame的tick，握手完成前为连接建立的tick
+    std::uint64_t lastWrite; // 发送队列由空变为非空，或最近一次写完成的tick
+    std::uint64_t pingSent;  // 发出PING的tick，0表示没有在等待回复
+#ifdef TCP_PROTO_COROUTINES
+    // 协程引擎：写循环在队列为空时、读循环在被暂停时等待各自的timer，cancel()即唤醒
+    boost::asio::steady_timer writerWakeup;
+    boost::asio::steady_timer readerWakeup;
+#endif
+#ifdef TCP_PROTO_IO_URING
+    // io_uring引擎：读、写各最多一个未完成的操作，完成之前各持有一份self
+    UringHandler<Participant> uringReader;
+    UringHandler<Participant> uringWriter;
+    std::vector<iovec> uringIovecs; // 本次写操作尚未写出的gather buffer
+    msghdr uringMessage;
+    std::size_t uringWritten; // 本次写操作已写出的字节数
+#endif
+    // 多路复用（见Protocol::Type::STREAM）：stream会话没有自己的socket，收发都经过承载它的连接，
+    // 与该连接在同一个shard中处理。会话的发送队列只保存额度不足、尚未交给连接的frame
+    std::shared_ptr<Participant> mux; // 承载本stream会话的连接，普通连接为空
+    std::uint32_t streamId;
+    std::vector<std::shared_ptr<Participant>> streams; // 本连接上的stream会话，按ID排序
+    std::int64_t sendCredit;    // stream会话：对端还允许server发送的字节数，不大于0时frame留在发送队列中
+    std::int64_t receiveCredit; // stream会话：对端还可以发送的字节数，超出即违反流控
+    std::size_t creditOwed;     // stream会话：已处理、尚未归还给对端的字节数，暂停期间不归还
+    // federation：peer为true的连接是与另一个节点之间的连接，其上每个stream会话只加入一个channel；
+    // dialed为true时由本节点发起，stream由本节点打开，对端发来的是owner的回复及channel中的消息
+    // 对端以HELLO_PEER声明自己是节点，只有来自节点列表中的地址（启用tls.caFile时还须通过证书验证）才被接受
+    bool peer;
+    bool dialed;
+    std::uint32_t nextStreamId; // 本节点发起的连接：下一个打开的stream的ID
+    bool pumpPosted;            // 节点间的stream会话：已安排在本轮事件循环结束时合并发送
+    // 本节点发起的stream会话：等待owner回复create/join，连接断开时以空参数调用
+    std::function<void(const Protocol::PackageView *)> upstreamReply;
+    // 隧道（见Protocol::Type::TUNNEL）：收到请求后不再解析、读取之后的数据，直到失败或交出socket
+    bool tunneling;
+    std::string tunnelName;  // 正在等待配对的offer所在的channel，退出时撤销
+    std::string tunnelSpill; // io_uring引擎：与请求一起读到、放不进reader的后续数据
+    // 已配对、TUNNEL_READY在发送队列中：队列清空后交出socket（fd，关闭时为-1）及请求之后已读到的数据
+    std::function<void(int, boost::asio::ip::tcp, std::string)> tunnelHandoff;
+    // 本连接读写循环的实现方式：通常为options.engine，在用户态加解密的TLS连接只使用回调引擎
+    SessionEngine engine;
+#ifdef TCP_PROTO_TLS
+    // TLS握手期间不发送发送队列中的frame；握手后内核完成加解密时tls为空，否则读写都经过tls
+    std::unique_ptr<TlsSession> tls;
+    bool securing;
+    bool certified; // 对端出示了证书且通过了tls.caFile的验证
+#endif
 
 public:
-    Participant(boost::asio::ip::tcp::socket socket_);
-    ~Participant();
+    Participant(boost::asio::ip::tcp::socket socket_, Shard &home, const ServerOptions &opts);
+
+    // 在连接connection上打开ID为id的stream会话，只能在该连接所在的shard中调用
+    Participant(const std::shared_ptr<Participant> &connection, std::uint32_t id);
 
     void run();
 
     void write(const Protocol::Package &pkg);
 
+    // 发送已编码好的frame，frame在所有接收方之间共享，不会被拷贝
+    // 只有frame的版本高于本连接协商出的版本时才会转换为v1重新编码
+    void write(Protocol::FramePtr frame);
+
+    // 可在任意线程调用：投递到本participant所在的shard后再write
+    void deliver(Protocol::FramePtr frame);
+
+    // 镜像channel与owner失去联系，本participant被移出
+    void evicted(const std::shared_ptr<Channel> &mirror);
+
+    /**
+     * 转发channel中其他成员(sender)发来的frame
+     * 发送队列已满时按照channel的policy处理
+     */
+    void relay(Protocol::FramePtr frame, const std::shared_ptr<Participant> &sender, SlowConsumerPolicy policy);
+
+    // 暂停/恢复读取，必须在本participant所在的shard中调用
+    void pause();
+
+    void resume();
+
+    // 关闭socket，未完成的读写随之失败并触发exit()
+    void close();
+
+    const BackpressureStats &backpressureStats();
+
+    ParticipantMetrics &metrics();
+
+    Protocol::Version protocolVersion();
+
+    // 在所在shard成员表中的句柄，run()之后不再改变
+    SlotTable<std::shared_ptr<Participant>>::Handle memberId();
+
+    Shard &home();
+
     std::shared_ptr<Participant> getPtr();
 
     void exit();
 
-private:
-    void readHeader();
+    // 隧道请求失败：回复failure后恢复为普通连接，必须在本participant所在的shard中调用
+    void tunnelFailed(Protocol::FramePtr failure);
+
+    // 隧道已配对：发出ready，之后交给handoff，必须在本participant所在的shard中调用
+    void tunnelPaired(Protocol::FramePtr ready, std::function<void(int, boost::asio::ip::tcp, std::string)> handoff);
 
-    void readBody(std::shared_ptr<Protocol::Package> pkg);
+    // 写入channel回放的历史frame（v2时以channelId标记），最后回复HISTORY_END，必须在本participant所在的shard中调用
+    void replayed(std::uint32_t channelId, const std::vector<Protocol::FramePtr> &frames, std::string_view end);
 
+    // 处理客户端发来的一个完整package，必须在本participant所在的shard中调用
     void handle(const Protocol::Package &pkg);
 
-    void transmit(const Protocol::Package &inputPkg);
+    // 同上，body为视图，只在本次调用期间有效
+    void handle(const Protocol::PackageView &pkg);
+
+private:
+    // 两种会话共用的构造，stream会话不从socket读取，接收缓冲区只需最小的容量
+    Participant(boost::asio::ip::tcp::socket socket_, Shard &home, const ServerOptions &opts,
+                std::size_t readerCapacity);
+
+    // 按engine开始读写循环
+    void startLoops();
+
+#ifdef TCP_PROTO_TLS
+    // 先完成TLS握手再开始读写循环，握手失败时断开
+    void secure(std::shared_ptr<TlsContext> context);
+#endif
+
+    void readFrames();
+
+    // 暂停或请求隧道期间停止的读取在二者都结束后继续
+    void continueReading();
+
+    /**
+     * 处理一次读到的len字节：解析出所有完整的package并逐个handle()
+     * header不合法时关闭连接并返回false，两种引擎共用
+     */
+    bool onRead(std::size_t len);
+
+    /**
+     * 一次写操作完成后弹出已发送的frame，必要时恢复被暂停的发送方
+     * 返回true表示队列中还有待发送的frame
+     */
+    bool onWritten(std::size_t len);
+
+    // 发送队列由空变为非空时发起写操作
+    void startWrite();
+
+    // 按当前状态取最早的超时tick调度timeout，没有需要检查的超时则取消
+    void armTimeout();
+
+    // timeout到期：发出PING或断开连接，否则重新调度
+    void onTimeout();
+
+    enum class Timeout
+    {
+        HANDSHAKE,
+        IDLE,
+        WRITE_STALL,
+    };
+
+    void timedOut(Timeout reason);
+
+#ifdef TCP_PROTO_COROUTINES
+    // self只用于在协程存活期间保持本对象，协程体中不使用
+    boost::asio::awaitable<void> readLoop(std::shared_ptr<Participant> self);
+
+    boost::asio::awaitable<void> writeLoop(std::shared_ptr<Participant> self);
+#endif
+
+#ifdef TCP_PROTO_IO_URING
+    // 把接收缓冲区中的数据交给reader解析，之后继续读取
+    void onUringRead(int result, std::uint32_t flags);
+
+    void onUringWritten(int result, std::uint32_t flags);
+
+    // 发送uringIovecs中剩余的部分
+    void sendWithUring();
+#endif
+
+    // 发送队列回落后恢复所有被暂停的发送方
+    void resumeSenders();
 
-    void leaveChannel();
+    // 连接收到STREAM：交给对应的stream会话处理，第一次使用的ID打开新的会话
+    void handleStream(const Protocol::PackageView &pkg);
 
-    void listAllChannels();
+    // 连接收到STREAM_CREDIT：增加该stream的发送额度，继续发送积压的frame
+    void creditStream(std::string_view body);
 
-    void createChannel(std::string channelName);
+    // 本连接上ID不小于streamId的第一个stream会话
+    std::vector<std::shared_ptr<Participant>>::iterator findStream(std::uint32_t id);
 
-    void joinInChannel(std::string channelName);
+    // 退出stream会话并通知对端，会话保留到对端回复关闭为止，期间收到的frame被丢弃
+    void closeStream(const std::shared_ptr<Participant> &session);
+
+    // 把stream会话的frame装入STREAM发送：header与内层frame依次放入连接的发送队列，内层frame不复制
+    void writeStream(std::uint32_t id, Protocol::FramePtr frame);
+
+    // stream会话：在额度之内把发送队列中的frame交给连接
+    void pumpStream();
+
+    // 节点间的stream会话：把队列前部连续的消息合并为一个不带channel ID的MESSAGE_BATCH，不足两条时返回空
+    Protocol::FramePtr coalesce();
+
+    // 本节点发起的连接：作为另一个节点的客户端开始收发，先发出声明节点身份的HELLO
+    void dial();
+
+    // 本节点发起的连接：打开一个新的stream会话
+    std::shared_ptr<Participant> openStream();
+
+    // 本节点发起的stream会话：处理owner发来的frame
+    void handleUpstream(const Protocol::PackageView &pkg);
+
+    // 是否为另一个节点打开的stream会话，其请求总是在本节点处理，不再转发
+    bool fromPeer();
+
+    // stream会话：处理完对端发来的size字节，攒够半个窗口时归还额度
+    void consumeCredit(std::size_t size);
+
+    // stream会话：把已处理的字节数归还给对端
+    void returnCredit();
+
+    // 协商协议版本，回复HELLO_ACK
+    void hello(const Protocol::PackageView &pkg);
+
+    // 已加入的ID为channelId的channel，不存在时返回空
+    std::shared_ptr<Channel> findChannel(std::uint32_t channelId);
+
+    /**
+     * 找出package所指的channel：带有FLAG_CHANNEL时按body开头的ID查找（并从body中去掉ID），
+     * 否则只在已加入一个channel时为该channel。找不到时回复OTHER_ERROR并返回空
+     */
+    std::shared_ptr<Channel> targetChannel(const Protocol::PackageView &pkg, std::string_view &body);
+
+    // v2连接收到的有关某个channel的回复带上其ID，v1连接原样发送
+    void writeTagged(Protocol::FramePtr frame, std::uint32_t channelId);
+
+    void transmit(const Protocol::PackageView &inputPkg);
+
+    void leaveChannel(const Protocol::PackageView &pkg);
+
+    // body格式为"前缀,游标,页大小"，在目录所在的shard中取出（或编码）该页后回复
+    void listAllChannels(std::string_view body);
+
+    // body格式为"版本号"或"版本号,最大条数"
+    void listChanges(std::string_view body);
+
+    // 回复server、所在channel及本连接的指标
+    void replyStats();
+
+    // body格式为"名称"，v2的连接也可以为"名称,策略"
+    void createChannel(std::string_view body);
+
+    void joinInChannel(std::string_view channelName);
+
+    // body格式为"last,N"或"since,序号"
+    void requestHistory(const Protocol::PackageView &pkg);
+
+    /**
+     * body格式为"offer,名称,令牌"或"connect,名称,令牌"，令牌为第二个','之后的全部内容且不能为空
+     * connect只与同一channel上令牌相同的offer配对；令牌不符时回复TUNNEL_FAILED，与该channel上没有offer时相同
+     */
+    void requestTunnel(std::string_view body);
+
+    // 等待配对的offer：socket可读时检查客户端是否已经断开（不读取数据）
+    void watchTunnel();
+
+    // 发送队列已清空：交出socket，之后本participant退出
+    void handOffTunnel();
+
+    // 在channel所属shard处理完create/join之后，回到本shard更新状态并回复
+    void onJoined(std::shared_ptr<Channel> joined, Protocol::FramePtr reply);
 
     void execWriteAction();
 };
+
+// ---------------- Class MetricsListener ------------------------------
+
+// 只监听127.0.0.1的最简HTTP服务：每个请求返回一次Prometheus文本格式的全部指标，之后关闭连接
+class MetricsListener
+{
+private:
+    Server &server;
+    boost::asio::ip::tcp::acceptor acceptor;
+
+public:
+    MetricsListener(Server &srv, boost::asio::io_context &ioCtx, unsigned short port);
+
+    boost::asio::ip::tcp::endpoint localEndpoint();
+
+private:
+    void accept();
+
+    void serve(std::shared_ptr<boost::asio::ip::tcp::socket> socket);
+};
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <string>
+
+// 连接读写循环的实现方式
+enum class SessionEngine
+{
+    CALLBACK,  // 链式的完成回调（默认）
+    COROUTINE, // 基于boost::asio::awaitable的读、写两个协程，需以TCP_PROTO_COROUTINES编译
+    IO_URING,  // accept及socket读写由每个shard的io_uring完成，需以TCP_PROTO_IO_URING编译
+};
+
+/**
+ * 解析引擎名称：callback / coroutine / io_uring
+ * 名称无效，或未以对应的选项（TCP_PROTO_COROUTINES / TCP_PROTO_IO_URING）编译时返回false
+ */
+inline bool parseSessionEngine(const std::string &str, SessionEngine &engine)
+{
+    if (str == "callback")
+    {
+        engine = SessionEngine::CALLBACK;
+        return true;
+    }
+#ifdef TCP_PROTO_COROUTINES
+    if (str == "coroutine")
+    {
+        engine = SessionEngine::COROUTINE;
+        return true;
+    }
+#endif
+#ifdef TCP_PROTO_IO_URING
+    if (str == "io_uring")
+    {
+        engine = SessionEngine::IO_URING;
+        return true;
+    }
+#endif
+    return false;
+}
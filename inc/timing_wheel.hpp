@@ -0,0 +1,112 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+// 哈希时间轮（Varghese & Lauck方案6），每个shard一个，只在shard的线程中使用
+// 时间以tick计数，到期时刻为deadline的timer挂在第deadline % 槽数个槽的链表上：
+//   - schedule()/cancel()都是O(1)，timer侵入式地嵌在其所有者中，不分配内存
+//   - 每前进一个tick只检查一个槽，槽中deadline未到的timer（超出一圈）留到之后的轮次
+// 与每个连接一个steady_timer相比，数十万个连接的超时不会在asio的定时器队列（堆）中产生同样数量的节点
+class TimingWheel
+{
+public:
+    class Timer
+    {
+        friend class TimingWheel;
+
+    private:
+        TimingWheel *wheel = nullptr; // 非空表示已调度
+        Timer **list = nullptr;       // 所在链表的表头
+        Timer *prev = nullptr;
+        Timer *next = nullptr;
+        std::uint64_t deadline = 0;
+
+    public:
+        Timer() = default;
+        Timer(const Timer &) = delete;
+        Timer &operator=(const Timer &) = delete;
+
+        // 析构时自动取消
+        virtual ~Timer();
+
+        // 到期时调用，调用前已从时间轮中移除，可以在其中重新schedule()
+        virtual void expire() = 0;
+
+        bool scheduled() const;
+
+        // 到期的tick，只在scheduled()时有意义
+        std::uint64_t expiry() const;
+    };
+
+    /**
+     * tickDuration为一个tick的时长，slotCount为槽的个数，向上取整为2的幂
+     * 一圈的时长为tickDuration * slotCount，更长的超时会在槽中停留多圈
+     */
+    explicit TimingWheel(std::chrono::milliseconds tickDuration = std::chrono::milliseconds(100),
+                         std::size_t slotCount = 1024);
+    ~TimingWheel();
+
+    TimingWheel(const TimingWheel &) = delete;
+    TimingWheel &operator=(const TimingWheel &) = delete;
+
+    // 当前的tick
+    std::uint64_t now() const;
+
+    std::chrono::milliseconds tick() const;
+
+    // 把时长换算为tick数，向上取整
+    std::uint64_t ticks(std::chrono::milliseconds duration) const;
+
+    /**
+     * 在deadline（tick）到期，已调度的timer先被取消
+     * deadline不晚于当前tick时在下一个tick到期
+     */
+    void schedule(Timer &timer, std::uint64_t deadline);
+
+    void cancel(Timer &timer);
+
+    // 已调度的timer个数
+    std::size_t size() const;
+
+    bool empty() const;
+
+    /**
+     * 前进到target（tick），依次调用所有deadline不晚于target的timer的expire()
+     * 一次前进超过一圈时只扫描一圈，到期的timer都会被调用，但不保证按deadline的先后顺序
+     */
+    void advance(std::uint64_t target);
+
+private:
+    std::chrono::milliseconds tickDuration;
+    std::vector<Timer *> slots;
+    std::uint64_t current;
+    std::size_t count;
+    Timer *expiring; // advance()中已到期、尚未调用的timer
+
+    void link(Timer &timer, Timer *&head);
+
+    void unlink(Timer &timer);
+};
+
+// 到期时调用owner的成员函数
+template <typename Owner>
+class WheelTimer : public TimingWheel::Timer
+{
+private:
+    Owner &owner;
+    void (Owner::*method)();
+
+public:
+    WheelTimer(Owner &target, void (Owner::*handler)())
+        : owner(target),
+          method(handler)
+    {
+    }
+
+    void expire() override
+    {
+        (owner.*method)();
+    }
+};
@@ -0,0 +1,266 @@
+#pragma once
+
+#include <boost/asio.hpp>
+#include <memory>
+#include <string>
+#ifdef TCP_PROTO_TLS
+#include <boost/asio/ssl/error.hpp>
+#include <openssl/ssl.h>
+#include <algorithm>
+#include <cstring>
+#include <mutex>
+#include <utility>
+#include <vector>
+#endif
+
+// TLS的可配置项，server与client共用
+struct TlsOptions
+{
+    // PEM格式的证书链及私钥，server的certFile为空时不启用TLS；keyFile为空时从certFile中读取私钥
+    // client的certFile非空时在对端请求时出示（federation中节点之间的双向验证）
+    std::string certFile;
+    std::string keyFile;
+    // 验证对端证书所用的CA（PEM），为空时不验证。自签名的证书即以证书本身作为CA
+    // client还检查证书与连接的主机名（或IP）相符，见TlsSession；server要求对端出示由该CA签发的证书，
+    // 只用于federation中节点之间的连接（见routePeers()），普通客户端的连接不请求证书
+    std::string caFile;
+    // 内核支持时把握手之后的记录加解密交给内核（kTLS），socket上的读写、splice()与明文连接相同
+    bool kernelOffload = true;
+    // client：以上一次连接得到的session ticket恢复会话，省去证书验证及完整的密钥交换
+    bool resumeSessions = true;
+};
+
+class TlsContext;
+class TlsSession;
+
+#ifdef TCP_PROTO_TLS
+
+enum class TlsRole
+{
+    SERVER,
+    CLIENT,
+};
+
+// ---------------- Class TlsContext ------------------------------
+
+// SSL_CTX的封装，创建后只读，可被多个线程中的连接共用（client缓存的会话除外，由sessionMutex保护）
+// server签发无状态的session ticket，不维护会话缓存；client缓存最近一次握手得到的会话，之后的连接以其恢复
+// OpenSSL 3.2之前只能为TLS 1.2卸载接收方向，内核支持kTLS时协议版本限制为TLS 1.2及AES-GCM
+class TlsContext
+{
+private:
+    SSL_CTX *ctx;
+    TlsRole role;
+    bool offload; // 是否请求kTLS
+    std::mutex sessionMutex;
+    SSL_SESSION *session; // client：最近一次握手得到的会话
+    std::shared_ptr<TlsContext> peers; // server：节点之间的连接改用的context，为空时不区分
+
+public:
+    // 读取证书、私钥或CA失败时抛出异常：std::runtime_error；进程此后忽略SIGPIPE
+    TlsContext(TlsRole tlsRole, const TlsOptions &options);
+
+    ~TlsContext();
+
+    TlsContext(const TlsContext &) = delete;
+    TlsContext &operator=(const TlsContext &) = delete;
+
+    SSL_CTX *native();
+
+    TlsRole getRole();
+
+    // client：缓存的会话（已增加引用计数，由调用方释放），没有时为空
+    SSL_SESSION *cachedSession();
+
+    // client：在ClientHello的ALPN中声明本连接是federation中节点之间的连接
+    void announcePeer();
+
+    // server：声明为节点之间连接的握手改用peerContext完成（例如要求并验证对端证书），只在开始接受连接之前调用
+    void routePeers(std::shared_ptr<TlsContext> peerContext);
+
+    // 以TCP_ULP加载tls模块来探测内核是否支持kTLS，结果在进程内缓存
+    static bool kernelSupported();
+
+    // 取出并清空本线程的OpenSSL错误队列，没有错误时返回what
+    static std::string lastError(const std::string &what);
+
+private:
+    static int onNewSession(SSL *ssl, SSL_SESSION *session);
+
+    static int onClientHello(SSL *ssl, int *alert, void *arg);
+};
+
+// ---------------- Class TlsSession ------------------------------
+
+/**
+ * 一个连接上的TLS。OpenSSL直接读写socket的fd（而不是asio::ssl那样经过内存BIO），握手完成后才能把密钥交给内核
+ * socket在本对象存在期间为非阻塞模式：握手及用户态的读写都先直接调用OpenSSL，WANT_READ/WANT_WRITE时
+ * 等待socket就绪后重试，完成的handler总是投递执行。offloaded()之后调用方直接读写socket，可以销毁本对象
+ * 只在socket所属io_context的线程中使用，socket须比本对象存活更久，读、写各最多一个未完成的操作
+ */
+class TlsSession
+{
+public:
+    // 每次SSL_write()的最大字节数：gather的多个frame先复制到一起，加密为尽量少的记录
+    static constexpr std::size_t WRITE_CHUNK = 64 * 1024;
+
+private:
+    using WaitType = boost::asio::ip::tcp::socket::wait_type;
+
+    std::shared_ptr<TlsContext> context;
+    boost::asio::ip::tcp::socket &socket;
+    SSL *ssl;
+    std::vector<char> staging; // 正在写出的数据，SSL_write()重试时必须使用同一个buffer
+    std::size_t staged;
+
+public:
+    /**
+     * client：host非空时以其作为SNI，并要求server的证书与之相符；host为IP地址时与证书中的IP比较，不发送SNI
+     * host为空时只验证证书链。创建SSL失败时抛出异常：std::runtime_error
+     */
+    TlsSession(std::shared_ptr<TlsContext> tlsContext, boost::asio::ip::tcp::socket &sock,
+               const std::string &host = std::string());
+
+    ~TlsSession();
+
+    TlsSession(const TlsSession &) = delete;
+    TlsSession &operator=(const TlsSession &) = delete;
+
+    // 完成握手后以handler(error_code)回调
+    template <typename Handler>
+    void handshake(Handler handler)
+    {
+        ERR_clear_error();
+        int result = SSL_do_handshake(ssl);
+        WaitType wait;
+        boost::system::error_code ec = result == 1 ? boost::system::error_code() : failure(result, wait);
+        if (ec == boost::asio::error::would_block)
+        {
+            socket.async_wait(wait, [this, handler = std::move(handler)](boost::system::error_code ec) mutable {
+                if (ec)
+                {
+                    handler(ec);
+                    return;
+                }
+                handshake(std::move(handler));
+            });
+            return;
+        }
+        boost::asio::post(socket.get_executor(), [handler = std::move(handler), ec]() mutable { handler(ec); });
+    }
+
+    // 两个方向的记录都由内核加解密
+    bool offloaded();
+
+    // 以session ticket恢复了会话
+    bool resumed();
+
+    // 对端出示了证书，且通过了context的CA的验证
+    bool peerVerified();
+
+    // 读到至少一个字节后以handler(error_code, 字节数)回调，对端关闭时为eof
+    template <typename Handler>
+    void asyncReadSome(boost::asio::mutable_buffer buffer, Handler handler)
+    {
+        std::size_t len = 0;
+        ERR_clear_error();
+        int result = SSL_read_ex(ssl, buffer.data(), buffer.size(), &len);
+        WaitType wait;
+        boost::system::error_code ec = result == 1 ? boost::system::error_code() : failure(result, wait);
+        if (ec == boost::asio::error::would_block)
+        {
+            socket.async_wait(wait, [this, buffer, handler = std::move(handler)](boost::system::error_code ec) mutable {
+                if (ec)
+                {
+                    handler(ec, 0);
+                    return;
+                }
+                asyncReadSome(buffer, std::move(handler));
+            });
+            return;
+        }
+        boost::asio::post(socket.get_executor(),
+                          [handler = std::move(handler), ec, len]() mutable { handler(ec, len); });
+    }
+
+    /**
+     * 写出buffers中的全部数据后以handler(error_code, 字节数)回调
+     * buffers引用的数据在完成之前必须保持有效（例如FrameQueue::gather()的结果）
+     */
+    template <typename ConstBufferSequence, typename Handler>
+    void asyncWrite(const ConstBufferSequence &buffers, Handler handler)
+    {
+        writeFrom(buffers, 0, std::move(handler));
+    }
+
+private:
+    // 从第offset个字节开始写出buffers
+    template <typename ConstBufferSequence, typename Handler>
+    void writeFrom(const ConstBufferSequence &buffers, std::size_t offset, Handler handler)
+    {
+        std::size_t total = boost::asio::buffer_size(buffers);
+        boost::system::error_code ec;
+        while (offset < total)
+        {
+            if (staged == 0)
+            {
+                stage(buffers, offset);
+            }
+            std::size_t len = 0;
+            ERR_clear_error();
+            int result = SSL_write_ex(ssl, staging.data(), staged, &len);
+            if (result == 1)
+            {
+                offset += staged;
+                staged = 0;
+                continue;
+            }
+            WaitType wait;
+            ec = failure(result, wait);
+            if (ec == boost::asio::error::would_block)
+            {
+                socket.async_wait(wait, [this, buffers, offset, handler = std::move(handler)](
+                                            boost::system::error_code ec) mutable {
+                    if (ec)
+                    {
+                        staged = 0;
+                        handler(ec, offset);
+                        return;
+                    }
+                    writeFrom(buffers, offset, std::move(handler));
+                });
+                return;
+            }
+            staged = 0;
+            break;
+        }
+        boost::asio::post(socket.get_executor(),
+                          [handler = std::move(handler), ec, offset]() mutable { handler(ec, offset); });
+    }
+
+    // 把buffers中从第offset个字节开始的至多WRITE_CHUNK个字节复制到staging
+    template <typename ConstBufferSequence>
+    void stage(const ConstBufferSequence &buffers, std::size_t offset)
+    {
+        for (auto it = boost::asio::buffer_sequence_begin(buffers);
+             it != boost::asio::buffer_sequence_end(buffers) && staged < WRITE_CHUNK; ++it)
+        {
+            boost::asio::const_buffer buffer(*it);
+            if (offset >= buffer.size())
+            {
+                offset -= buffer.size();
+                continue;
+            }
+            buffer += offset;
+            offset = 0;
+            std::size_t len = std::min(buffer.size(), WRITE_CHUNK - staged);
+            std::memcpy(staging.data() + staged, buffer.data(), len);
+            staged += len;
+        }
+    }
+
+    // SSL调用失败：WANT_READ/WANT_WRITE时返回would_block并在wait中给出要等待的方向，对端关闭时返回eof
+    boost::system::error_code failure(int result, WaitType &wait);
+};
+
+#endif
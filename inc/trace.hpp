@@ -0,0 +1,125 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// 热路径上的二进制trace
+// 每个线程拥有一个固定大小的环形缓冲区，TRACE()只把一条定长记录写入本线程的缓冲区：
+// 不格式化字符串、不加锁、不做系统调用，缓冲区写满后覆盖最早的记录（飞行记录器）
+// 进程退出前调用Trace::dump()把所有线程的记录写入文件，再由trace_decode离线解码
+//
+// 编译时通过TCP_PROTO_TRACE_MASK选择启用的类别（见Trace::Category），为0时TRACE()不产生任何代码
+#ifndef TCP_PROTO_TRACE_MASK
+#define TCP_PROTO_TRACE_MASK 0xFFu
+#endif
+
+namespace Trace
+{
+    enum Category : std::uint32_t
+    {
+        CONNECTION = 1u << 0, // 连接的建立与断开
+        IO = 1u << 1,         // 每次读写、每个frame
+        CHANNEL = 1u << 2,    // channel的创建、加入、离开、销毁
+        FAILURE = 1u << 3,    // 异常情况：解析错误、IO错误、慢消费者、被丢弃的frame
+    };
+
+    // 各事件的参数a/b的含义见注释，conn为连接在所在shard上的句柄
+    enum class Event : std::uint16_t
+    {
+        ACCEPT = 1,       // a: conn, b: 对端IPv4地址 << 16 | 端口
+        CLOSE = 2,        // a: conn, b: 0
+        READ = 3,         // a: conn, b: 读到的字节数
+        FRAME_IN = 4,     // a: conn, b: type << 32 | body长度
+        WRITE = 5,        // a: conn, b: 写出的字节数
+        CHANNEL_CREATE = 6,  // a: 名称的哈希, b: 名称的前8个字节
+        CHANNEL_DESTROY = 7, // a: 名称的哈希, b: 名称的前8个字节
+        JOIN = 8,         // a: conn, b: 名称的哈希
+        LEAVE = 9,        // a: conn, b: 名称的哈希
+        IO_ERROR = 10,    // a: conn, b: 错误码
+        PARSE_ERROR = 11, // a: conn, b: 0
+        BAD_REQUEST = 12, // a: conn, b: type
+        FRAME_DROP = 13,  // a: conn, b: frame长度（超出接收方协议版本的上限）
+        SLOW_CONSUMER = 14, // a: conn, b: policy << 48 | 队列中的字节数
+        TIMEOUT = 15,     // a: conn, b: 0 握手 / 1 空闲 / 2 写停滞
+    };
+
+    constexpr Category categoryOf(Event event)
+    {
+        switch (event)
+        {
+        case Event::ACCEPT:
+        case Event::CLOSE:
+            return CONNECTION;
+        case Event::READ:
+        case Event::FRAME_IN:
+        case Event::WRITE:
+            return IO;
+        case Event::CHANNEL_CREATE:
+        case Event::CHANNEL_DESTROY:
+        case Event::JOIN:
+        case Event::LEAVE:
+            return CHANNEL;
+        default:
+            return FAILURE;
+        }
+    }
+
+    constexpr bool enabled(Event event)
+    {
+        return (TCP_PROTO_TRACE_MASK & categoryOf(event)) != 0;
+    }
+
+    // 定长的trace记录，32字节
+    struct Record
+    {
+        std::uint64_t timestamp; // steady_clock，纳秒
+        std::uint16_t event;
+        std::uint16_t thread;    // 线程注册的序号
+        std::uint32_t reserved;
+        std::uint64_t a;
+        std::uint64_t b;
+    };
+    static_assert(sizeof(Record) == 32, "trace record must stay fixed-size");
+
+    // 每个线程最多保留的记录数（2的幂）
+    constexpr std::size_t BUFFER_RECORDS = 64 * 1024;
+
+    // 写入一条记录，由TRACE()调用
+    void record(Event event, std::uint64_t a, std::uint64_t b);
+
+    /**
+     * 把所有线程的记录写入path，返回是否成功
+     * 必须在其他线程都已停止写入（例如已join）之后调用
+     */
+    bool dump(const std::string &path);
+
+    // dump()生成的文件的内容
+    struct Dump
+    {
+        std::uint64_t steadyNanos = 0; // dump时的steady_clock
+        std::uint64_t systemNanos = 0; // 同一时刻的system_clock，用于换算为绝对时间
+        std::vector<Record> records;   // 所有线程的记录，按时间排序
+    };
+
+    // 读取dump()生成的文件，格式不正确时返回false
+    bool load(const std::string &path, Dump &dump);
+
+    // 事件名称，未知事件返回"UNKNOWN"
+    const char *eventName(std::uint16_t event);
+
+    // 把字符串的前8个字节打包成一个整数，用于在记录中携带channel名称
+    std::uint64_t packName(const std::string &name);
+
+    std::string unpackName(std::uint64_t packed);
+}
+
+#define TRACE(event, a, b)                                                              \
+    do                                                                                  \
+    {                                                                                   \
+        if constexpr (Trace::enabled(Trace::Event::event))                              \
+        {                                                                               \
+            Trace::record(Trace::Event::event, static_cast<std::uint64_t>(a),           \
+                          static_cast<std::uint64_t>(b));                               \
+        }                                                                               \
+    } while (0)
@@ -0,0 +1,136 @@
+#pragma once
+
+#include "protocol.hpp"
+#include "frame_reader.hpp"
+#include "tls.hpp"
+#include <boost/asio.hpp>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <string>
+
+// ---------------- Class Tunnel ------------------------------
+
+// 在两个已连接的TCP socket之间双向转发字节（见Protocol::Type::TUNNEL）：每个方向经由一个管道以splice()搬运，
+// 数据不复制到用户态。一个方向读到EOF时关闭另一端的写方向，两个方向都结束或任一端出错时关闭两个socket
+// 只在socket所属io_context的线程中运行，由未完成的异步等待持有，不需要外部保存
+class Tunnel : public std::enable_shared_from_this<Tunnel>
+{
+public:
+    // 每个管道请求的容量，越大每次splice()搬运的数据越多。受/proc/sys/fs/pipe-max-size限制，设置失败时保持默认
+    static constexpr int PIPE_SIZE = 1024 * 1024;
+    // 一个方向每次连续执行的splice()次数上限，之后让出线程
+    static constexpr unsigned int PUMP_BATCH = 16;
+
+private:
+    struct Direction
+    {
+        int from; // sockets的下标
+        int to;
+        int pipe[2];
+        std::size_t capacity; // 管道的实际容量
+        std::size_t buffered; // 管道中尚未写出的字节数
+        std::string head;     // 先于管道写出的数据
+        std::size_t headSent;
+        bool eof;  // from已读到EOF
+        bool done; // 已关闭to的写方向
+    };
+
+    boost::asio::ip::tcp::socket sockets[2];
+    Direction directions[2];
+    std::atomic<std::uint64_t> *counter;
+    bool closed;
+
+public:
+    /**
+     * 开始在first与second之间转发：toFirst/toSecond为先于转发的数据写入first/second的字节，
+     * 例如对端在隧道建立之前已经发出、被读入用户态的数据。counter不为空时累加转发的字节数
+     * 创建管道失败时抛出异常：std::system_error
+     */
+    static void start(boost::asio::ip::tcp::socket first, boost::asio::ip::tcp::socket second,
+                      std::string toFirst = std::string(), std::string toSecond = std::string(),
+                      std::atomic<std::uint64_t> *counter = nullptr);
+
+    Tunnel(boost::asio::ip::tcp::socket first, boost::asio::ip::tcp::socket second, std::string toFirst,
+           std::string toSecond, std::atomic<std::uint64_t> *bytes);
+
+    ~Tunnel();
+
+private:
+    // 在一个方向上尽量搬运数据，无法继续时等待相应的socket可读或可写
+    void pump(int direction);
+
+    // 系统调用失败：EAGAIN时等待socket就绪后继续，被信号打断时稍后重试，其余错误关闭隧道
+    void retry(int direction, int socket, boost::asio::ip::tcp::socket::wait_type type);
+
+    // 关闭两个socket，未完成的等待随之取消
+    void close();
+};
+
+// ---------------- Class TunnelEndpoint ------------------------------
+
+// 客户端一侧的隧道：expose把本地的TCP服务暴露在某个channel上，始终保持一个offer连接在server上等待，
+// 配对后连接本地服务并转发，同时发出下一个offer；forward在本地监听一个端口，每接受一个连接就以connect
+// 打开一个隧道，接到该channel上暴露的服务。两端须使用相同的令牌，server只把令牌相同的offer与connect配对
+// 两种情况下都由Tunnel在本地转发，状态只在io线程中访问
+// server启用了TLS时，与server之间的隧道连接也须由内核完成加解密（kTLS），否则无法splice()，隧道打开失败
+class TunnelEndpoint : public std::enable_shared_from_this<TunnelEndpoint>
+{
+private:
+    using Socket = std::shared_ptr<boost::asio::ip::tcp::socket>;
+
+    boost::asio::io_context &ioContext;
+    boost::asio::ip::tcp::resolver::results_type server;
+    std::string channel;
+    std::string token;
+    boost::asio::ip::tcp::resolver::results_type service; // expose：本地服务的地址
+    std::unique_ptr<boost::asio::ip::tcp::acceptor> acceptor; // forward：本地监听
+    Socket pending; // expose：正在server上等待配对的offer连接
+    std::shared_ptr<TlsContext> tlsContext; // 为空时以明文连接server
+    bool stopped;
+
+public:
+    // 以下在调用方线程中创建，之后的操作都投递到ioCtx中执行。tls不为空时以TLS连接server
+    static std::shared_ptr<TunnelEndpoint> expose(boost::asio::io_context &ioCtx,
+                                                  const boost::asio::ip::tcp::resolver::results_type &server,
+                                                  std::string channel, std::string token,
+                                                  const boost::asio::ip::tcp::resolver::results_type &service,
+                                                  std::shared_ptr<TlsContext> tls = nullptr);
+
+    // 监听失败时抛出异常：boost::system::system_error
+    static std::shared_ptr<TunnelEndpoint> forward(boost::asio::io_context &ioCtx,
+                                                   const boost::asio::ip::tcp::resolver::results_type &server,
+                                                   std::string channel, std::string token,
+                                                   const boost::asio::ip::tcp::endpoint &listen,
+                                                   std::shared_ptr<TlsContext> tls = nullptr);
+
+    TunnelEndpoint(boost::asio::io_context &ioCtx, const boost::asio::ip::tcp::resolver::results_type &serverEndpoints,
+                   std::string channelName, std::string tunnelToken, std::shared_ptr<TlsContext> tls);
+
+    // 不再发出offer或接受本地连接，已建立的隧道不受影响。可在任意线程调用
+    void stop();
+
+private:
+    // expose：发出一个offer，配对后连接本地服务
+    void offer();
+
+    // forward：接受一个本地连接并为其打开隧道
+    void accept();
+
+    /**
+     * 以socket连接server并发出TUNNEL请求（mode为"offer"或"connect"），收到TUNNEL_READY后以该连接及
+     * 回复之后已读到的数据调用done；失败时打印原因，以空连接调用done
+     */
+    void request(Socket socket, std::string_view mode, std::function<void(Socket, std::string)> done);
+
+#ifdef TCP_PROTO_TLS
+    // 在已连接的socket上完成TLS握手，内核接管了加解密时以该连接调用done，否则打印原因并以空连接调用done
+    void secure(Socket socket, std::function<void(Socket)> done);
+#endif
+
+    // 读取server对TUNNEL请求的回复
+    void receive(Socket socket, std::shared_ptr<FrameReader> reader, std::function<void(Socket, std::string)> done);
+
+    // 打印失败原因，stop()之后的失败不再打印
+    void failed(std::string_view reason);
+};
@@ -0,0 +1,162 @@
+#pragma once
+
+#ifdef TCP_PROTO_IO_URING
+
+#include <boost/asio.hpp>
+#include <linux/io_uring.h>
+#include <sys/socket.h>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string_view>
+
+// 基于io_uring的proactor，每个shard一个，只在shard的线程中使用
+// 直接使用io_uring_setup/io_uring_enter/io_uring_register系统调用，不依赖liburing：
+//   - 提交：一轮事件处理中产生的所有SQE只在最后以一次io_uring_enter提交
+//   - 完成：ring上注册的eventfd由shard的io_context等待，就绪后在shard线程中逐个回调，
+//     因此timer、inbox等仍由asio驱动，只有socket的accept/读/写改由io_uring完成
+//   - 接收使用预先注册的缓冲区环（provided buffer ring），由内核为每次recv选择缓冲区，
+//     未完成的recv不占用连接自己的接收缓冲区
+class Uring
+{
+public:
+    // 一个在ring中尚未完成的操作，SQE的user_data指向它
+    class Operation
+    {
+        friend class Uring;
+
+    private:
+        Operation *prev = nullptr; // 未完成操作的侵入式链表，ring销毁时用于abandon()
+        Operation *next = nullptr;
+        bool pending = false;
+
+    public:
+        virtual ~Operation() = default;
+
+        // 完成时在shard线程中调用，result为负的errno或操作的返回值
+        virtual void complete(int result, std::uint32_t flags) = 0;
+
+        // ring销毁时仍未完成的操作不再回调，只释放其持有的资源（与io_context销毁时丢弃handler相同）
+        virtual void abandon() {}
+    };
+
+    // 接收缓冲区环的大小：每个缓冲区的字节数及个数（2的幂）
+    static constexpr std::size_t BUFFER_SIZE = 16 * 1024;
+    static constexpr unsigned int BUFFER_COUNT = 256;
+
+    /**
+     * entries为SQ的大小，CQ为其4倍
+     * 内核不支持io_uring或所需的特性（provided buffer ring等，需Linux 6.0+）时抛出异常：std::system_error
+     */
+    explicit Uring(boost::asio::io_context &ioCtx, unsigned int entries = 1024);
+    ~Uring();
+
+    Uring(const Uring &) = delete;
+    Uring &operator=(const Uring &) = delete;
+
+    // multishot accept：每接受一个连接完成一次（result为新连接的fd），flags中没有IORING_CQE_F_MORE时需重新提交
+    void accept(int fd, Operation &op);
+
+    // 接收到内核从缓冲区环中选择的缓冲区，完成后用buffer()取得数据，处理完再用recycle()归还
+    void receive(int fd, Operation &op);
+
+    // sendmsg，message及其iovec必须保持有效直到完成
+    void send(int fd, const msghdr *message, Operation &op);
+
+    // 完成事件对应的接收缓冲区中的数据
+    std::string_view buffer(std::uint32_t flags, std::size_t length);
+
+    // 把完成事件使用的接收缓冲区归还给内核
+    void recycle(std::uint32_t flags);
+
+    // 立即提交所有待提交的SQE
+    void submit();
+
+private:
+    boost::asio::io_context &ioContext;
+    int ringFd;
+    int eventFd;
+    boost::asio::posix::stream_descriptor wakeup; // 等待eventFd
+    // SQ/CQ的共享内存
+    void *ringMemory;
+    std::size_t ringSize;
+    io_uring_sqe *sqes;
+    std::size_t sqesSize;
+    unsigned int *sqHead;
+    unsigned int *sqTail;
+    unsigned int sqMask;
+    unsigned int sqEntries;
+    unsigned int *cqHead;
+    unsigned int *cqTail;
+    unsigned int cqMask;
+    io_uring_cqe *cqes;
+    unsigned int unsubmitted;  // 已写入SQ但尚未提交的SQE个数
+    bool submitScheduled;      // 是否已投递了提交操作
+    // SQ已满且内核暂时不接受提交（EAGAIN/EBUSY，例如CQ的溢出列表非空）时暂存的SQE，之后的提交中按顺序放入SQ
+    std::deque<io_uring_sqe> backlog;
+    // 接收缓冲区环。不使用io_uring_buf_ring::bufs：C++中该柔性数组前的空结构体占1个字节，偏移与内核不一致
+    io_uring_buf *bufferRing;
+    std::size_t bufferRingSize;
+    std::unique_ptr<std::uint8_t[]> buffers;
+    std::uint16_t bufferTail;
+    Operation *operations; // 未完成的操作
+
+    // 空白的SQE，user_data指向op
+    static io_uring_sqe prepare(Operation &op);
+
+    // 把填好的SQE放入SQ，SQ已满时先提交，仍没有空间时放入backlog；本轮事件处理结束后统一提交
+    void enqueue(const io_uring_sqe &sqe, Operation &op);
+
+    // SQ有空闲位置时写入sqe并返回true
+    bool place(const io_uring_sqe &sqe);
+
+    void link(Operation &op);
+
+    void unlink(Operation &op);
+
+    void waitCompletions();
+
+    // 处理CQ中所有的完成事件
+    void reap();
+
+    // 销毁时取得CQ中所有的完成事件，已结束的操作只abandon()而不回调
+    void abandonCompletions();
+
+    void provide(std::uint16_t id);
+};
+
+// 把完成事件转发给owner的成员函数；hold()的对象在操作完成或被放弃之前保持存活
+template <typename Owner>
+class UringHandler : public Uring::Operation
+{
+private:
+    Owner &owner;
+    void (Owner::*method)(int, std::uint32_t);
+    std::shared_ptr<Owner> keepAlive;
+
+public:
+    UringHandler(Owner &target, void (Owner::*handler)(int, std::uint32_t))
+        : owner(target),
+          method(handler)
+    {
+    }
+
+    void hold(std::shared_ptr<Owner> object)
+    {
+        keepAlive = std::move(object);
+    }
+
+    void complete(int result, std::uint32_t flags) override
+    {
+        // 回调中可能再次提交并hold()，owner最早在回调返回后才被释放
+        auto object = std::move(keepAlive);
+        (owner.*method)(result, flags);
+    }
+
+    void abandon() override
+    {
+        auto object = std::move(keepAlive);
+    }
+};
+
+#endif
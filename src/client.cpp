@@ -10,37 +10,436 @@
 #include <limits>
 
 Client::Client(boost::asio::io_context &ioCtx,
-               const boost::asio::ip::tcp::resolver::results_type &endpoints)
+               const boost::asio::ip::tcp::resolver::results_type &endpoints,
+               std::chrono::microseconds delay,
+               SessionEngine sessionEngine,
+               std::shared_ptr<TlsContext> tls)
     : ioContext(ioCtx),
-      socket(ioCtx)
+      socket(ioCtx),
+      pkgQueue(SEND_QUEUE_MAX_BYTES, SEND_QUEUE_MAX_FRAMES),
+      outbox(OUTBOX_CAPACITY),
+      outboxScheduled(false),
+      outboxWaiters(0),
+      outboxStalled(false),
+      closed(false),
+      writeDelay(delay),
+      flushTimer(ioCtx),
+      version(Protocol::Version::V1),
+      engine(sessionEngine),
+      batchBytes(0),
+      batchDelay(0),
+      batchChannel(Protocol::NO_CHANNEL),
+      batchSeq(0),
+      batchTimer(ioCtx),
+      channelId(Protocol::NO_CHANNEL),
+      streamWindow(0),
+      tlsContext(std::move(tls))
+#ifdef TCP_PROTO_TLS
+      ,
+      securing(false)
+#endif
+#ifdef TCP_PROTO_COROUTINES
+      ,
+      writerWakeup(ioCtx)
+#endif
 {
     connect(endpoints);
 }
 
 void Client::write(const Protocol::Package &pkg)
 {
-    boost::asio::post(ioContext, [pkg, this]() {
-        bool actionFlag = !pkgQueue.empty(); // 当队列非空时说明还在执行写操作。
-        pkgQueue.push(pkg);
-        if (!actionFlag)
+    auto frame = Protocol::encodeFrame(pkg, version.load(std::memory_order_acquire));
+    if (batchBytes.load(std::memory_order_acquire) == 0)
+    {
+        send(std::move(frame));
+        return;
+    }
+    std::lock_guard<std::mutex> lock(batchMutex);
+    flushBatch(); // 保持与之前合并的消息的先后顺序
+    send(std::move(frame));
+}
+
+void Client::write(Protocol::Type type, std::string_view body)
+{
+    auto currentVersion = version.load(std::memory_order_acquire);
+    // 只有发往channel的请求需要与合并中的消息保持顺序，其余的（包括io线程发出的PONG、HELLO）不加锁
+    bool ordered = type == Protocol::Type::MESSAGE || type == Protocol::Type::LEAVE_CHANNEL ||
+                   type == Protocol::Type::HISTORY;
+    if (!ordered || batchBytes.load(std::memory_order_acquire) == 0)
+    {
+        send(encode(type, body, currentVersion));
+        return;
+    }
+    std::lock_guard<std::mutex> lock(batchMutex);
+    std::size_t maxBytes = batchBytes.load(std::memory_order_relaxed);
+    if (type == Protocol::Type::MESSAGE && maxBytes > 0 && currentVersion != Protocol::Version::V1 &&
+        Protocol::batchEntryLength(body.size()) <= maxBytes)
+    {
+        appendToBatch(body, currentVersion);
+        return;
+    }
+    auto frame = encode(type, body, currentVersion);
+    flushBatch();
+    send(std::move(frame));
+}
+
+Protocol::FramePtr Client::encode(Protocol::Type type, std::string_view body, Protocol::Version currentVersion)
+{
+    if (type == Protocol::Type::MESSAGE || type == Protocol::Type::LEAVE_CHANNEL || type == Protocol::Type::HISTORY)
+    {
+        return makeBuilder(type, currentVersion, body.size(), channelId.load(std::memory_order_acquire))
+            .append(body)
+            .finish();
+    }
+    return Protocol::encodeFrame(type, body, currentVersion);
+}
+
+void Client::setChannel(std::uint32_t id)
+{
+    // 在io线程中收到CREATE/JOIN的回复时调用，不能等待batchMutex；batch按所属的channel在追加时分开
+    channelId.store(id, std::memory_order_release);
+}
+
+Protocol::FrameBuilder Client::makeBuilder(Protocol::Type type, Protocol::Version currentVersion, std::size_t capacity,
+                                           std::uint32_t channel)
+{
+    if (currentVersion == Protocol::Version::V1 || channel == Protocol::NO_CHANNEL)
+    {
+        return Protocol::FrameBuilder(type, currentVersion, capacity);
+    }
+    Protocol::FrameBuilder builder(type, currentVersion, capacity + 5, Protocol::FLAG_CHANNEL);
+    Protocol::appendChannelId(builder, channel);
+    return builder;
+}
+
+void Client::setBatching(std::size_t maxBytes, std::chrono::microseconds maxDelay)
+{
+    std::lock_guard<std::mutex> lock(batchMutex);
+    flushBatch();
+    batchDelay = maxDelay;
+    batchBytes.store(std::min<std::size_t>(maxBytes, Protocol::V2_BODY_MAX_LENGTH), std::memory_order_release);
+}
+
+void Client::appendToBatch(std::string_view message, Protocol::Version currentVersion)
+{
+    std::size_t maxBytes = batchBytes.load(std::memory_order_relaxed);
+    std::size_t entry = Protocol::batchEntryLength(message.size());
+    std::uint32_t channel = channelId.load(std::memory_order_acquire);
+    if (batch && (batch->size() + entry > maxBytes || batchChannel != channel))
+    {
+        flushBatch();
+    }
+    if (!batch)
+    {
+        batch.emplace(makeBuilder(Protocol::Type::MESSAGE_BATCH, currentVersion, maxBytes, channel));
+        batchChannel = channel;
+        // 从batch中的第一条消息开始计时，每个batch只投递一次
+        boost::asio::post(ioContext, [this, seq = ++batchSeq]() {
+            batchTimer.expires_after(batchDelay);
+            batchTimer.async_wait([this, seq](std::error_code ec) {
+                if (!ec)
+                {
+                    flushExpiredBatch(seq);
+                }
+            });
+        });
+    }
+    Protocol::appendBatchEntry(*batch, message);
+    if (batch->size() + 1 >= maxBytes) // 已放不下任何消息
+    {
+        flushBatch();
+    }
+}
+
+void Client::flushExpiredBatch(std::uint64_t seq)
+{
+    std::unique_lock<std::mutex> lock(batchMutex, std::try_to_lock);
+    if (!lock)
+    {
+        // 持有锁的生产者可能正等待outbox腾出空间，先让io线程处理outbox
+        boost::asio::post(ioContext, [this, seq]() { flushExpiredBatch(seq); });
+        return;
+    }
+    if (seq == batchSeq) // 该batch可能已因写满而发出
+    {
+        flushBatch();
+    }
+}
+
+bool Client::writeStream(std::uint32_t stream, Protocol::Type type, std::string_view body)
+{
+    std::uint32_t window = streamWindow.load(std::memory_order_acquire);
+    if (window == 0)
+    {
+        return false;
+    }
+    // 内层frame直接编码在STREAM的body中
+    std::size_t capacity = Protocol::V2_HEADER_MAX_LENGTH + body.size();
+    Protocol::FrameBuilder builder(Protocol::Type::STREAM, Protocol::Version::V2, 5 + capacity);
+    Protocol::appendVarint(builder, stream);
+    std::size_t size = Protocol::encodeTo(Protocol::Version::V2, type, 0,
+                                          reinterpret_cast<const std::uint8_t *>(body.data()), body.size(),
+                                          builder.prepare(capacity), capacity);
+    builder.commit(size);
+    auto frame = builder.finish();
+
+    std::lock_guard<std::mutex> lock(streamMutex);
+    auto &state = streams.try_emplace(stream, StreamState{window, {}}).first->second;
+    if (state.credit > 0 && state.pending.empty())
+    {
+        state.credit -= static_cast<std::int64_t>(size);
+        send(std::move(frame));
+    }
+    else
+    {
+        state.pending.emplace_back(std::move(frame), size);
+    }
+    return true;
+}
+
+void Client::closeStream(std::uint32_t stream)
+{
+    std::lock_guard<std::mutex> lock(streamMutex);
+    streams.erase(stream);
+    send(Protocol::encodeStreamHeader(stream, 0));
+}
+
+void Client::onStreamCredit(std::uint32_t stream, std::uint32_t bytes)
+{
+    std::unique_lock<std::mutex> lock(streamMutex, std::try_to_lock);
+    if (!lock)
+    {
+        // 同flushExpiredBatch()，持有锁的生产者可能正等待io线程处理outbox
+        boost::asio::post(ioContext, [this, stream, bytes]() { onStreamCredit(stream, bytes); });
+        return;
+    }
+    auto found = streams.find(stream);
+    if (found == streams.end())
+    {
+        return; // 已关闭
+    }
+    auto &state = found->second;
+    state.credit += bytes;
+    while (state.credit > 0 && !state.pending.empty())
+    {
+        state.credit -= static_cast<std::int64_t>(state.pending.front().second);
+        send(std::move(state.pending.front().first));
+        state.pending.pop_front();
+    }
+}
+
+void Client::onStreamClosed(std::uint32_t stream)
+{
+    std::unique_lock<std::mutex> lock(streamMutex, std::try_to_lock);
+    if (!lock)
+    {
+        boost::asio::post(ioContext, [this, stream]() { onStreamClosed(stream); });
+        return;
+    }
+    streams.erase(stream);
+    send(Protocol::encodeStreamHeader(stream, 0));
+}
+
+void Client::flushBatch()
+{
+    if (batch)
+    {
+        send(batch->finish());
+        batch.reset();
+    }
+}
+
+void Client::send(Protocol::FramePtr frame)
+{
+    if (closed.load(std::memory_order_acquire))
+    {
+        return;
+    }
+    if (ioContext.get_executor().running_in_this_thread())
+    {
+        // outbox中的frame更早写入，先全部移入发送队列以保持顺序（不受发送队列上限的限制）
+        bool idle = false;
+        Protocol::FramePtr earlier;
+        while (outbox.pop(earlier))
         {
-            execWriteAction();
+            if (pkgQueue.push(std::move(earlier)))
+            {
+                idle = true;
+            }
         }
-    });
+        if (pkgQueue.push(std::move(frame)))
+        {
+            idle = true;
+        }
+        if (idle)
+        {
+            startWrite();
+        }
+        return;
+    }
+    if (!outbox.tryPush(frame))
+    {
+        // outbox已满：非空的outbox总有已投递的drain，或者在写完成后由resumeOutbox()继续取出，这里只需等待
+        outboxWaiters.fetch_add(1);
+        std::atomic_thread_fence(std::memory_order_seq_cst); // 与takeOutbox()中的fence配对，见wakeProducers()
+        {
+            std::unique_lock<std::mutex> lock(outboxMutex);
+            outboxSpace.wait(lock, [this, &frame]() {
+                return closed.load(std::memory_order_acquire) || outbox.tryPush(frame);
+            });
+        }
+        outboxWaiters.fetch_sub(1);
+        if (frame)
+        {
+            return; // 已关闭，frame没有放入outbox
+        }
+    }
+    if (!outboxScheduled.exchange(true))
+    {
+        boost::asio::post(ioContext, [this]() { drainOutbox(); });
+    }
+}
+
+bool Client::takeOutbox()
+{
+    bool idle = false;
+    Protocol::FramePtr frame;
+    for (unsigned int i = 0; i < DRAIN_BATCH; i++)
+    {
+        if (pkgQueue.full(0))
+        {
+            outboxStalled = true;
+            break;
+        }
+        if (!outbox.pop(frame))
+        {
+            break;
+        }
+        if (pkgQueue.push(std::move(frame))) // 队列原本为空时需要发起写操作，否则由正在进行的写操作继续发送
+        {
+            idle = true;
+        }
+    }
+    wakeProducers();
+    return idle;
+}
+
+void Client::wakeProducers()
+{
+    // 生产者先登记再重试tryPush()，这里先腾出空间再检查登记：两者之间的fence保证至少一方看到对方的写入，
+    // 因此不会在生产者开始等待之后漏掉唤醒。没有等待者时不加锁
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (outboxWaiters.load(std::memory_order_relaxed) == 0)
+    {
+        return;
+    }
+    // 持有锁再通知：生产者检查条件与开始等待之间不会收到通知
+    std::lock_guard<std::mutex> lock(outboxMutex);
+    outboxSpace.notify_all();
+}
+
+void Client::drainOutbox()
+{
+    if (takeOutbox())
+    {
+        startWrite();
+    }
+    if (outboxStalled)
+    {
+        // 由写完成后的resumeOutbox()继续，期间outboxScheduled保持为true，生产者不会再投递drain
+        return;
+    }
+    if (!outbox.empty())
+    {
+        // 让出线程给socket I/O，剩余的frame稍后继续处理
+        boost::asio::post(ioContext, [this]() { drainOutbox(); });
+        return;
+    }
+    outboxScheduled.store(false);
+    // 清除标记后再检查一次，避免遗漏在此期间放入的frame
+    if (!outbox.empty() && !outboxScheduled.exchange(true))
+    {
+        boost::asio::post(ioContext, [this]() { drainOutbox(); });
+    }
+}
+
+void Client::resumeOutbox()
+{
+    if (outboxStalled && pkgQueue.belowLowWatermark())
+    {
+        outboxStalled = false;
+        drainOutbox();
+    }
+}
+
+void Client::startWrite()
+{
+#ifdef TCP_PROTO_TLS
+    if (securing)
+    {
+        return; // 握手完成后发送
+    }
+#endif
+#ifdef TCP_PROTO_COROUTINES
+    if (engine == SessionEngine::COROUTINE)
+    {
+        writerWakeup.cancel();
+        return;
+    }
+#endif
+    if (writeDelay.count() > 0)
+    {
+        flushTimer.expires_after(writeDelay);
+        flushTimer.async_wait([this](std::error_code ec) {
+            if (!ec)
+            {
+                execWriteAction();
+            }
+        });
+    }
+    else
+    {
+        execWriteAction();
+    }
+}
+
+Protocol::Version Client::protocolVersion()
+{
+    return version.load(std::memory_order_acquire);
 }
 
 void Client::close()
 {
-    boost::asio::post(ioContext, [this]() { socket.close(); });
+    closed.store(true, std::memory_order_release);
+    wakeProducers(); // 等待outbox空间的生产者随之返回
+    boost::asio::post(ioContext, [this]() {
+        socket.close();
+#ifdef TCP_PROTO_COROUTINES
+        writerWakeup.cancel();
+#endif
+    });
 }
 
 void Client::connect(const boost::asio::ip::tcp::resolver::results_type &endpoints)
 {
+#ifdef TCP_PROTO_TLS
+    // 握手之前写出的frame会被server当作ClientHello，连接建立之前就开始等待
+    securing = tlsContext != nullptr;
+#endif
+    // 证书须与解析之前的主机名相符
+    std::string host = endpoints.empty() ? std::string() : endpoints.begin()->host_name();
     boost::asio::async_connect(socket, endpoints,
-                               [this](std::error_code ec, boost::asio::ip::tcp::endpoint) {
+                               [this, host](std::error_code ec, boost::asio::ip::tcp::endpoint) {
                                    if (!ec)
                                    {
-                                       readHeader();
+#ifdef TCP_PROTO_TLS
+                                       if (tlsContext)
+                                       {
+                                           secure(host);
+                                           return;
+                                       }
+#endif
+                                       established();
                                    }else{
                                        LOG(ERROR) << ec.message();
                                        close();
@@ -48,78 +447,326 @@ void Client::connect(const boost::asio::ip::tcp::resolver::results_type &endpoin
                                });
 }
 
-void Client::readHeader()
-{
-    auto pkg = std::make_shared<Protocol::Package>();
-    boost::asio::async_read(socket,
-                            std::vector<boost::asio::mutable_buffer>{
-                                boost::asio::buffer(&pkg->type, sizeof(Protocol::Package::type)),
-                                boost::asio::buffer(&pkg->length, sizeof(Protocol::Package::length)),
-                            },
-                            [pkg, this](std::error_code ec, std::size_t len) {
-                                if (!ec)
-                                {
-                                    pkg->body.resize(pkg->length);
-                                    readBody(pkg);
-                                }else{
-                                    LOG(ERROR) << ec.message();
-                                    close();
-                                }
-                            });
-}
-
-void Client::readBody(std::shared_ptr<Protocol::Package> pkg)
-{
-    boost::asio::async_read(socket, boost::asio::buffer(pkg->body, pkg->length),
-                            [pkg, this](std::error_code ec, std::size_t len) {
-                                if (!ec)
-                                {
-                                    try
-                                    {
-                                        auto type = Protocol::decodePackage(*pkg);
-                                        std::string output;
-                                        switch (type)
-                                        {
-                                        case Protocol::Type::MESSAGE:
-                                            output = "<------- " + std::string(pkg->body.begin(), pkg->body.end());
-                                            break;
-
-                                        default:
-                                            output = "[" + std::string(pkg->body.begin(), pkg->body.end()) + "]";
-                                            break;
-                                        }
-                                        std::cout << "\n" << output << "\n> " << std::flush;
-                                    }
-                                    catch (const std::exception &e)
-                                    {
-                                        // std::cout << "[" << e.what() << "]" << std::endl;
-                                        LOG(ERROR) << e.what();
-                                    }
-                                    readHeader();
-                                }else{
-                                    LOG(ERROR) << ec.message();
-                                    close();
-                                }
-                            });
+#ifdef TCP_PROTO_TLS
+void Client::secure(const std::string &host)
+{
+    try
+    {
+        tls = std::make_unique<TlsSession>(tlsContext, socket, host);
+    }
+    catch (const std::exception &e)
+    {
+        LOG(ERROR) << e.what();
+        close();
+        return;
+    }
+    securing = true;
+    tls->handshake([this](boost::system::error_code ec) {
+        securing = false;
+        if (ec)
+        {
+            LOG(ERROR) << "TLS handshake failed: " << ec.message();
+            close();
+            return;
+        }
+        if (tls->offloaded())
+        {
+            tls.reset(); // 之后直接读写socket
+        }
+        else
+        {
+            engine = SessionEngine::CALLBACK;
+        }
+        established();
+    });
+}
+#endif
+
+void Client::established()
+{
+    bool queued = !pkgQueue.empty(); // 握手期间放入队列的frame
+    // 以v1格式请求升级到v2，旧版本的server会忽略该请求
+    const char supported = static_cast<char>(Protocol::Version::V2);
+    write(Protocol::Type::HELLO, std::string_view(&supported, 1));
+    if (queued)
+    {
+        startWrite();
+    }
+#ifdef TCP_PROTO_COROUTINES
+    if (engine == SessionEngine::COROUTINE)
+    {
+        boost::asio::co_spawn(ioContext, readLoop(), boost::asio::detached);
+        boost::asio::co_spawn(ioContext, writeLoop(), boost::asio::detached);
+        return;
+    }
+#endif
+    readFrames();
+}
+
+void Client::readFrames()
+{
+    auto handler = makeCustomAllocHandler(readMemory, [this](std::error_code ec, std::size_t len) {
+        if (!ec)
+        {
+            reader.commit(len);
+            try
+            {
+                while (reader.next(inputPkg))
+                {
+                    print(inputPkg);
+                }
+            }
+            catch (const Protocol::invalid_length &e)
+            {
+                LOG(ERROR) << e.what();
+                close();
+                return;
+            }
+            readFrames();
+        }else{
+            LOG(ERROR) << ec.message();
+            close();
+        }
+    });
+#ifdef TCP_PROTO_TLS
+    if (tls)
+    {
+        tls->asyncReadSome(reader.prepare(), std::move(handler));
+        return;
+    }
+#endif
+    socket.async_read_some(reader.prepare(), std::move(handler));
+}
+
+void Client::print(const Protocol::PackageView &pkg, std::uint32_t stream)
+{
+    try
+    {
+        auto type = Protocol::decodePackage(pkg);
+        // stream中的frame以"[~ID]"标出所属的stream，有关某个channel的frame以"[#ID]"标出所属的channel
+        std::string_view body = pkg.body;
+        std::string tag = stream == 0 ? std::string() : "[~" + std::to_string(stream) + "] ";
+        if (pkg.flags & Protocol::FLAG_CHANNEL)
+        {
+            std::uint32_t id = Protocol::readChannelId(body);
+            tag += "[#" + std::to_string(id) + "] ";
+            if (stream == 0 &&
+                (type == Protocol::Type::SUCCEED_IN_CREATE_CHANNEL || type == Protocol::Type::SUCCEED_IN_JOIN_IN_CHANNEL))
+            {
+                setChannel(id);
+            }
+        }
+        switch (type)
+        {
+        case Protocol::Type::MESSAGE:
+            std::cout << "\n<------- " << tag << body;
+            break;
+
+        case Protocol::Type::MESSAGE_BATCH:
+        {
+            Protocol::BatchReader messages(body);
+            std::string_view message;
+            while (messages.next(message))
+            {
+                std::cout << "\n<------- " << tag << message;
+            }
+            break;
+        }
+
+        case Protocol::Type::PING:
+            // server检测空闲连接的心跳，原样回复
+            if (stream == 0)
+            {
+                write(Protocol::Type::PONG, pkg.body);
+            }
+            else
+            {
+                writeStream(stream, Protocol::Type::PONG, body);
+            }
+            return;
+
+        case Protocol::Type::PONG:
+            std::cout << "\n[PONG]";
+            break;
+
+        case Protocol::Type::CHANNEL_LIST:
+        {
+            // "版本号,是否还有下一页\n名称\n名称..."；旧的server及不带参数的v1请求收到以", "连接的名称，原样打印
+            std::string_view header = body.substr(0, body.find('\n'));
+            auto comma = header.find(',');
+            if (comma == std::string_view::npos || comma == 0 ||
+                header.find_first_not_of("0123456789") != comma ||
+                (header.substr(comma + 1) != "0" && header.substr(comma + 1) != "1"))
+            {
+                std::cout << "\n" << tag << "[" << body << "]";
+                break;
+            }
+            std::string_view names = body.substr(std::min(header.size() + 1, body.size()));
+            std::string_view last;
+            std::cout << "\n" << tag << "[";
+            while (!names.empty())
+            {
+                auto end = names.find('\n');
+                std::cout << (last.empty() ? "" : ", ") << names.substr(0, end);
+                last = names.substr(0, end);
+                names = end == std::string_view::npos ? std::string_view() : names.substr(end + 1);
+            }
+            std::cout << "] [Version " << header.substr(0, comma) << "]";
+            if (header.substr(comma + 1) == "1")
+            {
+                std::cout << " [More after " << last << "]";
+            }
+            break;
+        }
+
+        case Protocol::Type::HELLO_ACK:
+            if (stream == 0 && !pkg.body.empty() &&
+                static_cast<std::uint8_t>(pkg.body[0]) == static_cast<std::uint8_t>(Protocol::Version::V2))
+            {
+                std::string_view window = pkg.body.substr(1);
+                if (!window.empty())
+                {
+                    streamWindow.store(Protocol::readVarint(window), std::memory_order_release);
+                }
+                version.store(Protocol::Version::V2, std::memory_order_release);
+            }
+            return;
+
+        case Protocol::Type::STREAM:
+        {
+            std::string_view frame;
+            std::uint32_t id = Protocol::readStream(pkg.body, frame);
+            if (stream != 0)
+            {
+                break; // stream不能嵌套
+            }
+            if (frame.empty())
+            {
+                streamOwed.erase(id);
+                onStreamClosed(id);
+                std::cout << "\n[~" << id << "] [Closed]";
+                break;
+            }
+            print(Protocol::viewFrame(frame), id);
+            // 打印之后即归还额度，攒够半个窗口再发出
+            std::size_t &owed = streamOwed[id];
+            owed += frame.size();
+            if (owed >= streamWindow.load(std::memory_order_relaxed) / 2)
+            {
+                send(Protocol::encodeStreamCredit(id, static_cast<std::uint32_t>(owed)));
+                owed = 0;
+            }
+            return;
+        }
+
+        case Protocol::Type::STREAM_CREDIT:
+        {
+            std::uint32_t bytes;
+            std::uint32_t id = Protocol::readStreamCredit(pkg.body, bytes);
+            onStreamCredit(id, bytes);
+            return;
+        }
+
+        default:
+            std::cout << "\n" << tag << "[" << body << "]";
+            break;
+        }
+        std::cout << "\n> " << std::flush;
+    }
+    catch (const std::exception &e)
+    {
+        // std::cout << "[" << e.what() << "]" << std::endl;
+        LOG(ERROR) << e.what();
+    }
 }
 
 void Client::execWriteAction()
 {
-    boost::asio::async_write(socket,
-                             std::vector<boost::asio::const_buffer>{
-                                 boost::asio::buffer(&pkgQueue.front().type, sizeof(Protocol::Package::type)),
-                                 boost::asio::buffer(&pkgQueue.front().length, sizeof(Protocol::Package::length)),
-                                 boost::asio::buffer(pkgQueue.front().body)},
-                             [this](std::error_code ec, std::size_t len) {
-                                 if (!ec)
-                                 {
-                                     pkgQueue.pop();
-                                     if (!pkgQueue.empty())
-                                     {
-                                         execWriteAction();
-                                     }
-                                 }else{
-                                     LOG(ERROR) << ec.message();
-                                 }
-                             });
+    auto handler = makeCustomAllocHandler(writeMemory, [this](std::error_code ec, std::size_t) {
+        if (!ec)
+        {
+            if (pkgQueue.pop())
+            {
+                execWriteAction();
+            }
+            resumeOutbox();
+        }else{
+            LOG(ERROR) << ec.message();
+            close(); // 不再发送，等待outbox的生产者随之返回
+        }
+    });
+#ifdef TCP_PROTO_TLS
+    if (tls)
+    {
+        tls->asyncWrite(pkgQueue.gather(), std::move(handler));
+        return;
+    }
+#endif
+    boost::asio::async_write(socket, pkgQueue.gather(), std::move(handler));
+}
+
+#ifdef TCP_PROTO_COROUTINES
+boost::asio::awaitable<void> Client::readLoop()
+{
+    boost::system::error_code ec;
+    for (;;)
+    {
+        std::size_t len = co_await socket.async_read_some(reader.prepare(),
+                                                          boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+        if (ec)
+        {
+            LOG(ERROR) << ec.message();
+            close();
+            co_return;
+        }
+        reader.commit(len);
+        try
+        {
+            while (reader.next(inputPkg))
+            {
+                print(inputPkg);
+            }
+        }
+        catch (const Protocol::invalid_length &e)
+        {
+            LOG(ERROR) << e.what();
+            close();
+            co_return;
+        }
+    }
+}
+
+boost::asio::awaitable<void> Client::writeLoop()
+{
+    boost::system::error_code ec;
+    bool more = false;
+    while (socket.is_open())
+    {
+        if (!more)
+        {
+            if (pkgQueue.empty())
+            {
+                // 由write()在队列由空变为非空时唤醒
+                writerWakeup.expires_at(boost::asio::steady_timer::time_point::max());
+                co_await writerWakeup.async_wait(boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+                continue;
+            }
+            if (writeDelay.count() > 0)
+            {
+                flushTimer.expires_after(writeDelay);
+                co_await flushTimer.async_wait(boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+            }
+        }
+        co_await boost::asio::async_write(socket, pkgQueue.gather(),
+                                          boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+        if (ec)
+        {
+            LOG(ERROR) << ec.message();
+            close();
+            co_return;
+        }
+        more = pkgQueue.pop();
+        resumeOutbox();
+    }
 }
+#endif
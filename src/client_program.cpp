@@ -2,28 +2,99 @@
 #include <iostream>
 #include <unordered_map>
 #include "client.hpp"
+#include "tunnel.hpp"
 #include <thread>
 #include <string>
+#include <cstdlib>
+#include <vector>
 
 const std::unordered_map<std::string, Protocol::Type> Command{
     {"create", Protocol::Type::CREATE_CHANNEL},
     {"list", Protocol::Type::LIST_ALL_CHANNELS},
+    {"changes", Protocol::Type::LIST_CHANGES},
     {"join", Protocol::Type::JOIN_IN_CHANNEL},
     {"leave", Protocol::Type::LEAVE_CHANNEL},
+    {"stats", Protocol::Type::STATS},
+    {"ping", Protocol::Type::PING},
+    {"history", Protocol::Type::HISTORY},
 };
 
 int main(int argc, char **argv)
 {
-    if (argc != 3)
+    SessionEngine engine = SessionEngine::CALLBACK;
+    std::size_t batchBytes = 0;
+    unsigned long batchMicros = 0;
+    std::shared_ptr<TlsContext> tls;
+    bool valid = argc >= 3 && argc % 2 == 1;
+    for (int i = 3; valid && i + 1 < argc; i += 2)
     {
-        std::cerr << "Usage: client <host> <port>\n";
+        std::string flag = argv[i];
+        if (flag == "--engine")
+        {
+            valid = parseSessionEngine(argv[i + 1], engine);
+        }
+        else if (flag == "--batch") // --batch BYTES:MICROS
+        {
+            char *end = nullptr;
+            batchBytes = std::strtoul(argv[i + 1], &end, 10);
+            valid = *end == ':' && batchBytes > 0;
+            if (valid)
+            {
+                batchMicros = std::strtoul(end + 1, &end, 10);
+                valid = *end == '\0';
+            }
+        }
+        else if (flag == "--tls") // --tls CA_FILE 以TLS连接并以CA_FILE验证server证书，insecure表示不验证
+        {
+#ifdef TCP_PROTO_TLS
+            TlsOptions options;
+            options.caFile = argv[i + 1] == std::string("insecure") ? std::string() : argv[i + 1];
+            try
+            {
+                tls = std::make_shared<TlsContext>(TlsRole::CLIENT, options);
+            }
+            catch (const std::exception &e)
+            {
+                std::cerr << e.what() << "\n";
+                return 1;
+            }
+#else
+            std::cerr << "TLS support not compiled in\n";
+            return 1;
+#endif
+        }
+        else
+        {
+            valid = false;
+        }
+    }
+    if (!valid)
+    {
+        std::cerr << "Usage: client <host> <port> [--engine callback|coroutine] [--batch <bytes>:<micros>]"
+                  << " [--tls <ca-file>|insecure]\n";
         return 1;
     }
     boost::asio::io_context ioContext;
     boost::asio::ip::tcp::resolver resolver(ioContext);
     auto endpoints = resolver.resolve(argv[1], argv[2]);
-    Client client(ioContext, endpoints);
+    Client client(ioContext, endpoints, std::chrono::microseconds(0), engine, tls);
+    if (batchBytes > 0)
+    {
+        client.setBatching(batchBytes, std::chrono::microseconds(batchMicros));
+    }
     std::thread thread([&ioContext]() { ioContext.run(); });
+    std::uint32_t stream = 0; // 当前使用的stream，为0时直接在连接上发送
+    std::vector<std::shared_ptr<TunnelEndpoint>> tunnels;
+    auto send = [&client, &stream](Protocol::Type type, std::string_view body) {
+        if (stream == 0)
+        {
+            client.write(type, body);
+        }
+        else if (!client.writeStream(stream, type, body))
+        {
+            std::cout << "[Streams Not Supported]" << std::endl;
+        }
+    };
     std::string line;
     line.resize(Protocol::BODY_MAX_LENGTH);
     while (true)
@@ -36,6 +107,83 @@ int main(int argc, char **argv)
             ss.get();
             std::string cmdStr;
             ss >> cmdStr;
+            if (cmdStr == "use") // !use ID  之后的消息发往该channel
+            {
+                std::uint32_t id = 0;
+                if (!(ss >> id) || id == Protocol::NO_CHANNEL)
+                {
+                    std::cout << "[Invalid Argument]" << std::endl;
+                    continue;
+                }
+                client.setChannel(id);
+                continue;
+            }
+            if (cmdStr == "stream" || cmdStr == "endstream") // !stream ID 之后的输入都经由该stream发送，0表示不使用stream
+            {                                                 // !endstream ID 关闭该stream
+                std::uint32_t id = 0;
+                if (!(ss >> id) || (cmdStr == "endstream" && id == 0))
+                {
+                    std::cout << "[Invalid Argument]" << std::endl;
+                    continue;
+                }
+                if (cmdStr == "stream")
+                {
+                    stream = id;
+                }
+                else
+                {
+                    client.closeStream(id);
+                    stream = stream == id ? 0 : stream;
+                }
+                continue;
+            }
+            if (cmdStr == "expose" || cmdStr == "forward") // !expose CHANNEL HOST PORT TOKEN  把本地服务暴露在channel上
+            {                                               // !forward CHANNEL PORT TOKEN  把本地端口转发到channel上暴露的服务
+                std::string name, host, port, token;
+                ss >> name >> host;
+                if (cmdStr == "expose")
+                {
+                    ss >> port;
+                }
+                ss >> token;
+                if (name.empty() || host.empty() || (cmdStr == "expose" && port.empty()) || token.empty())
+                {
+                    std::cout << "[Invalid Argument]" << std::endl;
+                    continue;
+                }
+                try
+                {
+                    if (cmdStr == "expose")
+                    {
+                        tunnels.push_back(TunnelEndpoint::expose(ioContext, endpoints, name, token, resolver.resolve(host, port), tls));
+                    }
+                    else
+                    {
+                        unsigned long listenPort = std::stoul(host);
+                        if (listenPort == 0 || listenPort > 65535)
+                        {
+                            throw std::out_of_range("invalid port");
+                        }
+                        boost::asio::ip::tcp::endpoint listen(boost::asio::ip::address_v4::loopback(),
+                                                              static_cast<unsigned short>(listenPort));
+                        tunnels.push_back(TunnelEndpoint::forward(ioContext, endpoints, name, token, listen, tls));
+                    }
+                }
+                catch (const std::exception &e)
+                {
+                    std::cout << "[" << e.what() << "]" << std::endl;
+                }
+                continue;
+            }
+            if (cmdStr == "untunnel") // !untunnel  停止所有expose/forward，已建立的隧道不受影响
+            {
+                for (auto &tunnel : tunnels)
+                {
+                    tunnel->stop();
+                }
+                tunnels.clear();
+                continue;
+            }
             auto cmd = Command.find(cmdStr);
             if (cmd == Command.end())
             {
@@ -52,10 +200,45 @@ int main(int argc, char **argv)
                     std::cout << "[Invalid Argument]" << std::endl;
                     continue;
                 }
+                std::string policy; // !create CHANNEL_NAME [drop-oldest|drop-newest|disconnect|pause]
+                if (type == Protocol::Type::CREATE_CHANNEL && ss >> policy)
+                {
+                    argument += "," + policy;
+                }
+            }
+            else if (type == Protocol::Type::HISTORY) // !history last N 或 !history since SEQUENCE
+            {
+                std::string mode, number;
+                ss >> mode >> number;
+                if ((mode != "last" && mode != "since") || number.empty())
+                {
+                    std::cout << "[Invalid Argument]" << std::endl;
+                    continue;
+                }
+                argument = mode + "," + number;
+            }
+            else if (type == Protocol::Type::LIST_ALL_CHANNELS) // !list [PREFIX [CURSOR [LIMIT]]]，"-"表示该项为空
+            {
+                std::string item;
+                for (int i = 0; i < 3 && ss >> item; i++)
+                {
+                    argument += (i > 0 ? "," : "") + (item == "-" ? std::string() : item);
+                }
+            }
+            else if (type == Protocol::Type::LIST_CHANGES) // !changes VERSION [LIMIT]
+            {
+                std::string since, limit;
+                ss >> since >> limit;
+                if (since.empty())
+                {
+                    std::cout << "[Invalid Argument]" << std::endl;
+                    continue;
+                }
+                argument = limit.empty() ? since : since + "," + limit;
             }
             try
             {
-                client.write(Protocol::encodePackage(type, argument));
+                send(type, argument);
             }
             catch (const std::exception &e)
             {
@@ -67,7 +250,7 @@ int main(int argc, char **argv)
         { // 发送消息
             try
             {
-                client.write(Protocol::encodePackage(line));
+                send(Protocol::Type::MESSAGE, line);
             }
             catch (const std::exception &e)
             {
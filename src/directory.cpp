@@ -0,0 +1,226 @@
+#include "directory.hpp"
+#include <algorithm>
+#include <vector>
+
+namespace
+{
+    // 回复第一行"版本号,0|1\n"的最大长度
+    constexpr std::size_t HEADER_LINE_MAX_LENGTH = 20 + 3;
+    // 请求参数过长的页不缓存，避免缓存占用过多内存
+    constexpr std::size_t MAX_CACHED_KEY_LENGTH = 1024;
+
+    std::size_t clampLimit(std::size_t limit)
+    {
+        if (limit == 0)
+        {
+            return ChannelDirectory::DEFAULT_PAGE_SIZE;
+        }
+        return std::min(limit, ChannelDirectory::MAX_PAGE_SIZE);
+    }
+
+    bool startsWith(std::string_view str, std::string_view prefix)
+    {
+        return str.substr(0, prefix.size()) == prefix;
+    }
+
+    // 缓存key的公共部分：类别、frame版本、页大小
+    std::string makeKey(char kind, Protocol::Version frameVersion, std::size_t limit)
+    {
+        std::string key(1, kind);
+        key.append(frameVersion == Protocol::Version::V1 ? "1" : "2");
+        key.append(std::to_string(limit));
+        return key;
+    }
+}
+
+ChannelDirectory::ChannelDirectory()
+    : currentVersion(0),
+      logStart(0)
+{
+}
+
+bool ChannelDirectory::add(std::string_view name)
+{
+    if (!names.emplace(name).second)
+    {
+        return false;
+    }
+    changed(true, name);
+    return true;
+}
+
+bool ChannelDirectory::remove(std::string_view name)
+{
+    auto found = names.find(name);
+    if (found == names.end())
+    {
+        return false;
+    }
+    names.erase(found);
+    changed(false, name);
+    return true;
+}
+
+template <typename Build>
+Protocol::FramePtr ChannelDirectory::cached(const std::string &key, Build &&build)
+{
+    if (auto found = pages.find(key))
+    {
+        return *found;
+    }
+    auto frame = build();
+    if (key.size() <= MAX_CACHED_KEY_LENGTH)
+    {
+        if (pages.size() >= MAX_CACHED_PAGES)
+        {
+            pages = FlatMap<Protocol::FramePtr>();
+        }
+        pages.emplace(key, frame);
+    }
+    return frame;
+}
+
+std::uint64_t ChannelDirectory::version() const
+{
+    return currentVersion;
+}
+
+std::size_t ChannelDirectory::size() const
+{
+    return names.size();
+}
+
+Protocol::FramePtr ChannelDirectory::list(std::string_view prefix, std::string_view cursor, std::size_t limit,
+                                          Protocol::Version frameVersion)
+{
+    limit = clampLimit(limit);
+    std::string key = makeKey('l', frameVersion, limit);
+    key.append(1, '\0').append(prefix).append(1, '\0').append(cursor);
+    return cached(key, [&]() {
+        // cursor不小于prefix时，cursor之后的名称必然不小于prefix
+        auto it = cursor.empty() || cursor < prefix ? names.lower_bound(prefix) : names.upper_bound(cursor);
+        std::size_t budget = Protocol::bodyMaxLength(frameVersion) - HEADER_LINE_MAX_LENGTH;
+        std::vector<const std::string *> page;
+        std::size_t bytes = 0;
+        bool more = false;
+        for (; it != names.end() && startsWith(*it, prefix); ++it)
+        {
+            if (it->size() + 1 > budget)
+            {
+                continue; // 单个名称就超出上限（只可能发生在v1），无法列出
+            }
+            if (page.size() == limit || bytes + it->size() + 1 > budget)
+            {
+                more = true;
+                break;
+            }
+            page.push_back(&*it);
+            bytes += it->size() + 1;
+        }
+        Protocol::FrameBuilder builder(Protocol::Type::CHANNEL_LIST, frameVersion, bytes + HEADER_LINE_MAX_LENGTH);
+        builder.append(std::to_string(currentVersion)).append(more ? ",1" : ",0");
+        for (auto name : page)
+        {
+            builder.append("\n").append(*name);
+        }
+        return builder.finish();
+    });
+}
+
+const std::vector<Protocol::FramePtr> &ChannelDirectory::legacyList()
+{
+    if (!legacyPages.empty())
+    {
+        return legacyPages;
+    }
+    std::size_t budget = Protocol::bodyMaxLength(Protocol::Version::V1);
+    std::vector<const std::string *> page;
+    std::size_t bytes = 0;
+    auto finish = [&]() {
+        Protocol::FrameBuilder builder(Protocol::Type::CHANNEL_LIST, Protocol::Version::V1, bytes);
+        for (std::size_t i = 0; i < page.size(); i++)
+        {
+            if (i > 0)
+            {
+                builder.append(", ");
+            }
+            builder.append(*page[i]);
+        }
+        legacyPages.push_back(builder.finish());
+        page.clear();
+        bytes = 0;
+    };
+    for (auto &name : names)
+    {
+        if (name.size() > budget)
+        {
+            continue; // 同list()
+        }
+        if (!page.empty() && bytes + 2 + name.size() > budget)
+        {
+            finish();
+        }
+        bytes += (page.empty() ? 0 : 2) + name.size();
+        page.push_back(&name);
+    }
+    finish();
+    return legacyPages;
+}
+
+Protocol::FramePtr ChannelDirectory::changes(std::uint64_t since, std::size_t limit, Protocol::Version frameVersion)
+{
+    if (since < logStart || since > currentVersion)
+    {
+        return nullptr;
+    }
+    limit = clampLimit(limit);
+    std::string key = makeKey('c', frameVersion, limit);
+    key.append(1, '\0').append(std::to_string(since));
+    return cached(key, [&]() {
+        std::size_t budget = Protocol::bodyMaxLength(frameVersion) - HEADER_LINE_MAX_LENGTH;
+        std::size_t begin = since - logStart;
+        std::size_t end = begin;
+        std::size_t bytes = 0;
+        std::size_t count = 0;
+        for (; end < log.size(); end++)
+        {
+            std::size_t length = log[end].name.size() + 2;
+            if (length > budget)
+            {
+                continue; // 同list()，无法列出的名称跳过
+            }
+            if (count == limit || bytes + length > budget)
+            {
+                break;
+            }
+            bytes += length;
+            count++;
+        }
+        Protocol::FrameBuilder builder(Protocol::Type::CHANNEL_CHANGES, frameVersion, bytes + HEADER_LINE_MAX_LENGTH);
+        builder.append(std::to_string(logStart + end)).append(end < log.size() ? ",1" : ",0");
+        for (std::size_t i = begin; i < end; i++)
+        {
+            if (log[i].name.size() + 2 <= budget)
+            {
+                builder.append(log[i].added ? "\n+" : "\n-").append(log[i].name);
+            }
+        }
+        return builder.finish();
+    });
+}
+
+void ChannelDirectory::changed(bool added, std::string_view name)
+{
+    currentVersion++;
+    log.push_back(Change{added, std::string(name)});
+    if (log.size() > CHANGE_LOG_CAPACITY)
+    {
+        log.pop_front();
+        logStart++;
+    }
+    if (pages.size() > 0)
+    {
+        pages = FlatMap<Protocol::FramePtr>();
+    }
+    legacyPages.clear();
+}
@@ -0,0 +1,256 @@
+#include "federation.hpp"
+#include <glog/logging.h>
+#include <stdexcept>
+
+// ---------------- Class Federation ------------------------------
+
+// 解析"IP:端口"，不做域名解析，各节点据同一个字符串计算哈希
+static boost::asio::ip::tcp::endpoint parseNode(const std::string &node)
+{
+    auto separator = node.rfind(':');
+    if (separator == std::string::npos)
+    {
+        throw std::invalid_argument("invalid node address: " + node);
+    }
+    boost::system::error_code ec;
+    auto address = boost::asio::ip::make_address(node.substr(0, separator), ec);
+    unsigned long port = 0;
+    try
+    {
+        port = std::stoul(node.substr(separator + 1));
+    }
+    catch (const std::exception &)
+    {
+        ec = boost::asio::error::invalid_argument;
+    }
+    if (ec || port == 0 || port > 65535)
+    {
+        throw std::invalid_argument("invalid node address: " + node);
+    }
+    return boost::asio::ip::tcp::endpoint(address, static_cast<unsigned short>(port));
+}
+
+Federation::Federation(Server &srv, const std::vector<std::string> &nodes, unsigned int selfIndex)
+    : server(srv),
+      ring(nodes),
+      self(selfIndex),
+      states(srv.shardCount())
+{
+    if (self >= nodes.size())
+    {
+        throw std::invalid_argument("node index out of range");
+    }
+    for (auto &node : nodes)
+    {
+        endpoints.push_back(parseNode(node));
+    }
+    for (auto &state : states)
+    {
+        state.links.resize(nodes.size());
+    }
+    LOG(INFO) << "node " << self << " of " << nodes.size() << " in federation";
+}
+
+unsigned int Federation::ownerNode(std::string_view channelName) const
+{
+    return ring.owner(channelName);
+}
+
+bool Federation::isLocal(std::string_view channelName) const
+{
+    return ring.owner(channelName) == self;
+}
+
+bool Federation::isNode(const boost::asio::ip::address &address) const
+{
+    // 监听IPv6时IPv4的对端地址以映射的形式出现
+    auto remote = address;
+    if (remote.is_v6() && remote.to_v6().is_v4_mapped())
+    {
+        remote = boost::asio::ip::make_address_v4(boost::asio::ip::v4_mapped, remote.to_v6());
+    }
+    for (auto &endpoint : endpoints)
+    {
+        if (endpoint.address() == remote)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+void Federation::join(Shard &shard, const std::shared_ptr<Participant> &participant, const std::string &name,
+                      bool create, SlowConsumerPolicy policy)
+{
+    auto &waiters = states[shard.id()].pending[name];
+    waiters.push_back(Waiter{participant, create, policy});
+    if (waiters.size() > 1)
+    {
+        return; // 已有请求在等待owner回复
+    }
+    withLink(shard, ring.owner(name), [this, &shard, name](const std::shared_ptr<Participant> &connection) {
+        if (connection)
+        {
+            request(shard, name, connection);
+            return;
+        }
+        auto &pending = states[shard.id()].pending;
+        auto found = pending.find(name);
+        auto waiting = std::move(found->second);
+        pending.erase(found);
+        for (auto &waiter : waiting)
+        {
+            reject(waiter, "Error: owner node unavailable");
+        }
+    });
+}
+
+void Federation::withLink(Shard &shard, unsigned int node, std::function<void(const std::shared_ptr<Participant> &)> done)
+{
+    auto &link = states[shard.id()].links[node];
+    if (link.connection && !link.connection->closed)
+    {
+        done(link.connection);
+        return;
+    }
+    link.connection.reset();
+    link.waiting.push_back(std::move(done));
+    if (link.waiting.size() > 1)
+    {
+        return; // 正在连接
+    }
+    auto socket = std::make_shared<boost::asio::ip::tcp::socket>(shard.context());
+    socket->async_connect(endpoints[node], [this, &shard, node, socket](std::error_code ec) {
+        auto &link = states[shard.id()].links[node];
+        if (ec)
+        {
+            LOG(WARNING) << "failed to connect to node " << node << ": " << ec.message();
+        }
+        else
+        {
+            boost::system::error_code ignored;
+            socket->set_option(boost::asio::ip::tcp::no_delay(true), ignored);
+            link.connection = std::make_shared<Participant>(std::move(*socket), shard, server.getOptions());
+            link.connection->dial();
+        }
+        auto connection = link.connection;
+        auto waiting = std::move(link.waiting);
+        link.waiting.clear();
+        for (auto &callback : waiting)
+        {
+            callback(connection);
+        }
+    });
+}
+
+void Federation::request(Shard &shard, const std::string &name, const std::shared_ptr<Participant> &connection)
+{
+    const Waiter &first = states[shard.id()].pending[name].front();
+    auto session = connection->openStream();
+    // 会话持有回调，回调只能持有会话的弱引用
+    std::weak_ptr<Participant> weakSession = session;
+    session->upstreamReply = [this, &shard, name, weakSession](const Protocol::PackageView *reply) {
+        replied(shard, name, weakSession.lock(), reply);
+    };
+    if (first.create)
+    {
+        session->write(Protocol::FrameBuilder(Protocol::Type::CREATE_CHANNEL, Protocol::Version::V2)
+                           .append(name)
+                           .append(",")
+                           .append(slowConsumerPolicyName(first.policy))
+                           .finish());
+    }
+    else
+    {
+        session->write(Protocol::encodeFrame(Protocol::Type::JOIN_IN_CHANNEL, name, Protocol::Version::V2));
+    }
+}
+
+void Federation::replied(Shard &shard, const std::string &name, const std::shared_ptr<Participant> &session,
+                         const Protocol::PackageView *reply)
+{
+    auto &pending = states[shard.id()].pending;
+    auto found = pending.find(name);
+    if (found == pending.end())
+    {
+        return;
+    }
+    auto waiters = std::move(found->second);
+    pending.erase(found);
+    if (!reply || !session || session->closed)
+    {
+        for (auto &waiter : waiters)
+        {
+            reject(waiter, "Error: owner node unavailable");
+        }
+        return;
+    }
+
+    auto type = static_cast<Protocol::Type>(reply->type);
+    std::shared_ptr<Channel> mirror;
+    if (type == Protocol::Type::SUCCEED_IN_CREATE_CHANNEL || type == Protocol::Type::SUCCEED_IN_JOIN_IN_CHANNEL)
+    {
+        mirror = std::make_shared<Channel>(shard, name, session);
+        mirror->setPolicy(waiters.front().policy);
+        if (!shard.addChannel(mirror))
+        {
+            mirror.reset(); // 节点列表不一致时本节点可能也建立了同名的channel
+        }
+    }
+    if (!mirror)
+    {
+        // owner的回复（不带channel ID）转给第一个等待者，其余的重新请求：例如create因已存在而失败时，join仍可成功
+        auto failure = Protocol::encodeFrame(type, reply->body);
+        auto participant = waiters.front().participant;
+        participant->home().dispatch([participant, failure]() { participant->onJoined(nullptr, failure); });
+        session->mux->closeStream(session);
+        for (std::size_t i = 1; i < waiters.size(); i++)
+        {
+            join(shard, waiters[i].participant, name, waiters[i].create, waiters[i].policy);
+        }
+        return;
+    }
+
+    mirror->join(session);
+    session->channels.push_back(mirror);
+    for (std::size_t i = 0; i < waiters.size(); i++)
+    {
+        auto &waiter = waiters[i];
+        std::shared_ptr<Channel> joined;
+        Protocol::FramePtr result;
+        if (waiter.create && i > 0)
+        {
+            result = Protocol::encodeFrame(Protocol::Type::FAIL_IN_CREATE_CHANNEL, "Error: channel already exist");
+        }
+        else if (mirror->join(waiter.participant))
+        {
+            joined = mirror;
+            result = Protocol::FrameBuilder(waiter.create ? Protocol::Type::SUCCEED_IN_CREATE_CHANNEL
+                                                          : Protocol::Type::SUCCEED_IN_JOIN_IN_CHANNEL)
+                         .append(waiter.create ? "create and join in channel: " : "join in channel: ")
+                         .append(name)
+                         .finish();
+        }
+        else
+        {
+            result = Protocol::encodeFrame(waiter.create ? Protocol::Type::FAIL_IN_CREATE_CHANNEL
+                                                         : Protocol::Type::FAIL_IN_JOIN_IN_CHANNEL,
+                                           "Error: selected channel is full");
+        }
+        auto participant = waiter.participant;
+        participant->home().dispatch([participant, joined, result]() { participant->onJoined(joined, result); });
+    }
+    if (mirror->count() == 1)
+    {
+        session->close(); // 没有等待者加入成功
+    }
+}
+
+void Federation::reject(const Waiter &waiter, std::string_view error)
+{
+    auto failure = Protocol::encodeFrame(waiter.create ? Protocol::Type::FAIL_IN_CREATE_CHANNEL
+                                                       : Protocol::Type::FAIL_IN_JOIN_IN_CHANNEL,
+                                         error);
+    auto participant = waiter.participant;
+    participant->home().dispatch([participant, failure]() { participant->onJoined(nullptr, failure); });
+}
@@ -0,0 +1,176 @@
+#include "frame_pool.hpp"
+#include <mutex>
+#include <vector>
+
+namespace
+{
+    struct FreeBlock
+    {
+        FreeBlock *next;
+    };
+
+    // 每个线程的空闲块链表
+    struct ThreadCache
+    {
+        FreeBlock *lists[FramePool::SIZE_CLASS_NUM] = {};
+        std::size_t counts[FramePool::SIZE_CLASS_NUM] = {};
+
+        ~ThreadCache()
+        {
+            for (std::size_t i = 0; i < FramePool::SIZE_CLASS_NUM; i++)
+            {
+                while (lists[i])
+                {
+                    FreeBlock *block = lists[i];
+                    lists[i] = block->next;
+                    ::operator delete(block);
+                }
+            }
+        }
+    };
+
+    thread_local ThreadCache cache;
+
+    // 在线程缓存之间转移的一批空闲块
+    struct Batch
+    {
+        FreeBlock *head;
+        std::size_t count;
+    };
+
+    struct Depot
+    {
+        std::mutex mutex;
+        std::vector<Batch> batches[FramePool::SIZE_CLASS_NUM];
+        std::size_t bytes[FramePool::SIZE_CLASS_NUM] = {};
+
+        ~Depot()
+        {
+            for (auto &list : batches)
+            {
+                for (auto &batch : list)
+                {
+                    freeBlocks(batch.head);
+                }
+            }
+        }
+
+        static void freeBlocks(FreeBlock *block)
+        {
+            while (block)
+            {
+                FreeBlock *next = block->next;
+                ::operator delete(block);
+                block = next;
+            }
+        }
+    };
+
+    Depot depot;
+
+    // 把当前线程缓存中一半的块交给depot，depot已满时直接释放
+    void release(std::size_t index)
+    {
+        std::size_t count = cache.counts[index] / 2;
+        if (count == 0)
+        {
+            return;
+        }
+        FreeBlock *head = cache.lists[index];
+        FreeBlock *last = head;
+        for (std::size_t i = 1; i < count; i++)
+        {
+            last = last->next;
+        }
+        cache.lists[index] = last->next;
+        cache.counts[index] -= count;
+        last->next = nullptr;
+        std::size_t bytes = count * FramePool::SIZE_CLASSES[index];
+        {
+            std::lock_guard<std::mutex> lock(depot.mutex);
+            if (depot.bytes[index] + bytes <= FramePool::MAX_DEPOT_BYTES)
+            {
+                depot.batches[index].push_back(Batch{head, count});
+                depot.bytes[index] += bytes;
+                return;
+            }
+        }
+        Depot::freeBlocks(head);
+    }
+
+    // 当前线程缓存为空时从depot取回一批
+    void refill(std::size_t index)
+    {
+        std::lock_guard<std::mutex> lock(depot.mutex);
+        auto &list = depot.batches[index];
+        if (list.empty())
+        {
+            return;
+        }
+        Batch batch = list.back();
+        list.pop_back();
+        depot.bytes[index] -= batch.count * FramePool::SIZE_CLASSES[index];
+        cache.lists[index] = batch.head;
+        cache.counts[index] = batch.count;
+    }
+
+    // 返回size所属的size class，超出最大size class时返回SIZE_CLASS_NUM
+    std::size_t sizeClass(std::size_t size)
+    {
+        std::size_t i = 0;
+        while (i < FramePool::SIZE_CLASS_NUM && FramePool::SIZE_CLASSES[i] < size)
+        {
+            i++;
+        }
+        return i;
+    }
+} // namespace
+
+void *FramePool::allocate(std::size_t size)
+{
+    std::size_t index = sizeClass(size);
+    if (index == SIZE_CLASS_NUM)
+    {
+        return ::operator new(size);
+    }
+    if (!cache.lists[index])
+    {
+        refill(index);
+    }
+    FreeBlock *block = cache.lists[index];
+    if (block)
+    {
+        cache.lists[index] = block->next;
+        cache.counts[index]--;
+        return block;
+    }
+    return ::operator new(SIZE_CLASSES[index]);
+}
+
+void FramePool::deallocate(void *ptr, std::size_t size)
+{
+    std::size_t index = sizeClass(size);
+    if (index == SIZE_CLASS_NUM)
+    {
+        ::operator delete(ptr);
+        return;
+    }
+    if ((cache.counts[index] + 1) * SIZE_CLASSES[index] > MAX_CACHED_BYTES)
+    {
+        release(index);
+    }
+    FreeBlock *block = static_cast<FreeBlock *>(ptr);
+    block->next = cache.lists[index];
+    cache.lists[index] = block;
+    cache.counts[index]++;
+}
+
+std::size_t FramePool::cachedBlocks()
+{
+    std::size_t total = 0;
+    for (std::size_t i = 0; i < SIZE_CLASS_NUM; i++)
+    {
+        total += cache.counts[i];
+    }
+    return total;
+}
@@ -0,0 +1,144 @@
+#include "frame_queue.hpp"
+
+FrameQueue::FrameQueue(std::size_t bytesLimit, std::size_t framesLimit)
+    : ring(16),
+      head(0),
+      count(0),
+      inFlight(0),
+      byteCount(0),
+      maxBytes(bytesLimit),
+      maxFrames(framesLimit)
+{
+    buffers.reserve(MAX_GATHER_BUFFERS);
+}
+
+bool FrameQueue::push(Protocol::FramePtr frame)
+{
+    bool idle = count == 0;
+    if (count == ring.size())
+    {
+        std::vector<Protocol::FramePtr> larger(ring.size() * 2);
+        for (std::size_t i = 0; i < count; i++)
+        {
+            larger[i] = std::move(at(i));
+        }
+        ring.swap(larger);
+        head = 0;
+    }
+    byteCount += frame->size();
+    at(count++) = std::move(frame);
+    return idle;
+}
+
+GatherBuffers FrameQueue::gather()
+{
+    buffers.clear();
+    std::size_t bytes = 0;
+    for (std::size_t i = 0; i < count; i++)
+    {
+        auto &frame = at(i);
+        if (buffers.size() == MAX_GATHER_BUFFERS ||
+            (!buffers.empty() && bytes + frame->size() > MAX_GATHER_BYTES))
+        {
+            break;
+        }
+        buffers.push_back(boost::asio::buffer(frame->data(), frame->size()));
+        bytes += frame->size();
+    }
+    inFlight = buffers.size();
+    return GatherBuffers(buffers.data(), buffers.data() + buffers.size());
+}
+
+bool FrameQueue::pop()
+{
+    for (std::size_t i = 0; i < inFlight; i++)
+    {
+        byteCount -= at(0)->size();
+        at(0).reset();
+        head = (head + 1) & (ring.size() - 1);
+        count--;
+    }
+    inFlight = 0;
+    return count > 0;
+}
+
+bool FrameQueue::full(std::size_t incoming) const
+{
+    if (count == 0)
+    {
+        return false;
+    }
+    return count >= maxFrames || byteCount + incoming > maxBytes;
+}
+
+bool FrameQueue::exceeds(std::size_t incoming, std::size_t factor) const
+{
+    if (count == 0)
+    {
+        return false;
+    }
+    // 上限默认为最大值，乘以factor会溢出，因此以除法比较
+    return count / factor >= maxFrames || (byteCount + incoming) / factor > maxBytes;
+}
+
+bool FrameQueue::belowLowWatermark() const
+{
+    return count <= maxFrames / 2 && byteCount <= maxBytes / 2;
+}
+
+bool FrameQueue::dropOldest()
+{
+    if (count <= inFlight)
+    {
+        return false;
+    }
+    // 被丢弃的是第inFlight个frame，把它之前正在发送的frame依次后移一位
+    byteCount -= at(inFlight)->size();
+    for (std::size_t i = inFlight; i > 0; i--)
+    {
+        at(i) = std::move(at(i - 1));
+    }
+    at(0).reset();
+    head = (head + 1) & (ring.size() - 1);
+    count--;
+    return true;
+}
+
+Protocol::FramePtr FrameQueue::take()
+{
+    Protocol::FramePtr frame = std::move(at(0));
+    byteCount -= frame->size();
+    head = (head + 1) & (ring.size() - 1);
+    count--;
+    return frame;
+}
+
+const Protocol::FramePtr &FrameQueue::peek(std::size_t i)
+{
+    return at(i);
+}
+
+bool FrameQueue::empty() const
+{
+    return count == 0;
+}
+
+std::size_t FrameQueue::size() const
+{
+    return count;
+}
+
+std::size_t FrameQueue::bytes() const
+{
+    return byteCount;
+}
+
+std::size_t FrameQueue::sending() const
+{
+    return inFlight;
+}
+
+Protocol::FramePtr &FrameQueue::at(std::size_t i)
+{
+    return ring[(head + i) & (ring.size() - 1)];
+}
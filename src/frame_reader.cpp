@@ -0,0 +1,112 @@
+#include "frame_reader.hpp"
+#include <cstring>
+#include <algorithm>
+
+FrameReader::FrameReader(std::size_t initialCapacity, std::uint32_t maxBody)
+    : buffer(std::max<std::size_t>(initialCapacity, Protocol::V2_HEADER_MAX_LENGTH)),
+      head(0),
+      tail(0),
+      capacity(buffer.size()),
+      maxBodyLength(maxBody)
+{
+}
+
+void FrameReader::setMaxBodyLength(std::uint32_t maxBody)
+{
+    maxBodyLength = maxBody;
+}
+
+boost::asio::mutable_buffer FrameReader::prepare()
+{
+    if (head == tail)
+    {
+        head = tail = 0;
+        if (buffer.size() > std::max(capacity, RETAIN_CAPACITY))
+        {
+            // 大的package已经解析完，释放为它扩容的内存
+            std::vector<std::uint8_t>(capacity).swap(buffer);
+        }
+    }
+
+    // 当前未解析完的package需要的总长度，header不完整时至少要能放下一个最长的header
+    std::size_t required = Protocol::V2_HEADER_MAX_LENGTH;
+    Protocol::Header header;
+    if (decodeHeader(header))
+    {
+        required = header.size + header.length;
+    }
+
+    if (buffer.size() - head < required)
+    {
+        // 尾部空间不足以放下这个package，把未解析的数据挪到头部
+        if (head > 0)
+        {
+            std::memmove(buffer.data(), buffer.data() + head, size());
+            tail -= head;
+            head = 0;
+        }
+        // 已读满时才扩容，分配的内存不超过已到达数据的两倍，只发来header的连接不会使server按声明的长度分配
+        if (tail == buffer.size())
+        {
+            buffer.resize(std::min(required, buffer.size() * 2));
+        }
+    }
+    return boost::asio::buffer(buffer.data() + tail, buffer.size() - tail);
+}
+
+void FrameReader::commit(std::size_t len)
+{
+    tail += len;
+}
+
+bool FrameReader::next(Protocol::Package &pkg)
+{
+    Protocol::PackageView view;
+    if (!next(view))
+    {
+        return false;
+    }
+    pkg.type = view.type;
+    pkg.length = view.length;
+    pkg.flags = view.flags;
+    pkg.body.assign(view.body.begin(), view.body.end());
+    return true;
+}
+
+bool FrameReader::next(Protocol::PackageView &view)
+{
+    Protocol::Header header;
+    if (!decodeHeader(header) || size() < header.size + header.length)
+    {
+        return false;
+    }
+    view.type = header.type;
+    view.length = header.length;
+    view.flags = header.flags;
+    view.body = std::string_view(reinterpret_cast<const char *>(buffer.data() + head + header.size), header.length);
+    head += header.size + header.length;
+    return true;
+}
+
+std::size_t FrameReader::size() const
+{
+    return tail - head;
+}
+
+boost::asio::const_buffer FrameReader::data() const
+{
+    return boost::asio::buffer(buffer.data() + head, size());
+}
+
+bool FrameReader::decodeHeader(Protocol::Header &header) const
+{
+    if (!Protocol::decodeHeader(buffer.data() + head, size(), header))
+    {
+        return false;
+    }
+    if (header.length > maxBodyLength)
+    {
+        throw Protocol::invalid_length();
+    }
+    return true;
+}
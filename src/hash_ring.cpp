@@ -0,0 +1,48 @@
+#include "hash_ring.hpp"
+#include <algorithm>
+
+HashRing::HashRing(const std::vector<std::string> &nodeNames, unsigned int virtualNodes)
+    : nodes(nodeNames.size())
+{
+    points.reserve(nodeNames.size() * virtualNodes);
+    for (unsigned int i = 0; i < nodeNames.size(); i++)
+    {
+        for (unsigned int v = 0; v < virtualNodes; v++)
+        {
+            points.emplace_back(hash(nodeNames[i] + "#" + std::to_string(v)), i);
+        }
+    }
+    std::sort(points.begin(), points.end());
+}
+
+unsigned int HashRing::owner(std::string_view key) const
+{
+    if (points.empty())
+    {
+        return 0;
+    }
+    auto it = std::lower_bound(points.begin(), points.end(), std::make_pair(hash(key), 0u));
+    return it == points.end() ? points.front().second : it->second;
+}
+
+std::size_t HashRing::nodeCount() const
+{
+    return nodes;
+}
+
+std::uint64_t HashRing::hash(std::string_view key)
+{
+    std::uint64_t value = 0xcbf29ce484222325ull;
+    for (unsigned char c : key)
+    {
+        value ^= c;
+        value *= 0x100000001b3ull;
+    }
+    // splitmix64的finalizer
+    value ^= value >> 30;
+    value *= 0xbf58476d1ce4e5b9ull;
+    value ^= value >> 27;
+    value *= 0x94d049bb133111ebull;
+    value ^= value >> 31;
+    return value;
+}
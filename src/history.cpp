@@ -0,0 +1,401 @@
+#include "history.hpp"
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <system_error>
+
+namespace
+{
+    constexpr char SEGMENT_MAGIC[8] = {'T', 'P', 'H', 'I', 'S', 'T', '0', '1'};
+    constexpr char SEGMENT_SUFFIX[] = ".seg";
+    // 十六进制编码后的目录名不超过NAME_MAX
+    constexpr std::size_t NAME_MAX_LENGTH = 120;
+
+    // segment文件开头的header，本机字节序
+    struct SegmentHeader
+    {
+        char magic[8];
+        std::uint64_t first;     // 起始序号
+        std::uint64_t count;     // frame个数
+        std::uint64_t end;       // 已写入的字节数（含header）
+        std::uint64_t lastNanos; // 最后一次写入的时间，system_clock
+        std::uint64_t reserved[3];
+    };
+    static_assert(sizeof(SegmentHeader) == 64, "segment header must be 64 bytes");
+
+    [[noreturn]] void fail(const std::string &what)
+    {
+        throw std::system_error(errno, std::system_category(), what);
+    }
+
+    std::uint64_t nowNanos()
+    {
+        return static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                              std::chrono::system_clock::now().time_since_epoch())
+                                              .count());
+    }
+
+    std::string hexName(const std::string &name)
+    {
+        static const char digits[] = "0123456789abcdef";
+        std::string hex;
+        hex.reserve(name.size() * 2);
+        for (unsigned char c : name)
+        {
+            hex.push_back(digits[c >> 4]);
+            hex.push_back(digits[c & 0xF]);
+        }
+        return hex;
+    }
+
+    // 文件名为20位的起始序号，按字典序即按序号排列
+    std::string segmentPath(const std::string &directory, std::uint64_t first)
+    {
+        std::string number = std::to_string(first);
+        return directory + "/" + std::string(20 - number.size(), '0') + number + SEGMENT_SUFFIX;
+    }
+
+    // 从data开始的一个完整frame的长度，数据不足或header不合法时返回0
+    std::size_t frameLength(const std::uint8_t *data, std::size_t size)
+    {
+        Protocol::Header header;
+        try
+        {
+            if (!Protocol::decodeHeader(data, size, header) || header.size + header.length > size)
+            {
+                return 0;
+            }
+        }
+        catch (const Protocol::invalid_length &)
+        {
+            return 0;
+        }
+        return header.size + header.length;
+    }
+}
+
+// ---------------- Class ChannelHistory::Segment ------------------------------
+
+// 一个映射到内存的segment文件
+class ChannelHistory::Segment
+{
+private:
+    std::uint8_t *base;
+    std::size_t capacity;
+    SegmentHeader *header;
+    std::vector<std::uint64_t> index; // 第i项为第i * INDEX_INTERVAL个frame的偏移
+
+    Segment(std::string filePath, std::uint8_t *memory, std::size_t size)
+        : base(memory),
+          capacity(size),
+          header(reinterpret_cast<SegmentHeader *>(memory)),
+          path(std::move(filePath))
+    {
+    }
+
+    static std::uint8_t *map(const std::string &path, int fd, std::size_t size)
+    {
+        void *memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (memory == MAP_FAILED)
+        {
+            int error = errno;
+            ::close(fd);
+            errno = error;
+            fail("mmap " + path);
+        }
+        ::close(fd); // 映射在关闭fd之后依然有效
+        return static_cast<std::uint8_t *>(memory);
+    }
+
+public:
+    const std::string path;
+
+    ~Segment()
+    {
+        munmap(base, capacity);
+    }
+
+    // 创建一个空的segment，文件大小为size（稀疏文件，未写入的部分不占用磁盘）
+    static std::shared_ptr<Segment> create(const std::string &path, std::uint64_t first, std::size_t size)
+    {
+        int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0)
+        {
+            fail("open " + path);
+        }
+        if (ftruncate(fd, static_cast<off_t>(size)) != 0)
+        {
+            int error = errno;
+            ::close(fd);
+            errno = error;
+            fail("ftruncate " + path);
+        }
+        std::shared_ptr<Segment> segment(new Segment(path, map(path, fd, size), size));
+        std::memcpy(segment->header->magic, SEGMENT_MAGIC, sizeof(SEGMENT_MAGIC));
+        segment->header->first = first;
+        segment->header->count = 0;
+        segment->header->end = sizeof(SegmentHeader);
+        segment->header->lastNanos = 0;
+        return segment;
+    }
+
+    /**
+     * 打开已有的segment，逐个解析frame重建索引；header中的计数与实际内容不一致时（写入中途退出）以实际内容为准
+     * 不是segment文件时返回空
+     */
+    static std::shared_ptr<Segment> open(const std::string &path)
+    {
+        int fd = ::open(path.c_str(), O_RDWR | O_CLOEXEC);
+        if (fd < 0)
+        {
+            fail("open " + path);
+        }
+        off_t size = lseek(fd, 0, SEEK_END);
+        if (size < static_cast<off_t>(sizeof(SegmentHeader)))
+        {
+            ::close(fd);
+            return nullptr;
+        }
+        std::shared_ptr<Segment> segment(new Segment(path, map(path, fd, static_cast<std::size_t>(size)),
+                                                     static_cast<std::size_t>(size)));
+        SegmentHeader &header = *segment->header;
+        if (std::memcmp(header.magic, SEGMENT_MAGIC, sizeof(SEGMENT_MAGIC)) != 0)
+        {
+            return nullptr;
+        }
+        // end损坏（小于header）时视为没有frame，避免limit - offset回绕后越界解析
+        std::uint64_t limit = std::max<std::uint64_t>(std::min<std::uint64_t>(header.end, segment->capacity),
+                                                      sizeof(SegmentHeader));
+        std::uint64_t offset = sizeof(SegmentHeader);
+        std::uint64_t count = 0;
+        while (count < header.count)
+        {
+            std::size_t len = frameLength(segment->base + offset, limit - offset);
+            if (len == 0)
+            {
+                break;
+            }
+            if (count % INDEX_INTERVAL == 0)
+            {
+                segment->index.push_back(offset);
+            }
+            offset += len;
+            count++;
+        }
+        header.count = count;
+        header.end = offset;
+        return segment;
+    }
+
+    std::uint64_t first() const { return header->first; }
+    std::uint64_t count() const { return header->count; }
+    std::uint64_t end() const { return header->end; }
+    std::uint64_t lastNanos() const { return header->lastNanos; }
+    const std::uint8_t *data() const { return base; }
+
+    // frame的字节数（不含header）
+    std::uint64_t bytes() const
+    {
+        return header->end - sizeof(SegmentHeader);
+    }
+
+    bool fits(std::size_t size) const
+    {
+        return header->end + size <= capacity;
+    }
+
+    // 调用方需先以fits()检查剩余空间，返回frame的序号
+    std::uint64_t append(const std::uint8_t *data, std::size_t size, std::uint64_t now)
+    {
+        if (header->count % INDEX_INTERVAL == 0)
+        {
+            index.push_back(header->end);
+        }
+        std::memcpy(base + header->end, data, size);
+        header->end += size;
+        header->lastNanos = now;
+        return header->first + header->count++;
+    }
+
+    // 序号为sequence的frame的偏移，sequence必须在本segment之内
+    std::uint64_t locate(std::uint64_t sequence) const
+    {
+        std::uint64_t relative = sequence - header->first;
+        std::uint64_t offset = index[relative / INDEX_INTERVAL];
+        for (std::uint64_t i = 0; i < relative % INDEX_INTERVAL; i++)
+        {
+            offset += frameLength(base + offset, header->end - offset);
+        }
+        return offset;
+    }
+};
+
+// ---------------- Class ChannelHistory ------------------------------
+
+ChannelHistory::ChannelHistory(const HistoryOptions &opts, const std::string &channelName)
+    : options(opts),
+      totalBytes(0)
+{
+    if (channelName.size() > NAME_MAX_LENGTH)
+    {
+        throw std::system_error(ENAMETOOLONG, std::system_category(), "channel name too long for history");
+    }
+    directory = options.directory + "/" + hexName(channelName);
+    std::filesystem::create_directories(directory);
+
+    std::vector<std::string> paths;
+    for (const auto &entry : std::filesystem::directory_iterator(directory))
+    {
+        if (entry.is_regular_file() && entry.path().extension() == SEGMENT_SUFFIX)
+        {
+            paths.push_back(entry.path().string());
+        }
+    }
+    std::sort(paths.begin(), paths.end());
+    for (const auto &path : paths)
+    {
+        if (auto segment = Segment::open(path))
+        {
+            totalBytes += segment->bytes();
+            segments.push_back(std::move(segment));
+        }
+    }
+    if (segments.empty())
+    {
+        roll(0);
+    }
+    enforceRetention();
+}
+
+ChannelHistory::~ChannelHistory() = default;
+
+bool ChannelHistory::append(const Protocol::Frame &frame, std::uint64_t &sequence)
+{
+    if (frame.size() + sizeof(SegmentHeader) > options.segmentBytes)
+    {
+        return false;
+    }
+    if (!segments.back()->fits(frame.size()))
+    {
+        roll(nextSequence());
+        enforceRetention();
+    }
+    sequence = segments.back()->append(frame.data(), frame.size(), nowNanos());
+    totalBytes += frame.size();
+    return true;
+}
+
+std::uint64_t ChannelHistory::firstSequence() const
+{
+    return segments.front()->first();
+}
+
+std::uint64_t ChannelHistory::nextSequence() const
+{
+    return segments.back()->first() + segments.back()->count();
+}
+
+std::uint64_t ChannelHistory::bytes() const
+{
+    return totalBytes;
+}
+
+ChannelHistory::Range ChannelHistory::read(std::uint64_t from, std::size_t maxFrames, std::size_t maxBytes, bool split,
+                                           std::vector<Protocol::FramePtr> &out)
+{
+    Range range;
+    range.first = range.next = std::min(std::max(from, firstSequence()), nextSequence());
+    // 最后一个起始序号不大于from的segment
+    auto it = std::upper_bound(segments.begin(), segments.end(), range.next,
+                               [](std::uint64_t sequence, const std::shared_ptr<Segment> &segment) {
+                                   return sequence < segment->first();
+                               });
+    if (it != segments.begin())
+    {
+        --it;
+    }
+    std::size_t frames = 0;
+    std::size_t bytes = 0;
+    bool full = false;
+    for (; it != segments.end() && !full; ++it)
+    {
+        const std::shared_ptr<Segment> &segment = *it;
+        std::uint64_t last = segment->first() + segment->count();
+        if (range.next < segment->first())
+        {
+            range.next = segment->first(); // 跳过缺失的segment
+        }
+        if (range.next >= last)
+        {
+            continue;
+        }
+        if (frames == 0)
+        {
+            range.first = range.next;
+        }
+        std::uint64_t offset = segment->locate(range.next);
+        std::uint64_t chunk = offset; // 尚未输出的连续frame的起点
+        while (range.next < last)
+        {
+            std::size_t len = frameLength(segment->data() + offset, segment->end() - offset);
+            if (frames > 0 && (frames >= maxFrames || bytes + len > maxBytes))
+            {
+                full = true;
+                break;
+            }
+            if (offset > chunk && (split || offset + len - chunk > CHUNK_BYTES))
+            {
+                out.push_back(Protocol::makeFrameView(segment->data() + chunk, offset - chunk, segment));
+                chunk = offset;
+            }
+            offset += len;
+            bytes += len;
+            frames++;
+            range.next++;
+        }
+        if (offset > chunk)
+        {
+            out.push_back(Protocol::makeFrameView(segment->data() + chunk, offset - chunk, segment));
+        }
+    }
+    return range;
+}
+
+void ChannelHistory::enforceRetention()
+{
+    std::uint64_t now = nowNanos();
+    auto maxAge = static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(options.maxAge).count());
+    auto expired = [&](const Segment &segment) {
+        return maxAge > 0 && segment.count() > 0 && now - std::min(now, segment.lastNanos()) > maxAge;
+    };
+    // 正在写入的segment过期时先换一个新的segment，使其可以被删除
+    if (expired(*segments.back()))
+    {
+        roll(nextSequence());
+    }
+    while (segments.size() > 1 && (totalBytes > options.maxBytes || expired(*segments.front())))
+    {
+        auto segment = std::move(segments.front());
+        segments.pop_front();
+        totalBytes -= segment->bytes();
+        // 已映射的内存在引用它的Frame释放之前依然有效
+        std::error_code ec;
+        std::filesystem::remove(segment->path, ec);
+    }
+}
+
+void ChannelHistory::roll(std::uint64_t first)
+{
+    if (!segments.empty() && segments.back()->count() == 0)
+    {
+        // 空的segment（例如大小已不够一个frame）直接替换
+        std::error_code ec;
+        std::filesystem::remove(segments.back()->path, ec);
+        segments.pop_back();
+    }
+    segments.push_back(Segment::create(segmentPath(directory, first), first, options.segmentBytes));
+}
@@ -0,0 +1,65 @@
+#include "metrics.hpp"
+#include <iomanip>
+
+MetricsWriter::MetricsWriter(std::string metricPrefix)
+    : prefix(std::move(metricPrefix))
+{
+    out << std::setprecision(12);
+}
+
+void MetricsWriter::describe(const std::string &name, const std::string &type, const std::string &help)
+{
+    out << "# HELP " << prefix << name << " " << help << "\n";
+    out << "# TYPE " << prefix << name << " " << type << "\n";
+}
+
+void MetricsWriter::sample(const std::string &name, double value, const std::string &labels)
+{
+    out << prefix << name;
+    if (!labels.empty())
+    {
+        out << "{" << labels << "}";
+    }
+    out << " " << value << "\n";
+}
+
+void MetricsWriter::histogram(const std::string &name, const Histogram &histogram, const std::string &labels)
+{
+    std::string separator = labels.empty() ? "" : ",";
+    for (unsigned int shift = 8; shift <= 30; shift += 2)
+    {
+        std::uint64_t bound = std::uint64_t(1) << shift;
+        out << prefix << name << "_bucket{" << labels << separator << "le=\"" << bound / 1e9 << "\"} "
+            << histogram.countBelow(bound) << "\n";
+    }
+    out << prefix << name << "_bucket{" << labels << separator << "le=\"+Inf\"} " << histogram.count() << "\n";
+    sample(name + "_sum", histogram.sum() / 1e9, labels);
+    sample(name + "_count", static_cast<double>(histogram.count()), labels);
+}
+
+std::string MetricsWriter::escape(const std::string &value)
+{
+    std::string escaped;
+    for (char c : value)
+    {
+        if (c == '\\' || c == '"')
+        {
+            escaped += '\\';
+            escaped += c;
+        }
+        else if (c == '\n')
+        {
+            escaped += "\\n";
+        }
+        else
+        {
+            escaped += c;
+        }
+    }
+    return escaped;
+}
+
+std::string MetricsWriter::str() const
+{
+    return out.str();
+}
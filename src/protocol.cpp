@@ -1,15 +1,17 @@
 #include "protocol.hpp"
+#include "frame_pool.hpp"
 #include <stdexcept>
-#include <glog/logging.h>
+#include <cstring>
+#include <algorithm>
 
 using namespace Protocol;
 
-Package Protocol::encodePackage(const std::string &msg)
+Package Protocol::encodePackage(std::string_view msg)
 {
     return encodePackage(Type::MESSAGE, msg);
 }
 
-Package Protocol::encodePackage(Type type, const std::string &content)
+Package Protocol::encodePackage(Type type, std::string_view content, Version version)
 {
     Package pkg;
     if (!checkType(type))
@@ -17,21 +19,29 @@ Package Protocol::encodePackage(Type type, const std::string &content)
         throw invalid_type();
     }
     pkg.type = static_cast<std::uint16_t>(type);
-    if (content.size() > BODY_MAX_LENGTH)
+    if (content.size() > bodyMaxLength(version))
     {
         throw invalid_length();
     }
-    pkg.length = static_cast<std::uint16_t>(content.size());
+    pkg.length = static_cast<std::uint32_t>(content.size());
     pkg.body = std::vector<std::uint8_t>(content.begin(), content.end());
     return pkg;
 }
 
+std::uint32_t Protocol::bodyMaxLength(Version version)
+{
+    return version == Version::V1 ? BODY_MAX_LENGTH : V2_BODY_MAX_LENGTH;
+}
+
 Type Protocol::decodePackage(const Package &pkg)
 {
-    if (pkg.length != pkg.body.size())
+    return decodePackage(pkg.view());
+}
+
+Type Protocol::decodePackage(const PackageView &pkg)
+{
+    if (pkg.length != pkg.body.size() || pkg.length > V2_BODY_MAX_LENGTH)
     {
-        LOG(ERROR) << "package.length = " << pkg.length << ", pakcage.body.length = " << pkg.body.size();
-        LOG(ERROR) << "pakcage.body = " << std::string(pkg.body.begin(), pkg.body.end());
         throw invalid_length();
     }
     Type type = static_cast<Type>(pkg.type);
@@ -41,3 +51,581 @@ Type Protocol::decodePackage(const Package &pkg)
     }
     return type;
 }
+
+Frame::Frame(std::size_t size)
+    : storage(static_cast<std::uint8_t *>(FramePool::allocate(size))),
+      capacity(size),
+      bytes(storage),
+      length(size)
+{
+}
+
+Frame::Frame(const std::uint8_t *external, std::size_t size)
+    : storage(nullptr),
+      capacity(0),
+      bytes(const_cast<std::uint8_t *>(external)),
+      length(size)
+{
+}
+
+Frame::~Frame()
+{
+    if (storage)
+    {
+        FramePool::deallocate(storage, capacity);
+    }
+}
+
+void Frame::trim(std::size_t offset, std::size_t size)
+{
+    bytes = storage + offset;
+    length = size;
+}
+
+std::shared_ptr<Frame> Protocol::makeFrame(std::size_t size)
+{
+    return std::allocate_shared<Frame>(PoolAllocator<Frame>(), size);
+}
+
+namespace
+{
+    // 把value以varint(LEB128)编码写入out（至少5个字节），返回写入的字节数
+    std::size_t writeVarint(std::uint32_t value, std::uint8_t *out)
+    {
+        std::size_t pos = 0;
+        while (value >= 0x80)
+        {
+            out[pos++] = static_cast<std::uint8_t>(value | 0x80);
+            value >>= 7;
+        }
+        out[pos++] = static_cast<std::uint8_t>(value);
+        return pos;
+    }
+
+    // 持有所引用内存的所有者，frame销毁时才释放
+    class FrameView : public Frame
+    {
+    private:
+        std::shared_ptr<const void> owner;
+
+    public:
+        FrameView(const std::uint8_t *data, std::size_t size, std::shared_ptr<const void> keeper)
+            : Frame(data, size),
+              owner(std::move(keeper))
+        {
+        }
+    };
+}
+
+FramePtr Protocol::makeFrameView(const std::uint8_t *data, std::size_t size, std::shared_ptr<const void> owner)
+{
+    return std::allocate_shared<FrameView>(PoolAllocator<FrameView>(), data, size, std::move(owner));
+}
+
+bool Protocol::decodeHeader(const std::uint8_t *data, std::size_t size, Header &header)
+{
+    if (size == 0)
+    {
+        return false;
+    }
+    if (data[0] != V2_MAGIC)
+    {
+        if (size < HEADER_LENGTH)
+        {
+            return false;
+        }
+        std::uint16_t length;
+        std::memcpy(&header.type, data, sizeof(header.type));
+        std::memcpy(&length, data + sizeof(header.type), sizeof(length));
+        header.version = Version::V1;
+        header.flags = 0;
+        header.length = length;
+        header.size = HEADER_LENGTH;
+        return true;
+    }
+
+    // magic(1) + flags(1) + type(2) + varint(1~5)
+    if (size < 5)
+    {
+        return false;
+    }
+    std::uint32_t length = 0;
+    std::size_t pos = 4;
+    for (unsigned int shift = 0;; shift += 7)
+    {
+        if (pos == size)
+        {
+            return false;
+        }
+        if (pos == V2_HEADER_MAX_LENGTH)
+        {
+            throw invalid_length();
+        }
+        std::uint8_t byte = data[pos++];
+        if (shift == 28 && byte > 0x0F)
+        {
+            throw invalid_length();
+        }
+        length |= static_cast<std::uint32_t>(byte & 0x7F) << shift;
+        if (!(byte & 0x80))
+        {
+            break;
+        }
+    }
+    if (length > V2_BODY_MAX_LENGTH)
+    {
+        throw invalid_length();
+    }
+    header.version = Version::V2;
+    header.flags = data[1];
+    header.type = static_cast<std::uint16_t>((data[2] << 8) | data[3]);
+    header.length = length;
+    header.size = pos;
+    return true;
+}
+
+std::size_t Protocol::headerLength(Version version, std::uint32_t length)
+{
+    if (version == Version::V1)
+    {
+        return HEADER_LENGTH;
+    }
+    std::size_t size = 5;
+    while (length >= 0x80)
+    {
+        length >>= 7;
+        size++;
+    }
+    return size;
+}
+
+std::size_t Protocol::encodeHeader(Version version, std::uint16_t type, std::uint8_t flags,
+                                   std::uint32_t length, std::uint8_t *out)
+{
+    if (length > bodyMaxLength(version))
+    {
+        throw invalid_length();
+    }
+    if (version == Version::V1)
+    {
+        std::uint16_t len = static_cast<std::uint16_t>(length);
+        std::memcpy(out, &type, sizeof(type));
+        std::memcpy(out + sizeof(type), &len, sizeof(len));
+        return HEADER_LENGTH;
+    }
+    out[0] = V2_MAGIC;
+    out[1] = flags;
+    out[2] = static_cast<std::uint8_t>(type >> 8);
+    out[3] = static_cast<std::uint8_t>(type);
+    std::size_t pos = 4;
+    while (length >= 0x80)
+    {
+        out[pos++] = static_cast<std::uint8_t>(length | 0x80);
+        length >>= 7;
+    }
+    out[pos++] = static_cast<std::uint8_t>(length);
+    return pos;
+}
+
+std::size_t Protocol::encodeTo(Version version, Type type, std::uint8_t flags,
+                               const std::uint8_t *body, std::size_t length,
+                               std::uint8_t *out, std::size_t capacity)
+{
+    if (!checkType(type))
+    {
+        throw invalid_type();
+    }
+    if (length > bodyMaxLength(version))
+    {
+        throw invalid_length();
+    }
+    std::uint32_t len = static_cast<std::uint32_t>(length);
+    std::size_t headerSize = headerLength(version, len);
+    if (capacity < headerSize + length)
+    {
+        throw invalid_length();
+    }
+    encodeHeader(version, static_cast<std::uint16_t>(type), flags, len, out);
+    if (length > 0)
+    {
+        std::memcpy(out + headerSize, body, length);
+    }
+    return headerSize + length;
+}
+
+FramePtr Protocol::encodeFrame(const Package &pkg, Version version)
+{
+    return encodeFrame(pkg.view(), version);
+}
+
+FramePtr Protocol::encodeFrame(const PackageView &pkg, Version version)
+{
+    decodePackage(pkg);
+    if (pkg.length > bodyMaxLength(version))
+    {
+        throw invalid_length();
+    }
+    std::size_t headerSize = headerLength(version, pkg.length);
+    auto frame = makeFrame(headerSize + pkg.body.size());
+    encodeHeader(version, pkg.type, pkg.flags, pkg.length, frame->data());
+    std::memcpy(frame->data() + headerSize, pkg.body.data(), pkg.body.size());
+    return frame;
+}
+
+FramePtr Protocol::encodeFrame(Type type, std::string_view body, Version version)
+{
+    return FrameBuilder(type, version, body.size()).append(body).finish();
+}
+
+FrameBuilder::FrameBuilder(Type frameType, Version frameVersion, std::size_t capacity, std::uint8_t frameFlags)
+    : type(frameType),
+      version(frameVersion),
+      flags(frameFlags),
+      reserved(frameVersion == Version::V1 ? HEADER_LENGTH : V2_HEADER_MAX_LENGTH),
+      used(0)
+{
+    if (!checkType(type))
+    {
+        throw invalid_type();
+    }
+    frame = makeFrame(reserved + std::min<std::size_t>(capacity, bodyMaxLength(version)));
+}
+
+std::uint8_t *FrameBuilder::prepare(std::size_t n)
+{
+    if (n > bodyMaxLength(version) - used)
+    {
+        throw invalid_length();
+    }
+    std::size_t required = reserved + used + n;
+    if (frame->size() < required)
+    {
+        // 按两倍扩容，避免逐段append时反复复制
+        auto larger = makeFrame(std::max(required, std::min<std::size_t>(frame->size() * 2, reserved + bodyMaxLength(version))));
+        std::memcpy(larger->data() + reserved, frame->data() + reserved, used);
+        frame = std::move(larger);
+    }
+    return frame->data() + reserved + used;
+}
+
+void FrameBuilder::commit(std::size_t n)
+{
+    used += n;
+}
+
+FrameBuilder &FrameBuilder::append(std::string_view text)
+{
+    if (!text.empty())
+    {
+        std::memcpy(prepare(text.size()), text.data(), text.size());
+        commit(text.size());
+    }
+    return *this;
+}
+
+std::size_t FrameBuilder::size() const
+{
+    return used;
+}
+
+FramePtr FrameBuilder::finish()
+{
+    std::uint32_t length = static_cast<std::uint32_t>(used);
+    std::size_t headerSize = headerLength(version, length);
+    std::size_t offset = reserved - headerSize;
+    encodeHeader(version, static_cast<std::uint16_t>(type), flags, length, frame->data() + offset);
+    frame->trim(offset, headerSize + used);
+    return std::move(frame);
+}
+
+Version Protocol::frameVersion(const Frame &frame)
+{
+    return frame.size() > 0 && frame.data()[0] == V2_MAGIC ? Version::V2 : Version::V1;
+}
+
+FramePtr Protocol::convertFrame(const FramePtr &frame, Version version)
+{
+    if (frameVersion(*frame) == version)
+    {
+        return frame;
+    }
+    Header header;
+    if (!decodeHeader(frame->data(), frame->size(), header))
+    {
+        throw invalid_length();
+    }
+    std::string_view body(reinterpret_cast<const char *>(frame->data() + header.size), header.length);
+    std::uint8_t flags = header.flags;
+    if (version == Version::V1 && (flags & FLAG_CHANNEL))
+    {
+        readChannelId(body);
+        flags &= static_cast<std::uint8_t>(~FLAG_CHANNEL);
+    }
+    std::uint32_t length = static_cast<std::uint32_t>(body.size());
+    std::size_t headerSize = headerLength(version, length);
+    auto converted = makeFrame(headerSize + length);
+    encodeHeader(version, header.type, flags, length, converted->data());
+    std::memcpy(converted->data() + headerSize, body.data(), body.size());
+    return converted;
+}
+
+std::uint16_t Protocol::frameType(const Frame &frame)
+{
+    Header header;
+    if (!decodeHeader(frame.data(), frame.size(), header))
+    {
+        throw invalid_length();
+    }
+    return header.type;
+}
+
+std::size_t Protocol::batchEntryLength(std::size_t messageLength)
+{
+    std::size_t size = 1;
+    for (std::size_t length = messageLength; length >= 0x80; length >>= 7)
+    {
+        size++;
+    }
+    return size + messageLength;
+}
+
+void Protocol::appendBatchEntry(FrameBuilder &builder, std::string_view message)
+{
+    if (message.size() > V2_BODY_MAX_LENGTH)
+    {
+        throw invalid_length();
+    }
+    std::size_t total = batchEntryLength(message.size());
+    std::uint8_t *out = builder.prepare(total);
+    std::size_t pos = 0;
+    std::size_t length = message.size();
+    while (length >= 0x80)
+    {
+        out[pos++] = static_cast<std::uint8_t>(length | 0x80);
+        length >>= 7;
+    }
+    out[pos++] = static_cast<std::uint8_t>(length);
+    std::memcpy(out + pos, message.data(), message.size());
+    builder.commit(total);
+}
+
+bool BatchReader::next(std::string_view &message)
+{
+    if (rest.empty())
+    {
+        return false;
+    }
+    std::uint32_t length = 0;
+    std::size_t pos = 0;
+    for (unsigned int shift = 0;; shift += 7)
+    {
+        // 与v2 header的长度字段相同，最多5个字节
+        if (pos == rest.size() || pos == 5)
+        {
+            throw invalid_length();
+        }
+        std::uint8_t byte = static_cast<std::uint8_t>(rest[pos++]);
+        if (shift == 28 && byte > 0x0F)
+        {
+            throw invalid_length();
+        }
+        length |= static_cast<std::uint32_t>(byte & 0x7F) << shift;
+        if (!(byte & 0x80))
+        {
+            break;
+        }
+    }
+    if (length > rest.size() - pos)
+    {
+        throw invalid_length();
+    }
+    message = rest.substr(pos, length);
+    rest.remove_prefix(pos + length);
+    return true;
+}
+
+std::size_t Protocol::countBatch(std::string_view body)
+{
+    if (body.empty())
+    {
+        throw invalid_length();
+    }
+    BatchReader reader(body);
+    std::string_view message;
+    std::size_t count = 0;
+    while (reader.next(message))
+    {
+        count++;
+    }
+    return count;
+}
+
+std::vector<FramePtr> Protocol::splitBatch(const Frame &frame)
+{
+    Header header;
+    if (!decodeHeader(frame.data(), frame.size(), header) || header.size + header.length != frame.size())
+    {
+        throw invalid_length();
+    }
+    std::string_view body(reinterpret_cast<const char *>(frame.data() + header.size), header.length);
+    if (header.flags & FLAG_CHANNEL)
+    {
+        readChannelId(body);
+    }
+    BatchReader reader(body);
+    std::vector<FramePtr> frames;
+    std::string_view message;
+    while (reader.next(message))
+    {
+        if (message.size() <= BODY_MAX_LENGTH)
+        {
+            frames.push_back(encodeFrame(Type::MESSAGE, message));
+        }
+    }
+    return frames;
+}
+
+std::uint32_t Protocol::readVarint(std::string_view &body)
+{
+    std::uint32_t value = 0;
+    std::size_t pos = 0;
+    for (unsigned int shift = 0;; shift += 7)
+    {
+        if (pos == body.size() || pos == 5)
+        {
+            throw invalid_length();
+        }
+        std::uint8_t byte = static_cast<std::uint8_t>(body[pos++]);
+        if (shift == 28 && byte > 0x0F)
+        {
+            throw invalid_length();
+        }
+        value |= static_cast<std::uint32_t>(byte & 0x7F) << shift;
+        if (!(byte & 0x80))
+        {
+            break;
+        }
+    }
+    body.remove_prefix(pos);
+    return value;
+}
+
+void Protocol::appendVarint(FrameBuilder &builder, std::uint32_t value)
+{
+    std::uint8_t *out = builder.prepare(5);
+    builder.commit(writeVarint(value, out));
+}
+
+std::uint32_t Protocol::readChannelId(std::string_view &body)
+{
+    return readVarint(body);
+}
+
+void Protocol::appendChannelId(FrameBuilder &builder, std::uint32_t channelId)
+{
+    appendVarint(builder, channelId);
+}
+
+FramePtr Protocol::tagFrame(const Frame &frame, std::uint32_t channelId)
+{
+    Header header;
+    if (!decodeHeader(frame.data(), frame.size(), header) || header.size + header.length > frame.size())
+    {
+        throw invalid_length();
+    }
+    std::string_view body(reinterpret_cast<const char *>(frame.data() + header.size), header.length);
+    if (header.flags & FLAG_CHANNEL)
+    {
+        readChannelId(body);
+    }
+    FrameBuilder builder(static_cast<Type>(header.type), Version::V2, body.size() + 5, header.flags | FLAG_CHANNEL);
+    appendChannelId(builder, channelId);
+    builder.append(body);
+    return builder.finish();
+}
+
+FramePtr Protocol::untagFrame(const Frame &frame)
+{
+    Header header;
+    if (!decodeHeader(frame.data(), frame.size(), header) || header.size + header.length > frame.size())
+    {
+        throw invalid_length();
+    }
+    std::string_view body(reinterpret_cast<const char *>(frame.data() + header.size), header.length);
+    if (header.flags & FLAG_CHANNEL)
+    {
+        readChannelId(body);
+    }
+    FrameBuilder builder(static_cast<Type>(header.type), header.version, body.size(),
+                         header.flags & ~FLAG_CHANNEL);
+    builder.append(body);
+    return builder.finish();
+}
+
+FramePtr Protocol::encodeStreamHeader(std::uint32_t streamId, std::size_t frameSize)
+{
+    std::uint8_t id[5];
+    std::size_t idLength = writeVarint(streamId, id);
+    if (frameSize > V2_BODY_MAX_LENGTH - idLength)
+    {
+        throw invalid_length();
+    }
+    auto length = static_cast<std::uint32_t>(idLength + frameSize);
+    std::size_t size = headerLength(Version::V2, length);
+    auto frame = makeFrame(size + idLength);
+    encodeHeader(Version::V2, static_cast<std::uint16_t>(Type::STREAM), 0, length, frame->data());
+    std::memcpy(frame->data() + size, id, idLength);
+    return frame;
+}
+
+FramePtr Protocol::encodeStream(std::uint32_t streamId, std::string_view frame)
+{
+    FrameBuilder builder(Type::STREAM, Version::V2, frame.size() + 5);
+    appendVarint(builder, streamId);
+    builder.append(frame);
+    return builder.finish();
+}
+
+std::uint32_t Protocol::readStream(std::string_view body, std::string_view &frame)
+{
+    std::uint32_t streamId = readVarint(body);
+    Header header;
+    if (!body.empty() &&
+        (!decodeHeader(reinterpret_cast<const std::uint8_t *>(body.data()), body.size(), header) ||
+         header.size + header.length != body.size()))
+    {
+        throw invalid_length();
+    }
+    frame = body;
+    return streamId;
+}
+
+PackageView Protocol::viewFrame(std::string_view frame)
+{
+    Header header;
+    if (!decodeHeader(reinterpret_cast<const std::uint8_t *>(frame.data()), frame.size(), header) ||
+        header.size + header.length > frame.size())
+    {
+        throw invalid_length();
+    }
+    return {header.type, header.length, frame.substr(header.size, header.length), header.flags};
+}
+
+FramePtr Protocol::encodeStreamCredit(std::uint32_t streamId, std::uint32_t bytes)
+{
+    FrameBuilder builder(Type::STREAM_CREDIT, Version::V2, 10);
+    appendVarint(builder, streamId);
+    appendVarint(builder, bytes);
+    return builder.finish();
+}
+
+std::uint32_t Protocol::readStreamCredit(std::string_view body, std::uint32_t &bytes)
+{
+    std::uint32_t streamId = readVarint(body);
+    bytes = readVarint(body);
+    if (!body.empty())
+    {
+        throw invalid_length();
+    }
+    return streamId;
+}
@@ -1,395 +1,3020 @@
 #include "protocol.hpp"
 #include "server.hpp"
+#include "federation.hpp"
+#include "trace.hpp"
+#include "tunnel.hpp"
 #include <boost/asio.hpp>
-#include <unordered_map>
 #include <set>
-#include <queue>
 #include <sstream>
 #include <algorithm>
+#include <cstring>
+#include <limits>
+#include <charconv>
+#include <unistd.h>
 #include <glog/logging.h>
 
-// ---------------- Class Server ------------------------------
+bool parseSlowConsumerPolicy(std::string_view str, SlowConsumerPolicy &policy)
+{
+    if (str == "drop-oldest")
+    {
+        policy = SlowConsumerPolicy::DROP_OLDEST;
+    }
+    else if (str == "drop-newest")
+    {
+        policy = SlowConsumerPolicy::DROP_NEWEST;
+    }
+    else if (str == "disconnect")
+    {
+        policy = SlowConsumerPolicy::DISCONNECT;
+    }
+    else if (str == "pause")
+    {
+        policy = SlowConsumerPolicy::PAUSE_SENDER;
+    }
+    else
+    {
+        return false;
+    }
+    return true;
+}
 
-std::unordered_map<std::string, std::shared_ptr<Channel>> Server::channels{};
-std::set<std::shared_ptr<Participant>> Server::members{};
+std::string_view slowConsumerPolicyName(SlowConsumerPolicy policy)
+{
+    switch (policy)
+    {
+    case SlowConsumerPolicy::DROP_OLDEST:
+        return "drop-oldest";
+    case SlowConsumerPolicy::DROP_NEWEST:
+        return "drop-newest";
+    case SlowConsumerPolicy::DISCONNECT:
+        return "disconnect";
+    case SlowConsumerPolicy::PAUSE_SENDER:
+        return "pause";
+    }
+    return "";
+}
 
-Server::Server(boost::asio::io_context &ioCtx, const boost::asio::ip::tcp::endpoint &endpoint)
-    : acceptor(ioCtx, endpoint)
+// ---------------- Class Server ------------------------------
+
+Server::Server(boost::asio::io_context &ioCtx, const boost::asio::ip::tcp::endpoint &endpoint,
+               const ServerOptions &opts)
+    : Server(std::vector<boost::asio::io_context *>{&ioCtx}, endpoint, opts)
 {
-    LOG(INFO) << "server listen in " << endpoint.address().to_string() << ":" << endpoint.port();
-    accept();
 }
 
-void Server::accept()
+Server::Server(const std::vector<boost::asio::io_context *> &ioContexts,
+               const boost::asio::ip::tcp::endpoint &endpoint,
+               const ServerOptions &opts)
+    : options(opts),
+      registry(ioContexts.size()),
+      droppedOldest(0),
+      droppedNewest(0),
+      disconnected(0),
+      paused(0),
+      startTime(std::chrono::steady_clock::now())
 {
-    acceptor.async_accept([this](std::error_code ec, boost::asio::ip::tcp::socket socket) {
-        if (!ec)
+    if (!options.tls.certFile.empty())
+    {
+#ifdef TCP_PROTO_TLS
+        // 普通客户端的连接不请求证书，tls.caFile只用于节点之间的连接
+        TlsOptions clients = options.tls;
+        clients.caFile.clear();
+        tlsServer = std::make_shared<TlsContext>(TlsRole::SERVER, clients);
+        if (options.nodes.size() > 1)
         {
-            LOG(INFO) << "accept one connection, " << socket.remote_endpoint().address().to_string() << ":" << socket.remote_endpoint().port();
-            auto mem = std::make_shared<Participant>(std::move(socket));
-            members.insert(mem->getPtr());
-            mem->run();
-            accept();
+            tlsPeer = std::make_shared<TlsContext>(TlsRole::CLIENT, options.tls);
+            tlsPeer->announcePeer();
+            if (!options.tls.caFile.empty())
+            {
+                tlsServer->routePeers(std::make_shared<TlsContext>(TlsRole::SERVER, options.tls));
+            }
         }
-    });
+        LOG(INFO) << "TLS enabled, kernel offload "
+                  << (options.tls.kernelOffload && TlsContext::kernelSupported() ? "available" : "unavailable");
+#else
+        throw std::runtime_error("TLS support not compiled in (TCP_PROTO_TLS)");
+#endif
+    }
+    auto bindEndpoint = endpoint;
+    for (unsigned int i = 0; i < ioContexts.size(); i++)
+    {
+        shards.push_back(std::make_unique<Shard>(*this, i, *ioContexts[i], registry.partition(i)));
+        auto &acceptor = shards.back()->acceptor;
+        acceptor.open(bindEndpoint.protocol());
+        acceptor.set_option(boost::asio::ip::tcp::acceptor::reuse_address(true));
+        if (ioContexts.size() > 1)
+        {
+            acceptor.set_option(boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>(true));
+        }
+        acceptor.bind(bindEndpoint);
+        acceptor.listen();
+        // 端口为0时，其余shard绑定到第一个shard实际分配到的端口
+        bindEndpoint = acceptor.local_endpoint();
+    }
+    if (options.nodes.size() > 1)
+    {
+        mesh = std::make_unique<Federation>(*this, options.nodes, options.nodeIndex);
+    }
+    LOG(INFO) << "server listen in " << bindEndpoint.address().to_string() << ":" << bindEndpoint.port()
+              << " with " << shards.size() << " thread(s)";
+    for (auto &shard : shards)
+    {
+        Shard *s = shard.get();
+        s->dispatch([this, s]() { accept(*s); });
+    }
+    if (options.metricsPort != 0)
+    {
+        metricsListener = std::make_unique<MetricsListener>(*this, *ioContexts.front(), options.metricsPort);
+    }
 }
 
-// ---------------- Class Channel ------------------------------
+Server::~Server() = default;
 
-Channel::Channel(std::string channelName)
-    : name(channelName),
-      MAX_CONNECTION_NUM(2)
+unsigned int Server::shardCount()
 {
+    return shards.size();
 }
 
-Channel::Channel(std::string channelName, int num)
-    : name(channelName),
-      MAX_CONNECTION_NUM(num)
+Shard &Server::shard(unsigned int index)
 {
+    return *shards[index];
 }
 
-Channel::~Channel()
+Shard &Server::owner(std::string_view channelName)
 {
-    LOG(INFO) << "destruct this channel: " << name;
+    return *shards[std::hash<std::string_view>{}(channelName) % shards.size()];
 }
 
-bool Channel::ifFull()
+Federation *Server::federation()
 {
-    return connections.size() == MAX_CONNECTION_NUM;
+    return mesh.get();
 }
 
-unsigned int Channel::count()
+std::shared_ptr<TlsContext> Server::tlsContext(bool dialing)
 {
-    return connections.size();
+#ifdef TCP_PROTO_TLS
+    return dialing ? tlsPeer : tlsServer;
+#else
+    return nullptr;
+#endif
 }
 
-std::string Channel::getName()
+Shard &Server::directoryShard()
 {
-    return name;
+    return *shards.front();
 }
 
-std::shared_ptr<Channel> Channel::getPtr()
+ChannelDirectory &Server::channelDirectory()
 {
-    return shared_from_this();
+    return directory;
 }
 
-bool Channel::join(std::shared_ptr<Participant> con)
+boost::asio::ip::tcp::endpoint Server::localEndpoint()
 {
-    if (ifFull())
+    return shards.front()->acceptor.local_endpoint();
+}
+
+const ServerOptions &Server::getOptions()
+{
+    return options;
+}
+
+BackpressureStats Server::backpressureStats()
+{
+    BackpressureStats stats;
+    stats.droppedOldest = droppedOldest.load(std::memory_order_relaxed);
+    stats.droppedNewest = droppedNewest.load(std::memory_order_relaxed);
+    stats.disconnected = disconnected.load(std::memory_order_relaxed);
+    stats.paused = paused.load(std::memory_order_relaxed);
+    return stats;
+}
+
+void Server::countBackpressure(SlowConsumerPolicy policy, std::uint64_t frames)
+{
+    switch (policy)
     {
-        return false;
+    case SlowConsumerPolicy::DROP_OLDEST:
+        droppedOldest.fetch_add(frames, std::memory_order_relaxed);
+        break;
+    case SlowConsumerPolicy::DROP_NEWEST:
+        droppedNewest.fetch_add(frames, std::memory_order_relaxed);
+        break;
+    case SlowConsumerPolicy::DISCONNECT:
+        disconnected.fetch_add(1, std::memory_order_relaxed);
+        break;
+    case SlowConsumerPolicy::PAUSE_SENDER:
+        paused.fetch_add(1, std::memory_order_relaxed);
+        break;
     }
-    connections.insert(con);
-    return true;
 }
 
-bool Channel::send(std::shared_ptr<Participant> self, const Protocol::Package &pkg)
+namespace
 {
-    bool sendAtLeastOneTime = false;
-    for (auto &item : connections)
+    // 指标的名称、类型、说明，以及取值的成员指针
+    template <typename Member>
+    struct MetricField
+    {
+        const char *name;
+        const char *type;
+        const char *help;
+        Member value;
+    };
+
+    // 某个channel在收集时刻的指标
+    struct ChannelSample
+    {
+        std::string name;
+        std::uint64_t members;
+        std::uint64_t messages;
+        std::uint64_t bytesIn;
+        std::uint64_t deliveries;
+        std::uint64_t bytesOut;
+    };
+
+    ChannelSample sampleChannel(Channel &channel)
     {
-        if (item != self)
+        auto &metrics = channel.metrics();
+        return ChannelSample{channel.getName(),
+                             metrics.members.load(std::memory_order_relaxed),
+                             metrics.messages.load(std::memory_order_relaxed),
+                             metrics.bytesIn.load(std::memory_order_relaxed),
+                             metrics.deliveries.load(std::memory_order_relaxed),
+                             metrics.bytesOut.load(std::memory_order_relaxed)};
+    }
+
+    // 同一指标的所有样本必须连续输出，因此按指标而不是按channel遍历
+    void writeChannelMetrics(MetricsWriter &writer, const std::vector<ChannelSample> &samples)
+    {
+        if (samples.empty())
+        {
+            return;
+        }
+        const MetricField<std::uint64_t ChannelSample::*> fields[] = {
+            {"channel_members", "gauge", "Current members of the channel.", &ChannelSample::members},
+            {"channel_messages_total", "counter", "Messages sent to the channel.", &ChannelSample::messages},
+            {"channel_bytes_in_total", "counter", "Bytes of frames sent to the channel.", &ChannelSample::bytesIn},
+            {"channel_deliveries_total", "counter", "Frames fanned out to channel members.", &ChannelSample::deliveries},
+            {"channel_bytes_out_total", "counter", "Bytes of frames fanned out to channel members.", &ChannelSample::bytesOut},
+        };
+        for (auto &field : fields)
         {
-            item->write(pkg);
-            sendAtLeastOneTime = true;
+            writer.describe(field.name, field.type, field.help);
+            for (auto &sample : samples)
+            {
+                writer.sample(field.name, static_cast<double>(sample.*field.value),
+                              "channel=\"" + MetricsWriter::escape(sample.name) + "\"");
+            }
         }
     }
-    return sendAtLeastOneTime;
 }
 
-void Channel::leave(std::shared_ptr<Participant> self)
+void Server::writeMetrics(MetricsWriter &writer)
 {
-    connections.erase(self);
-    if (connections.empty())
+    std::uint64_t accepted = 0, closed = 0, framesIn = 0, bytesIn = 0, framesOut = 0, bytesOut = 0, highWater = 0;
+    std::uint64_t pings = 0, handshakeTimeouts = 0, idleTimeouts = 0, writeStallTimeouts = 0, tunnels = 0, tunnelBytes = 0;
+    std::uint64_t tlsHandshakes = 0, tlsResumed = 0, tlsFailures = 0, tlsOffloaded = 0;
+    Histogram fanout;
+    for (auto &shard : shards)
     {
-        Server::channels.erase(name);
+        auto &metrics = shard->metrics();
+        accepted += metrics.accepted.load(std::memory_order_relaxed);
+        closed += metrics.closed.load(std::memory_order_relaxed);
+        framesIn += metrics.framesIn.load(std::memory_order_relaxed);
+        bytesIn += metrics.bytesIn.load(std::memory_order_relaxed);
+        framesOut += metrics.framesOut.load(std::memory_order_relaxed);
+        bytesOut += metrics.bytesOut.load(std::memory_order_relaxed);
+        highWater = std::max(highWater, metrics.queueBytesHighWater.load(std::memory_order_relaxed));
+        pings += metrics.pings.load(std::memory_order_relaxed);
+        handshakeTimeouts += metrics.handshakeTimeouts.load(std::memory_order_relaxed);
+        idleTimeouts += metrics.idleTimeouts.load(std::memory_order_relaxed);
+        writeStallTimeouts += metrics.writeStallTimeouts.load(std::memory_order_relaxed);
+        tunnels += metrics.tunnels.load(std::memory_order_relaxed);
+        tunnelBytes += metrics.tunnelBytes.load(std::memory_order_relaxed);
+        tlsHandshakes += metrics.tlsHandshakes.load(std::memory_order_relaxed);
+        tlsResumed += metrics.tlsResumed.load(std::memory_order_relaxed);
+        tlsFailures += metrics.tlsFailures.load(std::memory_order_relaxed);
+        tlsOffloaded += metrics.tlsOffloaded.load(std::memory_order_relaxed);
+        metrics.fanoutNanos.snapshot(fanout);
     }
-}
+    double uptime = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
 
-// ---------------- Class Participant ------------------------------
+    writer.describe("uptime_seconds", "gauge", "Seconds since the server started.");
+    writer.sample("uptime_seconds", uptime);
+    writer.describe("shards", "gauge", "Number of shards (event loop threads).");
+    writer.sample("shards", shards.size());
+    writer.describe("connections_accepted_total", "counter", "Accepted connections.");
+    writer.sample("connections_accepted_total", accepted);
+    writer.describe("connections_accept_rate", "gauge", "Average accepted connections per second since start.");
+    writer.sample("connections_accept_rate", uptime > 0 ? accepted / uptime : 0);
+    writer.describe("connections", "gauge", "Open connections.");
+    writer.sample("connections", accepted - std::min(accepted, closed));
+    writer.describe("frames_in_total", "counter", "Frames received from clients.");
+    writer.sample("frames_in_total", framesIn);
+    writer.describe("bytes_in_total", "counter", "Bytes received from clients.");
+    writer.sample("bytes_in_total", bytesIn);
+    writer.describe("frames_out_total", "counter", "Frames written to clients.");
+    writer.sample("frames_out_total", framesOut);
+    writer.describe("bytes_out_total", "counter", "Bytes written to clients.");
+    writer.sample("bytes_out_total", bytesOut);
+    writer.describe("send_queue_bytes_high_water", "gauge", "Largest send queue of any connection, in bytes.");
+    writer.sample("send_queue_bytes_high_water", highWater);
+    writer.describe("slow_consumer_total", "counter", "Times a slow consumer policy was applied.");
+    auto stats = backpressureStats();
+    writer.sample("slow_consumer_total", stats.droppedOldest, "policy=\"drop-oldest\"");
+    writer.sample("slow_consumer_total", stats.droppedNewest, "policy=\"drop-newest\"");
+    writer.sample("slow_consumer_total", stats.disconnected, "policy=\"disconnect\"");
+    writer.sample("slow_consumer_total", stats.paused, "policy=\"pause\"");
+    writer.describe("pings_total", "counter", "Heartbeat PINGs sent to idle connections.");
+    writer.sample("pings_total", pings);
+    writer.describe("connection_timeouts_total", "counter", "Connections closed by a timeout.");
+    writer.sample("connection_timeouts_total", handshakeTimeouts, "reason=\"handshake\"");
+    writer.sample("connection_timeouts_total", idleTimeouts, "reason=\"idle\"");
+    writer.sample("connection_timeouts_total", writeStallTimeouts, "reason=\"write-stall\"");
+    writer.describe("tunnels_total", "counter", "Tunnels paired and handed to the splice forwarder.");
+    writer.sample("tunnels_total", tunnels);
+    writer.describe("tunnel_bytes_total", "counter", "Bytes forwarded through tunnels.");
+    writer.sample("tunnel_bytes_total", tunnelBytes);
+    writer.describe("tls_handshakes_total", "counter", "TLS handshakes by result.");
+    writer.sample("tls_handshakes_total", tlsHandshakes - tlsResumed, "result=\"full\"");
+    writer.sample("tls_handshakes_total", tlsResumed, "result=\"resumed\"");
+    writer.sample("tls_handshakes_total", tlsFailures, "result=\"failed\"");
+    writer.describe("tls_kernel_offload_total", "counter", "TLS connections whose records are encrypted by the kernel.");
+    writer.sample("tls_kernel_offload_total", tlsOffloaded);
+    writer.describe("fanout_seconds", "histogram", "Time to queue one channel message to all members on a shard.");
+    writer.histogram("fanout_seconds", fanout);
+}
 
-Participant::Participant(boost::asio::ip::tcp::socket socket_)
-    : socket(std::move(socket_))
+void Server::collectMetrics(std::function<void(std::string)> done)
 {
-    channel.reset();
+    // 向所有shard收集各自拥有的channel，最后一个完成的shard负责输出
+    auto samples = std::make_shared<std::vector<std::vector<ChannelSample>>>(shards.size());
+    auto remain = std::make_shared<std::atomic<unsigned int>>(shards.size());
+    auto callback = std::make_shared<std::function<void(std::string)>>(std::move(done));
+    for (auto &shard : shards)
+    {
+        Shard *target = shard.get();
+        target->dispatch([this, target, samples, remain, callback]() {
+            target->channels().forEach([&](const std::string &, std::shared_ptr<Channel> &channel) {
+                (*samples)[target->id()].push_back(sampleChannel(*channel));
+            });
+            if (remain->fetch_sub(1) != 1)
+            {
+                return;
+            }
+            std::vector<ChannelSample> all;
+            for (auto &list : *samples)
+            {
+                all.insert(all.end(), list.begin(), list.end());
+            }
+            MetricsWriter writer;
+            writeMetrics(writer);
+            writeChannelMetrics(writer, all);
+            (*callback)(writer.str());
+        });
+    }
 }
 
-Participant::~Participant()
+// 把对端地址打包进trace记录：IPv4地址 << 16 | 端口，IPv6只保留端口
+static std::uint64_t packEndpoint(const boost::asio::ip::tcp::endpoint &endpoint)
 {
-    LOG(INFO) << "destruct participant. remote address is " << socket.remote_endpoint().address().to_string() << ":" << socket.remote_endpoint().port();
+    std::uint64_t address = endpoint.address().is_v4() ? endpoint.address().to_v4().to_uint() : 0;
+    return address << 16 | endpoint.port();
 }
 
-void Participant::run()
+void Server::accept(Shard &shard)
 {
-    readHeader();
+#ifdef TCP_PROTO_IO_URING
+    if (options.engine == SessionEngine::IO_URING)
+    {
+        shard.acceptWithUring();
+        return;
+    }
+#endif
+    // 由accept填入对端地址，无需再调用remote_endpoint()
+    shard.acceptor.async_accept(shard.peer, [this, &shard](std::error_code ec, boost::asio::ip::tcp::socket socket) {
+        if (!ec)
+        {
+            accepted(shard, std::move(socket));
+            accept(shard);
+        }
+    });
 }
 
-std::shared_ptr<Participant> Participant::getPtr()
+void Server::accepted(Shard &shard, boost::asio::ip::tcp::socket socket)
 {
-    return shared_from_this();
+    increment(shard.metrics().accepted);
+    auto mem = std::make_shared<Participant>(std::move(socket), shard, options);
+    mem->run();
+    TRACE(ACCEPT, mem->memberId(), packEndpoint(shard.peer));
 }
 
-void Participant::exit()
+// ---------------- Class Shard ------------------------------
+
+Shard::Shard(Server &srv, unsigned int idx, boost::asio::io_context &ioCtx, Registry::Partition &part)
+    : server(srv),
+      index(idx),
+      ioContext(ioCtx),
+      partition(part),
+      scheduled(false),
+      wheelTimer(ioCtx),
+      wheelStart(std::chrono::steady_clock::now()),
+      ticking(false),
+#ifdef TCP_PROTO_IO_URING
+      acceptOperation(*this, &Shard::onUringAccept),
+#endif
+      acceptor(ioCtx)
 {
-    // 退出channel
-    if (channel)
+#ifdef TCP_PROTO_IO_URING
+    if (srv.getOptions().engine == SessionEngine::IO_URING)
     {
-        channel->leave(shared_from_this());
-        channel.reset();
+        ring = std::make_unique<Uring>(ioCtx);
     }
+#endif
+}
 
-    // socket.close();
-    Server::members.erase(shared_from_this());
+Server &Shard::getServer()
+{
+    return server;
 }
 
-void Participant::write(const Protocol::Package &pkg)
+unsigned int Shard::id()
 {
-    bool actionFlag = !pkgQueue.empty(); // 当队列非空时说明还在执行写操作。
-    pkgQueue.push(pkg);
-    if (!actionFlag)
-    {
-        execWriteAction();
-    }
+    return index;
 }
 
-void Participant::readHeader()
-{
-    auto pkg = std::make_shared<Protocol::Package>();
-    boost::asio::async_read(socket,
-                            std::vector<boost::asio::mutable_buffer>{
-                                boost::asio::buffer(&pkg->type, sizeof(Protocol::Package::type)),
-                                boost::asio::buffer(&pkg->length, sizeof(Protocol::Package::length)),
-                            },
-                            [pkg, this](std::error_code ec, std::size_t len) {
-                                if (!ec)
-                                {
-                                    pkg->body.resize(pkg->length);
-                                    readBody(pkg);
-                                }
-                                else
-                                {
-                                    LOG(ERROR) << "operation failed";
-                                    exit();
-                                }
-                            });
+boost::asio::io_context &Shard::context()
+{
+    return ioContext;
 }
 
-void Participant::readBody(std::shared_ptr<Protocol::Package> pkg)
-{
-    boost::asio::async_read(socket, boost::asio::buffer(pkg->body, pkg->length),
-                            [pkg, this](std::error_code ec, std::size_t len) {
-                                if (!ec)
-                                {
-                                    LOG(INFO) << "async read length = "<< len;
-                                    handle(*pkg);
-                                    readHeader();
-                                }
-                                else
-                                {
-                                    LOG(ERROR) << "operation failed";
-                                    exit();
-                                }
-                            });
+FlatMap<std::shared_ptr<Channel>> &Shard::channels()
+{
+    return partition.channels;
 }
 
-void Participant::execWriteAction()
+bool Shard::addChannel(const std::shared_ptr<Channel> &channel)
 {
-    boost::asio::async_write(socket,
-                             std::vector<boost::asio::const_buffer>{
-                                 boost::asio::buffer(&pkgQueue.front().type, sizeof(Protocol::Package::type)),
-                                 boost::asio::buffer(&pkgQueue.front().length, sizeof(Protocol::Package::length)),
-                                 boost::asio::buffer(pkgQueue.front().body)},
-                             [this](std::error_code ec, std::size_t len) {
-                                 if (!ec)
-                                 {
-                                     pkgQueue.pop();
-                                     if (!pkgQueue.empty())
-                                     {
-                                         execWriteAction();
-                                     }
-                                 }
-                                 else
-                                 {
-                                     LOG(ERROR) << "operation failed";
-                                     exit();
-                                 }
-                             });
+    if (!partition.channels.emplace(channel->getName(), channel).second)
+    {
+        return false;
+    }
+    std::uint32_t slot;
+    if (partition.freeChannelSlots.empty())
+    {
+        slot = partition.channelSlots++;
+    }
+    else
+    {
+        slot = partition.freeChannelSlots.back();
+        partition.freeChannelSlots.pop_back();
+    }
+    channel->channelId = slot * server.shardCount() + index + 1;
+    if (!channel->mirror)
+    {
+        server.directoryShard().dispatch([&srv = server, name = channel->getName()]() { srv.channelDirectory().add(name); });
+    }
+    return true;
 }
 
-void Participant::handle(const Protocol::Package &pkg)
+void Shard::removeChannel(Channel &channel)
 {
-    try
+    // 只删除登记的正是该channel的条目：已删除的channel可能再次收到leave，此时同名的可能已是新建的channel
+    auto found = partition.channels.find(channel.getName());
+    if (found && found->get() == &channel)
     {
-        auto type = Protocol::decodePackage(pkg);
-        switch (type)
+        partition.channels.erase(channel.getName());
+        partition.freeChannelSlots.push_back((channel.id() - 1) / server.shardCount());
+        if (!channel.mirror)
         {
-        case Protocol::Type::MESSAGE: //转发给同一channel的接收方
-            transmit(pkg);
-            break;
+            server.directoryShard().dispatch([&srv = server, name = channel.getName()]() { srv.channelDirectory().remove(name); });
+        }
+    }
+}
 
-        case Protocol::Type::LEAVE_CHANNEL:
-            leaveChannel();
-            break;
+ShardMetrics &Shard::metrics()
+{
+    return shardMetrics;
+}
 
-        case Protocol::Type::LIST_ALL_CHANNELS:
-            listAllChannels();
-            break;
+SlotTable<std::shared_ptr<Participant>> &Shard::members()
+{
+    return partition.members;
+}
 
-        case Protocol::Type::CREATE_CHANNEL:
-            createChannel(std::string(pkg.body.begin(), pkg.body.end()));
-            break;
+TimingWheel &Shard::timers()
+{
+    return wheel;
+}
 
-        case Protocol::Type::JOIN_IN_CHANNEL:
-            joinInChannel(std::string(pkg.body.begin(), pkg.body.end()));
-            break;
+std::uint64_t Shard::now()
+{
+    if (!ticking)
+    {
+        wheel.advance(elapsedTicks());
+    }
+    return wheel.now();
+}
 
-        default:
-            LOG(ERROR) << "unknow type: " << static_cast<std::int16_t>(type);
-            break;
-        }
+void Shard::schedule(TimingWheel::Timer &timer, std::uint64_t deadline)
+{
+    wheel.schedule(timer, deadline);
+    if (!ticking)
+    {
+        ticking = true;
+        tick();
     }
-    catch (const std::exception &e)
+}
+
+// 比较令牌，耗时与两者相同的前缀长度无关
+static bool sameToken(std::string_view a, std::string_view b)
+{
+    if (a.size() != b.size())
+    {
+        return false;
+    }
+    unsigned char difference = 0;
+    for (std::size_t i = 0; i < a.size(); i++)
     {
-        LOG(ERROR) << "[" << e.what() << "]";
+        difference |= static_cast<unsigned char>(a[i] ^ b[i]);
     }
+    return difference == 0;
 }
 
-void Participant::transmit(const Protocol::Package &inputPkg)
+void Shard::tunnel(const std::shared_ptr<Participant> &participant, const std::string &name, const std::string &token,
+                   bool offer)
 {
-    Protocol::Package pkg;
-    if (!channel)
+    const char *error;
+    if (!partition.channels.find(name))
     {
-        pkg = Protocol::encodePackage(Protocol::Type::OTHER_ERROR,
-                                      "Error: did not join any channel");
+        error = "Error: selected channel not exist";
     }
-    else if (channel->count() <= 1)
+    else if (offer)
     {
-        pkg = Protocol::encodePackage(Protocol::Type::OTHER_ERROR,
-                                      "Error: no other members in this channel");
+        tunnelOffers[name].push_back(TunnelOffer{participant, token});
+        return;
     }
     else
     {
-        if (!channel->send(shared_from_this(), inputPkg))
-        {
-            pkg = Protocol::encodePackage(Protocol::Type::OTHER_ERROR,
-                                          "Error: transmit package failed");
-        }
-        else
+        // 令牌不符与没有offer的回复相同，不透露该channel上是否有offer在等待
+        error = "Error: no tunnel offered on this channel";
+        auto found = tunnelOffers.find(name);
+        if (found != tunnelOffers.end())
         {
-            return;
+            auto &offers = found->second;
+            auto matched = std::find_if(offers.begin(), offers.end(),
+                                        [&token](const TunnelOffer &offer) { return sameToken(offer.token, token); });
+            if (matched != offers.end())
+            {
+                auto offered = std::move(matched->participant);
+                offers.erase(matched);
+                if (offers.empty())
+                {
+                    tunnelOffers.erase(found);
+                }
+                openTunnel(offered, participant, name);
+                return;
+            }
         }
     }
-    write(pkg);
+    auto failure = Protocol::encodeFrame(Protocol::Type::TUNNEL_FAILED, error);
+    participant->home().dispatch([participant, failure]() { participant->tunnelFailed(failure); });
 }
 
-void Participant::leaveChannel()
+void Shard::withdrawTunnel(const std::shared_ptr<Participant> &participant, const std::string &name)
 {
-    if (channel)
+    auto found = tunnelOffers.find(name);
+    if (found == tunnelOffers.end())
     {
-        channel->leave(shared_from_this());
-        channel.reset();
-        Protocol::Package pkg;
-        pkg = Protocol::encodePackage(Protocol::Type::SUCCEED_IN_LEAVE_CHANNEL,
-                                      "leaved channel");
-        write(pkg);
+        return; // 已经配对
+    }
+    auto &offers = found->second;
+    offers.erase(std::remove_if(offers.begin(), offers.end(),
+                                [&participant](const TunnelOffer &offer) { return offer.participant == participant; }),
+                 offers.end());
+    if (offers.empty())
+    {
+        tunnelOffers.erase(found);
     }
 }
 
-void Participant::listAllChannels()
+void Shard::openTunnel(const std::shared_ptr<Participant> &offer, const std::shared_ptr<Participant> &connect,
+                       const std::string &name)
 {
-    std::stringstream ss;
-    std::string separator = ", ";
-    auto it = Server::channels.cbegin();
-    if (it != Server::channels.cend())
+    struct Handoff
     {
-        ss << it->first;
-        it++;
-    }
-    for (; it != Server::channels.cend(); it++)
+        int fds[2] = {-1, -1};
+        boost::asio::ip::tcp protocols[2] = {boost::asio::ip::tcp::v4(), boost::asio::ip::tcp::v4()};
+        std::string heads[2]; // 各端在请求之后多发的数据，转给另一端
+        unsigned int arrived = 0;
+    };
+    auto handoff = std::make_shared<Handoff>();
+    auto ready = Protocol::FrameBuilder(Protocol::Type::TUNNEL_READY).append(name).finish();
+    const std::shared_ptr<Participant> ends[2] = {offer, connect};
+    for (int i = 0; i < 2; i++)
     {
-        ss << separator << it->first;
+        auto end = ends[i];
+        auto handedOff = [this, handoff, i](int fd, boost::asio::ip::tcp protocol, std::string head) {
+            dispatch([this, handoff, i, fd, protocol, head = std::move(head)]() mutable {
+                handoff->fds[i] = fd;
+                handoff->protocols[i] = protocol;
+                handoff->heads[i] = std::move(head);
+                if (++handoff->arrived < 2)
+                {
+                    return;
+                }
+                if (handoff->fds[0] >= 0 && handoff->fds[1] >= 0)
+                {
+                    try
+                    {
+                        boost::asio::ip::tcp::socket first(ioContext, handoff->protocols[0], handoff->fds[0]);
+                        handoff->fds[0] = -1;
+                        boost::asio::ip::tcp::socket second(ioContext, handoff->protocols[1], handoff->fds[1]);
+                        handoff->fds[1] = -1;
+                        Tunnel::start(std::move(first), std::move(second), std::move(handoff->heads[1]),
+                                      std::move(handoff->heads[0]), &shardMetrics.tunnelBytes);
+                        increment(shardMetrics.tunnels);
+                    }
+                    catch (const std::exception &e)
+                    {
+                        LOG(WARNING) << "failed to open tunnel: " << e.what();
+                    }
+                }
+                // 一端已断开（或转发未能开始）时关闭另一端
+                for (int fd : handoff->fds)
+                {
+                    if (fd >= 0)
+                    {
+                        ::close(fd);
+                    }
+                }
+            });
+        };
+        end->home().dispatch([end, ready, handedOff]() { end->tunnelPaired(ready, handedOff); });
     }
-    Protocol::Package pkg = Protocol::encodePackage(Protocol::Type::CHANNEL_LIST, ss.str());
-    write(pkg);
 }
 
-void Participant::createChannel(std::string channelName)
+std::uint64_t Shard::elapsedTicks()
 {
-    Protocol::Package pkg;
-    if (channelName.empty() || channelName.find(',') != std::string::npos)
-    {
-        pkg = Protocol::encodePackage(Protocol::Type::FAIL_IN_CREATE_CHANNEL,
-                                      "Error: invalid channel name");
-    }
-    else if (channel)
-    {
-        pkg = Protocol::encodePackage(Protocol::Type::FAIL_IN_CREATE_CHANNEL,
-                                      "Error: already in one channel");
-    }
-    else
-    {
-        auto channelPtr = std::make_shared<Channel>(channelName);
-        auto rlt = Server::channels.emplace(channelName, channelPtr);
-        if (rlt.second)
+    return static_cast<std::uint64_t>((std::chrono::steady_clock::now() - wheelStart) / wheel.tick());
+}
+
+void Shard::tick()
+{
+    wheelTimer.expires_at(wheelStart + wheel.tick() * (wheel.now() + 1));
+    wheelTimer.async_wait([this](std::error_code ec) {
+        if (ec)
         {
-            if (rlt.first->second->join(shared_from_this()))
-            {
-                channel = channelPtr->getPtr();
-                pkg = Protocol::encodePackage(Protocol::Type::SUCCEED_IN_CREATE_CHANNEL,
-                                              "create and join in channel: " + channelName);
-            }
-            else
-            {
-                pkg = Protocol::encodePackage(Protocol::Type::FAIL_IN_CREATE_CHANNEL,
-                                              "Error: failed to join in created channel");
-                Server::channels.erase(rlt.first);
-            }
+            return;
+        }
+        // 线程繁忙时可能一次前进多个tick
+        wheel.advance(std::max(elapsedTicks(), wheel.now() + 1));
+        if (wheel.empty())
+        {
+            ticking = false;
         }
         else
         {
-            pkg = Protocol::encodePackage(Protocol::Type::FAIL_IN_CREATE_CHANNEL,
-                                          "Error: channel already exist");
+            tick();
         }
-    }
-    write(pkg);
+    });
+}
+
+#ifdef TCP_PROTO_IO_URING
+Uring &Shard::uring()
+{
+    return *ring;
+}
+
+void Shard::acceptWithUring()
+{
+    ring->accept(acceptor.native_handle(), acceptOperation);
 }
 
-void Participant::joinInChannel(std::string channelName)
+void Shard::onUringAccept(int result, std::uint32_t flags)
 {
-    Protocol::Package pkg;
-    if (channel)
+    if (result < 0)
     {
-        pkg = Protocol::encodePackage(Protocol::Type::FAIL_IN_JOIN_IN_CHANNEL,
-                                      "already in channel: " + channel->getName());
+        return; // 与async_accept出错时相同，不再accept
     }
-    else
+    boost::system::error_code ec;
+    boost::asio::ip::tcp::socket socket(ioContext);
+    socket.assign(acceptor.local_endpoint(ec).protocol(), result, ec);
+    if (!ec)
     {
-        auto it = Server::channels.find(channelName);
-        if (it != Server::channels.end())
-        {
-            if (it->second->join(shared_from_this()))
-            {
-                channel = it->second->getPtr();
-                pkg = Protocol::encodePackage(Protocol::Type::SUCCEED_IN_JOIN_IN_CHANNEL,
-                                              "join in channel: " + channelName);
-            }
-            else if (it->second->ifFull())
-            {
-                pkg = Protocol::encodePackage(Protocol::Type::FAIL_IN_JOIN_IN_CHANNEL,
-                                              "Error: selected channel is full");
-            }
-            else
-            {
-                pkg = Protocol::encodePackage(Protocol::Type::FAIL_IN_JOIN_IN_CHANNEL,
-                                              "Error: fail to join in selected channel");
-            }
-        }
-        else
+        if constexpr (Trace::enabled(Trace::Event::ACCEPT))
         {
-            pkg = Protocol::encodePackage(Protocol::Type::FAIL_IN_JOIN_IN_CHANNEL,
-                                          "Error: selected channel not exist");
+            // multishot accept的多个完成事件共用同一个地址缓冲区，因此只在需要时单独取得对端地址
+            peer = socket.remote_endpoint(ec);
         }
+        server.accepted(*this, std::move(socket));
+    }
+    if (!(flags & IORING_CQE_F_MORE))
+    {
+        // multishot被内核终止（例如CQ溢出），重新提交
+        acceptWithUring();
+    }
+}
+#endif
+
+void Shard::enqueue(std::function<void()> task)
+{
+    inbox.push(std::move(task));
+    if (!scheduled.exchange(true))
+    {
+        boost::asio::post(ioContext, [this]() { drain(); });
+    }
+}
+
+void Shard::drain()
+{
+    std::function<void()> task;
+    for (unsigned int i = 0; i < DRAIN_BATCH && inbox.pop(task); i++)
+    {
+        task();
     }
+    if (!inbox.empty())
+    {
+        // 让出线程给本shard的socket I/O，剩余的task稍后继续处理
+        boost::asio::post(ioContext, [this]() { drain(); });
+        return;
+    }
+    scheduled.store(false);
+    // 清除标记后再检查一次，避免遗漏在此期间投递进来的task
+    if (!inbox.empty() && !scheduled.exchange(true))
+    {
+        boost::asio::post(ioContext, [this]() { drain(); });
+    }
+}
+
+// ---------------- Class Channel ------------------------------
+
+// 打开channel的历史，未启用或失败时返回空，channel照常工作
+static std::unique_ptr<ChannelHistory> openHistory(const HistoryOptions &options, const std::string &name)
+{
+    if (options.directory.empty())
+    {
+        return nullptr;
+    }
+    try
+    {
+        return std::make_unique<ChannelHistory>(options, name);
+    }
+    catch (const std::exception &e)
+    {
+        LOG(ERROR) << "failed to open history of channel " << name << ": " << e.what();
+        return nullptr;
+    }
+}
+
+Channel::Channel(Shard &owner, std::string channelName)
+    : MAX_CONNECTION_NUM(owner.getServer().getOptions().channelCapacity),
+      name(channelName),
+      channelId(Protocol::NO_CHANNEL),
+      shard(owner),
+      policy(owner.getServer().getOptions().slowConsumerPolicy),
+      shardMembers(owner.getServer().shardCount()),
+      history(openHistory(owner.getServer().getOptions().history, name)),
+      mirror(false)
+{
+}
+
+Channel::Channel(Shard &owner, std::string channelName, int num)
+    : MAX_CONNECTION_NUM(num),
+      name(channelName),
+      channelId(Protocol::NO_CHANNEL),
+      shard(owner),
+      policy(owner.getServer().getOptions().slowConsumerPolicy),
+      shardMembers(owner.getServer().shardCount()),
+      history(openHistory(owner.getServer().getOptions().history, name)),
+      mirror(false)
+{
+}
 
-    write(pkg);
+Channel::Channel(Shard &owner, std::string channelName, std::shared_ptr<Participant> upstreamSession)
+    : MAX_CONNECTION_NUM(owner.getServer().getOptions().channelCapacity),
+      name(channelName),
+      channelId(Protocol::NO_CHANNEL),
+      shard(owner),
+      policy(owner.getServer().getOptions().slowConsumerPolicy),
+      shardMembers(owner.getServer().shardCount()),
+      mirror(true),
+      upstream(std::move(upstreamSession))
+{
+}
+
+Channel::~Channel()
+{
+    TRACE(CHANNEL_DESTROY, std::hash<std::string>{}(name), Trace::packName(name));
+}
+
+bool Channel::ifFull()
+{
+    return connections.size() == MAX_CONNECTION_NUM;
+}
+
+unsigned int Channel::count()
+{
+    return connections.size();
+}
+
+std::string Channel::getName()
+{
+    return name;
+}
+
+std::uint32_t Channel::id()
+{
+    return channelId;
+}
+
+Shard &Channel::owner()
+{
+    return shard;
+}
+
+SlowConsumerPolicy Channel::getPolicy()
+{
+    return policy;
+}
+
+void Channel::setPolicy(SlowConsumerPolicy slowConsumerPolicy)
+{
+    policy = slowConsumerPolicy;
+}
+
+std::shared_ptr<Channel> Channel::getPtr()
+{
+    return shared_from_this();
+}
+
+ChannelMetrics &Channel::metrics()
+{
+    return channelMetrics;
+}
+
+bool Channel::contains(const std::shared_ptr<Participant> &con)
+{
+    return connections.count(con) > 0;
+}
+
+bool Channel::join(std::shared_ptr<Participant> con)
+{
+    if (ifFull())
+    {
+        return false;
+    }
+    connections.insert(con);
+    rebuildMembers(con->home().id());
+    channelMetrics.members.store(connections.size(), std::memory_order_relaxed);
+    TRACE(JOIN, con->memberId(), std::hash<std::string>{}(name));
+    return true;
+}
+
+bool Channel::send(std::shared_ptr<Participant> self, const Protocol::Package &pkg)
+{
+    // 只编码一次，所有接收方共享同一个frame
+    return send(self, Protocol::encodeFrame(pkg));
+}
+
+bool Channel::send(std::shared_ptr<Participant> self, Protocol::FramePtr frame, std::uint64_t messages)
+{
+    bool sendAtLeastOneTime = false;
+    // 整个batch作为一个frame扇出，只有v1的接收方需要拆分
+    bool batch = Protocol::frameType(*frame) == static_cast<std::uint16_t>(Protocol::Type::MESSAGE_BATCH);
+    std::uint64_t recipients = 0;
+    for (unsigned int i = 0; i < shardMembers.size(); i++)
+    {
+        auto members = shardMembers[i];
+        if (!members || (members->size() == 1 && members->front() == self))
+        {
+            continue;
+        }
+        sendAtLeastOneTime = true;
+        recipients += members->size() - (self->home().id() == i ? 1 : 0);
+        // 每个shard只投递一次，由成员所在的shard负责写入各自的发送队列
+        Shard &target = shard.getServer().shard(i);
+        target.dispatch([members, self, frame, batch, policy = policy, channelId = channelId, &target]() {
+            auto start = std::chrono::steady_clock::now();
+            // v1的接收方需要v1编码的frame（batch需拆分为单独的MESSAGE），
+            // v2的接收方需要带有channel ID的frame（v1发送方的frame不带ID），每个shard各最多转换一次
+            bool converted = !batch && Protocol::frameVersion(*frame) == Protocol::Version::V1;
+            Protocol::FramePtr legacy = converted ? frame : nullptr;
+            std::vector<Protocol::FramePtr> legacyBatch;
+            bool tagged = Protocol::frameVersion(*frame) != Protocol::Version::V1;
+            Protocol::FramePtr taggedFrame = tagged ? frame : nullptr;
+            for (auto &item : *members)
+            {
+                if (item == self)
+                {
+                    continue;
+                }
+                if (item->protocolVersion() != Protocol::Version::V1)
+                {
+                    if (!tagged)
+                    {
+                        tagged = true;
+                        try
+                        {
+                            taggedFrame = Protocol::tagFrame(*frame, channelId);
+                        }
+                        catch (const Protocol::invalid_length &)
+                        {
+                            TRACE(FRAME_DROP, item->memberId(), frame->size());
+                        }
+                    }
+                    if (taggedFrame)
+                    {
+                        item->relay(taggedFrame, self, policy);
+                    }
+                    continue;
+                }
+                if (!converted)
+                {
+                    converted = true;
+                    try
+                    {
+                        if (batch)
+                        {
+                            legacyBatch = Protocol::splitBatch(*frame);
+                        }
+                        else
+                        {
+                            legacy = Protocol::convertFrame(frame, Protocol::Version::V1);
+                        }
+                    }
+                    catch (const Protocol::invalid_length &)
+                    {
+                        TRACE(FRAME_DROP, item->memberId(), frame->size());
+                    }
+                }
+                if (legacy)
+                {
+                    item->relay(legacy, self, policy);
+                }
+                for (auto &part : legacyBatch)
+                {
+                    item->relay(part, self, policy);
+                }
+            }
+            target.metrics().fanoutNanos.record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                                    std::chrono::steady_clock::now() - start)
+                                                    .count());
+        });
+    }
+    increment(channelMetrics.messages, messages);
+    increment(channelMetrics.bytesIn, frame->size());
+    increment(channelMetrics.deliveries, recipients);
+    increment(channelMetrics.bytesOut, recipients * frame->size());
+    if (sendAtLeastOneTime && history)
+    {
+        record(*frame);
+    }
+    return sendAtLeastOneTime;
+}
+
+void Channel::record(const Protocol::Frame &frame)
+{
+    // 历史按名称保存，而channel删除后重建（ID的位置被复用）或server重启后ID会改变，
+    // 因此保存不带channel ID的frame，回放时再以当时的ID标记。v2的frame转发时总带有ID
+    Protocol::FramePtr untagged;
+    if (Protocol::frameVersion(frame) != Protocol::Version::V1)
+    {
+        try
+        {
+            untagged = Protocol::untagFrame(frame);
+        }
+        catch (const Protocol::invalid_length &)
+        {
+            return;
+        }
+    }
+    try
+    {
+        std::uint64_t sequence;
+        history->append(untagged ? *untagged : frame, sequence);
+    }
+    catch (const std::exception &e)
+    {
+        LOG(ERROR) << "failed to append history of channel " << name << ": " << e.what();
+        history.reset();
+    }
+}
+
+void Channel::replay(std::shared_ptr<Participant> target, bool last, std::uint64_t count)
+{
+    if (!history)
+    {
+        target->deliver(Protocol::encodeFrame(Protocol::Type::OTHER_ERROR, mirror ? "Error: history is kept by the owner node"
+                                                                                  : "Error: history is not enabled"));
+        return;
+    }
+    auto frames = std::make_shared<std::vector<Protocol::FramePtr>>();
+    ChannelHistory::Range range;
+    std::uint64_t next;
+    try
+    {
+        history->enforceRetention();
+        next = history->nextSequence();
+        std::uint64_t from = last ? next - std::min(count, next) : count;
+        // 一次最多回放半个发送队列，其余的由客户端以since继续请求
+        const ServerOptions &options = shard.getServer().getOptions();
+        range = history->read(from, std::max<std::size_t>(options.sendQueueMaxFrames / 2, 1),
+                              options.sendQueueMaxBytes / 2, true, *frames);
+    }
+    catch (const std::exception &e)
+    {
+        LOG(ERROR) << "failed to read history of channel " << name << ": " << e.what();
+        target->deliver(Protocol::encodeFrame(Protocol::Type::OTHER_ERROR, "Error: failed to read history"));
+        return;
+    }
+    auto end = std::to_string(range.first) + "," + std::to_string(range.next) + "," + std::to_string(next);
+    target->home().dispatch([target, channelId = channelId, frames, end]() { target->replayed(channelId, *frames, end); });
+}
+
+void Channel::leave(std::shared_ptr<Participant> self)
+{
+    if (connections.erase(self) > 0)
+    {
+        rebuildMembers(self->home().id());
+        channelMetrics.members.store(connections.size(), std::memory_order_relaxed);
+        TRACE(LEAVE, self->memberId(), std::hash<std::string>{}(name));
+    }
+    if (mirror && self == upstream)
+    {
+        // 与owner失去联系：移出所有本地成员，之后的加入重新向owner请求
+        upstream.reset();
+        auto evicted = std::move(connections);
+        connections.clear();
+        for (auto &members : shardMembers)
+        {
+            members.reset();
+        }
+        channelMetrics.members.store(0, std::memory_order_relaxed);
+        auto ch = getPtr();
+        for (auto &item : evicted)
+        {
+            item->home().dispatch([item, ch]() { item->evicted(ch); });
+        }
+    }
+    else if (upstream && connections.size() == 1)
+    {
+        // 最后一个本地成员已离开，关闭到owner的stream，upstream随之离开
+        auto session = upstream;
+        session->close();
+        return;
+    }
+    if (connections.empty())
+    {
+        shard.removeChannel(*this);
+    }
+}
+
+void Channel::rebuildMembers(unsigned int shardIndex)
+{
+    auto members = std::make_shared<MemberList>();
+    for (auto &item : connections)
+    {
+        if (item->home().id() == shardIndex)
+        {
+            members->push_back(item);
+        }
+    }
+    if (members->empty())
+    {
+        shardMembers[shardIndex].reset();
+    }
+    else
+    {
+        shardMembers[shardIndex] = std::move(members);
+    }
+}
+
+// ---------------- Class Participant ------------------------------
+
+Participant::Participant(boost::asio::ip::tcp::socket socket_, Shard &home, const ServerOptions &opts)
+    : Participant(std::move(socket_), home, opts, FrameReader::DEFAULT_CAPACITY)
+{
+}
+
+Participant::Participant(const std::shared_ptr<Participant> &connection, std::uint32_t id)
+    : Participant(boost::asio::ip::tcp::socket(connection->shard.context()), connection->shard, connection->options, 0)
+{
+    mux = connection;
+    streamId = id;
+    version = connection->version;
+    handshaken = true;
+    sendCredit = options.streamWindow;
+    receiveCredit = options.streamWindow;
+}
+
+Participant::Participant(boost::asio::ip::tcp::socket socket_, Shard &home, const ServerOptions &opts,
+                         std::size_t readerCapacity)
+    : socket(std::move(socket_)),
+      shard(home),
+      id(SlotTable<std::shared_ptr<Participant>>::INVALID_HANDLE),
+      joining(false),
+      closed(false),
+      pauseCount(0),
+      readSuspended(false),
+      version(Protocol::Version::V1),
+      options(opts),
+      pkgQueue(opts.sendQueueMaxBytes, opts.sendQueueMaxFrames),
+      flushTimer(socket.get_executor()),
+      reader(readerCapacity, Protocol::BODY_MAX_LENGTH),
+      timeout(*this, &Participant::onTimeout),
+      handshaken(false),
+      lastRead(0),
+      lastWrite(0),
+      pingSent(0)
+#ifdef TCP_PROTO_COROUTINES
+      ,
+      writerWakeup(socket.get_executor()),
+      readerWakeup(socket.get_executor())
+#endif
+#ifdef TCP_PROTO_IO_URING
+      ,
+      uringReader(*this, &Participant::onUringRead),
+      uringWriter(*this, &Participant::onUringWritten),
+      uringWritten(0)
+#endif
+      ,
+      streamId(0),
+      sendCredit(0),
+      receiveCredit(0),
+      creditOwed(0),
+      peer(false),
+      dialed(false),
+      nextStreamId(1),
+      pumpPosted(false),
+      tunneling(false),
+      engine(opts.engine)
+#ifdef TCP_PROTO_TLS
+      ,
+      securing(false),
+      certified(false)
+#endif
+{
+}
+
+void Participant::run()
+{
+    id = shard.members().insert(shared_from_this());
+    if (options.handshakeTimeout.count() > 0 || options.idleTimeout.count() > 0)
+    {
+        lastRead = shard.now();
+    }
+    armTimeout();
+#ifdef TCP_PROTO_TLS
+    if (auto context = shard.getServer().tlsContext(dialed))
+    {
+        secure(std::move(context));
+        return;
+    }
+#endif
+    startLoops();
+}
+
+void Participant::startLoops()
+{
+#ifdef TCP_PROTO_COROUTINES
+    if (engine == SessionEngine::COROUTINE)
+    {
+        // 两个协程各持有一份self，都结束后participant才会被销毁
+        boost::asio::co_spawn(socket.get_executor(), readLoop(shared_from_this()), boost::asio::detached);
+        boost::asio::co_spawn(socket.get_executor(), writeLoop(shared_from_this()), boost::asio::detached);
+        return;
+    }
+#endif
+    readFrames();
+}
+
+#ifdef TCP_PROTO_TLS
+void Participant::secure(std::shared_ptr<TlsContext> context)
+{
+    try
+    {
+        // --nodes中只有IP，节点的证书只按tls.caFile验证证书链
+        tls = std::make_unique<TlsSession>(std::move(context), socket);
+    }
+    catch (const std::exception &e)
+    {
+        LOG(WARNING) << e.what();
+        close();
+        exit();
+        return;
+    }
+    securing = true;
+    auto self = shared_from_this();
+    // 握手超时与明文连接的握手超时相同：到期时close()使等待失败
+    tls->handshake([this, self](boost::system::error_code ec) {
+        securing = false;
+        if (ec || closed)
+        {
+            increment(shard.metrics().tlsFailures);
+            TRACE(IO_ERROR, id, ec.value());
+            close();
+            exit();
+            return;
+        }
+        increment(shard.metrics().tlsHandshakes);
+        certified = tls->peerVerified();
+        if (tls->resumed())
+        {
+            increment(shard.metrics().tlsResumed);
+        }
+        if (tls->offloaded())
+        {
+            // 之后直接读写socket，各引擎及隧道的splice()都与明文连接相同
+            increment(shard.metrics().tlsOffloaded);
+            tls.reset();
+        }
+        else
+        {
+            engine = SessionEngine::CALLBACK;
+        }
+        startLoops();
+        if (!pkgQueue.empty())
+        {
+            startWrite(); // 握手期间放入队列的frame，例如dial()发出的HELLO
+        }
+    });
+}
+#endif
+
+Protocol::Version Participant::protocolVersion()
+{
+    return version;
+}
+
+SlotTable<std::shared_ptr<Participant>>::Handle Participant::memberId()
+{
+    return id;
+}
+
+Shard &Participant::home()
+{
+    return shard;
+}
+
+std::shared_ptr<Participant> Participant::getPtr()
+{
+    return shared_from_this();
+}
+
+void Participant::exit()
+{
+    closed = true;
+#ifdef TCP_PROTO_COROUTINES
+    // 唤醒正在等待的循环，使其看到closed后结束
+    writerWakeup.cancel();
+    readerWakeup.cancel();
+#endif
+    shard.timers().cancel(timeout);
+    resumeSenders();
+    // 退出所有channel
+    if (!channels.empty())
+    {
+        auto self = shared_from_this();
+        for (auto &ch : channels)
+        {
+            ch->owner().dispatch([ch, self]() { ch->leave(self); });
+        }
+        channels.clear();
+    }
+    // 连接上的所有stream会话随之退出
+    auto sessions = std::move(streams);
+    streams.clear();
+    for (auto &session : sessions)
+    {
+        session->exit();
+        session->mux.reset();
+    }
+    if (upstreamReply)
+    {
+        // 仍在等待owner回复的请求以失败结束
+        auto reply = std::move(upstreamReply);
+        upstreamReply = nullptr;
+        reply(nullptr);
+    }
+    if (!tunnelName.empty())
+    {
+        // 撤销尚未配对的offer
+        auto self = shared_from_this();
+        Shard &owner = shard.getServer().owner(tunnelName);
+        owner.dispatch([self, name = std::move(tunnelName), &owner]() { owner.withdrawTunnel(self, name); });
+        tunnelName.clear();
+    }
+    if (tunnelHandoff)
+    {
+        // 已配对但没能交出socket，隧道的另一端随之关闭
+        auto handoff = std::move(tunnelHandoff);
+        tunnelHandoff = nullptr;
+        handoff(-1, boost::asio::ip::tcp::v4(), std::string());
+    }
+
+    // socket.close();
+    if (shard.members().remove(id))
+    {
+        increment(shard.metrics().closed);
+        TRACE(CLOSE, id, 0);
+    }
+}
+
+void Participant::write(const Protocol::Package &pkg)
+{
+    write(Protocol::encodeFrame(pkg, version));
+}
+
+void Participant::write(Protocol::FramePtr frame)
+{
+    if (version == Protocol::Version::V1 && Protocol::frameVersion(*frame) != Protocol::Version::V1)
+    {
+        try
+        {
+            frame = Protocol::convertFrame(frame, Protocol::Version::V1);
+        }
+        catch (const Protocol::invalid_length &)
+        {
+            TRACE(FRAME_DROP, id, frame->size());
+            return;
+        }
+    }
+    bool idle = pkgQueue.push(std::move(frame));
+    updateMax(participantMetrics.queueBytesHighWater, pkgQueue.bytes());
+    updateMax(participantMetrics.queueFramesHighWater, pkgQueue.size());
+    updateMax(shard.metrics().queueBytesHighWater, pkgQueue.bytes());
+    if (idle) // 队列原本为空时需要发起写操作，否则由正在进行的写操作继续发送
+    {
+        startWrite();
+    }
+}
+
+void Participant::startWrite()
+{
+    if (mux)
+    {
+        // 由连接发送，写停滞也由连接检查
+        if (!mux->peer)
+        {
+            pumpStream();
+        }
+        else if (!pumpPosted)
+        {
+            // 节点间的stream：等本轮事件循环中扇出的消息都入队后再合并为一个batch发送
+            pumpPosted = true;
+            auto self = shared_from_this();
+            boost::asio::post(shard.context(), [self]() {
+                self->pumpPosted = false;
+                self->pumpStream();
+            });
+        }
+        return;
+    }
+    if (options.writeStallTimeout.count() > 0)
+    {
+        // 队列由空变为非空，从现在开始等待写完成
+        lastWrite = shard.now();
+        std::uint64_t deadline = lastWrite + shard.timers().ticks(options.writeStallTimeout);
+        if (!closed && (!timeout.scheduled() || timeout.expiry() > deadline))
+        {
+            shard.schedule(timeout, deadline);
+        }
+    }
+#ifdef TCP_PROTO_TLS
+    if (securing)
+    {
+        return; // 握手完成后发送
+    }
+#endif
+#ifdef TCP_PROTO_COROUTINES
+    if (engine == SessionEngine::COROUTINE)
+    {
+        writerWakeup.cancel();
+        return;
+    }
+#endif
+    if (options.writeDelay.count() > 0)
+    {
+        flushTimer.expires_after(options.writeDelay);
+        flushTimer.async_wait([this](std::error_code ec) {
+            if (!ec)
+            {
+                execWriteAction();
+            }
+        });
+    }
+    else
+    {
+        execWriteAction();
+    }
+}
+
+void Participant::deliver(Protocol::FramePtr frame)
+{
+    auto self = shared_from_this();
+    shard.dispatch([self, frame]() { self->write(frame); });
+}
+
+void Participant::evicted(const std::shared_ptr<Channel> &mirror)
+{
+    auto found = std::find(channels.begin(), channels.end(), mirror);
+    if (found == channels.end() || closed)
+    {
+        return;
+    }
+    channels.erase(found);
+    writeTagged(Protocol::encodeFrame(Protocol::Type::SUCCEED_IN_LEAVE_CHANNEL, "leaved channel: owner node unavailable"),
+                mirror->id());
+}
+
+void Participant::relay(Protocol::FramePtr frame, const std::shared_ptr<Participant> &sender, SlowConsumerPolicy policy)
+{
+    if (closed)
+    {
+        return;
+    }
+    if (!pkgQueue.full(frame->size()))
+    {
+        write(std::move(frame));
+        return;
+    }
+
+    switch (policy)
+    {
+    case SlowConsumerPolicy::DROP_OLDEST:
+    {
+        std::uint64_t dropped = 0;
+        while (pkgQueue.full(frame->size()) && pkgQueue.dropOldest())
+        {
+            dropped++;
+        }
+        if (dropped > 0)
+        {
+            stats.droppedOldest += dropped;
+            shard.getServer().countBackpressure(policy, dropped);
+        }
+        if (!pkgQueue.full(frame->size()))
+        {
+            write(std::move(frame));
+            break;
+        }
+        // 队列中的frame都已在写出中，无法腾出空间，只能丢弃新的frame
+        stats.droppedNewest++;
+        shard.getServer().countBackpressure(SlowConsumerPolicy::DROP_NEWEST);
+        break;
+    }
+
+    case SlowConsumerPolicy::DROP_NEWEST:
+        stats.droppedNewest++;
+        shard.getServer().countBackpressure(policy);
+        break;
+
+    case SlowConsumerPolicy::DISCONNECT:
+        stats.disconnected++;
+        shard.getServer().countBackpressure(policy);
+        TRACE(SLOW_CONSUMER, id, static_cast<std::uint64_t>(policy) << 48 | pkgQueue.bytes());
+        close();
+        break;
+
+    case SlowConsumerPolicy::PAUSE_SENDER:
+        if (pkgQueue.exceeds(frame->size(), PAUSE_QUEUE_LIMIT_FACTOR))
+        {
+            stats.disconnected++;
+            shard.getServer().countBackpressure(SlowConsumerPolicy::DISCONNECT);
+            TRACE(SLOW_CONSUMER, id, static_cast<std::uint64_t>(policy) << 48 | pkgQueue.bytes());
+            close();
+            break;
+        }
+        // 这个frame已经被读入，仍然放入队列；之后由发送方停止读取来限制队列的增长
+        // 与连接的计数相同，按(接收方, 发送方)的暂停次数而不是frame数记录
+        write(std::move(frame));
+        if (std::find(pausedSenders.begin(), pausedSenders.end(), sender) == pausedSenders.end())
+        {
+            stats.paused++;
+            shard.getServer().countBackpressure(policy);
+            pausedSenders.push_back(sender);
+            sender->home().dispatch([sender]() { sender->pause(); });
+        }
+        break;
+    }
+}
+
+void Participant::pause()
+{
+    pauseCount++;
+}
+
+void Participant::resume()
+{
+    if (--pauseCount == 0 && mux)
+    {
+        // stream会话暂停期间扣留了额度，归还后对端才继续在该stream上发送
+        returnCredit();
+        return;
+    }
+    continueReading();
+}
+
+void Participant::continueReading()
+{
+    if (pauseCount == 0 && !tunneling && readSuspended && !closed)
+    {
+        readSuspended = false;
+#ifdef TCP_PROTO_COROUTINES
+        if (engine == SessionEngine::COROUTINE)
+        {
+            readerWakeup.cancel();
+            return;
+        }
+#endif
+        readFrames();
+    }
+}
+
+void Participant::close()
+{
+    if (mux)
+    {
+        mux->closeStream(shared_from_this());
+        return;
+    }
+    closed = true;
+    boost::system::error_code ec;
+#ifdef TCP_PROTO_IO_URING
+    // 关闭fd不会取消io_uring中未完成的操作，先shutdown使其以EOF/错误结束并触发exit()
+    if (engine == SessionEngine::IO_URING)
+    {
+        socket.shutdown(boost::asio::ip::tcp::socket::shutdown_both, ec);
+    }
+#endif
+    socket.close(ec);
+#ifdef TCP_PROTO_COROUTINES
+    writerWakeup.cancel();
+    readerWakeup.cancel();
+#endif
+}
+
+void Participant::armTimeout()
+{
+    TimingWheel &wheel = shard.timers();
+    if (closed || mux || tunneling) // stream会话的超时由连接检查，等待配对的隧道没有超时
+    {
+        wheel.cancel(timeout);
+        return;
+    }
+    std::uint64_t deadline = std::numeric_limits<std::uint64_t>::max();
+    if (!handshaken)
+    {
+        if (options.handshakeTimeout.count() > 0)
+        {
+            deadline = lastRead + wheel.ticks(options.handshakeTimeout);
+        }
+    }
+    else if (options.idleTimeout.count() > 0)
+    {
+        if (version == Protocol::Version::V1)
+        {
+            deadline = lastRead + wheel.ticks(options.idleTimeout + options.heartbeatTimeout);
+        }
+        else
+        {
+            deadline = pingSent > 0 ? pingSent + wheel.ticks(options.heartbeatTimeout)
+                                    : lastRead + wheel.ticks(options.idleTimeout);
+        }
+    }
+    if (options.writeStallTimeout.count() > 0 && !pkgQueue.empty())
+    {
+        deadline = std::min(deadline, lastWrite + wheel.ticks(options.writeStallTimeout));
+    }
+    if (deadline == std::numeric_limits<std::uint64_t>::max())
+    {
+        wheel.cancel(timeout);
+    }
+    else
+    {
+        shard.schedule(timeout, deadline);
+    }
+}
+
+void Participant::onTimeout()
+{
+    if (closed)
+    {
+        return;
+    }
+    TimingWheel &wheel = shard.timers();
+    std::uint64_t now = wheel.now();
+    if (!handshaken)
+    {
+        if (options.handshakeTimeout.count() > 0 && now >= lastRead + wheel.ticks(options.handshakeTimeout))
+        {
+            timedOut(Timeout::HANDSHAKE);
+            return;
+        }
+    }
+    else if (options.idleTimeout.count() > 0)
+    {
+        if (pauseCount > 0)
+        {
+            lastRead = now; // 被暂停读取期间不计入空闲
+        }
+        else if (version == Protocol::Version::V1)
+        {
+            // v1的客户端不认识PING，给出与发送PING后相同的总时长，仍没有任何frame时断开
+            if (now >= lastRead + wheel.ticks(options.idleTimeout + options.heartbeatTimeout))
+            {
+                timedOut(Timeout::IDLE);
+                return;
+            }
+        }
+        else if (pingSent > 0)
+        {
+            if (now >= pingSent + wheel.ticks(options.heartbeatTimeout))
+            {
+                timedOut(Timeout::IDLE);
+                return;
+            }
+        }
+        else if (now >= lastRead + wheel.ticks(options.idleTimeout))
+        {
+            if (options.heartbeatTimeout.count() <= 0)
+            {
+                timedOut(Timeout::IDLE);
+                return;
+            }
+            pingSent = now;
+            increment(shard.metrics().pings);
+            write(Protocol::encodeFrame(Protocol::Type::PING, std::string_view(), version));
+        }
+    }
+    if (options.writeStallTimeout.count() > 0 && !pkgQueue.empty() &&
+        now >= lastWrite + wheel.ticks(options.writeStallTimeout))
+    {
+        timedOut(Timeout::WRITE_STALL);
+        return;
+    }
+    armTimeout();
+}
+
+void Participant::timedOut(Timeout reason)
+{
+    switch (reason)
+    {
+    case Timeout::HANDSHAKE:
+        increment(shard.metrics().handshakeTimeouts);
+        break;
+    case Timeout::IDLE:
+        increment(shard.metrics().idleTimeouts);
+        break;
+    case Timeout::WRITE_STALL:
+        increment(shard.metrics().writeStallTimeouts);
+        break;
+    }
+    TRACE(TIMEOUT, id, static_cast<std::uint64_t>(reason));
+    // 对端可能已失联，未完成的读写不一定会很快失败，因此直接退出
+    close();
+    exit();
+}
+
+const BackpressureStats &Participant::backpressureStats()
+{
+    return stats;
+}
+
+ParticipantMetrics &Participant::metrics()
+{
+    return participantMetrics;
+}
+
+void Participant::resumeSenders()
+{
+    for (auto &sender : pausedSenders)
+    {
+        sender->home().dispatch([sender]() { sender->resume(); });
+    }
+    pausedSenders.clear();
+}
+
+void Participant::handleStream(const Protocol::PackageView &pkg)
+{
+    if (mux || version == Protocol::Version::V1 || options.streamWindow == 0)
+    {
+        write(Protocol::encodeFrame(Protocol::Type::OTHER_ERROR, "Error: streams are not available", version));
+        return;
+    }
+    std::string_view frame;
+    std::uint32_t sid = Protocol::readStream(pkg.body, frame);
+    auto found = findStream(sid);
+    bool exists = found != streams.end() && (*found)->streamId == sid;
+    if (frame.empty())
+    {
+        // 对端关闭了stream，或回复了server发出的关闭通知
+        if (exists)
+        {
+            auto session = std::move(*found);
+            streams.erase(found);
+            session->exit();
+            session->mux.reset();
+            if (dialed)
+            {
+                write(Protocol::encodeStreamHeader(sid, 0)); // 回复owner，对端随之释放该ID
+            }
+        }
+        return;
+    }
+    if (!exists)
+    {
+        if (dialed)
+        {
+            return; // 本节点发起的连接上只有本节点打开的stream
+        }
+        if (streams.size() >= (peer ? options.maxStreamsPerPeer : options.maxStreamsPerConnection))
+        {
+            write(Protocol::encodeStreamHeader(sid, 0));
+            return;
+        }
+        found = streams.insert(found, std::make_shared<Participant>(shared_from_this(), sid));
+    }
+    auto session = *found;
+    if (session->closed)
+    {
+        return; // 已关闭，等待对端回复
+    }
+    if (session->receiveCredit <= 0)
+    {
+        // 对端没有遵守流控，关闭该stream
+        TRACE(BAD_REQUEST, id, pkg.type);
+        closeStream(session);
+        return;
+    }
+    session->receiveCredit -= static_cast<std::int64_t>(frame.size());
+    if (dialed)
+    {
+        session->handleUpstream(Protocol::viewFrame(frame));
+    }
+    else
+    {
+        session->handle(Protocol::viewFrame(frame));
+    }
+    session->consumeCredit(frame.size());
+}
+
+void Participant::creditStream(std::string_view body)
+{
+    std::uint32_t bytes;
+    std::uint32_t sid = Protocol::readStreamCredit(body, bytes);
+    auto found = findStream(sid);
+    if (found == streams.end() || (*found)->streamId != sid)
+    {
+        return;
+    }
+    auto &session = *found;
+    session->sendCredit += bytes;
+    session->pumpStream();
+}
+
+std::vector<std::shared_ptr<Participant>>::iterator Participant::findStream(std::uint32_t sid)
+{
+    return std::lower_bound(streams.begin(), streams.end(), sid,
+                            [](const std::shared_ptr<Participant> &session, std::uint32_t value) {
+                                return session->streamId < value;
+                            });
+}
+
+void Participant::closeStream(const std::shared_ptr<Participant> &session)
+{
+    if (session->closed)
+    {
+        return;
+    }
+    session->exit();
+    write(Protocol::encodeStreamHeader(session->streamId, 0));
+    if (dialed)
+    {
+        // 本节点打开的stream的ID不再复用，无需等待owner回复即可释放
+        auto found = findStream(session->streamId);
+        if (found != streams.end() && *found == session)
+        {
+            streams.erase(found);
+            session->mux.reset();
+        }
+    }
+}
+
+void Participant::writeStream(std::uint32_t sid, Protocol::FramePtr frame)
+{
+    auto header = Protocol::encodeStreamHeader(sid, frame->size());
+    bool idle = pkgQueue.push(std::move(header));
+    pkgQueue.push(std::move(frame));
+    updateMax(participantMetrics.queueBytesHighWater, pkgQueue.bytes());
+    updateMax(participantMetrics.queueFramesHighWater, pkgQueue.size());
+    updateMax(shard.metrics().queueBytesHighWater, pkgQueue.bytes());
+    if (idle)
+    {
+        startWrite();
+    }
+}
+
+void Participant::pumpStream()
+{
+    while (!pkgQueue.empty() && sendCredit > 0 && !closed)
+    {
+        auto frame = mux->peer ? coalesce() : nullptr;
+        if (!frame)
+        {
+            frame = pkgQueue.take();
+        }
+        sendCredit -= static_cast<std::int64_t>(frame->size());
+        mux->writeStream(streamId, std::move(frame));
+    }
+    if (!pausedSenders.empty() && pkgQueue.belowLowWatermark())
+    {
+        resumeSenders();
+    }
+}
+
+// frame中可以并入MESSAGE_BATCH的内容：MESSAGE为一条消息（single为true），MESSAGE_BATCH为依次排列的各条消息
+static bool batchContent(const Protocol::Frame &frame, std::string_view &content, bool &single)
+{
+    try
+    {
+        auto pkg = Protocol::viewFrame(std::string_view(reinterpret_cast<const char *>(frame.data()), frame.size()));
+        single = pkg.type == static_cast<std::uint16_t>(Protocol::Type::MESSAGE);
+        if (!single && pkg.type != static_cast<std::uint16_t>(Protocol::Type::MESSAGE_BATCH))
+        {
+            return false;
+        }
+        content = pkg.body;
+        if (pkg.flags & Protocol::FLAG_CHANNEL)
+        {
+            Protocol::readChannelId(content);
+        }
+        return true;
+    }
+    catch (const Protocol::invalid_length &)
+    {
+        return false;
+    }
+}
+
+Protocol::FramePtr Participant::coalesce()
+{
+    // batch不超过剩余的额度，额度不足一条时只取一条
+    std::size_t limit = std::min<std::size_t>(static_cast<std::size_t>(sendCredit), Protocol::V2_BODY_MAX_LENGTH);
+    std::size_t count = 0;
+    std::size_t length = 0;
+    std::string_view content;
+    bool single;
+    while (count < pkgQueue.size() && batchContent(*pkgQueue.peek(count), content, single))
+    {
+        std::size_t size = single ? Protocol::batchEntryLength(content.size()) : content.size();
+        if (count > 0 && length + size > limit)
+        {
+            break;
+        }
+        length += size;
+        count++;
+    }
+    if (count < 2)
+    {
+        return nullptr;
+    }
+    // 对端只在一个channel中，不需要channel ID
+    Protocol::FrameBuilder builder(Protocol::Type::MESSAGE_BATCH, Protocol::Version::V2, length);
+    for (std::size_t i = 0; i < count; i++)
+    {
+        auto frame = pkgQueue.take();
+        batchContent(*frame, content, single);
+        if (single)
+        {
+            Protocol::appendBatchEntry(builder, content);
+        }
+        else
+        {
+            builder.append(content);
+        }
+    }
+    return builder.finish();
+}
+
+void Participant::dial()
+{
+    peer = true;
+    dialed = true;
+    run();
+    // HELLO以v1编码，对端按顺序处理，之后的frame可以直接使用v2
+    char hello[] = {static_cast<char>(Protocol::Version::V2), static_cast<char>(Protocol::HELLO_PEER)};
+    write(Protocol::encodeFrame(Protocol::Type::HELLO, std::string_view(hello, sizeof(hello))));
+    version = Protocol::Version::V2;
+    reader.setMaxBodyLength(options.maxFrameBytes);
+    armTimeout();
+}
+
+std::shared_ptr<Participant> Participant::openStream()
+{
+    // ID递增分配，新会话总在末尾，streams仍按ID排序
+    auto session = std::make_shared<Participant>(shared_from_this(), nextStreamId++);
+    streams.push_back(session);
+    return session;
+}
+
+void Participant::handleUpstream(const Protocol::PackageView &pkg)
+{
+    switch (static_cast<Protocol::Type>(pkg.type))
+    {
+    case Protocol::Type::MESSAGE: // owner转发的消息，扇出给镜像channel的本地成员
+    case Protocol::Type::MESSAGE_BATCH:
+        handle(pkg);
+        break;
+
+    case Protocol::Type::SUCCEED_IN_CREATE_CHANNEL:
+    case Protocol::Type::FAIL_IN_CREATE_CHANNEL:
+    case Protocol::Type::SUCCEED_IN_JOIN_IN_CHANNEL:
+    case Protocol::Type::FAIL_IN_JOIN_IN_CHANNEL:
+        if (upstreamReply)
+        {
+            auto reply = std::move(upstreamReply);
+            upstreamReply = nullptr;
+            reply(&pkg);
+        }
+        break;
+
+    default:
+        break; // owner的错误提示等不需要处理
+    }
+}
+
+bool Participant::fromPeer()
+{
+    return mux && mux->peer;
+}
+
+void Participant::consumeCredit(std::size_t size)
+{
+    creditOwed += size;
+    if (pauseCount == 0 && creditOwed >= options.streamWindow / 2)
+    {
+        returnCredit();
+    }
+}
+
+void Participant::returnCredit()
+{
+    if (creditOwed == 0 || closed)
+    {
+        return;
+    }
+    receiveCredit += static_cast<std::int64_t>(creditOwed);
+    mux->write(Protocol::encodeStreamCredit(streamId, static_cast<std::uint32_t>(creditOwed)));
+    creditOwed = 0;
+}
+
+void Participant::readFrames()
+{
+#ifdef TCP_PROTO_IO_URING
+    if (engine == SessionEngine::IO_URING)
+    {
+        uringReader.hold(shared_from_this());
+        shard.uring().receive(socket.native_handle(), uringReader);
+        return;
+    }
+#endif
+    auto self = shared_from_this();
+    auto handler = makeCustomAllocHandler(readMemory, [this, self](std::error_code ec, std::size_t len) {
+        if (!ec)
+        {
+            if (!onRead(len))
+            {
+                return;
+            }
+            if (pauseCount > 0 || tunneling)
+            {
+                // 有接收方的队列已满，等待resume()后再继续读取；隧道请求之后的数据不再读取
+                readSuspended = true;
+            }
+            else
+            {
+                readFrames();
+            }
+        }
+        else
+        {
+            TRACE(IO_ERROR, id, ec.value());
+            exit();
+        }
+    });
+#ifdef TCP_PROTO_TLS
+    if (tls)
+    {
+        tls->asyncReadSome(reader.prepare(), std::move(handler));
+        return;
+    }
+#endif
+    socket.async_read_some(reader.prepare(), std::move(handler));
+}
+
+void Participant::execWriteAction()
+{
+#ifdef TCP_PROTO_IO_URING
+    if (engine == SessionEngine::IO_URING)
+    {
+        if (closed)
+        {
+            return; // fd已关闭，其编号可能已被新连接复用
+        }
+        uringIovecs.clear();
+        for (const auto &buffer : pkgQueue.gather())
+        {
+            uringIovecs.push_back({const_cast<void *>(buffer.data()), buffer.size()});
+        }
+        uringWritten = 0;
+        sendWithUring();
+        return;
+    }
+#endif
+    auto self = shared_from_this();
+    auto handler = makeCustomAllocHandler(writeMemory, [this, self](std::error_code ec, std::size_t len) {
+        if (!ec)
+        {
+            if (onWritten(len))
+            {
+                execWriteAction();
+            }
+        }
+        else
+        {
+            TRACE(IO_ERROR, id, ec.value());
+            exit();
+        }
+    });
+#ifdef TCP_PROTO_TLS
+    if (tls)
+    {
+        tls->asyncWrite(pkgQueue.gather(), std::move(handler));
+        return;
+    }
+#endif
+    boost::asio::async_write(socket, pkgQueue.gather(), std::move(handler));
+}
+
+bool Participant::onRead(std::size_t len)
+{
+    TRACE(READ, id, len);
+    reader.commit(len);
+    increment(participantMetrics.bytesIn, len);
+    increment(shard.metrics().bytesIn, len);
+    bool received = false;
+    try
+    {
+        while (!tunneling && reader.next(inputPkg))
+        {
+            received = true;
+            increment(participantMetrics.framesIn);
+            increment(shard.metrics().framesIn);
+            TRACE(FRAME_IN, id, std::uint64_t(inputPkg.type) << 32 | inputPkg.length);
+            handle(inputPkg);
+        }
+    }
+    catch (const Protocol::invalid_length &)
+    {
+        // header不合法，之后的数据已无法定位frame边界
+        TRACE(PARSE_ERROR, id, 0);
+        close();
+        exit();
+        return false;
+    }
+    if (received)
+    {
+        // 只记录tick，由timeout到期时检查（只有完整的frame才算活动，逐字节发送的连接仍会超时）
+        pingSent = 0;
+        if (options.handshakeTimeout.count() > 0 || options.idleTimeout.count() > 0)
+        {
+            lastRead = shard.now();
+        }
+        if (!handshaken)
+        {
+            // 空闲超时可能早于尚未到期的握手超时
+            handshaken = true;
+            armTimeout();
+        }
+    }
+    return true;
+}
+
+bool Participant::onWritten(std::size_t len)
+{
+    increment(participantMetrics.framesOut, pkgQueue.sending());
+    increment(participantMetrics.bytesOut, len);
+    increment(shard.metrics().framesOut, pkgQueue.sending());
+    increment(shard.metrics().bytesOut, len);
+    TRACE(WRITE, id, len);
+    if (options.writeStallTimeout.count() > 0)
+    {
+        lastWrite = shard.now();
+    }
+    bool more = pkgQueue.pop();
+    if (!pausedSenders.empty() && pkgQueue.belowLowWatermark())
+    {
+        resumeSenders();
+    }
+    if (!more && tunnelHandoff)
+    {
+        handOffTunnel(); // TUNNEL_READY已写出
+    }
+    return more;
+}
+
+#ifdef TCP_PROTO_IO_URING
+void Participant::onUringRead(int result, std::uint32_t flags)
+{
+    Uring &ring = shard.uring();
+    if (result == -ENOBUFS && !closed)
+    {
+        // 缓冲区环暂时耗尽，本轮处理完的缓冲区归还后下一次提交即可读到
+        readFrames();
+        return;
+    }
+    if (result <= 0 || closed)
+    {
+        ring.recycle(flags);
+        TRACE(IO_ERROR, id, result < 0 ? -result : 0);
+        exit();
+        return;
+    }
+    // 内核选择的缓冲区需要尽快归还，未解析完的数据复制到reader中
+    auto data = ring.buffer(flags, static_cast<std::size_t>(result));
+    bool parsed = true;
+    while (parsed && !tunneling && !data.empty())
+    {
+        auto space = reader.prepare();
+        std::size_t len = std::min(space.size(), data.size());
+        std::memcpy(space.data(), data.data(), len);
+        data.remove_prefix(len);
+        parsed = onRead(len);
+    }
+    if (parsed && tunneling)
+    {
+        tunnelSpill.append(data);
+    }
+    ring.recycle(flags);
+    if (!parsed)
+    {
+        return;
+    }
+    if (closed)
+    {
+        exit(); // 处理过程中被close()，不能再对已关闭的fd提交读操作
+    }
+    else if (pauseCount > 0 || tunneling)
+    {
+        readSuspended = true;
+    }
+    else
+    {
+        readFrames();
+    }
+}
+
+void Participant::onUringWritten(int result, std::uint32_t)
+{
+    if (result <= 0 || closed)
+    {
+        TRACE(IO_ERROR, id, result < 0 ? -result : 0);
+        exit();
+        return;
+    }
+    uringWritten += static_cast<std::size_t>(result);
+    // MSG_WAITALL下只有被信号打断等情况才会只写出一部分，跳过已写出的部分继续发送
+    std::size_t skip = static_cast<std::size_t>(result);
+    auto first = uringIovecs.begin();
+    while (first != uringIovecs.end() && skip >= first->iov_len)
+    {
+        skip -= first->iov_len;
+        ++first;
+    }
+    uringIovecs.erase(uringIovecs.begin(), first);
+    if (!uringIovecs.empty())
+    {
+        uringIovecs.front().iov_base = static_cast<std::uint8_t *>(uringIovecs.front().iov_base) + skip;
+        uringIovecs.front().iov_len -= skip;
+        sendWithUring();
+        return;
+    }
+    if (onWritten(uringWritten))
+    {
+        execWriteAction();
+    }
+}
+
+void Participant::sendWithUring()
+{
+    std::memset(&uringMessage, 0, sizeof(uringMessage));
+    uringMessage.msg_iov = uringIovecs.data();
+    uringMessage.msg_iovlen = uringIovecs.size();
+    uringWriter.hold(shared_from_this());
+    shard.uring().send(socket.native_handle(), &uringMessage, uringWriter);
+}
+#endif
+
+#ifdef TCP_PROTO_COROUTINES
+// 协程的帧由asio按线程回收复用，等待的异步操作也使用asio的回收分配器，稳定状态下不分配内存
+boost::asio::awaitable<void> Participant::readLoop([[maybe_unused]] std::shared_ptr<Participant> self)
+{
+    boost::system::error_code ec;
+    while (!closed)
+    {
+        if (pauseCount > 0 || tunneling)
+        {
+            // 有接收方的队列已满（或请求了隧道），等待resume()或exit()唤醒
+            readSuspended = true;
+            readerWakeup.expires_at(boost::asio::steady_timer::time_point::max());
+            co_await readerWakeup.async_wait(boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+            continue;
+        }
+        std::size_t len = co_await socket.async_read_some(reader.prepare(),
+                                                          boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+        if (ec)
+        {
+            TRACE(IO_ERROR, id, ec.value());
+            break;
+        }
+        if (!onRead(len))
+        {
+            co_return;
+        }
+    }
+    // 读取出错，或在暂停期间被close()
+    exit();
+}
+
+boost::asio::awaitable<void> Participant::writeLoop([[maybe_unused]] std::shared_ptr<Participant> self)
+{
+    boost::system::error_code ec;
+    bool more = false;
+    while (!closed)
+    {
+        if (!more)
+        {
+            if (pkgQueue.empty())
+            {
+                // 由write()在队列由空变为非空时唤醒
+                writerWakeup.expires_at(boost::asio::steady_timer::time_point::max());
+                co_await writerWakeup.async_wait(boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+                continue;
+            }
+            if (options.writeDelay.count() > 0)
+            {
+                flushTimer.expires_after(options.writeDelay);
+                co_await flushTimer.async_wait(boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+                if (closed)
+                {
+                    break;
+                }
+            }
+        }
+        std::size_t len = co_await boost::asio::async_write(socket, pkgQueue.gather(),
+                                                            boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+        if (ec)
+        {
+            TRACE(IO_ERROR, id, ec.value());
+            exit();
+            co_return;
+        }
+        more = onWritten(len);
+    }
+}
+#endif
+
+void Participant::replayed(std::uint32_t channelId, const std::vector<Protocol::FramePtr> &frames, std::string_view end)
+{
+    if (closed)
+    {
+        return;
+    }
+    for (auto &frame : frames)
+    {
+        // 历史中的frame不带channel ID：v2的接收方以当前的ID标记，v1的接收方batch需拆分为单独的MESSAGE，其余的由write()转换
+        try
+        {
+            if (version == Protocol::Version::V1 &&
+                Protocol::frameType(*frame) == static_cast<std::uint16_t>(Protocol::Type::MESSAGE_BATCH))
+            {
+                for (auto &part : Protocol::splitBatch(*frame))
+                {
+                    write(part);
+                }
+                continue;
+            }
+            writeTagged(frame, channelId);
+        }
+        catch (const Protocol::invalid_length &)
+        {
+            TRACE(FRAME_DROP, id, frame->size());
+        }
+    }
+    writeTagged(Protocol::encodeFrame(Protocol::Type::HISTORY_END, end), channelId);
+}
+
+void Participant::handle(const Protocol::Package &pkg)
+{
+    handle(pkg.view());
+}
+
+void Participant::handle(const Protocol::PackageView &pkg)
+{
+    try
+    {
+        auto type = Protocol::decodePackage(pkg);
+        switch (type)
+        {
+        case Protocol::Type::MESSAGE: //转发给同一channel的接收方
+        case Protocol::Type::MESSAGE_BATCH:
+            transmit(pkg);
+            break;
+
+        case Protocol::Type::LEAVE_CHANNEL:
+            leaveChannel(pkg);
+            break;
+
+        case Protocol::Type::LIST_ALL_CHANNELS:
+            listAllChannels(pkg.body);
+            break;
+
+        case Protocol::Type::LIST_CHANGES:
+            listChanges(pkg.body);
+            break;
+
+        case Protocol::Type::CREATE_CHANNEL:
+            createChannel(pkg.body);
+            break;
+
+        case Protocol::Type::JOIN_IN_CHANNEL:
+            joinInChannel(pkg.body);
+            break;
+
+        case Protocol::Type::HELLO:
+            hello(pkg);
+            break;
+
+        case Protocol::Type::STATS:
+            replyStats();
+            break;
+
+        case Protocol::Type::PING:
+            write(Protocol::encodeFrame(Protocol::Type::PONG, pkg.body, version));
+            break;
+
+        case Protocol::Type::PONG:
+            break; // 收到任何frame都已记为活动
+
+        case Protocol::Type::HELLO_ACK:
+            break; // 本节点发起的节点间连接，发出HELLO后已直接使用v2
+
+        case Protocol::Type::HISTORY:
+            requestHistory(pkg);
+            break;
+
+        case Protocol::Type::STREAM:
+            handleStream(pkg);
+            break;
+
+        case Protocol::Type::STREAM_CREDIT:
+            creditStream(pkg.body);
+            break;
+
+        case Protocol::Type::TUNNEL:
+            requestTunnel(pkg.body);
+            break;
+
+        default:
+            TRACE(BAD_REQUEST, id, static_cast<std::uint16_t>(type));
+            break;
+        }
+    }
+    catch (const std::exception &)
+    {
+        TRACE(BAD_REQUEST, id, pkg.type);
+    }
+}
+
+void Participant::replyStats()
+{
+    MetricsWriter writer;
+    shard.getServer().writeMetrics(writer);
+    if (!channels.empty())
+    {
+        // channel的指标都是原子变量，可以直接在本shard读取
+        std::vector<ChannelSample> samples;
+        for (auto &ch : channels)
+        {
+            samples.push_back(sampleChannel(*ch));
+        }
+        writeChannelMetrics(writer, samples);
+    }
+    const MetricField<std::atomic<std::uint64_t> ParticipantMetrics::*> fields[] = {
+        {"connection_frames_in_total", "counter", "Frames received on this connection.", &ParticipantMetrics::framesIn},
+        {"connection_bytes_in_total", "counter", "Bytes received on this connection.", &ParticipantMetrics::bytesIn},
+        {"connection_frames_out_total", "counter", "Frames written to this connection.", &ParticipantMetrics::framesOut},
+        {"connection_bytes_out_total", "counter", "Bytes written to this connection.", &ParticipantMetrics::bytesOut},
+        {"connection_send_queue_bytes_high_water", "gauge", "Largest send queue of this connection, in bytes.", &ParticipantMetrics::queueBytesHighWater},
+        {"connection_send_queue_frames_high_water", "gauge", "Largest send queue of this connection, in frames.", &ParticipantMetrics::queueFramesHighWater},
+    };
+    for (auto &field : fields)
+    {
+        writer.describe(field.name, field.type, field.help);
+        writer.sample(field.name, static_cast<double>((participantMetrics.*field.value).load(std::memory_order_relaxed)));
+    }
+    writer.describe("connection_slow_consumer_total", "counter", "Times a slow consumer policy was applied to this connection.");
+    writer.sample("connection_slow_consumer_total", stats.droppedOldest, "policy=\"drop-oldest\"");
+    writer.sample("connection_slow_consumer_total", stats.droppedNewest, "policy=\"drop-newest\"");
+    writer.sample("connection_slow_consumer_total", stats.disconnected, "policy=\"disconnect\"");
+    writer.sample("connection_slow_consumer_total", stats.paused, "policy=\"pause\"");
+    write(Protocol::encodeFrame(Protocol::Type::STATS_RESULT, writer.str(), version));
+}
+
+void Participant::hello(const Protocol::PackageView &pkg)
+{
+    std::uint8_t requested = pkg.body.empty() ? 0 : static_cast<std::uint8_t>(pkg.body[0]);
+    if (requested < static_cast<std::uint8_t>(Protocol::Version::V1))
+    {
+        write(Protocol::encodeFrame(Protocol::Type::OTHER_ERROR, "Error: invalid protocol version", version));
+        return;
+    }
+    // 取双方都支持的最高版本
+    auto negotiated = std::min(requested, static_cast<std::uint8_t>(Protocol::Version::V2));
+    // HELLO_ACK总是以v1编码，客户端在收到之前不能假定server支持v2
+    // 协商出v2且支持stream时，版本之后是varint编码的stream窗口大小
+    Protocol::FrameBuilder ack(Protocol::Type::HELLO_ACK, Protocol::Version::V1, 1 + 5);
+    *ack.prepare(1) = negotiated;
+    ack.commit(1);
+    if (negotiated == static_cast<std::uint8_t>(Protocol::Version::V2) && options.streamWindow > 0 && !mux)
+    {
+        Protocol::appendVarint(ack, options.streamWindow);
+    }
+    write(ack.finish());
+    version = static_cast<Protocol::Version>(negotiated);
+    reader.setMaxBodyLength(version == Protocol::Version::V2 ? options.maxFrameBytes : Protocol::BODY_MAX_LENGTH);
+    if (pkg.body.size() > 1 && (static_cast<std::uint8_t>(pkg.body[1]) & Protocol::HELLO_PEER) &&
+        shard.getServer().federation() && !mux)
+    {
+        // 不被接受时按普通客户端处理，stream数等限制照常检查
+        boost::system::error_code ec;
+        auto remote = socket.remote_endpoint(ec);
+        peer = !ec && shard.getServer().federation()->isNode(remote.address());
+#ifdef TCP_PROTO_TLS
+        if (!options.tls.caFile.empty() && shard.getServer().tlsContext(false))
+        {
+            peer = peer && certified;
+        }
+#endif
+        if (!peer)
+        {
+            TRACE(BAD_REQUEST, id, pkg.type);
+            LOG(WARNING) << "rejected federation peer " << (ec ? std::string("unknown") : remote.address().to_string());
+        }
+    }
+    armTimeout(); // 协商出v2后改为发送PING检查空闲
+}
+
+std::shared_ptr<Channel> Participant::findChannel(std::uint32_t channelId)
+{
+    auto it = std::lower_bound(channels.begin(), channels.end(), channelId,
+                               [](const std::shared_ptr<Channel> &ch, std::uint32_t target) { return ch->id() < target; });
+    return it != channels.end() && (*it)->id() == channelId ? *it : nullptr;
+}
+
+std::shared_ptr<Channel> Participant::targetChannel(const Protocol::PackageView &pkg, std::string_view &body)
+{
+    body = pkg.body;
+    const char *error;
+    if (pkg.flags & Protocol::FLAG_CHANNEL)
+    {
+        auto channelId = Protocol::readChannelId(body);
+        if (fromPeer() && channels.size() == 1)
+        {
+            return channels.front(); // 节点间的stream只在一个channel中，ID是对端分配的
+        }
+        if (auto ch = findChannel(channelId))
+        {
+            return ch;
+        }
+        error = "Error: not a member of this channel";
+    }
+    else if (channels.size() == 1)
+    {
+        return channels.front();
+    }
+    else
+    {
+        error = channels.empty() ? "Error: did not join any channel" : "Error: channel id required";
+    }
+    write(Protocol::encodeFrame(Protocol::Type::OTHER_ERROR, error, version));
+    return nullptr;
+}
+
+void Participant::writeTagged(Protocol::FramePtr frame, std::uint32_t channelId)
+{
+    if (version != Protocol::Version::V1)
+    {
+        frame = Protocol::tagFrame(*frame, channelId);
+    }
+    write(std::move(frame));
+}
+
+void Participant::transmit(const Protocol::PackageView &inputPkg)
+{
+    std::string_view body;
+    auto ch = targetChannel(inputPkg, body);
+    if (!ch)
+    {
+        return;
+    }
+
+    // 在channel所属的shard上转发，出错时再把错误信息投递回本participant
+    // body从接收缓冲区直接编码进共享的frame，这是转发路径上唯一的一次复制
+    // batch只校验格式，不拆分：整个batch作为一个frame转发
+    auto type = static_cast<Protocol::Type>(inputPkg.type);
+    std::uint64_t messages = 1;
+    if (type == Protocol::Type::MESSAGE_BATCH)
+    {
+        messages = Protocol::countBatch(body);
+    }
+    auto self = shared_from_this();
+    Protocol::FramePtr frame;
+    if (version == Protocol::Version::V1)
+    {
+        frame = Protocol::encodeFrame(type, body);
+    }
+    else
+    {
+        // 不论客户端是否指定，v2的frame都带上channel ID，加入多个channel的接收方据此区分
+        Protocol::FrameBuilder builder(type, version, body.size() + 5, inputPkg.flags | Protocol::FLAG_CHANNEL);
+        Protocol::appendChannelId(builder, ch->id());
+        frame = builder.append(body).finish();
+    }
+    // 其他节点转发来的消息在本节点没有接收方是正常的，不回复错误
+    ch->owner().dispatch([ch, self, frame, messages, quiet = fromPeer()]() {
+        const char *error = nullptr;
+        if (ch->count() <= 1)
+        {
+            error = "Error: no other members in this channel";
+        }
+        else if (!ch->send(self, frame, messages))
+        {
+            error = "Error: transmit package failed";
+        }
+        else
+        {
+            return;
+        }
+        if (!quiet)
+        {
+            self->deliver(Protocol::encodeFrame(Protocol::Type::OTHER_ERROR, error));
+        }
+    });
+}
+
+void Participant::leaveChannel(const Protocol::PackageView &pkg)
+{
+    if (channels.empty())
+    {
+        return;
+    }
+    std::string_view body;
+    auto ch = targetChannel(pkg, body);
+    if (!ch)
+    {
+        return;
+    }
+    auto self = shared_from_this();
+    ch->owner().dispatch([ch, self]() { ch->leave(self); });
+    channels.erase(std::find(channels.begin(), channels.end(), ch));
+    writeTagged(Protocol::encodeFrame(Protocol::Type::SUCCEED_IN_LEAVE_CHANNEL, "leaved channel"), ch->id());
+}
+
+// 解析十进制无符号整数，必须占满整个str
+static bool parseNumber(std::string_view str, std::uint64_t &value)
+{
+    auto result = std::from_chars(str.data(), str.data() + str.size(), value);
+    return !str.empty() && result.ec == std::errc() && result.ptr == str.data() + str.size();
+}
+
+void Participant::listAllChannels(std::string_view body)
+{
+    auto self = shared_from_this();
+    Server &server = shard.getServer();
+    if (body.empty() && version == Protocol::Version::V1)
+    {
+        // 旧的客户端不带参数，仍回复以", "连接的名称
+        server.directoryShard().dispatch([self, &server]() {
+            for (auto &frame : server.channelDirectory().legacyList())
+            {
+                self->deliver(frame);
+            }
+        });
+        return;
+    }
+    // 名称中不会出现','，前缀及游标都按名称处理
+    auto first = body.find(',');
+    std::string_view prefix = body.substr(0, first);
+    std::string_view cursor;
+    std::uint64_t limit = 0;
+    bool valid = true;
+    if (first != std::string_view::npos)
+    {
+        auto second = body.find(',', first + 1);
+        cursor = body.substr(first + 1, second == std::string_view::npos ? second : second - first - 1);
+        valid = second == std::string_view::npos || parseNumber(body.substr(second + 1), limit);
+    }
+    if (!valid)
+    {
+        write(Protocol::encodeFrame(Protocol::Type::OTHER_ERROR, "Error: invalid list request", version));
+        return;
+    }
+    server.directoryShard().dispatch([self, &server, prefix = std::string(prefix), cursor = std::string(cursor),
+                                      limit, frameVersion = version]() {
+        self->deliver(server.channelDirectory().list(prefix, cursor, limit, frameVersion));
+    });
+}
+
+void Participant::listChanges(std::string_view body)
+{
+    auto separator = body.find(',');
+    std::uint64_t since = 0;
+    std::uint64_t limit = 0;
+    if (!parseNumber(body.substr(0, separator), since) ||
+        (separator != std::string_view::npos && !parseNumber(body.substr(separator + 1), limit)))
+    {
+        write(Protocol::encodeFrame(Protocol::Type::OTHER_ERROR, "Error: invalid changes request", version));
+        return;
+    }
+    auto self = shared_from_this();
+    Server &server = shard.getServer();
+    server.directoryShard().dispatch([self, &server, since, limit, frameVersion = version]() {
+        auto frame = server.channelDirectory().changes(since, limit, frameVersion);
+        if (!frame)
+        {
+            frame = Protocol::encodeFrame(Protocol::Type::OTHER_ERROR, "Error: version too old, list again", frameVersion);
+        }
+        self->deliver(frame);
+    });
+}
+
+void Participant::createChannel(std::string_view body)
+{
+    // channel名称中不允许出现','；只有v2的连接可以在名称之后以','指定策略，v1的body整个都是名称
+    const char *error = nullptr;
+    SlowConsumerPolicy policy = options.slowConsumerPolicy;
+    auto separator = version == Protocol::Version::V1 ? std::string_view::npos : body.find(',');
+    std::string_view channelName = body.substr(0, separator);
+    if (channelName.empty() || channelName.find(',') != std::string_view::npos)
+    {
+        error = "Error: invalid channel name";
+    }
+    else if (separator != std::string_view::npos && !parseSlowConsumerPolicy(body.substr(separator + 1), policy))
+    {
+        error = "Error: invalid slow consumer policy";
+    }
+    else if (joining || (version == Protocol::Version::V1 && !channels.empty()))
+    {
+        error = "Error: already in one channel";
+    }
+    else if (channels.size() >= options.maxChannelsPerConnection)
+    {
+        error = "Error: too many channels";
+    }
+    else
+    {
+        joining = true;
+        auto self = shared_from_this();
+        Shard &owner = shard.getServer().owner(channelName);
+        // 名称需要跨线程保存，只在这里复制一次
+        owner.dispatch([self, name = std::string(channelName), policy, &owner]() {
+            std::shared_ptr<Channel> joined;
+            Protocol::FramePtr reply;
+            // 先检查名称再构造，同名channel的历史不会被再次打开
+            std::shared_ptr<Channel> channelPtr;
+            if (!owner.channels().find(name))
+            {
+                Federation *federation = owner.getServer().federation();
+                if (federation && !federation->isLocal(name) && !self->fromPeer())
+                {
+                    federation->join(owner, self, name, true, policy);
+                    return;
+                }
+                channelPtr = std::make_shared<Channel>(owner, name);
+                channelPtr->setPolicy(policy);
+            }
+            if (channelPtr && owner.addChannel(channelPtr))
+            {
+                TRACE(CHANNEL_CREATE, std::hash<std::string>{}(name), Trace::packName(name));
+                if (channelPtr->join(self))
+                {
+                    joined = channelPtr->getPtr();
+                    reply = Protocol::FrameBuilder(Protocol::Type::SUCCEED_IN_CREATE_CHANNEL)
+                                .append("create and join in channel: ")
+                                .append(name)
+                                .finish();
+                }
+                else
+                {
+                    reply = Protocol::encodeFrame(Protocol::Type::FAIL_IN_CREATE_CHANNEL,
+                                                  "Error: failed to join in created channel");
+                    owner.removeChannel(*channelPtr);
+                }
+            }
+            else
+            {
+                reply = Protocol::encodeFrame(Protocol::Type::FAIL_IN_CREATE_CHANNEL, "Error: channel already exist");
+            }
+            self->home().dispatch([self, joined, reply]() { self->onJoined(joined, reply); });
+        });
+        return;
+    }
+    write(Protocol::encodeFrame(Protocol::Type::FAIL_IN_CREATE_CHANNEL, error, version));
+}
+
+void Participant::joinInChannel(std::string_view channelName)
+{
+    if (version == Protocol::Version::V1 && !channels.empty())
+    {
+        write(Protocol::FrameBuilder(Protocol::Type::FAIL_IN_JOIN_IN_CHANNEL, version)
+                  .append("already in channel: ")
+                  .append(channels.front()->getName())
+                  .finish());
+        return;
+    }
+    if (joining)
+    {
+        write(Protocol::encodeFrame(Protocol::Type::FAIL_IN_JOIN_IN_CHANNEL, "Error: already joining a channel", version));
+        return;
+    }
+    if (channels.size() >= options.maxChannelsPerConnection)
+    {
+        write(Protocol::encodeFrame(Protocol::Type::FAIL_IN_JOIN_IN_CHANNEL, "Error: too many channels", version));
+        return;
+    }
+
+    joining = true;
+    auto self = shared_from_this();
+    Shard &owner = shard.getServer().owner(channelName);
+    owner.dispatch([self, name = std::string(channelName), &owner]() {
+        std::shared_ptr<Channel> joined;
+        Protocol::FramePtr reply;
+        auto found = owner.channels().find(name);
+        if (found)
+        {
+            auto &target = *found;
+            if (target->contains(self))
+            {
+                reply = Protocol::encodeFrame(Protocol::Type::FAIL_IN_JOIN_IN_CHANNEL, "Error: already in this channel");
+            }
+            else if (target->join(self))
+            {
+                joined = target->getPtr();
+                reply = Protocol::FrameBuilder(Protocol::Type::SUCCEED_IN_JOIN_IN_CHANNEL)
+                            .append("join in channel: ")
+                            .append(name)
+                            .finish();
+            }
+            else if (target->ifFull())
+            {
+                reply = Protocol::encodeFrame(Protocol::Type::FAIL_IN_JOIN_IN_CHANNEL, "Error: selected channel is full");
+            }
+            else
+            {
+                reply = Protocol::encodeFrame(Protocol::Type::FAIL_IN_JOIN_IN_CHANNEL,
+                                              "Error: fail to join in selected channel");
+            }
+        }
+        else if (Federation *federation = owner.getServer().federation();
+                 federation && !federation->isLocal(name) && !self->fromPeer())
+        {
+            federation->join(owner, self, name, false, owner.getServer().getOptions().slowConsumerPolicy);
+            return;
+        }
+        else
+        {
+            reply = Protocol::encodeFrame(Protocol::Type::FAIL_IN_JOIN_IN_CHANNEL, "Error: selected channel not exist");
+        }
+        self->home().dispatch([self, joined, reply]() { self->onJoined(joined, reply); });
+    });
+}
+
+void Participant::requestHistory(const Protocol::PackageView &pkg)
+{
+    std::string_view body;
+    auto ch = targetChannel(pkg, body);
+    if (!ch)
+    {
+        return;
+    }
+    auto separator = body.find(',');
+    std::string_view mode = body.substr(0, separator);
+    std::uint64_t count = 0;
+    bool valid = separator != std::string_view::npos && (mode == "last" || mode == "since");
+    if (valid)
+    {
+        valid = parseNumber(body.substr(separator + 1), count);
+    }
+    if (!valid)
+    {
+        write(Protocol::encodeFrame(Protocol::Type::OTHER_ERROR, "Error: invalid history request", version));
+        return;
+    }
+    auto self = shared_from_this();
+    ch->owner().dispatch([ch, self, last = mode == "last", count]() { ch->replay(self, last, count); });
+}
+
+void Participant::requestTunnel(std::string_view body)
+{
+    // channel名称中不会出现','，令牌为第二个','之后的全部内容
+    auto separator = body.find(',');
+    auto tokenSeparator = separator == std::string_view::npos ? separator : body.find(',', separator + 1);
+    std::string_view mode = body.substr(0, separator);
+    if (tokenSeparator == std::string_view::npos || tokenSeparator == separator + 1 || tokenSeparator + 1 == body.size() ||
+        (mode != "offer" && mode != "connect"))
+    {
+        write(Protocol::encodeFrame(Protocol::Type::TUNNEL_FAILED, "Error: invalid tunnel request", version));
+        return;
+    }
+    if (mux || peer || dialed || joining || !channels.empty() || !streams.empty())
+    {
+        // 隧道独占整个socket
+        write(Protocol::encodeFrame(Protocol::Type::TUNNEL_FAILED, "Error: tunnel needs a connection of its own", version));
+        return;
+    }
+#ifdef TCP_PROTO_TLS
+    if (tls)
+    {
+        // 在用户态加解密的连接无法以splice()转发
+        write(Protocol::encodeFrame(Protocol::Type::TUNNEL_FAILED, "Error: tunnel needs kernel TLS", version));
+        return;
+    }
+#endif
+    tunneling = true;
+    shard.timers().cancel(timeout);
+    bool offer = mode == "offer";
+    std::string name(body.substr(separator + 1, tokenSeparator - separator - 1));
+    std::string token(body.substr(tokenSeparator + 1));
+    if (offer)
+    {
+        tunnelName = name;
+        watchTunnel();
+    }
+    auto self = shared_from_this();
+    Shard &owner = shard.getServer().owner(name);
+    owner.dispatch([self, name, token, offer, &owner]() { owner.tunnel(self, name, token, offer); });
+}
+
+void Participant::watchTunnel()
+{
+    auto self = shared_from_this();
+    socket.async_wait(boost::asio::ip::tcp::socket::wait_read, [this, self](std::error_code ec) {
+        if (ec || closed || tunnelName.empty())
+        {
+            return; // 已配对或已失败，之后的数据不再由这里检查
+        }
+        char byte;
+        ssize_t n = ::recv(socket.native_handle(), &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+        {
+            // 客户端在配对之前断开，读取已经停止，不会再有读操作失败来触发exit()
+            close();
+            exit();
+        }
+        else if (n < 0)
+        {
+            watchTunnel();
+        }
+        // 否则客户端在配对之前就发来了数据，留在socket中，配对后由Tunnel转发
+    });
+}
+
+void Participant::tunnelFailed(Protocol::FramePtr failure)
+{
+    tunneling = false;
+    tunnelName.clear();
+    tunnelSpill.clear();
+    if (closed)
+    {
+        return;
+    }
+    write(failure);
+    armTimeout();
+    continueReading();
+}
+
+void Participant::tunnelPaired(Protocol::FramePtr ready,
+                               std::function<void(int, boost::asio::ip::tcp, std::string)> handoff)
+{
+    tunnelName.clear();
+    if (closed)
+    {
+        handoff(-1, boost::asio::ip::tcp::v4(), std::string());
+        return;
+    }
+    tunnelHandoff = std::move(handoff);
+    write(ready);
+}
+
+void Participant::handOffTunnel()
+{
+    auto handoff = std::move(tunnelHandoff);
+    tunnelHandoff = nullptr;
+    // 请求之后已读到的数据：reader中尚未解析的部分，以及io_uring引擎放不进reader的部分
+    auto unparsed = reader.data();
+    std::string head(static_cast<const char *>(unparsed.data()), unparsed.size());
+    head += tunnelSpill;
+    tunnelSpill.clear();
+    boost::system::error_code ec;
+    auto protocol = socket.local_endpoint(ec).protocol();
+    int fd = -1;
+    if (!ec)
+    {
+        fd = socket.release(ec); // 取消未完成的watchTunnel()，fd不再由socket关闭
+        fd = ec ? -1 : fd;
+    }
+    closed = true;
+    socket.close(ec);
+    exit();
+    handoff(fd, protocol, std::move(head));
+}
+
+void Participant::onJoined(std::shared_ptr<Channel> joined, Protocol::FramePtr reply)
+{
+    joining = false;
+    if (closed)
+    {
+        // 等待回复期间连接已经断开，撤销这次加入
+        if (joined)
+        {
+            auto self = shared_from_this();
+            joined->owner().dispatch([joined, self]() { joined->leave(self); });
+        }
+        return;
+    }
+    if (joined)
+    {
+        auto pos = std::lower_bound(channels.begin(), channels.end(), joined->id(),
+                                    [](const std::shared_ptr<Channel> &ch, std::uint32_t id) { return ch->id() < id; });
+        channels.insert(pos, joined);
+        writeTagged(reply, joined->id());
+        return;
+    }
+    write(reply);
+}
+
+// ---------------- Class MetricsListener ------------------------------
+
+MetricsListener::MetricsListener(Server &srv, boost::asio::io_context &ioCtx, unsigned short port)
+    : server(srv),
+      acceptor(ioCtx, boost::asio::ip::tcp::endpoint(boost::asio::ip::address_v4::loopback(), port))
+{
+    LOG(INFO) << "metrics listen in 127.0.0.1:" << acceptor.local_endpoint().port();
+    accept();
+}
+
+boost::asio::ip::tcp::endpoint MetricsListener::localEndpoint()
+{
+    return acceptor.local_endpoint();
+}
+
+void MetricsListener::accept()
+{
+    acceptor.async_accept([this](std::error_code ec, boost::asio::ip::tcp::socket socket) {
+        if (!ec)
+        {
+            serve(std::make_shared<boost::asio::ip::tcp::socket>(std::move(socket)));
+            accept();
+        }
+    });
+}
+
+void MetricsListener::serve(std::shared_ptr<boost::asio::ip::tcp::socket> socket)
+{
+    // 不解析请求内容，读到请求头结束后即返回指标
+    auto request = std::make_shared<std::string>();
+    boost::asio::async_read_until(*socket, boost::asio::dynamic_buffer(*request, 8192), "\r\n\r\n",
+                                  [this, socket, request](std::error_code ec, std::size_t) {
+                                      if (ec)
+                                      {
+                                          return;
+                                      }
+                                      server.collectMetrics([socket](std::string body) {
+                                          auto response = std::make_shared<std::string>(
+                                              "HTTP/1.0 200 OK\r\n"
+                                              "Content-Type: text/plain; version=0.0.4\r\n"
+                                              "Content-Length: " + std::to_string(body.size()) + "\r\n"
+                                              "Connection: close\r\n\r\n" + body);
+                                          // 回到socket所在的线程发送
+                                          boost::asio::post(socket->get_executor(), [socket, response]() {
+                                              boost::asio::async_write(*socket, boost::asio::buffer(*response),
+                                                                       [socket, response](std::error_code, std::size_t) {
+                                                                           boost::system::error_code ignored;
+                                                                           socket->shutdown(boost::asio::ip::tcp::socket::shutdown_both, ignored);
+                                                                       });
+                                          });
+                                      });
+                                  });
 }
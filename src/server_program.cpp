@@ -1,17 +1,270 @@
 #include <server.hpp>
+#include <trace.hpp>
 #include <boost/asio.hpp>
 #include <glog/logging.h>
+#include <string>
+#include <thread>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+
+static void printUsage()
+{
+    LOG(ERROR) << "Usage: server <port> [--threads <N>] [--write-delay <microseconds>]"
+               << " [--send-queue-bytes <bytes>] [--send-queue-frames <N>] [--max-frame-bytes <bytes>]"
+               << " [--slow-consumer drop-oldest|drop-newest|disconnect|pause]"
+               << " [--channel-capacity <N>] [--max-channels <N>] [--metrics-port <port>] [--trace-file <path>]"
+               << " [--engine callback|coroutine|io_uring]"
+               << " [--handshake-timeout <ms>] [--idle-timeout <ms>] [--heartbeat-timeout <ms>]"
+               << " [--write-stall-timeout <ms>] [--history-dir <path>] [--history-segment-bytes <bytes>]"
+               << " [--history-max-bytes <bytes>] [--history-max-age <seconds>]"
+               << " [--stream-window <bytes>] [--max-streams <N>] [--max-peer-streams <N>]"
+               << " [--nodes <ip:port,ip:port,...>] [--node-index <N>]"
+               << " [--tls-cert <pem>] [--tls-key <pem>] [--tls-ca <pem>] [--tls-offload on|off]\n";
+}
+
+// 解析十进制无符号整数，不是数字、有多余字符或超出T的范围时返回false
+template <typename T>
+static bool parseNumber(const char *text, T &value)
+{
+    try
+    {
+        std::size_t used;
+        unsigned long long parsed = std::stoull(text, &used);
+        if (text[0] == '-' || text[used] != '\0' || parsed > std::numeric_limits<T>::max())
+        {
+            return false;
+        }
+        value = static_cast<T>(parsed);
+        return true;
+    }
+    catch (const std::logic_error &)
+    {
+        return false;
+    }
+}
 
 int main(int argc, char *argv[])
 {
-    if (argc != 2)
+    // 端口之后的参数都是成对的"--选项 值"，缺少值时打印用法
+    bool valid = argc >= 2 && argc % 2 == 0;
+    if (!valid)
     {
-        LOG(ERROR) << "Usage: server <port>\n";
+        printUsage();
         return 1;
     }
-    boost::asio::io_context ioContext;
+    ServerOptions options;
+    unsigned int threads = 1;
+    std::string traceFile; // 退出时把trace写入该文件，为空时不写
+    for (int i = 2; i + 1 < argc; i += 2)
+    {
+        std::string flag = argv[i];
+        if (flag == "--threads")
+        {
+            threads = std::max(1, std::atoi(argv[i + 1]));
+        }
+        else if (flag == "--write-delay")
+        {
+            options.writeDelay = std::chrono::microseconds(std::atoi(argv[i + 1]));
+        }
+        else if (flag == "--send-queue-bytes")
+        {
+            if (!parseNumber(argv[i + 1], options.sendQueueMaxBytes))
+            {
+                LOG(ERROR) << "invalid value for " << flag << ": " << argv[i + 1];
+                printUsage();
+                return 1;
+            }
+        }
+        else if (flag == "--send-queue-frames")
+        {
+            if (!parseNumber(argv[i + 1], options.sendQueueMaxFrames))
+            {
+                LOG(ERROR) << "invalid value for " << flag << ": " << argv[i + 1];
+                printUsage();
+                return 1;
+            }
+        }
+        else if (flag == "--max-frame-bytes") // v2 frame body的上限，不超过协议允许的16MB
+        {
+            unsigned long long maxFrameBytes;
+            if (!parseNumber(argv[i + 1], maxFrameBytes))
+            {
+                LOG(ERROR) << "invalid value for " << flag << ": " << argv[i + 1];
+                printUsage();
+                return 1;
+            }
+            options.maxFrameBytes = static_cast<std::uint32_t>(
+                std::min<unsigned long long>(maxFrameBytes, Protocol::V2_BODY_MAX_LENGTH));
+        }
+        else if (flag == "--channel-capacity")
+        {
+            options.channelCapacity = std::max(1, std::atoi(argv[i + 1]));
+        }
+        else if (flag == "--max-channels")
+        {
+            options.maxChannelsPerConnection = std::max(1, std::atoi(argv[i + 1]));
+        }
+        else if (flag == "--stream-window") // 为0时不支持stream
+        {
+            if (!parseNumber(argv[i + 1], options.streamWindow))
+            {
+                LOG(ERROR) << "invalid value for " << flag << ": " << argv[i + 1];
+                printUsage();
+                return 1;
+            }
+        }
+        else if (flag == "--max-streams")
+        {
+            options.maxStreamsPerConnection = std::max(1, std::atoi(argv[i + 1]));
+        }
+        else if (flag == "--max-peer-streams")
+        {
+            options.maxStreamsPerPeer = std::max(1, std::atoi(argv[i + 1]));
+        }
+        else if (flag == "--nodes") // federation中所有节点的地址，各节点相同
+        {
+            options.nodes.clear();
+            std::string list = argv[i + 1];
+            for (std::size_t start = 0; start <= list.size();)
+            {
+                auto end = std::min(list.find(',', start), list.size());
+                options.nodes.push_back(list.substr(start, end - start));
+                start = end + 1;
+            }
+        }
+        else if (flag == "--node-index") // 本节点在--nodes中的下标
+        {
+            options.nodeIndex = static_cast<unsigned int>(std::atoi(argv[i + 1]));
+        }
+        else if (flag == "--tls-cert") // 指定证书即启用TLS
+        {
+            options.tls.certFile = argv[i + 1];
+        }
+        else if (flag == "--tls-key")
+        {
+            options.tls.keyFile = argv[i + 1];
+        }
+        else if (flag == "--tls-ca") // federation：验证其他节点的证书
+        {
+            options.tls.caFile = argv[i + 1];
+        }
+        else if (flag == "--tls-offload") // 内核支持时是否使用kTLS，默认为on
+        {
+            options.tls.kernelOffload = std::string(argv[i + 1]) != "off";
+        }
+        else if (flag == "--metrics-port")
+        {
+            options.metricsPort = static_cast<unsigned short>(std::atoi(argv[i + 1]));
+        }
+        else if (flag == "--engine")
+        {
+            if (!parseSessionEngine(argv[i + 1], options.engine))
+            {
+                LOG(ERROR) << "invalid or unsupported engine: " << argv[i + 1];
+                return 1;
+            }
+        }
+        else if (flag == "--handshake-timeout")
+        {
+            options.handshakeTimeout = std::chrono::milliseconds(std::atoi(argv[i + 1]));
+        }
+        else if (flag == "--idle-timeout")
+        {
+            options.idleTimeout = std::chrono::milliseconds(std::atoi(argv[i + 1]));
+        }
+        else if (flag == "--heartbeat-timeout")
+        {
+            options.heartbeatTimeout = std::chrono::milliseconds(std::atoi(argv[i + 1]));
+        }
+        else if (flag == "--write-stall-timeout")
+        {
+            options.writeStallTimeout = std::chrono::milliseconds(std::atoi(argv[i + 1]));
+        }
+        else if (flag == "--history-dir")
+        {
+            options.history.directory = argv[i + 1];
+        }
+        else if (flag == "--history-segment-bytes")
+        {
+            if (!parseNumber(argv[i + 1], options.history.segmentBytes))
+            {
+                LOG(ERROR) << "invalid value for " << flag << ": " << argv[i + 1];
+                printUsage();
+                return 1;
+            }
+        }
+        else if (flag == "--history-max-bytes")
+        {
+            if (!parseNumber(argv[i + 1], options.history.maxBytes))
+            {
+                LOG(ERROR) << "invalid value for " << flag << ": " << argv[i + 1];
+                printUsage();
+                return 1;
+            }
+        }
+        else if (flag == "--history-max-age")
+        {
+            options.history.maxAge = std::chrono::seconds(std::atoll(argv[i + 1]));
+        }
+        else if (flag == "--trace-file")
+        {
+            traceFile = argv[i + 1];
+        }
+        else if (flag == "--slow-consumer")
+        {
+            if (!parseSlowConsumerPolicy(argv[i + 1], options.slowConsumerPolicy))
+            {
+                LOG(ERROR) << "invalid slow consumer policy: " << argv[i + 1];
+                return 1;
+            }
+        }
+        else
+        {
+            LOG(ERROR) << "unknown option: " << flag;
+            return 1;
+        }
+    }
+
+    // 每个线程一个io_context
+    std::vector<std::unique_ptr<boost::asio::io_context>> ioContexts;
+    std::vector<boost::asio::io_context *> contexts;
+    for (unsigned int i = 0; i < threads; i++)
+    {
+        ioContexts.push_back(std::make_unique<boost::asio::io_context>(1));
+        contexts.push_back(ioContexts.back().get());
+    }
     boost::asio::ip::tcp::endpoint endpoint(boost::asio::ip::tcp::v4(), std::atoi(argv[1]));
-    Server server(ioContext, endpoint);
-    ioContext.run();
+    Server server(contexts, endpoint, options);
+
+    // 收到SIGINT/SIGTERM后停止所有io_context，等待线程结束后再写出trace
+    boost::asio::signal_set signals(*ioContexts[0], SIGINT, SIGTERM);
+    signals.async_wait([&ioContexts](std::error_code ec, int) {
+        if (!ec)
+        {
+            for (auto &ioContext : ioContexts)
+            {
+                ioContext->stop();
+            }
+        }
+    });
+
+    std::vector<std::thread> workers;
+    for (unsigned int i = 1; i < threads; i++)
+    {
+        workers.emplace_back([&ioContexts, i]() { ioContexts[i]->run(); });
+    }
+    ioContexts[0]->run();
+    for (auto &worker : workers)
+    {
+        worker.join();
+    }
+    if (!traceFile.empty() && !Trace::dump(traceFile))
+    {
+        LOG(ERROR) << "failed to write trace to " << traceFile;
+        return 1;
+    }
     return 0;
 }
@@ -0,0 +1,172 @@
+#include "timing_wheel.hpp"
+#include <algorithm>
+
+namespace
+{
+    std::size_t roundUpToPowerOf2(std::size_t n)
+    {
+        std::size_t size = 1;
+        while (size < n)
+        {
+            size <<= 1;
+        }
+        return size;
+    }
+}
+
+TimingWheel::Timer::~Timer()
+{
+    if (wheel)
+    {
+        wheel->cancel(*this);
+    }
+}
+
+bool TimingWheel::Timer::scheduled() const
+{
+    return wheel != nullptr;
+}
+
+std::uint64_t TimingWheel::Timer::expiry() const
+{
+    return deadline;
+}
+
+TimingWheel::TimingWheel(std::chrono::milliseconds duration, std::size_t slotCount)
+    : tickDuration(std::max(duration, std::chrono::milliseconds(1))),
+      slots(roundUpToPowerOf2(slotCount), nullptr),
+      current(0),
+      count(0),
+      expiring(nullptr)
+{
+}
+
+TimingWheel::~TimingWheel()
+{
+    // 仍在调度中的timer与时间轮解除关联，之后析构时不再访问时间轮
+    for (Timer *&head : slots)
+    {
+        while (head)
+        {
+            Timer *timer = head;
+            unlink(*timer);
+            timer->wheel = nullptr;
+        }
+    }
+    while (expiring)
+    {
+        Timer *timer = expiring;
+        unlink(*timer);
+        timer->wheel = nullptr;
+    }
+}
+
+std::uint64_t TimingWheel::now() const
+{
+    return current;
+}
+
+std::chrono::milliseconds TimingWheel::tick() const
+{
+    return tickDuration;
+}
+
+std::uint64_t TimingWheel::ticks(std::chrono::milliseconds duration) const
+{
+    if (duration.count() <= 0)
+    {
+        return 0;
+    }
+    return static_cast<std::uint64_t>((duration.count() + tickDuration.count() - 1) / tickDuration.count());
+}
+
+void TimingWheel::schedule(Timer &timer, std::uint64_t deadline)
+{
+    cancel(timer);
+    timer.deadline = std::max(deadline, current + 1);
+    timer.wheel = this;
+    link(timer, slots[timer.deadline & (slots.size() - 1)]);
+    count++;
+}
+
+void TimingWheel::cancel(Timer &timer)
+{
+    if (timer.wheel != this)
+    {
+        return;
+    }
+    unlink(timer);
+    timer.wheel = nullptr;
+    count--;
+}
+
+std::size_t TimingWheel::size() const
+{
+    return count;
+}
+
+bool TimingWheel::empty() const
+{
+    return count == 0;
+}
+
+void TimingWheel::advance(std::uint64_t target)
+{
+    if (target <= current)
+    {
+        return;
+    }
+    // 先把所有到期的timer移到expiring中再逐个调用：expire()中可能取消或重新调度任意timer
+    std::uint64_t steps = std::min<std::uint64_t>(target - current, slots.size());
+    for (std::uint64_t i = 1; i <= steps; i++)
+    {
+        Timer *timer = slots[(current + i) & (slots.size() - 1)];
+        while (timer)
+        {
+            Timer *next = timer->next;
+            if (timer->deadline <= target)
+            {
+                unlink(*timer);
+                link(*timer, expiring);
+            }
+            timer = next;
+        }
+    }
+    current = target;
+    while (expiring)
+    {
+        Timer *timer = expiring;
+        cancel(*timer);
+        timer->expire();
+    }
+}
+
+void TimingWheel::link(Timer &timer, Timer *&head)
+{
+    timer.list = &head;
+    timer.prev = nullptr;
+    timer.next = head;
+    if (head)
+    {
+        head->prev = &timer;
+    }
+    head = &timer;
+}
+
+void TimingWheel::unlink(Timer &timer)
+{
+    if (timer.prev)
+    {
+        timer.prev->next = timer.next;
+    }
+    else
+    {
+        *timer.list = timer.next;
+    }
+    if (timer.next)
+    {
+        timer.next->prev = timer.prev;
+    }
+    timer.list = nullptr;
+    timer.prev = timer.next = nullptr;
+}
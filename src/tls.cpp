@@ -0,0 +1,287 @@
+#ifdef TCP_PROTO_TLS
+
+#include "tls.hpp"
+#include <openssl/err.h>
+#include <openssl/x509v3.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <signal.h>
+#include <unistd.h>
+#include <cerrno>
+#include <stdexcept>
+
+// ---------------- Class TlsContext ------------------------------
+
+// 内核可以卸载的TLS 1.2密码套件
+static const char *const KERNEL_CIPHERS = "ECDHE-ECDSA-AES128-GCM-SHA256:ECDHE-RSA-AES128-GCM-SHA256:"
+                                          "ECDHE-ECDSA-AES256-GCM-SHA384:ECDHE-RSA-AES256-GCM-SHA384";
+
+// 节点之间的连接在ALPN中声明的协议，以长度为前缀编码
+static const unsigned char PEER_PROTOCOL[] = "\x0e"
+                                             "tcp-proto-peer";
+static constexpr std::size_t PEER_PROTOCOL_LENGTH = sizeof(PEER_PROTOCOL) - 1;
+
+TlsContext::TlsContext(TlsRole tlsRole, const TlsOptions &options)
+    : ctx(SSL_CTX_new(tlsRole == TlsRole::SERVER ? TLS_server_method() : TLS_client_method())),
+      role(tlsRole),
+      offload(options.kernelOffload && kernelSupported()),
+      session(nullptr)
+{
+    if (!ctx)
+    {
+        throw std::runtime_error(lastError("SSL_CTX_new failed"));
+    }
+    // OpenSSL的socket BIO以write()写出（kTLS只能使用这种BIO），对端已关闭时不应以SIGPIPE终止进程
+    ::signal(SIGPIPE, SIG_IGN);
+    try
+    {
+        SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+        // 不支持重新协商；对端不发close_notify直接断开时按EOF处理
+        SSL_CTX_set_options(ctx, SSL_OP_NO_RENEGOTIATION | SSL_OP_IGNORE_UNEXPECTED_EOF);
+        if (offload)
+        {
+            SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#if OPENSSL_VERSION_NUMBER < 0x30200000L
+            SSL_CTX_set_max_proto_version(ctx, TLS1_2_VERSION);
+            SSL_CTX_set_cipher_list(ctx, KERNEL_CIPHERS);
+#endif
+        }
+        if ((role == TlsRole::SERVER || !options.certFile.empty()) &&
+            (SSL_CTX_use_certificate_chain_file(ctx, options.certFile.c_str()) != 1 ||
+             SSL_CTX_use_PrivateKey_file(ctx, (options.keyFile.empty() ? options.certFile : options.keyFile).c_str(),
+                                         SSL_FILETYPE_PEM) != 1 ||
+             SSL_CTX_check_private_key(ctx) != 1))
+        {
+            throw std::runtime_error(lastError("failed to load certificate " + options.certFile));
+        }
+        if (role == TlsRole::SERVER)
+        {
+            // ticket由server的密钥加密、client保存，server无需按会话ID缓存，各shard之间没有共享的状态
+            SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+            SSL_CTX_set_num_tickets(ctx, 1);
+        }
+        else if (options.resumeSessions)
+        {
+            // TLS 1.3的ticket在握手之后才到达，由回调保存
+            SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+            SSL_CTX_sess_set_new_cb(ctx, &TlsContext::onNewSession);
+            SSL_CTX_set_app_data(ctx, this);
+        }
+        if (!options.caFile.empty())
+        {
+            if (SSL_CTX_load_verify_locations(ctx, options.caFile.c_str(), nullptr) != 1)
+            {
+                throw std::runtime_error(lastError("failed to load CA " + options.caFile));
+            }
+            // server只在节点之间的连接上使用（见routePeers()），没有出示证书的对端握手失败
+            SSL_CTX_set_verify(ctx, role == TlsRole::SERVER ? SSL_VERIFY_PEER | SSL_VERIFY_FAIL_IF_NO_PEER_CERT : SSL_VERIFY_PEER,
+                               nullptr);
+        }
+    }
+    catch (...)
+    {
+        SSL_CTX_free(ctx);
+        throw;
+    }
+}
+
+TlsContext::~TlsContext()
+{
+    SSL_SESSION_free(session);
+    SSL_CTX_free(ctx);
+}
+
+SSL_CTX *TlsContext::native()
+{
+    return ctx;
+}
+
+TlsRole TlsContext::getRole()
+{
+    return role;
+}
+
+SSL_SESSION *TlsContext::cachedSession()
+{
+    std::lock_guard<std::mutex> lock(sessionMutex);
+    if (session)
+    {
+        SSL_SESSION_up_ref(session);
+    }
+    return session;
+}
+
+int TlsContext::onNewSession(SSL *ssl, SSL_SESSION *newSession)
+{
+    auto *context = static_cast<TlsContext *>(SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl)));
+    std::lock_guard<std::mutex> lock(context->sessionMutex);
+    SSL_SESSION_free(context->session);
+    context->session = newSession;
+    return 1; // 持有回调传入的引用
+}
+
+void TlsContext::announcePeer()
+{
+    SSL_CTX_set_alpn_protos(ctx, PEER_PROTOCOL, PEER_PROTOCOL_LENGTH);
+}
+
+void TlsContext::routePeers(std::shared_ptr<TlsContext> peerContext)
+{
+    peers = std::move(peerContext);
+    SSL_CTX_set_client_hello_cb(ctx, &TlsContext::onClientHello, this);
+}
+
+int TlsContext::onClientHello(SSL *ssl, int *, void *arg)
+{
+    auto *context = static_cast<TlsContext *>(arg);
+    const unsigned char *protocols = nullptr;
+    std::size_t length = 0;
+    if (SSL_client_hello_get0_ext(ssl, TLSEXT_TYPE_application_layer_protocol_negotiation, &protocols, &length) != 1 ||
+        length < 2)
+    {
+        return SSL_CLIENT_HELLO_SUCCESS;
+    }
+    // 2字节的列表长度之后是以长度为前缀的协议名
+    for (std::size_t offset = 2; offset < length; offset += 1 + protocols[offset])
+    {
+        if (length - offset >= PEER_PROTOCOL_LENGTH && std::memcmp(protocols + offset, PEER_PROTOCOL, PEER_PROTOCOL_LENGTH) == 0)
+        {
+            // 切换context不改变SSL上已设置的验证方式，需另外设置；session ticket的密钥仍来自原来的context
+            SSL_set_SSL_CTX(ssl, context->peers->ctx);
+            SSL_set_verify(ssl, SSL_CTX_get_verify_mode(context->peers->ctx), nullptr);
+            break;
+        }
+    }
+    return SSL_CLIENT_HELLO_SUCCESS;
+}
+
+bool TlsContext::kernelSupported()
+{
+    // 未连接的socket上设置tls ULP：模块存在时失败于ENOTCONN，不存在时为ENOENT
+    static const bool supported = []() {
+        int fd = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0)
+        {
+            return false;
+        }
+        bool result = ::setsockopt(fd, IPPROTO_TCP, TCP_ULP, "tls", sizeof("tls")) == 0 || errno == ENOTCONN;
+        ::close(fd);
+        return result;
+    }();
+    return supported;
+}
+
+std::string TlsContext::lastError(const std::string &what)
+{
+    unsigned long code = ERR_get_error();
+    ERR_clear_error();
+    if (code == 0)
+    {
+        return what;
+    }
+    char text[256];
+    ERR_error_string_n(code, text, sizeof(text));
+    return what + ": " + text;
+}
+
+// ---------------- Class TlsSession ------------------------------
+
+TlsSession::TlsSession(std::shared_ptr<TlsContext> tlsContext, boost::asio::ip::tcp::socket &sock,
+                       const std::string &host)
+    : context(std::move(tlsContext)),
+      socket(sock),
+      ssl(SSL_new(context->native())),
+      staging(WRITE_CHUNK),
+      staged(0)
+{
+    // SSL_set_fd()创建的BIO不关闭fd，fd仍由socket关闭
+    if (!ssl || SSL_set_fd(ssl, socket.native_handle()) != 1)
+    {
+        SSL_free(ssl);
+        throw std::runtime_error(TlsContext::lastError("SSL_new failed"));
+    }
+    if (context->getRole() == TlsRole::SERVER)
+    {
+        SSL_set_accept_state(ssl);
+    }
+    else
+    {
+        SSL_set_connect_state(ssl);
+        if (!host.empty())
+        {
+            boost::system::error_code ec;
+            boost::asio::ip::make_address(host, ec);
+            bool expected = !ec ? X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl), host.c_str()) == 1
+                                : SSL_set_tlsext_host_name(ssl, host.c_str()) == 1 && SSL_set1_host(ssl, host.c_str()) == 1;
+            if (!expected)
+            {
+                SSL_free(ssl);
+                throw std::runtime_error(TlsContext::lastError("invalid TLS host name " + host));
+            }
+        }
+        if (SSL_SESSION *cached = context->cachedSession())
+        {
+            SSL_set_session(ssl, cached);
+            SSL_SESSION_free(cached);
+        }
+    }
+    socket.non_blocking(true);
+    // 握手的各个flight与session ticket是分开写出的小段，Nagle会使其等待对端的延迟ACK
+    boost::system::error_code ec;
+    socket.set_option(boost::asio::ip::tcp::no_delay(true), ec);
+}
+
+TlsSession::~TlsSession()
+{
+    // 内核卸载之后不发送close_notify，连接继续以明文的方式读写
+    // 标记为已关闭：否则SSL_free()认为连接异常中断，把client缓存的会话标记为不可恢复（致命错误时OpenSSL已经标记过）
+    SSL_set_shutdown(ssl, SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+    SSL_free(ssl);
+    boost::system::error_code ec;
+    socket.non_blocking(false, ec);
+}
+
+bool TlsSession::offloaded()
+{
+    return BIO_get_ktls_send(SSL_get_wbio(ssl)) && BIO_get_ktls_recv(SSL_get_rbio(ssl));
+}
+
+bool TlsSession::resumed()
+{
+    return SSL_session_reused(ssl) == 1;
+}
+
+bool TlsSession::peerVerified()
+{
+    // 恢复的会话中保存着完整握手时对端的证书及验证结果
+    return SSL_get0_peer_certificate(ssl) != nullptr && SSL_get_verify_result(ssl) == X509_V_OK;
+}
+
+boost::system::error_code TlsSession::failure(int result, WaitType &wait)
+{
+    int error = SSL_get_error(ssl, result);
+    switch (error)
+    {
+    case SSL_ERROR_WANT_READ:
+        wait = boost::asio::ip::tcp::socket::wait_read;
+        return boost::asio::error::would_block;
+    case SSL_ERROR_WANT_WRITE:
+        wait = boost::asio::ip::tcp::socket::wait_write;
+        return boost::asio::error::would_block;
+    case SSL_ERROR_ZERO_RETURN:
+        return boost::asio::error::eof;
+    case SSL_ERROR_SYSCALL:
+        if (errno != 0)
+        {
+            return boost::system::error_code(errno, boost::system::system_category());
+        }
+        return boost::asio::error::eof;
+    default:
+        unsigned long code = ERR_get_error();
+        ERR_clear_error();
+        return boost::system::error_code(static_cast<int>(code), boost::asio::error::get_ssl_category());
+    }
+}
+
+#endif
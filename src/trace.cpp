@@ -0,0 +1,202 @@
+#include "trace.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <mutex>
+
+namespace Trace
+{
+    namespace
+    {
+        constexpr char FILE_MAGIC[8] = {'T', 'P', 'T', 'R', 'A', 'C', 'E', '1'};
+
+        static_assert((BUFFER_RECORDS & (BUFFER_RECORDS - 1)) == 0, "BUFFER_RECORDS must be a power of 2");
+
+        // 一个线程的环形缓冲区，只由所属线程写入
+        struct Buffer
+        {
+            std::uint16_t thread = 0;
+            std::uint64_t head = 0; // 已写入的记录总数
+            std::unique_ptr<Record[]> records{new Record[BUFFER_RECORDS]};
+        };
+
+        // 所有线程的缓冲区，只在线程第一次写入时加锁注册，缓冲区在进程结束前不会释放
+        struct Registry
+        {
+            std::mutex mutex;
+            std::vector<std::unique_ptr<Buffer>> buffers;
+        };
+
+        Registry &registry()
+        {
+            static Registry instance;
+            return instance;
+        }
+
+        thread_local Buffer *localBuffer = nullptr;
+
+        Buffer *registerThread()
+        {
+            auto buffer = std::make_unique<Buffer>();
+            Registry &reg = registry();
+            std::lock_guard<std::mutex> lock(reg.mutex);
+            buffer->thread = static_cast<std::uint16_t>(reg.buffers.size());
+            reg.buffers.push_back(std::move(buffer));
+            localBuffer = reg.buffers.back().get();
+            return localBuffer;
+        }
+
+        std::uint64_t nanosSinceEpoch(std::chrono::nanoseconds duration)
+        {
+            return static_cast<std::uint64_t>(duration.count());
+        }
+
+        template <typename T>
+        void writeValue(std::ofstream &out, const T &value)
+        {
+            out.write(reinterpret_cast<const char *>(&value), sizeof(value));
+        }
+
+        template <typename T>
+        bool readValue(std::ifstream &in, T &value)
+        {
+            return static_cast<bool>(in.read(reinterpret_cast<char *>(&value), sizeof(value)));
+        }
+    }
+
+    void record(Event event, std::uint64_t a, std::uint64_t b)
+    {
+        Buffer *buffer = localBuffer ? localBuffer : registerThread();
+        Record &slot = buffer->records[buffer->head & (BUFFER_RECORDS - 1)];
+        slot.timestamp = nanosSinceEpoch(std::chrono::steady_clock::now().time_since_epoch());
+        slot.event = static_cast<std::uint16_t>(event);
+        slot.thread = buffer->thread;
+        slot.reserved = 0;
+        slot.a = a;
+        slot.b = b;
+        buffer->head++;
+    }
+
+    // 文件格式（本机字节序）：
+    //     magic[8] | u32 记录大小 | u32 线程数 | u64 steady纳秒 | u64 system纳秒
+    //     每个线程：u32 线程序号 | u32 保留 | u64 记录数 | 记录（按写入顺序）
+    bool dump(const std::string &path)
+    {
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        if (!out)
+        {
+            return false;
+        }
+        Registry &reg = registry();
+        std::lock_guard<std::mutex> lock(reg.mutex);
+        out.write(FILE_MAGIC, sizeof(FILE_MAGIC));
+        writeValue(out, static_cast<std::uint32_t>(sizeof(Record)));
+        writeValue(out, static_cast<std::uint32_t>(reg.buffers.size()));
+        writeValue(out, nanosSinceEpoch(std::chrono::steady_clock::now().time_since_epoch()));
+        writeValue(out, nanosSinceEpoch(std::chrono::system_clock::now().time_since_epoch()));
+        for (auto &buffer : reg.buffers)
+        {
+            std::uint64_t count = std::min<std::uint64_t>(buffer->head, BUFFER_RECORDS);
+            writeValue(out, static_cast<std::uint32_t>(buffer->thread));
+            writeValue(out, std::uint32_t(0));
+            writeValue(out, count);
+            // 缓冲区写满后，最早的记录位于head处
+            for (std::uint64_t i = buffer->head - count; i < buffer->head; i++)
+            {
+                writeValue(out, buffer->records[i & (BUFFER_RECORDS - 1)]);
+            }
+        }
+        return static_cast<bool>(out.flush());
+    }
+
+    bool load(const std::string &path, Dump &dump)
+    {
+        std::ifstream in(path, std::ios::binary);
+        char magic[sizeof(FILE_MAGIC)];
+        std::uint32_t recordSize = 0;
+        std::uint32_t threadNum = 0;
+        if (!in.read(magic, sizeof(magic)) || std::memcmp(magic, FILE_MAGIC, sizeof(magic)) != 0 ||
+            !readValue(in, recordSize) || recordSize != sizeof(Record) || !readValue(in, threadNum) ||
+            !readValue(in, dump.steadyNanos) || !readValue(in, dump.systemNanos))
+        {
+            return false;
+        }
+        dump.records.clear();
+        for (std::uint32_t i = 0; i < threadNum; i++)
+        {
+            std::uint32_t thread = 0;
+            std::uint32_t reserved = 0;
+            std::uint64_t count = 0;
+            if (!readValue(in, thread) || !readValue(in, reserved) || !readValue(in, count) || count > BUFFER_RECORDS)
+            {
+                return false;
+            }
+            std::size_t offset = dump.records.size();
+            dump.records.resize(offset + count);
+            if (count > 0 && !in.read(reinterpret_cast<char *>(&dump.records[offset]), count * sizeof(Record)))
+            {
+                return false;
+            }
+        }
+        // 各线程内的记录已按时间排序，合并后保持同一时刻的写入顺序
+        std::stable_sort(dump.records.begin(), dump.records.end(), [](const Record &lhs, const Record &rhs) {
+            return lhs.timestamp < rhs.timestamp;
+        });
+        return true;
+    }
+
+    const char *eventName(std::uint16_t event)
+    {
+        switch (static_cast<Event>(event))
+        {
+        case Event::ACCEPT:
+            return "ACCEPT";
+        case Event::CLOSE:
+            return "CLOSE";
+        case Event::READ:
+            return "READ";
+        case Event::FRAME_IN:
+            return "FRAME_IN";
+        case Event::WRITE:
+            return "WRITE";
+        case Event::CHANNEL_CREATE:
+            return "CHANNEL_CREATE";
+        case Event::CHANNEL_DESTROY:
+            return "CHANNEL_DESTROY";
+        case Event::JOIN:
+            return "JOIN";
+        case Event::LEAVE:
+            return "LEAVE";
+        case Event::IO_ERROR:
+            return "IO_ERROR";
+        case Event::PARSE_ERROR:
+            return "PARSE_ERROR";
+        case Event::BAD_REQUEST:
+            return "BAD_REQUEST";
+        case Event::FRAME_DROP:
+            return "FRAME_DROP";
+        case Event::SLOW_CONSUMER:
+            return "SLOW_CONSUMER";
+        case Event::TIMEOUT:
+            return "TIMEOUT";
+        default:
+            return "UNKNOWN";
+        }
+    }
+
+    std::uint64_t packName(const std::string &name)
+    {
+        std::uint64_t packed = 0;
+        std::memcpy(&packed, name.data(), std::min<std::size_t>(name.size(), sizeof(packed)));
+        return packed;
+    }
+
+    std::string unpackName(std::uint64_t packed)
+    {
+        char name[sizeof(packed)];
+        std::memcpy(name, &packed, sizeof(packed));
+        return std::string(name, strnlen(name, sizeof(name)));
+    }
+}
@@ -0,0 +1,408 @@
+#include "tunnel.hpp"
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <cerrno>
+#include <iostream>
+#include <system_error>
+
+// ---------------- Class Tunnel ------------------------------
+
+void Tunnel::start(boost::asio::ip::tcp::socket first, boost::asio::ip::tcp::socket second, std::string toFirst,
+                   std::string toSecond, std::atomic<std::uint64_t> *counter)
+{
+    auto tunnel = std::make_shared<Tunnel>(std::move(first), std::move(second), std::move(toFirst),
+                                           std::move(toSecond), counter);
+    tunnel->pump(0);
+    if (!tunnel->closed)
+    {
+        tunnel->pump(1);
+    }
+}
+
+Tunnel::Tunnel(boost::asio::ip::tcp::socket first, boost::asio::ip::tcp::socket second, std::string toFirst,
+               std::string toSecond, std::atomic<std::uint64_t> *bytes)
+    : sockets{std::move(first), std::move(second)},
+      directions{{1, 0, {-1, -1}, 0, 0, std::move(toFirst), 0, false, false},
+                 {0, 1, {-1, -1}, 0, 0, std::move(toSecond), 0, false, false}},
+      counter(bytes),
+      closed(false)
+{
+    for (auto &direction : directions)
+    {
+        if (::pipe2(direction.pipe, O_CLOEXEC | O_NONBLOCK) != 0)
+        {
+            int error = errno;
+            if (&direction != &directions[0])
+            {
+                // 抛出异常时析构函数不会被调用，关闭已创建的管道
+                ::close(directions[0].pipe[0]);
+                ::close(directions[0].pipe[1]);
+            }
+            throw std::system_error(error, std::generic_category(), "pipe2");
+        }
+        ::fcntl(direction.pipe[1], F_SETPIPE_SZ, PIPE_SIZE);
+        int capacity = ::fcntl(direction.pipe[1], F_GETPIPE_SZ);
+        direction.capacity = capacity > 0 ? static_cast<std::size_t>(capacity) : 64 * 1024;
+    }
+    // splice()的socket一端以O_NONBLOCK决定是否阻塞
+    for (auto &socket : sockets)
+    {
+        socket.non_blocking(true);
+    }
+}
+
+Tunnel::~Tunnel()
+{
+    for (auto &direction : directions)
+    {
+        for (int fd : direction.pipe)
+        {
+            if (fd >= 0)
+            {
+                ::close(fd);
+            }
+        }
+    }
+}
+
+void Tunnel::pump(int index)
+{
+    Direction &direction = directions[index];
+    int in = sockets[direction.from].native_handle();
+    int out = sockets[direction.to].native_handle();
+    for (unsigned int i = 0; i < PUMP_BATCH; i++)
+    {
+        ssize_t n;
+        if (direction.headSent < direction.head.size())
+        {
+            n = ::send(out, direction.head.data() + direction.headSent, direction.head.size() - direction.headSent,
+                       MSG_NOSIGNAL);
+            if (n < 0)
+            {
+                retry(index, direction.to, boost::asio::ip::tcp::socket::wait_write);
+                return;
+            }
+            direction.headSent += static_cast<std::size_t>(n);
+            if (direction.headSent == direction.head.size())
+            {
+                std::string().swap(direction.head);
+                direction.headSent = 0;
+            }
+            continue;
+        }
+        if (direction.buffered > 0)
+        {
+            n = ::splice(direction.pipe[0], nullptr, out, nullptr, direction.buffered, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n < 0)
+            {
+                retry(index, direction.to, boost::asio::ip::tcp::socket::wait_write);
+                return;
+            }
+            direction.buffered -= static_cast<std::size_t>(n);
+            if (counter)
+            {
+                counter->fetch_add(static_cast<std::uint64_t>(n), std::memory_order_relaxed);
+            }
+            continue;
+        }
+        if (direction.eof)
+        {
+            boost::system::error_code ec;
+            sockets[direction.to].shutdown(boost::asio::ip::tcp::socket::shutdown_send, ec);
+            direction.done = true;
+            if (ec || directions[1 - index].done)
+            {
+                close();
+            }
+            return;
+        }
+        // 管道已空，EAGAIN只可能来自socket
+        n = ::splice(in, nullptr, direction.pipe[1], nullptr, direction.capacity, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n < 0)
+        {
+            retry(index, direction.from, boost::asio::ip::tcp::socket::wait_read);
+            return;
+        }
+        direction.eof = n == 0;
+        direction.buffered += static_cast<std::size_t>(n);
+    }
+    // 连续搬运的次数已达上限，让出线程后继续
+    auto self = shared_from_this();
+    boost::asio::post(sockets[0].get_executor(), [self, index]() {
+        if (!self->closed)
+        {
+            self->pump(index);
+        }
+    });
+}
+
+void Tunnel::retry(int index, int socket, boost::asio::ip::tcp::socket::wait_type type)
+{
+    int error = errno;
+    auto self = shared_from_this();
+    if (error == EINTR)
+    {
+        boost::asio::post(sockets[0].get_executor(), [self, index]() {
+            if (!self->closed)
+            {
+                self->pump(index);
+            }
+        });
+        return;
+    }
+    if (error != EAGAIN && error != EWOULDBLOCK)
+    {
+        close(); // 对端重置等错误，另一个方向也无法再继续
+        return;
+    }
+    sockets[socket].async_wait(type, [self, index](boost::system::error_code ec) {
+        if (!ec && !self->closed)
+        {
+            self->pump(index);
+        }
+    });
+}
+
+void Tunnel::close()
+{
+    closed = true;
+    boost::system::error_code ec;
+    for (auto &socket : sockets)
+    {
+        socket.close(ec);
+    }
+}
+
+// ---------------- Class TunnelEndpoint ------------------------------
+
+std::shared_ptr<TunnelEndpoint> TunnelEndpoint::expose(boost::asio::io_context &ioCtx,
+                                                       const boost::asio::ip::tcp::resolver::results_type &server,
+                                                       std::string channel, std::string token,
+                                                       const boost::asio::ip::tcp::resolver::results_type &service,
+                                                       std::shared_ptr<TlsContext> tls)
+{
+    auto endpoint = std::make_shared<TunnelEndpoint>(ioCtx, server, std::move(channel), std::move(token), std::move(tls));
+    endpoint->service = service;
+    boost::asio::post(ioCtx, [endpoint]() { endpoint->offer(); });
+    return endpoint;
+}
+
+std::shared_ptr<TunnelEndpoint> TunnelEndpoint::forward(boost::asio::io_context &ioCtx,
+                                                        const boost::asio::ip::tcp::resolver::results_type &server,
+                                                        std::string channel, std::string token,
+                                                        const boost::asio::ip::tcp::endpoint &listen,
+                                                        std::shared_ptr<TlsContext> tls)
+{
+    auto endpoint = std::make_shared<TunnelEndpoint>(ioCtx, server, std::move(channel), std::move(token), std::move(tls));
+    endpoint->acceptor = std::make_unique<boost::asio::ip::tcp::acceptor>(ioCtx, listen);
+    boost::asio::post(ioCtx, [endpoint]() { endpoint->accept(); });
+    return endpoint;
+}
+
+TunnelEndpoint::TunnelEndpoint(boost::asio::io_context &ioCtx,
+                               const boost::asio::ip::tcp::resolver::results_type &serverEndpoints,
+                               std::string channelName, std::string tunnelToken, std::shared_ptr<TlsContext> tls)
+    : ioContext(ioCtx),
+      server(serverEndpoints),
+      channel(std::move(channelName)),
+      token(std::move(tunnelToken)),
+      tlsContext(std::move(tls)),
+      stopped(false)
+{
+}
+
+void TunnelEndpoint::stop()
+{
+    auto self = shared_from_this();
+    boost::asio::post(ioContext, [self]() {
+        self->stopped = true;
+        boost::system::error_code ec;
+        if (self->acceptor)
+        {
+            self->acceptor->close(ec);
+        }
+        if (self->pending)
+        {
+            self->pending->close(ec); // server随之撤销这个offer
+        }
+    });
+}
+
+void TunnelEndpoint::offer()
+{
+    if (stopped)
+    {
+        return;
+    }
+    auto self = shared_from_this();
+    pending = std::make_shared<boost::asio::ip::tcp::socket>(ioContext);
+    request(pending, "offer", [self](Socket tunnel, std::string head) {
+        self->pending.reset();
+        if (!tunnel)
+        {
+            return; // 例如channel不存在，不再继续offer
+        }
+        // 先发出下一个offer，本地服务在此期间也能被连接
+        self->offer();
+        auto local = std::make_shared<boost::asio::ip::tcp::socket>(self->ioContext);
+        boost::asio::async_connect(*local, self->service,
+                                   [self, tunnel, local, head = std::move(head)](boost::system::error_code ec,
+                                                                                 const boost::asio::ip::tcp::endpoint &) mutable {
+                                       if (ec)
+                                       {
+                                           self->failed(ec.message()); // 隧道随tunnel析构而关闭
+                                           return;
+                                       }
+                                       local->set_option(boost::asio::ip::tcp::no_delay(true), ec);
+                                       // server在READY之后转来的数据来自forward一端，写给本地服务
+                                       Tunnel::start(std::move(*tunnel), std::move(*local), std::string(), std::move(head));
+                                   });
+    });
+}
+
+void TunnelEndpoint::accept()
+{
+    auto self = shared_from_this();
+    auto local = std::make_shared<boost::asio::ip::tcp::socket>(ioContext);
+    acceptor->async_accept(*local, [self, local](boost::system::error_code ec) {
+        if (ec)
+        {
+            self->failed(ec.message());
+            return;
+        }
+        self->accept();
+        local->set_option(boost::asio::ip::tcp::no_delay(true), ec);
+        auto tunnel = std::make_shared<boost::asio::ip::tcp::socket>(self->ioContext);
+        // 本地连接在隧道建立之前发来的数据留在其socket中，之后由Tunnel转发
+        self->request(tunnel, "connect", [local](Socket tunnel, std::string head) {
+            if (tunnel)
+            {
+                Tunnel::start(std::move(*local), std::move(*tunnel), std::move(head), std::string());
+            }
+        });
+    });
+}
+
+void TunnelEndpoint::request(Socket socket, std::string_view mode, std::function<void(Socket, std::string)> done)
+{
+    auto self = shared_from_this();
+    auto frame = Protocol::FrameBuilder(Protocol::Type::TUNNEL)
+                     .append(mode)
+                     .append(",")
+                     .append(channel)
+                     .append(",")
+                     .append(token)
+                     .finish();
+    boost::asio::async_connect(
+        *socket, server, [self, socket, frame, done](boost::system::error_code ec, const boost::asio::ip::tcp::endpoint &) {
+            if (ec)
+            {
+                self->failed(ec.message());
+                done(nullptr, std::string());
+                return;
+            }
+            socket->set_option(boost::asio::ip::tcp::no_delay(true), ec);
+            auto send = [self, frame, done](Socket socket) {
+                if (!socket)
+                {
+                    done(nullptr, std::string());
+                    return;
+                }
+                boost::asio::async_write(*socket, boost::asio::buffer(frame->data(), frame->size()),
+                                         [self, socket, frame, done](boost::system::error_code ec, std::size_t) {
+                                             if (ec)
+                                             {
+                                                 self->failed(ec.message());
+                                                 done(nullptr, std::string());
+                                                 return;
+                                             }
+                                             self->receive(socket, std::make_shared<FrameReader>(), done);
+                                         });
+            };
+#ifdef TCP_PROTO_TLS
+            if (self->tlsContext)
+            {
+                self->secure(socket, send);
+                return;
+            }
+#endif
+            send(socket);
+        });
+}
+
+#ifdef TCP_PROTO_TLS
+void TunnelEndpoint::secure(Socket socket, std::function<void(Socket)> done)
+{
+    auto self = shared_from_this();
+    std::shared_ptr<TlsSession> session;
+    try
+    {
+        // 与主连接相同，按解析前的主机名校验证书
+        session = std::make_shared<TlsSession>(tlsContext, *socket, server.empty() ? std::string() : server.begin()->host_name());
+    }
+    catch (const std::exception &e)
+    {
+        failed(e.what());
+        done(nullptr);
+        return;
+    }
+    // 握手完成后释放session，之后直接读写socket
+    session->handshake([self, socket, session, done](boost::system::error_code ec) {
+        if (ec || !session->offloaded())
+        {
+            self->failed(ec ? ec.message() : "tunnel needs kernel TLS");
+            done(nullptr);
+            return;
+        }
+        done(socket);
+    });
+}
+#endif
+
+void TunnelEndpoint::receive(Socket socket, std::shared_ptr<FrameReader> reader,
+                             std::function<void(Socket, std::string)> done)
+{
+    auto self = shared_from_this();
+    socket->async_read_some(reader->prepare(), [self, socket, reader, done](boost::system::error_code ec, std::size_t len) {
+        if (ec)
+        {
+            self->failed(ec == boost::asio::error::eof ? "connection closed by server" : ec.message());
+            done(nullptr, std::string());
+            return;
+        }
+        reader->commit(len);
+        Protocol::PackageView reply;
+        try
+        {
+            if (!reader->next(reply))
+            {
+                self->receive(socket, reader, done);
+                return;
+            }
+        }
+        catch (const Protocol::invalid_length &)
+        {
+            self->failed("invalid reply");
+            done(nullptr, std::string());
+            return;
+        }
+        if (reply.type != static_cast<std::uint16_t>(Protocol::Type::TUNNEL_READY))
+        {
+            self->failed(reply.body);
+            done(nullptr, std::string());
+            return;
+        }
+        std::cout << "\n[Tunnel Opened: " << reply.body << "]\n> " << std::flush;
+        auto rest = reader->data();
+        done(socket, std::string(static_cast<const char *>(rest.data()), rest.size()));
+    });
+}
+
+void TunnelEndpoint::failed(std::string_view reason)
+{
+    if (!stopped)
+    {
+        std::cout << "\n[Tunnel Failed: " << reason << "]\n> " << std::flush;
+    }
+}
@@ -0,0 +1,451 @@
+#ifdef TCP_PROTO_IO_URING
+
+#include "uring.hpp"
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <system_error>
+
+namespace
+{
+    constexpr std::uint16_t BUFFER_GROUP = 0;
+
+    int setup(unsigned int entries, io_uring_params &params)
+    {
+        return static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+    }
+
+    int enter(int fd, unsigned int toSubmit, unsigned int minComplete = 0, unsigned int flags = 0)
+    {
+        return static_cast<int>(syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, nullptr, 0));
+    }
+
+    int registerRing(int fd, unsigned int opcode, void *arg, unsigned int count)
+    {
+        return static_cast<int>(syscall(__NR_io_uring_register, fd, opcode, arg, count));
+    }
+
+    [[noreturn]] void fail(const char *what)
+    {
+        throw std::system_error(errno, std::system_category(), what);
+    }
+}
+
+Uring::Uring(boost::asio::io_context &ioCtx, unsigned int entries)
+    : ioContext(ioCtx),
+      ringFd(-1),
+      eventFd(-1),
+      wakeup(ioCtx),
+      ringMemory(MAP_FAILED),
+      ringSize(0),
+      sqes(static_cast<io_uring_sqe *>(MAP_FAILED)),
+      sqesSize(0),
+      unsubmitted(0),
+      submitScheduled(false),
+      bufferRing(static_cast<io_uring_buf *>(MAP_FAILED)),
+      bufferRingSize(0),
+      buffers(new std::uint8_t[BUFFER_SIZE * BUFFER_COUNT]),
+      bufferTail(0),
+      operations(nullptr)
+{
+    static_assert((BUFFER_COUNT & (BUFFER_COUNT - 1)) == 0, "BUFFER_COUNT must be a power of 2");
+    io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = entries * 4;
+    ringFd = setup(entries, params);
+    if (ringFd < 0)
+    {
+        fail("io_uring_setup");
+    }
+    // 成员在构造函数抛出异常时不会析构，之后的失败需要先释放已取得的资源
+    try
+    {
+        if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP))
+        {
+            errno = ENOSYS;
+            fail("io_uring features");
+        }
+        ringSize = std::max<std::size_t>(params.sq_off.array + params.sq_entries * sizeof(unsigned int),
+                                         params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+        ringMemory = mmap(nullptr, ringSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+        if (ringMemory == MAP_FAILED)
+        {
+            fail("mmap io_uring");
+        }
+        sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+        sqes = static_cast<io_uring_sqe *>(
+            mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES));
+        if (sqes == MAP_FAILED)
+        {
+            fail("mmap io_uring sqes");
+        }
+        auto *base = static_cast<std::uint8_t *>(ringMemory);
+        sqHead = reinterpret_cast<unsigned int *>(base + params.sq_off.head);
+        sqTail = reinterpret_cast<unsigned int *>(base + params.sq_off.tail);
+        sqMask = *reinterpret_cast<unsigned int *>(base + params.sq_off.ring_mask);
+        sqEntries = params.sq_entries;
+        cqHead = reinterpret_cast<unsigned int *>(base + params.cq_off.head);
+        cqTail = reinterpret_cast<unsigned int *>(base + params.cq_off.tail);
+        cqMask = *reinterpret_cast<unsigned int *>(base + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe *>(base + params.cq_off.cqes);
+        // SQ中的第i项固定对应第i个SQE
+        auto *array = reinterpret_cast<unsigned int *>(base + params.sq_off.array);
+        for (unsigned int i = 0; i < sqEntries; i++)
+        {
+            array[i] = i;
+        }
+
+        // 注册接收缓冲区环，所有缓冲区一开始都交给内核
+        bufferRingSize = BUFFER_COUNT * sizeof(io_uring_buf);
+        bufferRing = static_cast<io_uring_buf *>(
+            mmap(nullptr, bufferRingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+        if (bufferRing == MAP_FAILED)
+        {
+            fail("mmap buffer ring");
+        }
+        io_uring_buf_reg reg;
+        std::memset(&reg, 0, sizeof(reg));
+        reg.ring_addr = reinterpret_cast<std::uint64_t>(bufferRing);
+        reg.ring_entries = BUFFER_COUNT;
+        reg.bgid = BUFFER_GROUP;
+        if (registerRing(ringFd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+        {
+            fail("IORING_REGISTER_PBUF_RING");
+        }
+        for (unsigned int i = 0; i < BUFFER_COUNT; i++)
+        {
+            provide(static_cast<std::uint16_t>(i));
+        }
+
+        eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (eventFd < 0 || registerRing(ringFd, IORING_REGISTER_EVENTFD, &eventFd, 1) < 0)
+        {
+            fail("IORING_REGISTER_EVENTFD");
+        }
+        wakeup.assign(eventFd);
+    }
+    catch (...)
+    {
+        if (eventFd >= 0 && !wakeup.is_open())
+        {
+            ::close(eventFd);
+        }
+        if (bufferRing != MAP_FAILED)
+        {
+            munmap(bufferRing, bufferRingSize);
+        }
+        if (sqes != MAP_FAILED)
+        {
+            munmap(sqes, sqesSize);
+        }
+        if (ringMemory != MAP_FAILED)
+        {
+            munmap(ringMemory, ringSize);
+        }
+        ::close(ringFd);
+        throw;
+    }
+    waitCompletions();
+}
+
+Uring::~Uring()
+{
+    boost::system::error_code ec;
+    wakeup.close(ec);
+    // backlog中的SQE从未交给内核，不会有完成事件
+    for (const io_uring_sqe &sqe : backlog)
+    {
+        auto *op = reinterpret_cast<Operation *>(sqe.user_data);
+        unlink(*op);
+        op->abandon();
+    }
+    backlog.clear();
+    // 内核在操作完成之前仍会写入接收缓冲区、读取sendmsg的iovec，关闭ring并不等待。
+    // 因此先取消所有未完成的操作，等到它们的完成事件都已取得之后才释放缓冲区及共享内存；
+    // 每一轮的取消请求自身也产生一个完成事件，等待总会返回
+    io_uring_sqe cancel;
+    std::memset(&cancel, 0, sizeof(cancel));
+    cancel.opcode = IORING_OP_ASYNC_CANCEL;
+    cancel.cancel_flags = IORING_ASYNC_CANCEL_ANY;
+    bool drained = true;
+    while (operations)
+    {
+        // SQ已满时本轮只提交其中的SQE，取消请求在下一轮放入
+        bool cancelling = place(cancel);
+        int submitted = enter(ringFd, unsubmitted, cancelling ? 1 : 0, cancelling ? IORING_ENTER_GETEVENTS : 0);
+        if (submitted >= 0)
+        {
+            unsubmitted -= static_cast<unsigned int>(submitted);
+        }
+        else if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+        {
+            drained = false;
+            break;
+        }
+        abandonCompletions();
+    }
+    ::close(ringFd);
+    munmap(sqes, sqesSize);
+    munmap(ringMemory, ringSize);
+    if (drained)
+    {
+        munmap(bufferRing, bufferRingSize);
+    }
+    else
+    {
+        // 无法确认内核已不再使用接收缓冲区，宁可泄漏也不释放
+        buffers.release();
+    }
+    while (operations)
+    {
+        Operation *op = operations;
+        unlink(*op);
+        op->abandon();
+    }
+}
+
+void Uring::accept(int fd, Operation &op)
+{
+    io_uring_sqe sqe = prepare(op);
+    sqe.opcode = IORING_OP_ACCEPT;
+    sqe.fd = fd;
+    sqe.ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe.accept_flags = SOCK_CLOEXEC;
+    enqueue(sqe, op);
+}
+
+void Uring::receive(int fd, Operation &op)
+{
+    io_uring_sqe sqe = prepare(op);
+    sqe.opcode = IORING_OP_RECV;
+    sqe.fd = fd;
+    sqe.flags = IOSQE_BUFFER_SELECT;
+    sqe.buf_group = BUFFER_GROUP;
+    enqueue(sqe, op);
+}
+
+void Uring::send(int fd, const msghdr *message, Operation &op)
+{
+    io_uring_sqe sqe = prepare(op);
+    sqe.opcode = IORING_OP_SENDMSG;
+    sqe.fd = fd;
+    sqe.addr = reinterpret_cast<std::uint64_t>(message);
+    sqe.len = 1;
+    // MSG_WAITALL：由内核继续发送剩余的部分，直到全部写完或出错
+    sqe.msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    enqueue(sqe, op);
+}
+
+std::string_view Uring::buffer(std::uint32_t flags, std::size_t length)
+{
+    std::size_t id = flags >> IORING_CQE_BUFFER_SHIFT;
+    return std::string_view(reinterpret_cast<const char *>(buffers.get() + id * BUFFER_SIZE), length);
+}
+
+void Uring::recycle(std::uint32_t flags)
+{
+    if (flags & IORING_CQE_F_BUFFER)
+    {
+        provide(static_cast<std::uint16_t>(flags >> IORING_CQE_BUFFER_SHIFT));
+    }
+}
+
+void Uring::provide(std::uint16_t id)
+{
+    io_uring_buf &buf = bufferRing[bufferTail & (BUFFER_COUNT - 1)];
+    buf.addr = reinterpret_cast<std::uint64_t>(buffers.get() + id * BUFFER_SIZE);
+    buf.len = BUFFER_SIZE;
+    buf.bid = id;
+    bufferTail++;
+    // 环的tail与第一项的resv字段重叠
+    __atomic_store_n(&bufferRing[0].resv, bufferTail, __ATOMIC_RELEASE);
+}
+
+io_uring_sqe Uring::prepare(Operation &op)
+{
+    io_uring_sqe sqe;
+    std::memset(&sqe, 0, sizeof(sqe));
+    sqe.user_data = reinterpret_cast<std::uint64_t>(&op);
+    return sqe;
+}
+
+bool Uring::place(const io_uring_sqe &sqe)
+{
+    unsigned int tail = *sqTail;
+    if (tail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) == sqEntries)
+    {
+        return false;
+    }
+    sqes[tail & sqMask] = sqe;
+    __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+    unsubmitted++;
+    return true;
+}
+
+void Uring::enqueue(const io_uring_sqe &sqe, Operation &op)
+{
+    link(op);
+    // backlog非空时也不能直接放入SQ，否则会越过之前暂存的SQE
+    if (!backlog.empty() || !place(sqe))
+    {
+        submit();
+        if (!backlog.empty() || !place(sqe))
+        {
+            // 不在这里处理完成事件：调用方正在发起操作，回调不能重入
+            backlog.push_back(sqe);
+        }
+    }
+    // 本轮事件处理中的所有SQE在其结束后一起提交
+    if (!submitScheduled)
+    {
+        submitScheduled = true;
+        boost::asio::post(ioContext, [this]() {
+            submitScheduled = false;
+            submit();
+        });
+    }
+}
+
+void Uring::submit()
+{
+    for (;;)
+    {
+        while (!backlog.empty() && place(backlog.front()))
+        {
+            backlog.pop_front();
+        }
+        if (unsubmitted == 0)
+        {
+            return;
+        }
+        int submitted = enter(ringFd, unsubmitted);
+        if (submitted < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            // EAGAIN/EBUSY：内核暂时无法接受更多请求，SQ及backlog中的SQE留到处理完下一批完成事件后再提交
+            return;
+        }
+        if (submitted == 0)
+        {
+            return;
+        }
+        unsubmitted -= static_cast<unsigned int>(submitted);
+    }
+}
+
+void Uring::link(Operation &op)
+{
+    if (op.pending)
+    {
+        return; // multishot的操作在重新提交前已经完成，不会重复链接
+    }
+    op.pending = true;
+    op.prev = nullptr;
+    op.next = operations;
+    if (operations)
+    {
+        operations->prev = &op;
+    }
+    operations = &op;
+}
+
+void Uring::unlink(Operation &op)
+{
+    if (!op.pending)
+    {
+        return;
+    }
+    op.pending = false;
+    if (op.prev)
+    {
+        op.prev->next = op.next;
+    }
+    else
+    {
+        operations = op.next;
+    }
+    if (op.next)
+    {
+        op.next->prev = op.prev;
+    }
+    op.prev = op.next = nullptr;
+}
+
+void Uring::waitCompletions()
+{
+    wakeup.async_wait(boost::asio::posix::stream_descriptor::wait_read, [this](std::error_code ec) {
+        if (ec)
+        {
+            return;
+        }
+        std::uint64_t count;
+        while (::read(eventFd, &count, sizeof(count)) < 0 && errno == EINTR)
+        {
+        }
+        // 提交时内核可能把溢出列表中的完成事件移入CQ，处理完再提交，直到CQ为空
+        do
+        {
+            reap();
+            submit();
+        } while (*cqHead != __atomic_load_n(cqTail, __ATOMIC_ACQUIRE));
+        waitCompletions();
+    });
+}
+
+void Uring::abandonCompletions()
+{
+    unsigned int head = *cqHead;
+    unsigned int tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+    while (head != tail)
+    {
+        const io_uring_cqe &cqe = cqes[head & cqMask];
+        auto *op = reinterpret_cast<Operation *>(cqe.user_data);
+        std::uint32_t flags = cqe.flags;
+        head++;
+        __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+        // 取消请求的user_data为0；multishot的操作在最后一个完成事件（没有IORING_CQE_F_MORE）之后才结束
+        if (op && !(flags & IORING_CQE_F_MORE))
+        {
+            unlink(*op);
+            op->abandon();
+        }
+    }
+}
+
+void Uring::reap()
+{
+    unsigned int head = *cqHead;
+    for (;;)
+    {
+        unsigned int tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+        if (head == tail)
+        {
+            break;
+        }
+        while (head != tail)
+        {
+            const io_uring_cqe &cqe = cqes[head & cqMask];
+            auto *op = reinterpret_cast<Operation *>(cqe.user_data);
+            int result = cqe.res;
+            std::uint32_t flags = cqe.flags;
+            head++;
+            // 先归还CQE，回调中可以继续提交新的操作
+            __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+            if (!(flags & IORING_CQE_F_MORE))
+            {
+                unlink(*op);
+            }
+            op->complete(result, flags);
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,104 @@
+// 离线解码server --trace-file生成的二进制trace，每条记录输出一行：
+//     trace_decode <file> [--wall]
+// 默认输出相对第一条记录的时间（微秒），--wall输出本地时间
+#include "trace.hpp"
+#include <cinttypes>
+#include <cstdio>
+#include <ctime>
+#include <string>
+
+using Trace::Event;
+
+// a/b按事件类型解释，见Trace::Event的注释
+static std::string describe(const Trace::Record &record)
+{
+    char text[128];
+    switch (static_cast<Event>(record.event))
+    {
+    case Event::ACCEPT:
+        std::snprintf(text, sizeof(text), "conn=%" PRIx64 " peer=%u.%u.%u.%u:%u", record.a,
+                      static_cast<unsigned int>(record.b >> 40 & 0xFF), static_cast<unsigned int>(record.b >> 32 & 0xFF),
+                      static_cast<unsigned int>(record.b >> 24 & 0xFF), static_cast<unsigned int>(record.b >> 16 & 0xFF),
+                      static_cast<unsigned int>(record.b & 0xFFFF));
+        break;
+    case Event::FRAME_IN:
+        std::snprintf(text, sizeof(text), "conn=%" PRIx64 " type=%u length=%u", record.a,
+                      static_cast<unsigned int>(record.b >> 32), static_cast<unsigned int>(record.b & 0xFFFFFFFF));
+        break;
+    case Event::READ:
+    case Event::WRITE:
+    case Event::FRAME_DROP:
+        std::snprintf(text, sizeof(text), "conn=%" PRIx64 " bytes=%" PRIu64, record.a, record.b);
+        break;
+    case Event::CHANNEL_CREATE:
+    case Event::CHANNEL_DESTROY:
+        std::snprintf(text, sizeof(text), "channel=%016" PRIx64 " name=%s", record.a,
+                      Trace::unpackName(record.b).c_str());
+        break;
+    case Event::JOIN:
+    case Event::LEAVE:
+        std::snprintf(text, sizeof(text), "conn=%" PRIx64 " channel=%016" PRIx64, record.a, record.b);
+        break;
+    case Event::CLOSE:
+    case Event::PARSE_ERROR:
+        std::snprintf(text, sizeof(text), "conn=%" PRIx64, record.a);
+        break;
+    case Event::IO_ERROR:
+        std::snprintf(text, sizeof(text), "conn=%" PRIx64 " error=%" PRIu64, record.a, record.b);
+        break;
+    case Event::BAD_REQUEST:
+        std::snprintf(text, sizeof(text), "conn=%" PRIx64 " type=%" PRIu64, record.a, record.b);
+        break;
+    case Event::SLOW_CONSUMER:
+    {
+        // 与SlowConsumerPolicy的枚举值顺序一致
+        const char *names[] = {"drop-oldest", "drop-newest", "disconnect", "pause"};
+        unsigned int index = static_cast<unsigned int>(record.b >> 48);
+        std::snprintf(text, sizeof(text), "conn=%" PRIx64 " policy=%s queued=%" PRIu64, record.a,
+                      index < 4 ? names[index] : "unknown", record.b & 0xFFFFFFFFFFFF);
+        break;
+    }
+    default:
+        std::snprintf(text, sizeof(text), "conn=%" PRIx64 " b=%" PRIu64, record.a, record.b);
+        break;
+    }
+    return text;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        std::fprintf(stderr, "Usage: trace_decode <file> [--wall]\n");
+        return 1;
+    }
+    bool wall = argc > 2 && std::string(argv[2]) == "--wall";
+    Trace::Dump dump;
+    if (!Trace::load(argv[1], dump))
+    {
+        std::fprintf(stderr, "invalid trace file: %s\n", argv[1]);
+        return 1;
+    }
+    std::uint64_t base = dump.records.empty() ? 0 : dump.records.front().timestamp;
+    for (const auto &record : dump.records)
+    {
+        char time[64];
+        if (wall)
+        {
+            // steady_clock与system_clock的差值在dump时取得
+            std::uint64_t nanos = dump.systemNanos - (dump.steadyNanos - record.timestamp);
+            std::time_t seconds = static_cast<std::time_t>(nanos / 1000000000);
+            std::tm local;
+            localtime_r(&seconds, &local);
+            std::size_t n = std::strftime(time, sizeof(time), "%H:%M:%S", &local);
+            std::snprintf(time + n, sizeof(time) - n, ".%06u", static_cast<unsigned int>(nanos % 1000000000 / 1000));
+        }
+        else
+        {
+            std::snprintf(time, sizeof(time), "%14.3f", (record.timestamp - base) / 1e3);
+        }
+        std::printf("%s  T%-3u %-15s %s\n", time, static_cast<unsigned int>(record.thread),
+                    Trace::eventName(record.event), describe(record).c_str());
+    }
+    return 0;
+}